@@ -54,6 +54,7 @@
 #include "util.h"
 #include "nilfs_gc.h"
 #include "cnormap.h"
+#include "liveidx.h"
 #include "parser.h"
 
 #ifdef _GNU_SOURCE
@@ -62,6 +63,7 @@ static const struct option long_option[] = {
 	{"all",  no_argument, NULL, 'a'},
 	{"index", required_argument, NULL, 'i'},
 	{"latest-usage", no_argument, NULL, 'l' },
+	{"liveness-index", required_argument, NULL, 'L'},
 	{"lines", required_argument, NULL, 'n'},
 	{"protection-period", required_argument, NULL, 'p'},
 	{"help", no_argument, NULL, 'h'},
@@ -75,13 +77,15 @@ static const struct option long_option[] = {
 	"  -h, --help\t\t\tdisplay this help and exit\n"		\
 	"  -i, --index\t\t\tskip index segments at start of inputs\n"	\
 	"  -l, --latest-usage\t\tprint usage status of the moment\n"	\
+	"  -L, --liveness-index\t\treuse live block counts in directory\n" \
 	"  -n, --lines\t\t\tlist only lines input segments\n"		\
 	"  -p, --protection-period\tspecify protection period\n"	\
 	"  -V, --version\t\t\tdisplay version and exit\n"
 #else	/* !_GNU_SOURCE */
 #include <unistd.h>
 #define LSSU_USAGE \
-	"Usage: %s [-alhV] [-i index] [-n lines] [-p period] [device]\n"
+	"Usage: %s [-alhV] [-i index] [-L dir] [-n lines] [-p period] "	\
+	"[device]\n"
 #endif	/* _GNU_SOURCE */
 
 #define LSSU_BUFSIZE	128
@@ -115,43 +119,81 @@ static nilfs_cno_t protcno;
 static int64_t prottime, now;
 static uint64_t param_index;
 static uint64_t param_lines;
+static const char *liveidx_dir;
+static struct nilfs_liveidx *liveidx;
 
 static size_t blocks_per_segment;
 static struct nilfs_suinfo suinfos[LSSU_NSEGS];
+static struct nilfs_assess_result results[LSSU_NSEGS];
+static struct nilfs_assess_result assessed[LSSU_NSEGS];
 
 static void lssu_print_header(void)
 {
 	puts(lssu_format[disp_mode].header);
 }
 
-static ssize_t lssu_get_latest_usage(struct nilfs *nilfs,
-				     uint64_t segnum, uint64_t protseq,
-				     nilfs_cno_t protcno)
+/**
+ * lssu_assess_usage - count live blocks of dirty segments
+ * @nilfs: nilfs object
+ * @segnum: segment number of suinfos[0]
+ * @nsi: number of entries in suinfos
+ * @protseq: start of sequence number of protected segments
+ *
+ * Live block counts found in the liveness index are reused; the other
+ * segments are assessed together.  On return, results[i] holds the
+ * counts of the segment of suinfos[i].
+ */
+static int lssu_assess_usage(struct nilfs *nilfs, uint64_t segnum,
+			     ssize_t nsi, uint64_t protseq)
 {
-	struct nilfs_reclaim_stat stat;
 	struct nilfs_reclaim_params params = {
-		.flags = NILFS_RECLAIM_PARAM_PROTSEQ,
+		.flags = NILFS_RECLAIM_PARAM_PROTSEQ |
+			NILFS_RECLAIM_PARAM_SNAPSHOT_CACHE,
 		.protseq = protseq
 	};
-	uint64_t segnums[1];
-	int ret;
+	struct nilfs_liveidx_entry ent;
+	uint64_t segnums[LSSU_NSEGS];
+	size_t idx[LSSU_NSEGS];
+	ssize_t i, n = 0;
 
 	if (protcno != NILFS_CNO_MAX) {
 		params.flags |= NILFS_RECLAIM_PARAM_PROTCNO;
 		params.protcno = protcno;
 	}
 
-	memset(&stat, 0, sizeof(stat));
-	segnums[0] = segnum;
+	for (i = 0; i < nsi; i++) {
+		memset(&results[i], 0, sizeof(results[i]));
+		if (!nilfs_suinfo_dirty(&suinfos[i]) ||
+		    nilfs_suinfo_error(&suinfos[i]))
+			continue;
 
-	ret = nilfs_assess_segment(nilfs, segnums, 1, &params, &stat);
-	if (unlikely(ret < 0))
-		return -1;
+		if (liveidx && nilfs_liveidx_lookup(liveidx, segnum + i,
+						    &suinfos[i], protcno,
+						    &ent)) {
+			results[i].flags = NILFS_ASSESS_RESULT_ASSESSED;
+			results[i].live_blks = ent.nlive;
+			continue;
+		}
+		segnums[n] = segnum + i;
+		idx[n++] = i;
+	}
+	if (n == 0)
+		return 0;
 
-	if (stat.protected_segs > 0)
-		return -2;
+	if (unlikely(nilfs_assess_segments(nilfs, segnums, n, &params,
+					   assessed, NULL) < 0))
+		return -1;
 
-	return stat.live_blks;
+	for (i = 0; i < n; i++) {
+		results[idx[i]] = assessed[i];
+		if (liveidx &&
+		    (assessed[i].flags & NILFS_ASSESS_RESULT_ASSESSED))
+			nilfs_liveidx_update(liveidx, segnums[i],
+					     assessed[i].seqnum,
+					     &suinfos[idx[i]], protcno,
+					     assessed[i].live_blks);
+	}
+	return 0;
 }
 
 static ssize_t lssu_print_suinfo(struct nilfs *nilfs, uint64_t segnum,
@@ -160,11 +202,17 @@ static ssize_t lssu_print_suinfo(struct nilfs *nilfs, uint64_t segnum,
 	struct tm tm;
 	time_t t;
 	char timebuf[LSSU_BUFSIZE];
-	ssize_t i, n = 0, ret;
+	ssize_t i, n = 0;
 	int ratio;
 	int protected;
 	size_t nliveblks;
 
+	if (disp_mode == LSSU_MODE_LATEST_USAGE &&
+	    unlikely(lssu_assess_usage(nilfs, segnum, nsi, protseq) < 0)) {
+		warn("failed to get usage");
+		return -1;
+	}
+
 	for (i = 0; i < nsi; i++, segnum++) {
 		if (!all && nilfs_suinfo_clean(&suinfos[i]))
 			continue;
@@ -196,18 +244,14 @@ static ssize_t lssu_print_suinfo(struct nilfs *nilfs, uint64_t segnum,
 			    nilfs_suinfo_error(&suinfos[i]))
 				goto skip_scan;
 
-			ret = lssu_get_latest_usage(nilfs, segnum, protseq,
-						    protcno);
-			if (ret >= 0) {
-				nliveblks = ret;
-				ratio = (ret * 100 + 99) / blocks_per_segment;
-			} else if (likely(ret == -2)) {
+			if (results[i].flags & NILFS_ASSESS_RESULT_ASSESSED) {
+				nliveblks = results[i].live_blks;
+				ratio = (nliveblks * 100 + 99) /
+					blocks_per_segment;
+			} else {
 				nliveblks = suinfos[i].sui_nblocks;
 				ratio = 100;
 				protected = 1;
-			} else {
-				warn("failed to get usage");
-				return -1;
 			}
 
 skip_scan:
@@ -286,6 +330,38 @@ static int lssu_get_protcno(struct nilfs *nilfs,
 	return ret;
 }
 
+static int lssu_open_liveidx(struct nilfs *nilfs)
+{
+	char *path;
+	int ret = -1;
+
+	path = nilfs_liveidx_path(nilfs, liveidx_dir);
+	if (unlikely(!path)) {
+		warn(NULL);
+		return -1;
+	}
+
+	liveidx = nilfs_liveidx_open(nilfs, path);
+	if (unlikely(!liveidx)) {
+		if (errno == EEXIST)
+			warnx("%s is not a liveness index of %s", path,
+			      nilfs_get_dev(nilfs));
+		else
+			warn("cannot open liveness index %s", path);
+		goto out;
+	}
+
+	ret = nilfs_liveidx_check_context(liveidx, nilfs);
+	if (unlikely(ret < 0)) {
+		warn("cannot check liveness index %s", path);
+		nilfs_liveidx_close(liveidx);
+		liveidx = NULL;
+	}
+out:
+	free(path);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	struct nilfs *nilfs;
@@ -306,10 +382,10 @@ int main(int argc, char *argv[])
 		progname++;
 
 #ifdef _GNU_SOURCE
-	while ((c = getopt_long(argc, argv, "ai:ln:hp:V",
+	while ((c = getopt_long(argc, argv, "ai:lL:n:hp:V",
 				long_option, &option_index)) >= 0) {
 #else	/* !_GNU_SOURCE */
-	while ((c = getopt(argc, argv, "ai:ln:hp:V")) >= 0) {
+	while ((c = getopt(argc, argv, "ai:lL:n:hp:V")) >= 0) {
 #endif	/* _GNU_SOURCE */
 
 		switch (c) {
@@ -322,6 +398,9 @@ int main(int argc, char *argv[])
 		case 'l':
 			latest = 1;
 			break;
+		case 'L':
+			liveidx_dir = optarg;
+			break;
 		case 'n':
 			param_lines = (uint64_t)atoll(optarg);
 			break;
@@ -375,6 +454,9 @@ int main(int argc, char *argv[])
 		}
 		now = tv.tv_sec;
 
+		/* reads of the device fall back to pread() if unavailable */
+		nilfs_opt_set_io_uring(nilfs);
+
 		blocks_per_segment = nilfs_get_blocks_per_segment(nilfs);
 		disp_mode = LSSU_MODE_LATEST_USAGE;
 
@@ -384,9 +466,18 @@ int main(int argc, char *argv[])
 			status = EXIT_FAILURE;
 			goto out_close_nilfs;
 		}
+
+		if (liveidx_dir) {
+			ret = lssu_open_liveidx(nilfs);
+			if (unlikely(ret < 0)) {
+				status = EXIT_FAILURE;
+				goto out_close_nilfs;
+			}
+		}
 	}
 
 	status = lssu_list_suinfo(nilfs);
+	nilfs_liveidx_close(liveidx);
 
 out_close_nilfs:
 	nilfs_close(nilfs);
@@ -10,5 +10,7 @@
 
 extern uint32_t crc32_le(uint32_t seed, unsigned char const *data,
 			 size_t length);
+extern uint32_t crc32_le_bytewise(uint32_t seed, unsigned char const *data,
+				  size_t length);
 
 #endif /* __CRC32_H__ */
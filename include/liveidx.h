@@ -0,0 +1,54 @@
+/*
+ * liveidx.h - index of live block counts of segments
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifndef NILFS_LIVEIDX_H
+#define NILFS_LIVEIDX_H
+
+#include <stdint.h>	/* uint64_t, uint32_t */
+#include "nilfs.h"	/* struct nilfs, struct nilfs_suinfo */
+
+/**
+ * struct nilfs_liveidx_entry - live block count of a segment
+ * @seqnum: sequence number of the segment when it was assessed
+ * @lastmod: modification time of the segment when it was assessed
+ * @protcno: start of checkpoint numbers protected when it was assessed
+ * @nblocks: number of written blocks when it was assessed
+ * @flags: flags (NILFS_LIVEIDX_VALID)
+ * @nlive: number of live blocks
+ * @seq: sequence count, odd while the entry is being written
+ */
+struct nilfs_liveidx_entry {
+	uint64_t seqnum;
+	int64_t lastmod;
+	uint64_t protcno;
+	uint32_t nblocks;
+	uint32_t flags;
+	uint32_t nlive;
+	uint32_t seq;
+};
+
+#define NILFS_LIVEIDX_VALID	0x1
+
+struct nilfs_liveidx;
+
+char *nilfs_liveidx_path(const struct nilfs *nilfs, const char *dir);
+struct nilfs_liveidx *nilfs_liveidx_open(struct nilfs *nilfs,
+					 const char *path);
+void nilfs_liveidx_close(struct nilfs_liveidx *idx);
+int nilfs_liveidx_lookup(const struct nilfs_liveidx *idx, uint64_t segnum,
+			 const struct nilfs_suinfo *si, nilfs_cno_t protcno,
+			 struct nilfs_liveidx_entry *ent);
+int nilfs_liveidx_update(struct nilfs_liveidx *idx, uint64_t segnum,
+			 uint64_t seqnum, const struct nilfs_suinfo *si,
+			 nilfs_cno_t protcno, uint32_t nlive);
+int nilfs_liveidx_invalidate(struct nilfs_liveidx *idx,
+			     const uint64_t *segnums, size_t nsegs);
+int nilfs_liveidx_check_context(struct nilfs_liveidx *idx,
+				struct nilfs *nilfs);
+
+#endif /* NILFS_LIVEIDX_H */
@@ -77,9 +77,33 @@ struct nilfs_layout {
 
 struct nilfs *nilfs_open(const char *dev, const char *dir, int flags);
 void nilfs_close(struct nilfs *nilfs);
+void nilfs_close_ioc(struct nilfs *nilfs);
+int nilfs_open_ioc(struct nilfs *nilfs);
 
 const char *nilfs_get_dev(const struct nilfs *nilfs);
 
+/* ioctl commands counted by nilfs_get_ioctl_count() */
+enum nilfs_ioctl_stat {
+	NILFS_IOCTL_STAT_CHANGE_CPMODE,
+	NILFS_IOCTL_STAT_DELETE_CHECKPOINT,
+	NILFS_IOCTL_STAT_GET_CPINFO,
+	NILFS_IOCTL_STAT_GET_CPSTAT,
+	NILFS_IOCTL_STAT_GET_SUINFO,
+	NILFS_IOCTL_STAT_SET_SUINFO,
+	NILFS_IOCTL_STAT_GET_SUSTAT,
+	NILFS_IOCTL_STAT_GET_VINFO,
+	NILFS_IOCTL_STAT_GET_BDESCS,
+	NILFS_IOCTL_STAT_CLEAN_SEGMENTS,
+	NILFS_IOCTL_STAT_SYNC,
+	NILFS_IOCTL_STAT_RESIZE,
+	NILFS_IOCTL_STAT_SET_ALLOC_RANGE,
+	NILFS_IOCTL_STAT_FREEZE,
+	NILFS_IOCTL_STAT_THAW,
+	__NR_NILFS_IOCTL_STAT,
+};
+
+uint64_t nilfs_get_ioctl_count(const struct nilfs *nilfs, unsigned int index);
+
 int nilfs_opt_test(const struct nilfs *nilfs, unsigned int index);
 int nilfs_opt_set(struct nilfs *nilfs, unsigned int index);
 int nilfs_opt_clear(struct nilfs *nilfs, unsigned int index);
@@ -100,6 +124,7 @@ static inline int nilfs_opt_clear_##name(struct nilfs *nilfs)		\
 
 NILFS_OPT_FNS(mmap, 0)
 NILFS_OPT_FNS(set_suinfo, 1)
+NILFS_OPT_FNS(io_uring, 2)
 
 nilfs_cno_t nilfs_get_oldest_cno(struct nilfs *nilfs);
 
@@ -160,22 +185,42 @@ struct nilfs_segment {
 
 int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 		      struct nilfs_segment *segment);
+int nilfs_get_segment_summary(struct nilfs *nilfs, uint64_t segnum,
+			      uint32_t blkcnt, struct nilfs_segment *segment);
 int nilfs_put_segment(struct nilfs_segment *segment);
+int nilfs_readahead_segment(const struct nilfs *nilfs, uint64_t segnum);
 int nilfs_get_segment_seqnum(const struct nilfs *nilfs, uint64_t segnum,
 			     uint64_t *seqnum);
+int nilfs_get_segment_seqnums(const struct nilfs *nilfs,
+			      const uint64_t *segnums, size_t nsegs,
+			      uint64_t *seqnums);
 
 size_t nilfs_get_block_size(const struct nilfs *nilfs);
 uint64_t nilfs_get_nsegments(const struct nilfs *nilfs);
 uint32_t nilfs_get_blocks_per_segment(const struct nilfs *nilfs);
 uint32_t nilfs_get_reserved_segments_ratio(const struct nilfs *nilfs);
+const unsigned char *nilfs_get_uuid(const struct nilfs *nilfs);
 
 int nilfs_change_cpmode(struct nilfs *nilfs, nilfs_cno_t cno, int mode);
 ssize_t nilfs_get_cpinfo(struct nilfs *nilfs, nilfs_cno_t cno, int mode,
 			 struct nilfs_cpinfo *cpinfo, size_t nci);
 int nilfs_delete_checkpoint(struct nilfs *nilfs, nilfs_cno_t cno);
 int nilfs_get_cpstat(const struct nilfs *nilfs, struct nilfs_cpstat *cpstat);
+ssize_t nilfs_lookup_snapshot_cache(const struct nilfs *nilfs,
+				    const struct nilfs_cpstat *cpstat,
+				    const nilfs_cno_t **ssp);
+void nilfs_update_snapshot_cache(struct nilfs *nilfs,
+				 const struct nilfs_cpstat *cpstat,
+				 const struct nilfs_sustat *sustat,
+				 nilfs_cno_t *ss, size_t nss);
+void nilfs_rebase_snapshot_cache(struct nilfs *nilfs,
+				 const struct nilfs_cpstat *cpstat,
+				 const struct nilfs_sustat *sustat);
+void nilfs_invalidate_snapshot_cache(struct nilfs *nilfs);
 ssize_t nilfs_get_suinfo(const struct nilfs *nilfs, uint64_t segnum,
 			 struct nilfs_suinfo *suinfo, size_t nsi);
+int nilfs_get_suinfo_batch(const struct nilfs *nilfs, const uint64_t *segnums,
+			   size_t nsegs, struct nilfs_suinfo *si);
 int nilfs_set_suinfo(const struct nilfs *nilfs,
 		     struct nilfs_suinfo_update *sup, size_t nsup);
 int nilfs_get_sustat(const struct nilfs *nilfs, struct nilfs_sustat *sustat);
@@ -48,6 +48,8 @@ struct nilfs_cleaner_args {
 	uint64_t nsegs;		/* number of segments */
 	uint32_t runtime; /* runtime in seconds */
 	uint32_t min_reclaimable_blocks;
+	uint64_t read_bandwidth;  /* bytes per second (0: unlimited) */
+	uint64_t write_bandwidth; /* bytes per second (0: unlimited) */
 };
 
 enum nilfs_cleaner_args_unit {
@@ -80,6 +82,8 @@ enum nilfs_cleaner_args_unit {
 #define NILFS_CLEANER_ARG_NPASSES			(1 << 6) /* reserved */
 #define NILFS_CLEANER_ARG_RUNTIME			(1 << 7) /* reserved */
 #define NILFS_CLEANER_ARG_MIN_RECLAIMABLE_BLOCKS	(1 << 8)
+#define NILFS_CLEANER_ARG_READ_BANDWIDTH		(1 << 9)
+#define NILFS_CLEANER_ARG_WRITE_BANDWIDTH		(1 << 10)
 
 enum {
 	NILFS_CLEANER_STATUS_IDLE,
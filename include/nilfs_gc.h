@@ -20,7 +20,55 @@
 #define NILFS_RECLAIM_PARAM_PROTSEQ			(1UL << 0)
 #define NILFS_RECLAIM_PARAM_PROTCNO			(1UL << 1)
 #define NILFS_RECLAIM_PARAM_MIN_RECLAIMABLE_BLKS	(1UL << 2)
-#define __NR_NILFS_RECLAIM_PARAMS	3
+#define NILFS_RECLAIM_PARAM_READAHEAD			(1UL << 3)
+#define NILFS_RECLAIM_PARAM_VINFO_CACHE			(1UL << 4)
+#define NILFS_RECLAIM_PARAM_MEM_BUDGET			(1UL << 5)
+#define NILFS_RECLAIM_PARAM_PIPELINE			(1UL << 6)
+#define NILFS_RECLAIM_PARAM_SNAPSHOT_CACHE		(1UL << 7)
+#define __NR_NILFS_RECLAIM_PARAMS	8
+
+/* flags for extended fields of nilfs_reclaim_stat struct */
+#define NILFS_RECLAIM_STAT_VINFO_CACHE			(1UL << 0)
+#define NILFS_RECLAIM_STAT_MEMORY			(1UL << 1)
+#define NILFS_RECLAIM_STAT_PIPELINE			(1UL << 2)
+#define NILFS_RECLAIM_STAT_TIMING			(1UL << 3)
+#define NILFS_RECLAIM_STAT_ERROR			(1UL << 4)
+#define NILFS_RECLAIM_STAT_EXFLAGS	(NILFS_RECLAIM_STAT_VINFO_CACHE | \
+					 NILFS_RECLAIM_STAT_MEMORY |	 \
+					 NILFS_RECLAIM_STAT_PIPELINE |	 \
+					 NILFS_RECLAIM_STAT_TIMING |	 \
+					 NILFS_RECLAIM_STAT_ERROR)
+
+/* phases of garbage collection timed with NILFS_RECLAIM_STAT_TIMING */
+enum {
+	NILFS_RECLAIM_PHASE_READ,	/* reading segment summaries */
+	NILFS_RECLAIM_PHASE_PARSE,	/* collecting blocks from summaries */
+	NILFS_RECLAIM_PHASE_VINFO,	/* GET_VINFO ioctls */
+	NILFS_RECLAIM_PHASE_SNAPSHOT,	/* fetching the list of snapshots */
+	NILFS_RECLAIM_PHASE_TOSS,	/* judging liveness of blocks */
+	NILFS_RECLAIM_PHASE_BDESC,	/* GET_BDESCS ioctls */
+	NILFS_RECLAIM_PHASE_CLEAN,	/* CLEAN_SEGMENTS or SET_SUINFO ioctl */
+	NILFS_RECLAIM_NR_PHASES
+};
+
+/**
+ * struct nilfs_reclaim_phase - time spent in a phase of GC
+ * @wall_ns: elapsed time in nanoseconds
+ * @cpu_ns: CPU time of the calling thread in nanoseconds
+ * @ncalls: number of segments read or parsed, number of ioctls issued,
+ * or number of times the phase was entered
+ *
+ * Segments that are mapped with mmap are read on demand, so the time
+ * to read them is accounted to NILFS_RECLAIM_PHASE_PARSE.
+ */
+struct nilfs_reclaim_phase {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	size_t ncalls;
+};
+
+struct nilfs_vicache;
+struct nilfs_reclaim_prep;
 
 /**
  * struct nilfs_reclaim_params - structure to specify GC parameters
@@ -28,17 +76,49 @@
  * @min_reclaimable_blks: minimum number of reclaimable blocks
  * @protseq: start of sequence number of protected segments
  * @protcno: start number of checkpoint to be protected
+ * @readahead: number of segments to be read ahead while parsing segments
+ * @vicache: cache of lifetime of virtual blocks (see vicache.h)
+ * @mem_budget: upper limit in bytes of memory used for block descriptors
+ * @prep: blocks of the segments to be reclaimed collected in advance
+ * [optional]
+ * @next_segnums: array of segments expected to be reclaimed next
+ * @next_nsegs: size of the @next_segnums array
+ * @next_prep: place to store the blocks of @next_segnums collected in
+ * advance
+ *
+ * With NILFS_RECLAIM_PARAM_MEM_BUDGET, the segments are processed in
+ * successive batches whose descriptors fit in @mem_budget.  A batch
+ * holds at least one segment, so the budget is exceeded if a single
+ * segment does not fit in it.
+ *
+ * With NILFS_RECLAIM_PARAM_PIPELINE, the blocks of @next_segnums are
+ * collected by a worker thread while the last batch is looked up in the
+ * DAT file and cleaned, and are returned in *@next_prep (or NULL).  The
+ * caller passes that object back in @prep when it reclaims the same
+ * segments, and frees it with nilfs_reclaim_prep_free().  It is used
+ * only if none of the segments was written or protected in between.
+ *
+ * NILFS_RECLAIM_PARAM_SNAPSHOT_CACHE has no field; if it is set, the list
+ * of snapshots is taken from the cache attached to the nilfs object (see
+ * nilfs_lookup_snapshot_cache()) instead of being read on every call.
  */
 struct nilfs_reclaim_params {
 	unsigned long flags;
 	unsigned long min_reclaimable_blks;
 	uint64_t protseq;
 	nilfs_cno_t protcno;
+	unsigned long readahead;
+	struct nilfs_vicache *vicache;
+	size_t mem_budget;
+	struct nilfs_reclaim_prep *prep;
+	const uint64_t *next_segnums;
+	size_t next_nsegs;
+	struct nilfs_reclaim_prep **next_prep;
 };
 
 /**
  * struct nilfs_reclaim_stat - structure to store GC statistics
- * @exflags: flags for extended fields (reserved)
+ * @exflags: flags for extended fields
  * @cleaned_segs: number of cleaned segments
  * @protected_segs: number of protected (deselected) segments
  * @deferred_segs: number of deferred segments
@@ -49,6 +129,23 @@ struct nilfs_reclaim_params {
  * @defunct_vblks: number of defunct (reclaimable) virtual blocks
  * @defunct_pblks: number of defunct (reclaimable) DAT file blocks
  * @freed_vblks: number of freed virtual blocks
+ * @vinfo_hits: number of virtual blocks found in the vinfo cache
+ * @vinfo_misses: number of virtual blocks looked up with GET_VINFO
+ * @peak_mem: peak size in bytes of memory used for block descriptors
+ * @nbatches: number of batches the segments were processed in
+ * @prepared_segs: number of segments whose blocks were taken from the
+ * prepared set given by the pipeline parameters
+ * @phases: time spent in each phase (NILFS_RECLAIM_PHASE_*)
+ * @bytes_read: number of bytes of segment summaries read, including
+ * those read ahead for the next call by the pipeline parameters
+ * @error: error number that stopped the call after some segments were
+ * cleaned, or 0 if the call was not stopped by an error
+ *
+ * The caller requests extended fields by setting their flags in
+ * @exflags.  On return, flags of fields that were not filled are
+ * cleared: all of them if no segment was processed, the vinfo cache
+ * counts if no vinfo cache was given, and the pipeline count if the
+ * pipeline parameters were not given.
  */
 struct nilfs_reclaim_stat {
 	unsigned long exflags;
@@ -62,6 +159,43 @@ struct nilfs_reclaim_stat {
 	size_t defunct_vblks;
 	size_t defunct_pblks;
 	size_t freed_vblks;
+	size_t vinfo_hits;
+	size_t vinfo_misses;
+	size_t peak_mem;
+	size_t nbatches;
+	size_t prepared_segs;
+	struct nilfs_reclaim_phase phases[NILFS_RECLAIM_NR_PHASES];
+	uint64_t bytes_read;
+	int error;
+};
+
+/* flags for nilfs_assess_result struct */
+#define NILFS_ASSESS_RESULT_ASSESSED	(1U << 0)
+#define NILFS_ASSESS_RESULT_PROTECTED	(1U << 1)
+
+/**
+ * struct nilfs_assess_result - live block counts of a segment
+ * @flags: flags (NILFS_ASSESS_RESULT_*)
+ * @nblocks: number of blocks written in the segment
+ * @seqnum: sequence number of the segment when it was assessed
+ * @live_blks: number of live (in-use) blocks
+ * @live_vblks: number of live (in-use) virtual blocks
+ * @live_pblks: number of live (in-use) DAT file blocks
+ * @defunct_blks: number of defunct (reclaimable) blocks
+ *
+ * The other fields are valid only if NILFS_ASSESS_RESULT_ASSESSED is
+ * set.  A segment that was skipped has NILFS_ASSESS_RESULT_PROTECTED
+ * set (and @nblocks filled) if it is in the protected region, or no
+ * flag if it is not reclaimable, e.g. clean or active.
+ */
+struct nilfs_assess_result {
+	uint32_t flags;
+	uint32_t nblocks;
+	uint64_t seqnum;
+	uint32_t live_blks;
+	uint32_t live_vblks;
+	uint32_t live_pblks;
+	uint32_t defunct_blks;
 };
 
 ssize_t nilfs_reclaim_segment(struct nilfs *nilfs,
@@ -73,6 +207,17 @@ int nilfs_xreclaim_segment(struct nilfs *nilfs,
 			   const struct nilfs_reclaim_params *params,
 			   struct nilfs_reclaim_stat *stat);
 
+struct nilfs_reclaim_prep *
+nilfs_prepare_reclaim(struct nilfs *nilfs, const uint64_t *segnums,
+		      size_t nsegs, const struct nilfs_reclaim_params *params);
+void nilfs_reclaim_prep_free(struct nilfs_reclaim_prep *prep);
+
+ssize_t nilfs_assess_segments(struct nilfs *nilfs, const uint64_t *segnums,
+			      size_t nsegs,
+			      const struct nilfs_reclaim_params *params,
+			      struct nilfs_assess_result *results,
+			      struct nilfs_reclaim_stat *stat);
+
 int nilfs_segment_is_protected(struct nilfs *nilfs, uint64_t segnum,
 			       uint64_t protseq);
 
@@ -17,5 +17,6 @@ nilfs_cno_t nilfs_parse_cno(const char *arg, char **endptr, int base);
 int nilfs_parse_cno_range(const char *arg, uint64_t *start, uint64_t *end,
 			  int base);
 int nilfs_parse_protection_period(const char *arg, unsigned long *period);
+int nilfs_parse_size(const char *arg, unsigned long long *size);
 
 #endif /* NILFS_PARSER_H */
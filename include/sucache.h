@@ -0,0 +1,43 @@
+/*
+ * sucache.h - incrementally refreshed cache of segment usage
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifndef NILFS_SUCACHE_H
+#define NILFS_SUCACHE_H
+
+#include <stdint.h>	/* uint64_t */
+#include <sys/types.h>	/* size_t */
+#include "nilfs.h"	/* struct nilfs, struct nilfs_suinfo */
+
+/**
+ * struct nilfs_sucache_stat - statistics of segment usage cache
+ * @full_scans: number of scans of the whole sufile
+ * @partial_scans: number of incremental refreshes
+ * @scanned_segs: number of segments whose usage was fetched
+ */
+struct nilfs_sucache_stat {
+	uint64_t full_scans;
+	uint64_t partial_scans;
+	uint64_t scanned_segs;
+};
+
+struct nilfs_sucache;
+
+struct nilfs_sucache *nilfs_sucache_create(struct nilfs *nilfs);
+void nilfs_sucache_destroy(struct nilfs_sucache *sucache);
+int nilfs_sucache_refresh(struct nilfs_sucache *sucache,
+			  const struct nilfs_sustat *sustat);
+void nilfs_sucache_invalidate(struct nilfs_sucache *sucache,
+			      const uint64_t *segnums, size_t nsegs);
+void nilfs_sucache_invalidate_all(struct nilfs_sucache *sucache);
+const struct nilfs_suinfo *
+nilfs_sucache_get_suinfo(const struct nilfs_sucache *sucache,
+			 uint64_t *nsegsp);
+void nilfs_sucache_get_stat(const struct nilfs_sucache *sucache,
+			    struct nilfs_sucache_stat *stat);
+
+#endif /* NILFS_SUCACHE_H */
@@ -0,0 +1,37 @@
+/*
+ * uring.h - io_uring based raw device i/o
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifndef NILFS_URING_H
+#define NILFS_URING_H
+
+#include <sys/types.h>	/* off_t, size_t, ssize_t */
+
+/**
+ * struct nilfs_io_req - read request
+ * @buf: destination buffer
+ * @len: number of bytes to be read
+ * @offset: byte offset on the device
+ * @result: number of bytes read (set on completion)
+ */
+struct nilfs_io_req {
+	void *buf;
+	size_t len;
+	off_t offset;
+	ssize_t result;
+};
+
+#define NILFS_URING_ENTRIES	64
+
+struct nilfs_uring;
+
+struct nilfs_uring *nilfs_uring_create(unsigned int entries);
+void nilfs_uring_destroy(struct nilfs_uring *ring);
+int nilfs_uring_read(struct nilfs_uring *ring, int fd,
+		     struct nilfs_io_req *reqs, size_t nreqs);
+
+#endif /* NILFS_URING_H */
@@ -40,6 +40,8 @@ int nilfs_vector_delete_elements(struct nilfs_vector *vector,
 void *nilfs_vector_insert_elements(struct nilfs_vector *vector,
 				   unsigned int index, size_t nelems);
 void nilfs_vector_clear(struct nilfs_vector *vector);
+ssize_t nilfs_vector_filter(struct nilfs_vector *vector,
+			    int (*filter)(void *elem, void *arg), void *arg);
 
 static inline void *nilfs_vector_get_data(const struct nilfs_vector *vector)
 {
@@ -0,0 +1,32 @@
+/*
+ * vicache.h - cache of lifetime information of virtual blocks
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifndef NILFS_VICACHE_H
+#define NILFS_VICACHE_H
+
+#include <stdint.h>	/* uint64_t */
+#include <sys/types.h>	/* size_t */
+#include "nilfs.h"	/* struct nilfs_sustat, struct nilfs_period, etc */
+
+struct nilfs_vicache;
+
+struct nilfs_vicache *nilfs_vicache_create(size_t nentries);
+void nilfs_vicache_destroy(struct nilfs_vicache *vicache);
+void nilfs_vicache_validate(struct nilfs_vicache *vicache,
+			    const struct nilfs_sustat *sustat, nilfs_cno_t cno);
+int nilfs_vicache_lookup(const struct nilfs_vicache *vicache,
+			 uint64_t vblocknr, struct nilfs_period *period);
+void nilfs_vicache_insert(struct nilfs_vicache *vicache, uint64_t vblocknr,
+			  const struct nilfs_period *period);
+void nilfs_vicache_evict(struct nilfs_vicache *vicache,
+			 const uint64_t *vblocknrs, size_t n);
+void nilfs_vicache_rebase(struct nilfs_vicache *vicache,
+			  const struct nilfs_sustat *sustat, nilfs_cno_t cno);
+void nilfs_vicache_invalidate_all(struct nilfs_vicache *vicache);
+
+#endif /* NILFS_VICACHE_H */
@@ -29,6 +29,10 @@
 #include "config.h"
 #endif	/* HAVE_CONFIG_H */
 
+#if HAVE_CRC32_PCLMUL
+#include <immintrin.h>
+#endif	/* HAVE_CRC32_PCLMUL */
+
 #include "crc32.h"
 
 static const uint32_t crc32tab[] = { /* CRC polynomial 0xedb88320 */
@@ -86,13 +90,194 @@ static const uint32_t crc32tab[] = { /* CRC polynomial 0xedb88320 */
 	0x2d02ef8d
 };
 
-uint32_t crc32_le(uint32_t Crc_I, const unsigned char *Buffer_PC,
-		  size_t Length_I)
+/*
+ * Slice-by-8 tables.  crc32tab_s8[0] is a copy of crc32tab, and
+ * crc32tab_s8[k][i] is the CRC of byte i followed by k zero bytes.
+ * They are derived from crc32tab when the library is loaded.
+ */
+static uint32_t crc32tab_s8[8][256];
+
+static uint32_t crc32_le_generic(uint32_t crc, const unsigned char *p,
+				 size_t len);
+static uint32_t (*crc32_le_impl)(uint32_t, const unsigned char *, size_t) =
+	crc32_le_generic;
+
+/**
+ * crc32_le_bytewise - calculate crc32 one byte at a time
+ * @crc: seed
+ * @p: data
+ * @len: length of @p in bytes
+ *
+ * This is the reference implementation; the other engines must give the
+ * same results.
+ */
+uint32_t crc32_le_bytewise(uint32_t crc, const unsigned char *p, size_t len)
 {
 	size_t c;
 
-	for (c = 0; c < Length_I; c++)
-		Crc_I = (Crc_I >> 8) ^ crc32tab[(uint8_t)Crc_I ^ Buffer_PC[c]];
+	for (c = 0; c < len; c++)
+		crc = (crc >> 8) ^ crc32tab[(uint8_t)crc ^ p[c]];
+
+	return crc;
+}
+
+static inline uint32_t crc32_get_le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * crc32_le_generic - calculate crc32 with slice-by-8 tables
+ * @crc: seed
+ * @p: data
+ * @len: length of @p in bytes
+ */
+static uint32_t crc32_le_generic(uint32_t crc, const unsigned char *p,
+				 size_t len)
+{
+	const uint32_t (*t)[256] = (const uint32_t (*)[256])crc32tab_s8;
+	uint32_t lo, hi;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		lo = crc32_get_le32(p) ^ crc;
+		hi = crc32_get_le32(p + 4);
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+			t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+			t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+			t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+	}
+	return crc32_le_bytewise(crc, p, len);
+}
+
+#if HAVE_CRC32_PCLMUL
+/*
+ * Folding constants for the bit-reflected polynomial 0xedb88320, see
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction" (Intel, 2009).  These are the same constants as used by
+ * crc32-pclmul of the Linux kernel.
+ */
+#define CRC32_PCLMUL_K1		0x154442bd4ULL	/* x^(4*128+32) mod P */
+#define CRC32_PCLMUL_K2		0x1c6e41596ULL	/* x^(4*128-32) mod P */
+#define CRC32_PCLMUL_K3		0x1751997d0ULL	/* x^(128+32) mod P */
+#define CRC32_PCLMUL_K4		0x0ccaa009eULL	/* x^(128-32) mod P */
+#define CRC32_PCLMUL_K5		0x163cd6124ULL	/* x^64 mod P */
+#define CRC32_PCLMUL_P		0x1db710641ULL	/* P' (bit-reflected P) */
+#define CRC32_PCLMUL_U		0x1f7011641ULL	/* floor(x^64 / P)' */
+#define CRC32_PCLMUL_MINLEN	64
+
+static inline __attribute__((target("pclmul,sse4.1")))
+__m128i crc32_pclmul_fold(__m128i x, __m128i k, __m128i data)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+					   _mm_clmulepi64_si128(x, k, 0x11)),
+			     data);
+}
+
+/**
+ * crc32_le_pclmul - calculate crc32 with carry-less multiplication
+ * @crc: seed
+ * @p: data
+ * @len: length of @p in bytes
+ *
+ * Folds 64 bytes per iteration with PCLMULQDQ, then reduces the
+ * remaining 128-bit value to 32 bits with a Barrett reduction.  Short
+ * buffers and the trailing bytes are handed to crc32_le_generic().
+ */
+static __attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_le_pclmul(uint32_t crc, const unsigned char *p, size_t len)
+{
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+	__m128i x1, x2, x3, x4, k;
+	size_t rest;
+
+	if (len < CRC32_PCLMUL_MINLEN)
+		return crc32_le_generic(crc, p, len);
+
+	rest = len & 15;
+	len -= rest;
+
+	x1 = _mm_loadu_si128((const __m128i *)p);
+	x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 48));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	len -= 64;
+
+	k = _mm_set_epi64x(CRC32_PCLMUL_K2, CRC32_PCLMUL_K1);
+	for (; len >= 64; len -= 64, p += 64) {
+		x1 = crc32_pclmul_fold(x1, k,
+				       _mm_loadu_si128((const __m128i *)p));
+		x2 = crc32_pclmul_fold(x2, k,
+				       _mm_loadu_si128((const __m128i *)
+						       (p + 16)));
+		x3 = crc32_pclmul_fold(x3, k,
+				       _mm_loadu_si128((const __m128i *)
+						       (p + 32)));
+		x4 = crc32_pclmul_fold(x4, k,
+				       _mm_loadu_si128((const __m128i *)
+						       (p + 48)));
+	}
+
+	/* fold the four 128-bit lanes into one */
+	k = _mm_set_epi64x(CRC32_PCLMUL_K4, CRC32_PCLMUL_K3);
+	x1 = crc32_pclmul_fold(x1, k, x2);
+	x1 = crc32_pclmul_fold(x1, k, x3);
+	x1 = crc32_pclmul_fold(x1, k, x4);
+	for (; len >= 16; len -= 16, p += 16)
+		x1 = crc32_pclmul_fold(x1, k,
+				       _mm_loadu_si128((const __m128i *)p));
+
+	/* 128 bits -> 64 bits, appending 32 zero bits */
+	x2 = _mm_clmulepi64_si128(k, x1, 0x01);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	/* 64 bits -> 32 bits */
+	k = _mm_set_epi64x(0, CRC32_PCLMUL_K5);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
 
-	return Crc_I;
+	/* Barrett reduction */
+	k = _mm_set_epi64x(CRC32_PCLMUL_U, CRC32_PCLMUL_P);
+	x2 = x1;
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x10);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = _mm_extract_epi32(x1, 1);
+
+	return rest ? crc32_le_generic(crc, p, rest) : crc;
+}
+#endif	/* HAVE_CRC32_PCLMUL */
+
+/**
+ * crc32_init - set up slice-by-8 tables and select a crc32 engine
+ */
+static void __attribute__((constructor)) crc32_init(void)
+{
+	uint32_t crc;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = crc32tab[i];
+		crc32tab_s8[0][i] = crc;
+		for (k = 1; k < 8; k++) {
+			crc = (crc >> 8) ^ crc32tab[crc & 0xff];
+			crc32tab_s8[k][i] = crc;
+		}
+	}
+
+#if HAVE_CRC32_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1"))
+		crc32_le_impl = crc32_le_pclmul;
+#endif	/* HAVE_CRC32_PCLMUL */
+}
+
+uint32_t crc32_le(uint32_t Crc_I, const unsigned char *Buffer_PC,
+		  size_t Length_I)
+{
+	return crc32_le_impl(Crc_I, Buffer_PC, Length_I);
 }
@@ -33,19 +33,32 @@
 #include <sys/time.h>
 #endif	/* HAVE_SYS_TIME */
 
+#if HAVE_TIME_H
+#include <time.h>	/* clock_gettime() */
+#endif	/* HAVE_TIME_H */
+
 #include <errno.h>
 #include <assert.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <pthread.h>
 #include "util.h"
 #include "segment.h"
 #include "vector.h"
+#include "vicache.h"
 #include "nilfs_gc.h"
 
-#define NILFS_GC_NBDESCS	512
-#define NILFS_GC_NVINFO	512
 #define NILFS_GC_NCPINFO	512
 
+/*
+ * Maximum number of entries passed to one NILFS_IOCTL_GET_VINFO or
+ * NILFS_IOCTL_GET_BDESCS call.  The kernel copies the array through a
+ * one-page buffer and takes the segment constructor lock separately for
+ * each page-sized piece, so a large batch neither holds the lock longer
+ * nor needs more kernel memory; it only saves system calls.
+ */
+#define NILFS_GC_BATCH_MAX	16384
+
 
 static void default_logger(int priority, const char *fmt, ...)
 {
@@ -59,19 +72,67 @@ static void default_logger(int priority, const char *fmt, ...)
 
 void (*nilfs_gc_logger)(int priority, const char *fmt, ...) = default_logger;
 
+/**
+ * struct nilfs_phase_clock - start time of a phase of GC
+ * @wall: monotonic time
+ * @cpu: CPU time of the calling thread
+ */
+struct nilfs_phase_clock {
+	struct timespec wall;
+	struct timespec cpu;
+};
 
-static int nilfs_comp_vdesc_blocknr(const void *elem1, const void *elem2)
+static inline int nilfs_timing_enabled(const struct nilfs_reclaim_stat *stat)
 {
-	const struct nilfs_vdesc *vdesc1 = elem1, *vdesc2 = elem2;
+	return stat && (stat->exflags & NILFS_RECLAIM_STAT_TIMING);
+}
 
-	return (vdesc1->vd_blocknr < vdesc2->vd_blocknr) ? -1 : 1;
+static void nilfs_phase_begin(const struct nilfs_reclaim_stat *stat,
+			      struct nilfs_phase_clock *clk)
+{
+	if (!nilfs_timing_enabled(stat))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &clk->wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &clk->cpu);
+}
+
+static inline uint64_t nilfs_elapsed_ns(const struct timespec *start,
+					const struct timespec *end)
+{
+	return (int64_t)(end->tv_sec - start->tv_sec) * 1000000000LL +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * nilfs_phase_end - account time spent in a phase of GC
+ * @stat: reclaim statistics
+ * @phase: phase number (NILFS_RECLAIM_PHASE_*)
+ * @clk: start time given by nilfs_phase_begin()
+ * @ncalls: count to be added to the phase
+ */
+static void nilfs_phase_end(struct nilfs_reclaim_stat *stat, int phase,
+			    const struct nilfs_phase_clock *clk, size_t ncalls)
+{
+	struct nilfs_reclaim_phase *ph;
+	struct nilfs_phase_clock now;
+
+	if (!nilfs_timing_enabled(stat))
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now.wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now.cpu);
+
+	ph = &stat->phases[phase];
+	ph->wall_ns += nilfs_elapsed_ns(&clk->wall, &now.wall);
+	ph->cpu_ns += nilfs_elapsed_ns(&clk->cpu, &now.cpu);
+	ph->ncalls += ncalls;
 }
 
-static int nilfs_comp_vdesc_vblocknr(const void *elem1, const void *elem2)
+
+static int nilfs_comp_vdesc_blocknr(const void *elem1, const void *elem2)
 {
 	const struct nilfs_vdesc *vdesc1 = elem1, *vdesc2 = elem2;
 
-	return (vdesc1->vd_vblocknr < vdesc2->vd_vblocknr) ? -1 : 1;
+	return (vdesc1->vd_blocknr < vdesc2->vd_blocknr) ? -1 : 1;
 }
 
 static int nilfs_comp_period(const void *elem1, const void *elem2)
@@ -104,6 +165,157 @@ static int nilfs_comp_bdesc(const void *elem1, const void *elem2)
 		return 0;
 }
 
+/**
+ * struct nilfs_vdesc_ref - reference to a descriptor of virtual block
+ * @key: virtual block number
+ * @index: index of the descriptor in the vector of descriptors
+ */
+struct nilfs_vdesc_ref {
+	uint64_t key;
+	size_t index;
+};
+
+/**
+ * nilfs_sort_vdesc_refs - sort references to descriptors by key
+ * @refs: array of references
+ * @n: number of references
+ *
+ * Description: This is an LSD radix sort over the bytes of 64-bit keys.
+ * Byte positions in which all keys agree, such as the high order bytes
+ * of virtual block numbers, are skipped.  The sort is stable.
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+static int nilfs_sort_vdesc_refs(struct nilfs_vdesc_ref *refs, size_t n)
+{
+	size_t count[sizeof(uint64_t)][256];
+	struct nilfs_vdesc_ref *src = refs, *dst, *tmp;
+	size_t i, sum, c;
+	unsigned int d, shift;
+
+	if (n < 2)
+		return 0;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		for (d = 0; d < sizeof(uint64_t); d++)
+			count[d][(refs[i].key >> (d * 8)) & 0xff]++;
+
+	dst = malloc(sizeof(*dst) * n);
+	if (unlikely(!dst))
+		return -1;
+
+	for (d = 0; d < sizeof(uint64_t); d++) {
+		shift = d * 8;
+		if (count[d][(src[0].key >> shift) & 0xff] == n)
+			continue;	/* all keys have the same digit */
+
+		for (sum = 0, c = 0; c < 256; c++) {
+			i = count[d][c];
+			count[d][c] = sum;
+			sum += i;
+		}
+		for (i = 0; i < n; i++)
+			dst[count[d][(src[i].key >> shift) & 0xff]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != refs) {
+		memcpy(refs, src, sizeof(*refs) * n);
+		free(src);
+	} else {
+		free(dst);
+	}
+	return 0;
+}
+
+/**
+ * struct nilfs_vdesc_run - run of descriptors in ascending disk order
+ * @start: index of the first descriptor
+ * @len: number of descriptors
+ * @blocknr: disk block number of the first descriptor
+ */
+struct nilfs_vdesc_run {
+	size_t start;
+	size_t len;
+	uint64_t blocknr;
+};
+
+static int nilfs_comp_vdesc_run(const void *elem1, const void *elem2)
+{
+	const struct nilfs_vdesc_run *run1 = elem1, *run2 = elem2;
+
+	return (run1->blocknr < run2->blocknr) ? -1 : 1;
+}
+
+/**
+ * nilfs_sort_vdesc_blocknr - sort descriptors by disk block number
+ * @vdescv: vector object storing (descriptors of) virtual block numbers
+ *
+ * Description: Descriptors are collected in disk order within each
+ * segment, so @vdescv consists of a few ascending runs, one per
+ * segment, which cover disjoint ranges of blocks.  Instead of sorting
+ * the descriptors themselves, this sorts the runs by their first block
+ * and concatenates them.  It falls back to a full sort if the runs
+ * overlap.
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+static int nilfs_sort_vdesc_blocknr(struct nilfs_vector *vdescv)
+{
+	struct nilfs_vdesc *vdescs = nilfs_vector_get_data(vdescv), *tmp;
+	size_t n = nilfs_vector_get_size(vdescv);
+	struct nilfs_vdesc_run *runs;
+	size_t i, nruns = 1, pos;
+	int ret = -1;
+
+	for (i = 1; i < n; i++)
+		if (vdescs[i].vd_blocknr < vdescs[i - 1].vd_blocknr)
+			nruns++;
+	if (n == 0 || nruns == 1)
+		return 0;
+
+	runs = malloc(sizeof(*runs) * nruns);
+	tmp = malloc(sizeof(*tmp) * n);
+	if (unlikely(!runs || !tmp))
+		goto out;
+
+	runs[0].start = 0;
+	runs[0].blocknr = vdescs[0].vd_blocknr;
+	for (i = 1, nruns = 1; i < n; i++) {
+		if (vdescs[i].vd_blocknr < vdescs[i - 1].vd_blocknr) {
+			runs[nruns - 1].len = i - runs[nruns - 1].start;
+			runs[nruns].start = i;
+			runs[nruns].blocknr = vdescs[i].vd_blocknr;
+			nruns++;
+		}
+	}
+	runs[nruns - 1].len = n - runs[nruns - 1].start;
+
+	qsort(runs, nruns, sizeof(*runs), nilfs_comp_vdesc_run);
+
+	for (i = 1; i < nruns; i++) {
+		if (vdescs[runs[i - 1].start + runs[i - 1].len - 1].vd_blocknr >=
+		    runs[i].blocknr) {
+			nilfs_vector_sort(vdescv, nilfs_comp_vdesc_blocknr);
+			ret = 0;
+			goto out;
+		}
+	}
+
+	for (i = 0, pos = 0; i < nruns; pos += runs[i].len, i++)
+		memcpy(&tmp[pos], &vdescs[runs[i].start],
+		       sizeof(*tmp) * runs[i].len);
+	memcpy(vdescs, tmp, sizeof(*tmp) * n);
+	ret = 0;
+out:
+	free(tmp);
+	free(runs);
+	return ret;
+}
+
 /**
  * nilfs_acc_blocks_file - collect summary of blocks in a file
  * @file: file object
@@ -203,21 +415,27 @@ static int nilfs_acc_blocks_psegment(struct nilfs_psegment *psegment,
  * @nblocks: size of valid logs in the segment (per block)
  * @vdescv: vector object to store (descriptors of) virtual block numbers
  * @bdescv: vector object to store (descriptors of) disk block numbers
+ * @nbytesp: place to which the size of the summaries of the logs is added
  */
 static int nilfs_acc_blocks_segment(const struct nilfs_segment *segment,
 				    uint32_t nblocks,
 				    struct nilfs_vector *vdescv,
-				    struct nilfs_vector *bdescv)
+				    struct nilfs_vector *bdescv,
+				    uint64_t *nbytesp)
 {
 	struct nilfs_psegment psegment;
 	const char *errstr;
+	uint64_t nbytes = 0;
 	int ret;
 
 	nilfs_psegment_for_each(&psegment, segment, nblocks) {
 		ret = nilfs_acc_blocks_psegment(&psegment, vdescv, bdescv);
 		if (unlikely(ret < 0))
 			return -1;
+		nbytes += roundup(le32_to_cpu(psegment.segsum->ss_sumbytes),
+				  1UL << psegment.blkbits);
 	}
+	*nbytesp += nbytes;
 	if (nilfs_psegment_is_error(&psegment, &errstr)) {
 		nilfs_gc_logger(LOG_ERR,
 				"error %d (%s) while reading segment summary at pseg blocknr = %llu, segnum = %llu",
@@ -255,21 +473,49 @@ static ssize_t nilfs_deselect_segment(uint64_t *segnums, size_t nsegs, int nr)
  * @segnums: array of selected segments
  * @nsegs: size of @segnums array
  * @protseq: start of sequence number of protected segments
+ * @nra: number of segments to be read ahead
+ * @maxblks: maximum number of blocks to be collected (0 if unlimited)
  * @vdescv: vector object to store (descriptors of) virtual block numbers
  * @bdescv: vector object to store (descriptors of) disk block numbers
+ * @naccp: place to store the number of segments whose blocks were
+ * collected
+ * @sis: array to store usage of the collected segments [optional]
+ * @seqnums: array to store sequence numbers of the collected segments
+ * [optional]
+ * @stat: reclaim statistics to account time and bytes read [optional]
+ *
+ * While the summary of segnums[i] is parsed, reads of the following
+ * @nra segments are started in the background so that the device does
+ * not sit idle.  Collection stops before a segment that would bring the
+ * number of blocks over @maxblks, except for the first one.
+ *
+ * Return Value: the number of segments left in @segnums after
+ * deselection.  The first *@naccp of them were collected; deselected
+ * segments are moved to the end of @segnums.
  */
 static ssize_t nilfs_acc_blocks(struct nilfs *nilfs,
 				uint64_t *segnums, size_t nsegs,
-				uint64_t protseq,
+				uint64_t protseq, size_t nra, size_t maxblks,
 				struct nilfs_vector *vdescv,
-				struct nilfs_vector *bdescv)
+				struct nilfs_vector *bdescv, size_t *naccp,
+				struct nilfs_suinfo *sis, uint64_t *seqnums,
+				struct nilfs_reclaim_stat *stat)
 {
 	struct nilfs_suinfo si;
 	struct nilfs_segment segment;
-	int ret, i = 0;
+	struct nilfs_phase_clock clk;
+	uint64_t nbytes = 0;
+	int ret, i = 0, ra = 0;
 	ssize_t n = nsegs;
+	size_t nblks = 0;
 
 	while (i < n) {
+		/* keep segnums[i + 1] .. segnums[i + nra] in flight */
+		if (ra <= i)
+			ra = i + 1;
+		for (; ra < n && ra <= i + nra; ra++)
+			nilfs_readahead_segment(nilfs, segnums[ra]);
+
 		ret = nilfs_get_suinfo(nilfs, segnums[i], &si, 1);
 		if (unlikely(ret < 0))
 			return -1;
@@ -282,98 +528,217 @@ static ssize_t nilfs_acc_blocks(struct nilfs *nilfs,
 			 * more by duplicate cleaner daemons.
 			 */
 			n = nilfs_deselect_segment(segnums, n, i);
+			ra--;
 			continue;
 		}
 
-		ret = nilfs_get_segment(nilfs, segnums[i], &segment);
+		if (maxblks && i > 0 && nblks + si.sui_nblocks > maxblks)
+			break;
+		nblks += si.sui_nblocks;
+
+		nilfs_phase_begin(stat, &clk);
+		ret = nilfs_get_segment_summary(nilfs, segnums[i],
+						si.sui_nblocks, &segment);
 		if (unlikely(ret < 0))
 			return -1;
+		nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_READ, &clk, 1);
 
 		if (cnt64_ge(segment.seqnum, protseq)) {
 			n = nilfs_deselect_segment(segnums, n, i);
+			ra--;
 			ret = nilfs_put_segment(&segment);
 			if (unlikely(ret < 0))
 				return -1;
 			continue;
 		}
+		nilfs_phase_begin(stat, &clk);
 		ret = nilfs_acc_blocks_segment(&segment, si.sui_nblocks,
-					       vdescv, bdescv);
+					       vdescv, bdescv, &nbytes);
 		if (unlikely(ret < 0))
 			return -1;
+		nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_PARSE, &clk, 1);
+
+		if (sis)
+			sis[i] = si;
+		if (seqnums)
+			seqnums[i] = segment.seqnum;
 
 		ret = nilfs_put_segment(&segment);
 		if (unlikely(ret < 0))
 			return -1;
 		i++;
 	}
+	if (stat)
+		stat->bytes_read += nbytes;
+	*naccp = i;
 	return n;
 }
 
+/**
+ * nilfs_get_batched - issue an ioctl on an array in large batches
+ * @nilfs: nilfs object
+ * @get: function issuing the ioctl
+ * @buf: array of entries, filled in place
+ * @size: size of an entry
+ * @nmembs: number of entries in @buf
+ * @stat: reclaim statistics to account time and ioctls [optional]
+ * @phase: phase to which the ioctls are accounted
+ *
+ * @buf is handed to the kernel directly; no entry is copied in user
+ * space.  Each call covers as many of the remaining entries as allowed by
+ * NILFS_GC_BATCH_MAX, and a short return resumes from the first entry
+ * that was not filled.
+ */
+static int nilfs_get_batched(struct nilfs *nilfs,
+			     ssize_t (*get)(struct nilfs *, void *, size_t),
+			     void *buf, size_t size, size_t nmembs,
+			     struct nilfs_reclaim_stat *stat, int phase)
+{
+	struct nilfs_phase_clock clk;
+	char *p = buf;
+	size_t i, ncalls = 0;
+	ssize_t n;
+
+	nilfs_phase_begin(stat, &clk);
+	for (i = 0; i < nmembs; i += n) {
+		ncalls++;
+		n = get(nilfs, p + i * size,
+			min_t(size_t, nmembs - i, NILFS_GC_BATCH_MAX));
+		if (unlikely(n < 0))
+			return -1;
+		if (unlikely(n == 0)) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	nilfs_phase_end(stat, phase, &clk, ncalls);
+	return 0;
+}
+
+static ssize_t nilfs_get_vinfo_batch(struct nilfs *nilfs, void *buf,
+				     size_t nmembs)
+{
+	return nilfs_get_vinfo(nilfs, buf, nmembs);
+}
+
+static ssize_t nilfs_get_bdescs_batch(struct nilfs *nilfs, void *buf,
+				      size_t nmembs)
+{
+	return nilfs_get_bdescs(nilfs, buf, nmembs);
+}
+
 /**
  * nilfs_get_vdesc - get information on virtual block addresses
  * @nilfs: nilfs object
  * @vdescv: vector object storing (descriptors of) virtual block numbers
+ * @vicache: vinfo cache [optional]
+ * @refsp: place to store references to @vdescv sorted by virtual block
+ * number
+ * @nhitsp: place to store the number of blocks found in @vicache
+ * @stat: reclaim statistics to account time and ioctls [optional]
+ *
+ * The descriptors in @vdescv are left in disk order; the lifetime of
+ * each virtual block is looked up through the references in ascending
+ * order of virtual block numbers.  The virtual block numbers missing
+ * from @vicache are gathered into a single vinfo array, which is passed
+ * to the kernel in large batches.  The caller must free *@refsp.
  */
-static int nilfs_get_vdesc(struct nilfs *nilfs, struct nilfs_vector *vdescv)
+static int nilfs_get_vdesc(struct nilfs *nilfs, struct nilfs_vector *vdescv,
+			   struct nilfs_vicache *vicache,
+			   struct nilfs_vdesc_ref **refsp, size_t *nhitsp,
+			   struct nilfs_reclaim_stat *stat)
 {
+	struct nilfs_vdesc *vdescs = nilfs_vector_get_data(vdescv);
+	size_t nvdescs = nilfs_vector_get_size(vdescv);
+	struct nilfs_vdesc_ref *refs;
+	struct nilfs_vinfo *vinfo = NULL;
+	size_t *index = NULL;
 	struct nilfs_vdesc *vdesc;
-	struct nilfs_vinfo vinfo[NILFS_GC_NVINFO];
-	ssize_t n;
-	int i, j;
+	size_t i, j, nhits = 0;
+	int errsv;
 
-	nilfs_vector_sort(vdescv, nilfs_comp_vdesc_vblocknr);
+	refs = malloc(sizeof(*refs) * max_t(size_t, nvdescs, 1));
+	if (unlikely(!refs))
+		return -1;
 
-	for (i = 0; i < nilfs_vector_get_size(vdescv); i += n) {
-		for (j = 0;
-		     (j < NILFS_GC_NVINFO) &&
-			     (i + j < nilfs_vector_get_size(vdescv));
-		     j++) {
-			vdesc = nilfs_vector_get_element(vdescv, i + j);
-			assert(vdesc != NULL);
-			vinfo[j].vi_vblocknr = vdesc->vd_vblocknr;
-		}
-		n = nilfs_get_vinfo(nilfs, vinfo, j);
-		if (unlikely(n < 0))
-			return -1;
-		for (j = 0; j < n; j++) {
-			vdesc = nilfs_vector_get_element(vdescv, i + j);
-			assert((vdesc != NULL) &&
-			       (vdesc->vd_vblocknr == vinfo[j].vi_vblocknr));
-			vdesc->vd_period.p_start = vinfo[j].vi_start;
-			vdesc->vd_period.p_end = vinfo[j].vi_end;
+	for (i = 0; i < nvdescs; i++) {
+		refs[i].key = vdescs[i].vd_vblocknr;
+		refs[i].index = i;
+	}
+	if (unlikely(nilfs_sort_vdesc_refs(refs, nvdescs) < 0))
+		goto failed;
+
+	vinfo = malloc(sizeof(*vinfo) * max_t(size_t, nvdescs, 1));
+	index = malloc(sizeof(*index) * max_t(size_t, nvdescs, 1));
+	if (unlikely(!vinfo || !index))
+		goto failed;
+
+	for (i = 0, j = 0; i < nvdescs; i++) {
+		vdesc = &vdescs[refs[i].index];
+		if (vicache &&
+		    nilfs_vicache_lookup(vicache, refs[i].key,
+					 &vdesc->vd_period)) {
+			nhits++;
+			continue;
 		}
+		vinfo[j].vi_vblocknr = refs[i].key;
+		index[j++] = refs[i].index;
 	}
 
+	if (unlikely(nilfs_get_batched(nilfs, nilfs_get_vinfo_batch, vinfo,
+				       sizeof(*vinfo), j, stat,
+				       NILFS_RECLAIM_PHASE_VINFO) < 0))
+		goto failed;
+
+	for (i = 0; i < j; i++) {
+		vdesc = &vdescs[index[i]];
+		assert(vdesc->vd_vblocknr == vinfo[i].vi_vblocknr);
+		vdesc->vd_period.p_start = vinfo[i].vi_start;
+		vdesc->vd_period.p_end = vinfo[i].vi_end;
+		if (vicache)
+			nilfs_vicache_insert(vicache, vinfo[i].vi_vblocknr,
+					     &vdesc->vd_period);
+	}
+	free(vinfo);
+	free(index);
+	*refsp = refs;
+	*nhitsp = nhits;
 	return 0;
+
+failed:
+	errsv = errno;
+	free(vinfo);
+	free(index);
+	free(refs);
+	errno = errsv;
+	return -1;
 }
 
 /**
  * nilfs_get_snapshot - get checkpoint numbers of snapshots
  * @nilfs: nilfs object
+ * @cpstat: status of checkpoints
  * @ssp: pointer to store array of checkpoint numbers which are snapshots
  */
-static ssize_t nilfs_get_snapshot(struct nilfs *nilfs, nilfs_cno_t **ssp)
+static ssize_t nilfs_get_snapshot(struct nilfs *nilfs,
+				  const struct nilfs_cpstat *cpstat,
+				  nilfs_cno_t **ssp)
 {
-	struct nilfs_cpstat cpstat;
 	struct nilfs_cpinfo cpinfo[NILFS_GC_NCPINFO];
 	nilfs_cno_t cno, *ss, prev = 0;
 	ssize_t n;
 	uint64_t nss = 0;
 	int i, j;
-	int ret;
 
-	ret = nilfs_get_cpstat(nilfs, &cpstat);
-	if (unlikely(ret < 0))
-		return -1;
-	if (cpstat.cs_nsss == 0)
+	if (cpstat->cs_nsss == 0)
 		return 0;
 
-	ss = malloc(sizeof(*ss) * cpstat.cs_nsss);
+	ss = malloc(sizeof(*ss) * cpstat->cs_nsss);
 	if (unlikely(ss == NULL))
 		return -1;
 
 	cno = 0;
-	for (i = 0; i < cpstat.cs_nsss; i += n) {
+	for (i = 0; i < cpstat->cs_nsss; i += n) {
 		n = nilfs_get_cpinfo(nilfs, cno, NILFS_SNAPSHOT, cpinfo,
 				     NILFS_GC_NCPINFO);
 		if (unlikely(n < 0)) {
@@ -400,29 +765,83 @@ static ssize_t nilfs_get_snapshot(struct nilfs *nilfs, nilfs_cno_t **ssp)
 		if (cno == 0)
 			break;
 	}
-	if (unlikely(cpstat.cs_nsss != nss))
+	if (unlikely(cpstat->cs_nsss != nss))
 		nilfs_gc_logger
 			(LOG_WARNING, "snapshot count mismatch: %llu != %llu",
-			 (unsigned long long)cpstat.cs_nsss,
+			 (unsigned long long)cpstat->cs_nsss,
 			 (unsigned long long)nss);
 	*ssp = ss;
 	return nss;
 }
 
+/**
+ * nilfs_get_snapshot_set - get checkpoint numbers of snapshots
+ * @nilfs: nilfs object
+ * @use_cache: flag to reuse snapshot list cached in @nilfs
+ * @ssp: pointer to store array of checkpoint numbers which are snapshots
+ * @bufp: pointer to store array that the caller must free, or NULL
+ *
+ * If @use_cache is set, the list cached in @nilfs is used while it is
+ * valid, and a list read here is cached for the next call (see
+ * nilfs_lookup_snapshot_cache()).  Otherwise the list is read on every
+ * call.
+ */
+static ssize_t nilfs_get_snapshot_set(struct nilfs *nilfs, int use_cache,
+				      const nilfs_cno_t **ssp,
+				      nilfs_cno_t **bufp)
+{
+	struct nilfs_cpstat cpstat;
+	struct nilfs_sustat sustat;
+	nilfs_cno_t *ss = NULL;
+	ssize_t n;
+
+	*ssp = NULL;
+	*bufp = NULL;
+	if (unlikely(nilfs_get_cpstat(nilfs, &cpstat) < 0))
+		return -1;
+
+	if (use_cache) {
+		n = nilfs_lookup_snapshot_cache(nilfs, &cpstat, ssp);
+		if (n >= 0)
+			return n;
+		if (unlikely(nilfs_get_sustat(nilfs, &sustat) < 0))
+			return -1;
+	}
+
+	n = nilfs_get_snapshot(nilfs, &cpstat, &ss);
+	if (unlikely(n < 0))
+		return -1;
+
+	*ssp = ss;
+	if (use_cache)
+		nilfs_update_snapshot_cache(nilfs, &cpstat, &sustat, ss, n);
+	else
+		*bufp = ss;
+	return n;
+}
+
+/* judgement of nilfs_vdesc_is_live() */
+enum {
+	NILFS_VDESC_DEAD = 0,
+	NILFS_VDESC_LIVE = 1,
+	NILFS_VDESC_CHECK_SNAPSHOT = 2,	/* live if a snapshot is in period */
+};
+
 /*
  * nilfs_vdesc_is_live - judge if a virtual block address is live or dead
  * @vdesc: descriptor object of the virtual block address
  * @protect: the minimum of checkpoint numbers to be protected
  * @ss: checkpoint numbers of snapshots
  * @n: size of @ss array
- * @last_hit: the last snapshot number hit
+ *
+ * Return Value: NILFS_VDESC_LIVE or NILFS_VDESC_DEAD if the judgement
+ * does not depend on individual snapshots, or NILFS_VDESC_CHECK_SNAPSHOT
+ * if the block is live only if a snapshot falls in its period.
  */
 static int nilfs_vdesc_is_live(const struct nilfs_vdesc *vdesc,
 			       nilfs_cno_t protect, const nilfs_cno_t *ss,
-			       size_t n, nilfs_cno_t *last_hit)
+			       size_t n)
 {
-	long low, high, index;
-
 	if (vdesc->vd_cno == 0) {
 		/*
 		 * live/dead judge for sufile and cpfile should not
@@ -435,169 +854,387 @@ static int nilfs_vdesc_is_live(const struct nilfs_vdesc *vdesc,
 
 	if (vdesc->vd_period.p_end == NILFS_CNO_MAX ||
 	    vdesc->vd_period.p_end > protect)
-		return 1;
+		return NILFS_VDESC_LIVE;
 
 	if (n == 0 || vdesc->vd_period.p_start > ss[n - 1] ||
 	    vdesc->vd_period.p_end <= ss[0])
-		return 0;
+		return NILFS_VDESC_DEAD;
 
-	/* Try the last hit snapshot number */
-	if (*last_hit >= vdesc->vd_period.p_start &&
-	    *last_hit < vdesc->vd_period.p_end)
-		return 1;
+	return NILFS_VDESC_CHECK_SNAPSHOT;
+}
 
-	low = 0;
-	high = n - 1;
-	index = 0;
-	while (low <= high) {
-		index = (low + high) / 2;
-		if (ss[index] < vdesc->vd_period.p_start) {
-			/* drop snapshot numbers ss[low] .. ss[index] */
-			low = index + 1;
-		} else if (ss[index] >= vdesc->vd_period.p_end) {
-			/* drop snapshot numbers ss[index] .. ss[high] */
-			high = index - 1;
-		} else {
-			/* ss[index] is in the range [p_start, p_end) */
-			*last_hit = ss[index];
-			return 1;
+#define NILFS_SSINDEX_NQUERY	8	/* Queries interleaved at once */
+
+/**
+ * struct nilfs_ssindex - snapshot numbers in Eytzinger layout
+ * @ss: array of snapshot numbers; ss[1] is the root and the children of
+ * ss[k] are ss[2k] and ss[2k + 1]
+ * @n: number of snapshots
+ * @depth: number of levels of the tree
+ */
+struct nilfs_ssindex {
+	nilfs_cno_t *ss;
+	size_t n;
+	unsigned int depth;
+};
+
+static size_t nilfs_ssindex_fill(struct nilfs_ssindex *idx,
+				 const nilfs_cno_t *ss, size_t i, size_t k)
+{
+	if (k <= idx->n) {
+		i = nilfs_ssindex_fill(idx, ss, i, 2 * k);
+		idx->ss[k] = ss[i++];
+		i = nilfs_ssindex_fill(idx, ss, i, 2 * k + 1);
+	}
+	return i;
+}
+
+/**
+ * nilfs_ssindex_build - build search tree of snapshot numbers
+ * @idx: index to be initialized
+ * @ss: checkpoint numbers of snapshots in ascending order
+ * @n: size of @ss array
+ */
+static int nilfs_ssindex_build(struct nilfs_ssindex *idx,
+			       const nilfs_cno_t *ss, size_t n)
+{
+	idx->ss = malloc(sizeof(*idx->ss) * (n + 1));
+	if (unlikely(!idx->ss))
+		return -1;
+
+	idx->n = n;
+	for (idx->depth = 0; (1UL << idx->depth) <= n; idx->depth++)
+		;
+	nilfs_ssindex_fill(idx, ss, 0, 1);
+	return 0;
+}
+
+/**
+ * nilfs_ssindex_any_in - test if snapshots are in periods
+ * @idx: snapshot index
+ * @periods: array of pointers to periods
+ * @n: number of periods
+ * @result: array to store 1 if a snapshot is in [p_start, p_end) of
+ * the corresponding period, or 0 otherwise
+ *
+ * Description: The lower bound of p_start is searched without branches
+ * on the comparison results.  NILFS_SSINDEX_NQUERY searches descend
+ * the tree in lock step so that their cache misses overlap, and nodes a
+ * few levels below are prefetched.
+ */
+static void nilfs_ssindex_any_in(const struct nilfs_ssindex *idx,
+				 const struct nilfs_period **periods,
+				 size_t n, unsigned char *result)
+{
+	const nilfs_cno_t *ss = idx->ss;
+	size_t k[NILFS_SSINDEX_NQUERY];
+	size_t i, j, m;
+	unsigned int d;
+
+	for (i = 0; i < n; i += m) {
+		m = min_t(size_t, n - i, NILFS_SSINDEX_NQUERY);
+		for (j = 0; j < m; j++)
+			k[j] = 1;
+
+		for (d = 0; d < idx->depth; d++) {
+			for (j = 0; j < m; j++) {
+				if (k[j] > idx->n)
+					continue;	/* at a leaf already */
+				if (16 * k[j] <= idx->n)
+					__builtin_prefetch(&ss[16 * k[j]]);
+				k[j] = 2 * k[j] +
+					(ss[k[j]] < periods[i + j]->p_start);
+			}
+		}
+		for (j = 0; j < m; j++) {
+			/* drop the trailing right turns to get lower bound */
+			k[j] >>= __builtin_ffsl(~k[j]);
+			result[i + j] = k[j] != 0 &&
+				ss[k[j]] < periods[i + j]->p_end;
+		}
+	}
+}
+
+/**
+ * struct nilfs_toss_vdesc_ctx - context of nilfs_toss_vdesc()
+ * @periodv: vector object to store deletable checkpoint numbers (periods)
+ * @vblocknrv: vector object to store deletable virtual block numbers
+ * @live: array of flags that tell if each descriptor is live
+ * @index: index of the descriptor passed to nilfs_vdesc_marked_live()
+ */
+struct nilfs_toss_vdesc_ctx {
+	struct nilfs_vector *periodv;
+	struct nilfs_vector *vblocknrv;
+	unsigned char *live;
+	size_t index;
+};
+
+/**
+ * nilfs_toss_vdesc - register a deletable virtual block
+ * @vdesc: descriptor object of the virtual block address
+ * @ctx: context object
+ *
+ * Return Value: 0 on success, or -1 on error.
+ */
+static int nilfs_toss_vdesc(const struct nilfs_vdesc *vdesc,
+			    struct nilfs_toss_vdesc_ctx *ctx)
+{
+	struct nilfs_period *periodp;
+	uint64_t *vblocknrp;
+	size_t n;
+
+	/* Add the virtual block number to the candidate for deletion. */
+	vblocknrp = nilfs_vector_get_new_element(ctx->vblocknrv);
+	if (unlikely(!vblocknrp))
+		return -1;
+	*vblocknrp = vdesc->vd_vblocknr;
+
+	/*
+	 * Add the period to the candidate for deletion unless the file
+	 * is cpfile or sufile.  Blocks with neighbouring virtual block
+	 * numbers tend to share their lifetimes, so a period overlapping or
+	 * adjoining the last one added is merged into it.
+	 */
+	if (vdesc->vd_cno != 0) {
+		n = nilfs_vector_get_size(ctx->periodv);
+		if (n > 0) {
+			periodp = nilfs_vector_get_element(ctx->periodv, n - 1);
+			if (vdesc->vd_period.p_start <= periodp->p_end &&
+			    periodp->p_start <= vdesc->vd_period.p_end) {
+				if (vdesc->vd_period.p_start < periodp->p_start)
+					periodp->p_start =
+						vdesc->vd_period.p_start;
+				if (vdesc->vd_period.p_end > periodp->p_end)
+					periodp->p_end = vdesc->vd_period.p_end;
+				return 0;
+			}
 		}
+		periodp = nilfs_vector_get_new_element(ctx->periodv);
+		if (unlikely(!periodp))
+			return -1;
+		*periodp = vdesc->vd_period;
 	}
 	return 0;
 }
 
+/**
+ * nilfs_vdesc_marked_live - filter function to keep live virtual blocks
+ * @elem: descriptor object of the virtual block address
+ * @arg: context object (struct nilfs_toss_vdesc_ctx)
+ */
+static int nilfs_vdesc_marked_live(void *elem, void *arg)
+{
+	struct nilfs_toss_vdesc_ctx *ctx = arg;
+
+	return ctx->live[ctx->index++];
+}
+
+/**
+ * nilfs_check_snapshots - judge virtual blocks that depend on snapshots
+ * @vdescs: array of descriptors of virtual blocks
+ * @nvdescs: number of descriptors in @vdescs
+ * @ss: checkpoint numbers of snapshots
+ * @nss: size of @ss array
+ * @live: array of judgements; NILFS_VDESC_CHECK_SNAPSHOT entries are
+ * replaced with NILFS_VDESC_LIVE or NILFS_VDESC_DEAD
+ */
+static int nilfs_check_snapshots(const struct nilfs_vdesc *vdescs,
+				 size_t nvdescs, const nilfs_cno_t *ss,
+				 size_t nss, unsigned char *live)
+{
+	const struct nilfs_period **periods;
+	struct nilfs_ssindex idx;
+	unsigned char *result;
+	size_t *pending;
+	size_t i, npending = 0;
+	int ret = -1;
+
+	for (i = 0; i < nvdescs; i++)
+		if (live[i] == NILFS_VDESC_CHECK_SNAPSHOT)
+			npending++;
+	if (npending == 0)
+		return 0;
+
+	pending = malloc(sizeof(*pending) * npending);
+	periods = malloc(sizeof(*periods) * npending);
+	result = malloc(npending);
+	if (unlikely(!pending || !periods || !result))
+		goto out;
+
+	if (unlikely(nilfs_ssindex_build(&idx, ss, nss) < 0))
+		goto out;
+
+	for (i = 0, npending = 0; i < nvdescs; i++) {
+		if (live[i] == NILFS_VDESC_CHECK_SNAPSHOT) {
+			pending[npending] = i;
+			periods[npending++] = &vdescs[i].vd_period;
+		}
+	}
+	nilfs_ssindex_any_in(&idx, periods, npending, result);
+	for (i = 0; i < npending; i++)
+		live[pending[i]] = result[i];
+
+	free(idx.ss);
+	ret = 0;
+out:
+	free(result);
+	free(periods);
+	free(pending);
+	return ret;
+}
+
+/**
+ * nilfs_judge_vdescs - judge if virtual blocks are live or dead
+ * @vdescs: array of descriptors of virtual blocks
+ * @nvdescs: number of descriptors in @vdescs
+ * @protcno: start number of checkpoint to be protected
+ * @ss: checkpoint numbers of snapshots
+ * @nss: size of @ss array
+ * @live: array to store 1 for each live descriptor, or 0 otherwise
+ */
+static int nilfs_judge_vdescs(const struct nilfs_vdesc *vdescs,
+			      size_t nvdescs, nilfs_cno_t protcno,
+			      const nilfs_cno_t *ss, size_t nss,
+			      unsigned char *live)
+{
+	size_t i;
+
+	for (i = 0; i < nvdescs; i++)
+		live[i] = nilfs_vdesc_is_live(&vdescs[i], protcno, ss, nss);
+
+	return nilfs_check_snapshots(vdescs, nvdescs, ss, nss, live);
+}
+
 /**
  * nilfs_toss_vdescs - deselect deletable virtual block numbers
  * @nilfs: nilfs object
  * @vdescv: vector object storing (descriptors of) virtual block numbers
+ * @refs: references to @vdescv sorted by virtual block number
  * @periodv: vector object to store deletable checkpoint numbers (periods)
  * @vblocknrv: vector object to store deletable virtual block numbers
  * @protcno: start number of checkpoint to be protected
+ * @use_cache: flag to reuse snapshot list cached in @nilfs
+ * @stat: reclaim statistics
  *
  * nilfs_cleanerd_toss_vdescs() deselects virtual block numbers of files
- * other than the DAT file.
+ * other than the DAT file.  Blocks whose liveness depends on snapshots
+ * are judged together in a batch after the others.  Deletable blocks are
+ * then registered in ascending order of virtual block numbers through
+ * @refs, so that @vblocknrv and @periodv are filled in that order, and
+ * live descriptors are compacted in place keeping the disk order of
+ * @vdescv.
  */
 static int nilfs_toss_vdescs(struct nilfs *nilfs,
 			     struct nilfs_vector *vdescv,
+			     const struct nilfs_vdesc_ref *refs,
 			     struct nilfs_vector *periodv,
 			     struct nilfs_vector *vblocknrv,
-			     nilfs_cno_t protcno)
+			     nilfs_cno_t protcno, int use_cache,
+			     struct nilfs_reclaim_stat *stat)
 {
-	struct nilfs_vdesc *vdesc;
-	struct nilfs_period *periodp;
-	uint64_t *vblocknrp;
-	nilfs_cno_t *ss, last_hit;
+	struct nilfs_toss_vdesc_ctx ctx;
+	struct nilfs_phase_clock clk;
+	const struct nilfs_vdesc *vdescs = nilfs_vector_get_data(vdescv);
+	size_t nvdescs = nilfs_vector_get_size(vdescv);
+	const nilfs_cno_t *ss;
+	nilfs_cno_t *ssbuf;
+	size_t i, nss;
 	ssize_t n;
-	int i, j, ret;
+	int ret = -1;
 
-	ss = NULL;
-	n = nilfs_get_snapshot(nilfs, &ss);
+	nilfs_phase_begin(stat, &clk);
+	n = nilfs_get_snapshot_set(nilfs, use_cache, &ss, &ssbuf);
 	if (unlikely(n < 0))
 		return n;
-
-	last_hit = 0;
-	for (i = 0; i < nilfs_vector_get_size(vdescv); i++) {
-		for (j = i; j < nilfs_vector_get_size(vdescv); j++) {
-			vdesc = nilfs_vector_get_element(vdescv, j);
-			assert(vdesc != NULL);
-			if (nilfs_vdesc_is_live(vdesc, protcno, ss, n,
-						&last_hit))
-				break;
-
-			/*
-			 * Add the virtual block number to the candidate
-			 * for deletion.
-			 */
-			vblocknrp = nilfs_vector_get_new_element(vblocknrv);
-			if (unlikely(!vblocknrp)) {
-				ret = -1;
-				goto out;
-			}
-			*vblocknrp = vdesc->vd_vblocknr;
-
-			/*
-			 * Add the period to the candidate for deletion
-			 * unless the file is cpfile or sufile.
-			 */
-			if (vdesc->vd_cno != 0) {
-				periodp = nilfs_vector_get_new_element(periodv);
-				if (unlikely(!periodp)) {
-					ret = -1;
-					goto out;
-				}
-				*periodp = vdesc->vd_period;
-			}
-		}
-		if (j > i)
-			nilfs_vector_delete_elements(vdescv, i, j - i);
+	nss = n;
+	nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_SNAPSHOT, &clk, 1);
+
+	nilfs_phase_begin(stat, &clk);
+	ctx.periodv = periodv;
+	ctx.vblocknrv = vblocknrv;
+	ctx.index = 0;
+	ctx.live = malloc(max_t(size_t, nvdescs, 1));
+	if (unlikely(!ctx.live))
+		goto out;
+
+	if (unlikely(nilfs_judge_vdescs(vdescs, nvdescs, protcno, ss, nss,
+					ctx.live) < 0))
+		goto out;
+
+	for (i = 0; i < nvdescs; i++) {
+		if (ctx.live[refs[i].index])
+			continue;
+		if (unlikely(nilfs_toss_vdesc(&vdescs[refs[i].index],
+					      &ctx) < 0))
+			goto out;
 	}
-	ret = 0;
- out:
-	free(ss);
+
+	ret = nilfs_vector_filter(vdescv, nilfs_vdesc_marked_live, &ctx) < 0 ?
+		-1 : 0;
+	nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_TOSS, &clk, 1);
+out:
+	free(ctx.live);
+	free(ssbuf);
 	return ret;
 }
 
 /**
  * nilfs_unify_period - unify periods of checkpoint numbers
  * @periodv: vector object storing checkpoint numbers
+ *
+ * The periods are sorted by their start and then merged in a single
+ * pass: overlapping or adjoining periods are folded into the last one
+ * kept, and the others are moved down next to it.
  */
 static void nilfs_unify_period(struct nilfs_vector *periodv)
 {
-	struct nilfs_period *base, *target;
-	int i, j;
+	struct nilfs_period *periods;
+	size_t i, j, n = nilfs_vector_get_size(periodv);
 
-	nilfs_vector_sort(periodv, nilfs_comp_period);
+	if (n < 2)
+		return;
 
-	for (i = 0; i < nilfs_vector_get_size(periodv); i++) {
-		base = nilfs_vector_get_element(periodv, i);
-		assert(base != NULL);
-		for (j = i + 1; j < nilfs_vector_get_size(periodv); j++) {
-			target = nilfs_vector_get_element(periodv, j);
-			assert(target != NULL);
-			if (base->p_end < target->p_start)
-				break;
-			if (base->p_end < target->p_end)
-				base->p_end = target->p_end;
-		}
+	nilfs_vector_sort(periodv, nilfs_comp_period);
+	periods = nilfs_vector_get_data(periodv);
 
-		if (j > i + 1)
-			nilfs_vector_delete_elements(periodv, i + 1,
-						     j - i - 1);
+	for (i = 0, j = 1; j < n; j++) {
+		if (periods[i].p_end < periods[j].p_start)
+			periods[++i] = periods[j];
+		else if (periods[i].p_end < periods[j].p_end)
+			periods[i].p_end = periods[j].p_end;
 	}
+
+	if (i + 1 < n)
+		nilfs_vector_delete_elements(periodv, i + 1, n - i - 1);
 }
 
 /**
  * nilfs_get_bdesc - get information on disk block addresses
  * @nilfs: nilfs object
  * @bdescv: vector object storing (descriptors of) disk block numbers
+ * @stat: reclaim statistics to account time and ioctls [optional]
  */
-static int nilfs_get_bdesc(struct nilfs *nilfs, struct nilfs_vector *bdescv)
+static int nilfs_get_bdesc(struct nilfs *nilfs, struct nilfs_vector *bdescv,
+			   struct nilfs_reclaim_stat *stat)
 {
-	struct nilfs_bdesc *bdescs;
-	size_t nbdescs, count;
-	ssize_t n;
-	int i;
-
 	nilfs_vector_sort(bdescv, nilfs_comp_bdesc);
 
-	bdescs = nilfs_vector_get_data(bdescv);
-	nbdescs = nilfs_vector_get_size(bdescv);
-	for (i = 0; i < nbdescs; i += n) {
-		count = min_t(size_t, nbdescs - i, NILFS_GC_NBDESCS);
-		n = nilfs_get_bdescs(nilfs, bdescs + i, count);
-		if (unlikely(n < 0))
-			return -1;
-	}
-
-	return 0;
+	return nilfs_get_batched(nilfs, nilfs_get_bdescs_batch,
+				 nilfs_vector_get_data(bdescv),
+				 sizeof(struct nilfs_bdesc),
+				 nilfs_vector_get_size(bdescv), stat,
+				 NILFS_RECLAIM_PHASE_BDESC);
 }
 
 /**
  * nilfs_bdesc_is_live - judge if a disk block address is live or dead
- * @bdesc: descriptor object of the disk block address
+ * @elem: descriptor object of the disk block address
+ * @arg: unused
  */
-static int nilfs_bdesc_is_live(struct nilfs_bdesc *bdesc)
+static int nilfs_bdesc_is_live(void *elem, void *arg)
 {
+	const struct nilfs_bdesc *bdesc = elem;
+
 	return bdesc->bd_oblocknr == bdesc->bd_blocknr;
 }
 
@@ -610,152 +1247,240 @@ static int nilfs_bdesc_is_live(struct nilfs_bdesc *bdesc)
  */
 static int nilfs_toss_bdescs(struct nilfs_vector *bdescv)
 {
-	struct nilfs_bdesc *bdesc;
-	int i, j;
+	return nilfs_vector_filter(bdescv, nilfs_bdesc_is_live, NULL) < 0 ?
+		-1 : 0;
+}
 
-	for (i = 0; i < nilfs_vector_get_size(bdescv); i++) {
-		for (j = i; j < nilfs_vector_get_size(bdescv); j++) {
-			bdesc = nilfs_vector_get_element(bdescv, j);
-			assert(bdesc != NULL);
-			if (nilfs_bdesc_is_live(bdesc))
-				break;
-		}
-		if (j > i)
-			nilfs_vector_delete_elements(bdescv, i, j - i);
-	}
-	return 0;
+/*
+ * Upper estimate of the memory used per block while a batch is
+ * processed: the descriptor with the slack left by vector growth, the
+ * reference, vinfo and index entries of nilfs_get_vdesc(), the liveness
+ * flag, and the deletable virtual block number and period.
+ */
+#define NILFS_GC_BYTES_PER_BLOCK					\
+	(2 * sizeof(struct nilfs_vdesc) + sizeof(struct nilfs_vdesc_ref) + \
+	 sizeof(struct nilfs_vinfo) + sizeof(size_t) + 1 +		\
+	 sizeof(struct nilfs_period) + sizeof(uint64_t))
+
+/**
+ * struct nilfs_reclaim_vectors - vectors used to reclaim a batch
+ * @vdescv: descriptors of virtual block numbers
+ * @bdescv: descriptors of disk block numbers
+ * @periodv: deletable checkpoint numbers (periods)
+ * @vblocknrv: deletable virtual block numbers
+ * @supv: segment usage updates of deferred segments
+ * @no_set_suinfo: flag set if the set_suinfo ioctl is not supported
+ *
+ * The set_suinfo option of the nilfs object is cleared according to
+ * @no_set_suinfo only after the worker thread, which reads the options
+ * of the object, has finished.
+ */
+struct nilfs_reclaim_vectors {
+	struct nilfs_vector *vdescv;
+	struct nilfs_vector *bdescv;
+	struct nilfs_vector *periodv;
+	struct nilfs_vector *vblocknrv;
+	struct nilfs_vector *supv;
+	int no_set_suinfo;
+};
+
+/* results of nilfs_reclaim_batch() */
+enum {
+	NILFS_RECLAIM_BATCH_CLEANED,
+	NILFS_RECLAIM_BATCH_DEFERRED,
+	NILFS_RECLAIM_BATCH_INTERRUPTED,
+};
+
+static size_t nilfs_vector_memsize(const struct nilfs_vector *vector)
+{
+	return vector->v_maxelems * vector->v_elemsize;
 }
 
 /**
- * nilfs_xreclaim_segment - reclaim segments (enhanced API)
+ * nilfs_reclaim_vicache - get vinfo cache to be used by a batch
  * @nilfs: nilfs object
- * @segnums: array of segment numbers storing selected segments
- * @nsegs: size of the @segnums array
- * @dryrun: dry-run flag
  * @params: reclaim parameters
- * @stat: reclaim statistics
+ *
+ * Return Value: the vinfo cache given by @params after discarding the
+ * entries invalidated by writes since the last use, or NULL if it is not
+ * used.
  */
-int nilfs_xreclaim_segment(struct nilfs *nilfs,
-			   uint64_t *segnums, size_t nsegs, int dryrun,
-			   const struct nilfs_reclaim_params *params,
-			   struct nilfs_reclaim_stat *stat)
+static struct nilfs_vicache *
+nilfs_reclaim_vicache(struct nilfs *nilfs,
+		      const struct nilfs_reclaim_params *params)
 {
-	struct nilfs_vector *vdescv, *bdescv, *periodv, *vblocknrv, *supv;
-	sigset_t sigset, oldset, waitset;
-	nilfs_cno_t protcno;
-	ssize_t n, i, ret = -1;
-	size_t nblocks;
-	uint32_t reclaimable_blocks;
-	struct nilfs_suinfo_update *sup;
-	struct timeval tv;
+	struct nilfs_sustat sustat;
+	struct nilfs_cpstat cpstat;
 
-	if (unlikely(!(params->flags & NILFS_RECLAIM_PARAM_PROTSEQ) ||
-	    (params->flags & (~0UL << __NR_NILFS_RECLAIM_PARAMS)))) {
-		/*
-		 * The protseq parameter is mandatory.  Unknown
-		 * parameters are rejected.
-		 */
-		errno = EINVAL;
-		return -1;
-	}
+	if (!(params->flags & NILFS_RECLAIM_PARAM_VINFO_CACHE) ||
+	    !params->vicache)
+		return NULL;
 
-	if (nsegs == 0)
-		return 0;
+	if (nilfs_get_sustat(nilfs, &sustat) < 0 ||
+	    nilfs_get_cpstat(nilfs, &cpstat) < 0) {
+		nilfs_vicache_invalidate_all(params->vicache);
+		return NULL;
+	}
+	nilfs_vicache_validate(params->vicache, &sustat, cpstat.cs_cno);
+	return params->vicache;
+}
 
-	vdescv = nilfs_vector_create(sizeof(struct nilfs_vdesc));
-	bdescv = nilfs_vector_create(sizeof(struct nilfs_bdesc));
-	periodv = nilfs_vector_create(sizeof(struct nilfs_period));
-	vblocknrv = nilfs_vector_create(sizeof(uint64_t));
-	supv = nilfs_vector_create(sizeof(struct nilfs_suinfo_update));
-	if (unlikely(!vdescv || !bdescv || !periodv || !vblocknrv || !supv))
-		goto out_vec;
+/**
+ * nilfs_reclaim_rebase_vicache - keep vinfo cache across own cleaning
+ * @nilfs: nilfs object
+ * @vicache: vinfo cache
+ *
+ * Each CLEAN_SEGMENTS ioctl makes a checkpoint, which would make the next
+ * batch discard the cache.  This takes the checkpoint number found right
+ * after the ioctl as the new baseline of the cache.
+ */
+static void nilfs_reclaim_rebase_vicache(struct nilfs *nilfs,
+					 struct nilfs_vicache *vicache)
+{
+	struct nilfs_sustat sustat;
+	struct nilfs_cpstat cpstat;
 
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGINT);
-	sigaddset(&sigset, SIGTERM);
-	ret = sigprocmask(SIG_BLOCK, &sigset, &oldset);
-	if (unlikely(ret < 0)) {
-		nilfs_gc_logger(LOG_ERR, "cannot block signals: %s",
-				strerror(errno));
-		goto out_vec;
+	if (nilfs_get_sustat(nilfs, &sustat) < 0 ||
+	    nilfs_get_cpstat(nilfs, &cpstat) < 0) {
+		nilfs_vicache_invalidate_all(vicache);
+		return;
 	}
+	nilfs_vicache_rebase(vicache, &sustat, cpstat.cs_cno);
+}
 
-	ret = nilfs_lock_cleaner(nilfs);
-	if (unlikely(ret < 0))
-		goto out_sig;
+static nilfs_cno_t
+nilfs_reclaim_protcno(const struct nilfs_reclaim_params *params)
+{
+	return (params->flags & NILFS_RECLAIM_PARAM_PROTCNO) ?
+		params->protcno : NILFS_CNO_MAX;
+}
 
-	/* count blocks */
-	n = nilfs_acc_blocks(nilfs, segnums, nsegs, params->protseq, vdescv,
-			     bdescv);
-	if (unlikely(n < 0)) {
-		ret = n;
-		goto out_lock;
-	}
-	if (stat) {
-		stat->cleaned_segs = n;
-		stat->protected_segs = nsegs - n;
-		stat->deferred_segs = 0;
-	}
-	if (n == 0) {
-		ret = 0;
-		goto out_lock;
+static int nilfs_reclaim_use_sscache(const struct nilfs_reclaim_params *params)
+{
+	return !!(params->flags & NILFS_RECLAIM_PARAM_SNAPSHOT_CACHE);
+}
+
+/**
+ * nilfs_reclaim_rebase_sscache - keep snapshot list across own cleaning
+ * @nilfs: nilfs object
+ *
+ * Same as nilfs_reclaim_rebase_vicache(), but for the snapshot list
+ * cached in @nilfs.
+ */
+static void nilfs_reclaim_rebase_sscache(struct nilfs *nilfs)
+{
+	struct nilfs_sustat sustat;
+	struct nilfs_cpstat cpstat;
+
+	if (nilfs_get_sustat(nilfs, &sustat) < 0 ||
+	    nilfs_get_cpstat(nilfs, &cpstat) < 0) {
+		nilfs_invalidate_snapshot_cache(nilfs);
+		return;
 	}
+	nilfs_rebase_snapshot_cache(nilfs, &cpstat, &sustat);
+}
+
+/**
+ * nilfs_reclaim_batch - reclaim a batch of segments
+ * @nilfs: nilfs object
+ * @segnums: array of segments whose blocks were collected in @vecs
+ * @n: size of the @segnums array
+ * @dryrun: dry-run flag
+ * @params: reclaim parameters
+ * @vecs: vectors holding the blocks of @segnums
+ * @stat: reclaim statistics to which the counts of blocks are added
+ *
+ * Return Value: NILFS_RECLAIM_BATCH_CLEANED if the segments were cleaned
+ * (or would be in a dry run), NILFS_RECLAIM_BATCH_DEFERRED if they were
+ * left for later because of too few reclaimable blocks,
+ * NILFS_RECLAIM_BATCH_INTERRUPTED if a termination signal is pending, or
+ * -1 on error.
+ */
+static int nilfs_reclaim_batch(struct nilfs *nilfs, uint64_t *segnums,
+			       size_t n, int dryrun,
+			       const struct nilfs_reclaim_params *params,
+			       struct nilfs_reclaim_vectors *vecs,
+			       struct nilfs_reclaim_stat *stat)
+{
+	struct nilfs_vector *vdescv = vecs->vdescv, *bdescv = vecs->bdescv;
+	struct nilfs_vdesc_ref *refs;
+	struct nilfs_vicache *vicache;
+	struct nilfs_suinfo_update *sup;
+	struct nilfs_phase_clock clk;
+	struct timeval tv;
+	sigset_t waitset;
+	size_t nhits, nblocks, nvblocks, memsize, i;
+	uint32_t reclaimable_blocks;
+	int ret;
 
 	/* toss virtual blocks */
-	ret = nilfs_get_vdesc(nilfs, vdescv);
+	vicache = nilfs_reclaim_vicache(nilfs, params);
+	ret = nilfs_get_vdesc(nilfs, vdescv, vicache, &refs, &nhits, stat);
 	if (unlikely(ret < 0))
-		goto out_lock;
+		return -1;
 
-	nblocks = nilfs_vector_get_size(vdescv);
-	protcno = (params->flags & NILFS_RECLAIM_PARAM_PROTCNO) ?
-		params->protcno : NILFS_CNO_MAX;
+	nvblocks = nilfs_vector_get_size(vdescv);
+	stat->vinfo_hits += nhits;
+	stat->vinfo_misses += nvblocks - nhits;
+
+	/* the vinfo array of nilfs_get_vdesc() was the largest transient */
+	memsize = nilfs_vector_memsize(vdescv) + nilfs_vector_memsize(bdescv) +
+		nvblocks * (sizeof(*refs) + sizeof(struct nilfs_vinfo) +
+			    sizeof(size_t));
+	stat->peak_mem = max_t(size_t, stat->peak_mem, memsize);
 
-	ret = nilfs_toss_vdescs(nilfs, vdescv, periodv, vblocknrv, protcno);
+	ret = nilfs_toss_vdescs(nilfs, vdescv, refs, vecs->periodv,
+				vecs->vblocknrv, nilfs_reclaim_protcno(params),
+				nilfs_reclaim_use_sscache(params), stat);
+	free(refs);
 	if (unlikely(ret < 0))
-		goto out_lock;
+		return -1;
 
-	if (stat) {
-		stat->live_vblks = nilfs_vector_get_size(vdescv);
-		stat->defunct_vblks = nblocks - stat->live_vblks;
-		stat->freed_vblks = nilfs_vector_get_size(vblocknrv);
-	}
+	stat->live_vblks += nilfs_vector_get_size(vdescv);
+	stat->defunct_vblks += nvblocks - nilfs_vector_get_size(vdescv);
+	stat->freed_vblks += nilfs_vector_get_size(vecs->vblocknrv);
 
-	nilfs_vector_sort(vdescv, nilfs_comp_vdesc_blocknr);
-	nilfs_unify_period(periodv);
+	nilfs_phase_begin(stat, &clk);
+	ret = nilfs_sort_vdesc_blocknr(vdescv);
+	if (unlikely(ret < 0))
+		return -1;
+	nilfs_unify_period(vecs->periodv);
+	nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_TOSS, &clk, 0);
 
 	/* toss DAT file blocks */
-	ret = nilfs_get_bdesc(nilfs, bdescv);
+	ret = nilfs_get_bdesc(nilfs, bdescv, stat);
 	if (unlikely(ret < 0))
-		goto out_lock;
+		return -1;
 
+	nilfs_phase_begin(stat, &clk);
 	nblocks = nilfs_vector_get_size(bdescv);
 	ret = nilfs_toss_bdescs(bdescv);
 	if (unlikely(ret < 0))
-		goto out_lock;
+		return -1;
+	nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_TOSS, &clk, 0);
 
 	reclaimable_blocks = (nilfs_get_blocks_per_segment(nilfs) * n) -
 			(nilfs_vector_get_size(vdescv) +
 			nilfs_vector_get_size(bdescv));
 
-	if (stat) {
-		stat->live_pblks = nilfs_vector_get_size(bdescv);
-		stat->defunct_pblks = nblocks - stat->live_pblks;
+	stat->live_pblks += nilfs_vector_get_size(bdescv);
+	stat->defunct_pblks += nblocks - nilfs_vector_get_size(bdescv);
+	stat->live_blks += nilfs_vector_get_size(vdescv) +
+		nilfs_vector_get_size(bdescv);
+	stat->defunct_blks += reclaimable_blocks;
 
-		stat->live_blks = stat->live_vblks + stat->live_pblks;
-		stat->defunct_blks = reclaimable_blocks;
-	}
 	if (dryrun)
-		goto out_lock;
+		return NILFS_RECLAIM_BATCH_CLEANED;
 
 	ret = sigpending(&waitset);
 	if (unlikely(ret < 0)) {
 		nilfs_gc_logger(LOG_ERR, "cannot test signals: %s",
 				strerror(errno));
-		goto out_lock;
+		return -1;
 	}
 	if (sigismember(&waitset, SIGINT) || sigismember(&waitset, SIGTERM)) {
 		nilfs_gc_logger(LOG_DEBUG, "interrupted");
-		goto out_lock;
+		return NILFS_RECLAIM_BATCH_INTERRUPTED;
 	}
 
 	/*
@@ -764,20 +1489,16 @@ int nilfs_xreclaim_segment(struct nilfs *nilfs,
 	 */
 	if ((params->flags & NILFS_RECLAIM_PARAM_MIN_RECLAIMABLE_BLKS) &&
 			nilfs_opt_test_set_suinfo(nilfs) &&
+			!vecs->no_set_suinfo &&
 			reclaimable_blocks < params->min_reclaimable_blks * n) {
-		if (stat) {
-			stat->deferred_segs = n;
-			stat->cleaned_segs = 0;
-		}
-
 		ret = gettimeofday(&tv, NULL);
 		if (unlikely(ret < 0))
-			goto out_lock;
+			return -1;
 
 		for (i = 0; i < n; ++i) {
-			sup = nilfs_vector_get_new_element(supv);
+			sup = nilfs_vector_get_new_element(vecs->supv);
 			if (unlikely(!sup))
-				goto out_lock;
+				return -1;
 
 			sup->sup_segnum = segnums[i];
 			sup->sup_flags = 0;
@@ -785,44 +1506,602 @@ int nilfs_xreclaim_segment(struct nilfs *nilfs,
 			sup->sup_sui.sui_lastmod = tv.tv_sec;
 		}
 
-		ret = nilfs_set_suinfo(nilfs, nilfs_vector_get_data(supv), n);
+		nilfs_phase_begin(stat, &clk);
+		ret = nilfs_set_suinfo(nilfs,
+				       nilfs_vector_get_data(vecs->supv), n);
+		nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_CLEAN, &clk, 1);
 
 		if (ret == 0)
-			goto out_lock;
+			return NILFS_RECLAIM_BATCH_DEFERRED;
 
 		if (unlikely(ret < 0 && errno != ENOTTY)) {
 			nilfs_gc_logger(LOG_ERR, "cannot set suinfo: %s",
 					strerror(errno));
-			goto out_lock;
+			return -1;
 		}
 
 		/* errno == ENOTTY */
 		nilfs_gc_logger(LOG_WARNING,
 				"set_suinfo ioctl is not supported");
-		nilfs_opt_clear_set_suinfo(nilfs);
-		if (stat) {
-			stat->deferred_segs = 0;
-			stat->cleaned_segs = n;
-		}
+		vecs->no_set_suinfo = 1;
 		/* Try nilfs_clean_segments */
 	}
 
+	nilfs_phase_begin(stat, &clk);
 	ret = nilfs_clean_segments(nilfs,
 				   nilfs_vector_get_data(vdescv),
 				   nilfs_vector_get_size(vdescv),
-				   nilfs_vector_get_data(periodv),
-				   nilfs_vector_get_size(periodv),
-				   nilfs_vector_get_data(vblocknrv),
-				   nilfs_vector_get_size(vblocknrv),
+				   nilfs_vector_get_data(vecs->periodv),
+				   nilfs_vector_get_size(vecs->periodv),
+				   nilfs_vector_get_data(vecs->vblocknrv),
+				   nilfs_vector_get_size(vecs->vblocknrv),
 				   nilfs_vector_get_data(bdescv),
 				   nilfs_vector_get_size(bdescv),
 				   segnums, n);
+	/* freed numbers can be reused, even if the call failed halfway */
+	if (vicache)
+		nilfs_vicache_evict(vicache,
+				    nilfs_vector_get_data(vecs->vblocknrv),
+				    nilfs_vector_get_size(vecs->vblocknrv));
 	if (unlikely(ret < 0)) {
 		nilfs_gc_logger(LOG_ERR, "cannot clean segments: %s",
 				strerror(errno));
+		/* EBUSY may come from a snapshot missing in a stale list */
+		nilfs_invalidate_snapshot_cache(nilfs);
+		return -1;
+	}
+	nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_CLEAN, &clk, 1);
+	if (vicache)
+		nilfs_reclaim_rebase_vicache(nilfs, vicache);
+	if (nilfs_reclaim_use_sscache(params))
+		nilfs_reclaim_rebase_sscache(nilfs);
+	return NILFS_RECLAIM_BATCH_CLEANED;
+}
+
+static void nilfs_reverse_segnums(uint64_t *segnums, size_t n)
+{
+	uint64_t *p = segnums, *q = segnums + n - 1, t;
+
+	for (; p < q; p++, q--) {
+		t = *p;
+		*p = *q;
+		*q = t;
+	}
+}
+
+/**
+ * nilfs_rotate_segnums - move segments in front of others
+ * @segnums: array of segment numbers
+ * @nfront: number of segments at the head of @segnums
+ * @nback: number of segments following them
+ *
+ * Moves @segnums[@nfront .. @nfront + @nback) to the head of @segnums
+ * keeping the order of both ranges.
+ */
+static void nilfs_rotate_segnums(uint64_t *segnums, size_t nfront,
+				 size_t nback)
+{
+	if (nfront == 0 || nback == 0)
+		return;
+	nilfs_reverse_segnums(segnums, nfront);
+	nilfs_reverse_segnums(segnums + nfront, nback);
+	nilfs_reverse_segnums(segnums, nfront + nback);
+}
+
+/**
+ * struct nilfs_reclaim_prep - blocks of segments collected in advance
+ * @segnums: segments requested, in the order they were given
+ * @order: the same segments, collected ones first and deselected last
+ * @nsegs: number of segments requested
+ * @n: number of segments left after deselection
+ * @nacc: number of segments whose blocks were collected
+ * @sis: usage of the collected segments at the time of collection
+ * @seqnums: sequence numbers of the collected segments
+ * @vdescv: descriptors of virtual block numbers
+ * @bdescv: descriptors of disk block numbers
+ */
+struct nilfs_reclaim_prep {
+	uint64_t *segnums;
+	uint64_t *order;
+	size_t nsegs;
+	size_t n;
+	size_t nacc;
+	struct nilfs_suinfo *sis;
+	uint64_t *seqnums;
+	struct nilfs_vector *vdescv;
+	struct nilfs_vector *bdescv;
+};
+
+static size_t nilfs_reclaim_maxblks(const struct nilfs_reclaim_params *params)
+{
+	if (!(params->flags & NILFS_RECLAIM_PARAM_MEM_BUDGET) ||
+	    params->mem_budget == 0)
+		return 0;
+	return max_t(size_t, params->mem_budget / NILFS_GC_BYTES_PER_BLOCK, 1);
+}
+
+/**
+ * nilfs_reclaim_prep_free - free blocks collected in advance
+ * @prep: object returned through the pipeline parameters
+ */
+void nilfs_reclaim_prep_free(struct nilfs_reclaim_prep *prep)
+{
+	if (prep == NULL)
+		return;
+
+	nilfs_vector_destroy(prep->vdescv);
+	nilfs_vector_destroy(prep->bdescv);
+	free(prep->seqnums);
+	free(prep->sis);
+	free(prep->order);
+	free(prep->segnums);
+	free(prep);
+}
+
+/*
+ * __nilfs_prepare_reclaim - nilfs_prepare_reclaim() that also adds the
+ * number of bytes of segment summaries read to @bytes_read
+ */
+static struct nilfs_reclaim_prep *
+__nilfs_prepare_reclaim(struct nilfs *nilfs, const uint64_t *segnums,
+			size_t nsegs, const struct nilfs_reclaim_params *params,
+			uint64_t *bytes_read)
+{
+	struct nilfs_reclaim_stat st;
+	struct nilfs_reclaim_prep *prep;
+	size_t nra;
+	ssize_t n;
+	int errsv;
+
+	prep = calloc(1, sizeof(*prep));
+	if (unlikely(!prep))
+		return NULL;
+
+	prep->nsegs = nsegs;
+	prep->segnums = malloc(sizeof(uint64_t) * max_t(size_t, nsegs, 1));
+	prep->order = malloc(sizeof(uint64_t) * max_t(size_t, nsegs, 1));
+	prep->sis = malloc(sizeof(*prep->sis) * max_t(size_t, nsegs, 1));
+	prep->seqnums = malloc(sizeof(uint64_t) * max_t(size_t, nsegs, 1));
+	prep->vdescv = nilfs_vector_create(sizeof(struct nilfs_vdesc));
+	prep->bdescv = nilfs_vector_create(sizeof(struct nilfs_bdesc));
+	if (unlikely(!prep->segnums || !prep->order || !prep->sis ||
+		     !prep->seqnums || !prep->vdescv || !prep->bdescv))
+		goto failed;
+
+	memcpy(prep->segnums, segnums, sizeof(uint64_t) * nsegs);
+	memcpy(prep->order, segnums, sizeof(uint64_t) * nsegs);
+
+	memset(&st, 0, sizeof(st));
+	nra = (params->flags & NILFS_RECLAIM_PARAM_READAHEAD) ?
+		params->readahead : 0;
+	n = nilfs_acc_blocks(nilfs, prep->order, nsegs, params->protseq, nra,
+			     nilfs_reclaim_maxblks(params), prep->vdescv,
+			     prep->bdescv, &prep->nacc, prep->sis,
+			     prep->seqnums, &st);
+	*bytes_read += st.bytes_read;
+	if (unlikely(n < 0))
+		goto failed;
+	prep->n = n;
+	return prep;
+
+failed:
+	errsv = errno;
+	nilfs_reclaim_prep_free(prep);
+	errno = errsv;
+	return NULL;
+}
+
+/**
+ * nilfs_prepare_reclaim - collect blocks of segments in advance
+ * @nilfs: nilfs object
+ * @segnums: array of segment numbers expected to be reclaimed
+ * @nsegs: size of the @segnums array
+ * @params: reclaim parameters
+ *
+ * Description: nilfs_prepare_reclaim() reads the summaries of the
+ * segments given by @segnums and keeps their block descriptors, up to
+ * the number of blocks allowed by the memory budget of @params.  Only
+ * the segment layout is recorded; the lifetimes of the blocks are
+ * looked up when the object is passed to nilfs_xreclaim_segment().
+ *
+ * Return Value: On success, the pointer to the object is returned.  On
+ * error, NULL is returned.
+ */
+struct nilfs_reclaim_prep *
+nilfs_prepare_reclaim(struct nilfs *nilfs, const uint64_t *segnums,
+		      size_t nsegs, const struct nilfs_reclaim_params *params)
+{
+	uint64_t bytes_read = 0;
+
+	return __nilfs_prepare_reclaim(nilfs, segnums, nsegs, params,
+				       &bytes_read);
+}
+
+/**
+ * nilfs_reclaim_prep_usable - test if collected blocks are still valid
+ * @nilfs: nilfs object
+ * @prep: blocks collected in advance
+ * @segnums: array of segments to be reclaimed
+ * @nsegs: size of the @segnums array
+ * @protseq: start of sequence number of protected segments
+ *
+ * The collected blocks are valid if @prep was made for the same
+ * segments and none of the collected segments has been written or has
+ * entered the protected region since.
+ */
+static int nilfs_reclaim_prep_usable(struct nilfs *nilfs,
+				     const struct nilfs_reclaim_prep *prep,
+				     const uint64_t *segnums, size_t nsegs,
+				     uint64_t protseq)
+{
+	struct nilfs_suinfo *sis;
+	size_t i;
+	int ret = 0;
+
+	if (prep->nsegs != nsegs ||
+	    memcmp(prep->segnums, segnums, sizeof(uint64_t) * nsegs) != 0)
+		return 0;
+
+	if (prep->nacc == 0)
+		return 1;
+
+	sis = malloc(sizeof(*sis) * prep->nacc);
+	if (unlikely(!sis))
+		return 0;
+
+	if (nilfs_get_suinfo_batch(nilfs, prep->order, prep->nacc, sis) < 0)
+		goto out;
+
+	for (i = 0; i < prep->nacc; i++) {
+		if (!nilfs_suinfo_reclaimable(&sis[i]) ||
+		    sis[i].sui_lastmod != prep->sis[i].sui_lastmod ||
+		    sis[i].sui_nblocks != prep->sis[i].sui_nblocks ||
+		    cnt64_ge(prep->seqnums[i], protseq))
+			goto out;
+	}
+	ret = 1;
+out:
+	free(sis);
+	return ret;
+}
+
+/**
+ * struct nilfs_prep_worker - worker collecting blocks of next segments
+ * @thread: worker thread
+ * @nilfs: nilfs object
+ * @params: reclaim parameters
+ * @prep: collected blocks, or NULL on failure
+ * @err: error number on failure
+ * @bytes_read: number of bytes of segment summaries read
+ */
+struct nilfs_prep_worker {
+	pthread_t thread;
+	struct nilfs *nilfs;
+	const struct nilfs_reclaim_params *params;
+	struct nilfs_reclaim_prep *prep;
+	int err;
+	uint64_t bytes_read;
+};
+
+static void *nilfs_prep_worker_main(void *arg)
+{
+	struct nilfs_prep_worker *worker = arg;
+	const struct nilfs_reclaim_params *params = worker->params;
+
+	worker->prep = __nilfs_prepare_reclaim(worker->nilfs,
+					       params->next_segnums,
+					       params->next_nsegs, params,
+					       &worker->bytes_read);
+	if (unlikely(!worker->prep))
+		worker->err = errno;
+	return NULL;
+}
+
+/**
+ * nilfs_start_prep_worker - start collecting blocks of next segments
+ * @worker: worker object
+ * @nilfs: nilfs object
+ * @params: reclaim parameters with the pipeline parameters
+ *
+ * The worker reads segments while the caller only issues ioctls, so the
+ * two never use the raw device access of @nilfs at the same time, and
+ * the options of @nilfs are not changed until the worker is joined.
+ * Signals are left to the calling thread.
+ */
+static int nilfs_start_prep_worker(struct nilfs_prep_worker *worker,
+				   struct nilfs *nilfs,
+				   const struct nilfs_reclaim_params *params)
+{
+	sigset_t sigset, oldset;
+	int ret;
+
+	worker->nilfs = nilfs;
+	worker->params = params;
+	worker->prep = NULL;
+	worker->err = 0;
+	worker->bytes_read = 0;
+
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+	ret = pthread_create(&worker->thread, NULL, nilfs_prep_worker_main,
+			     worker);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (unlikely(ret != 0)) {
+		nilfs_gc_logger(LOG_WARNING, "cannot start worker thread: %s",
+				strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+static struct nilfs_reclaim_prep *
+nilfs_join_prep_worker(struct nilfs_prep_worker *worker)
+{
+	pthread_join(worker->thread, NULL);
+	if (!worker->prep)
+		nilfs_gc_logger(LOG_DEBUG, "cannot prepare next segments: %s",
+				strerror(worker->err));
+	return worker->prep;
+}
+
+/**
+ * nilfs_reclaim_stat_filled - get extended field groups filled by a call
+ * @params: reclaim parameters
+ *
+ * Return Value: flags of the extended fields that are filled once
+ * segments are processed with @params.  The vinfo cache counts and the
+ * pipeline count are filled only if their parameters are given.
+ */
+static unsigned long
+nilfs_reclaim_stat_filled(const struct nilfs_reclaim_params *params)
+{
+	unsigned long filled = NILFS_RECLAIM_STAT_MEMORY |
+		NILFS_RECLAIM_STAT_TIMING | NILFS_RECLAIM_STAT_ERROR;
+
+	if ((params->flags & NILFS_RECLAIM_PARAM_VINFO_CACHE) &&
+	    params->vicache)
+		filled |= NILFS_RECLAIM_STAT_VINFO_CACHE;
+	if (params->flags & NILFS_RECLAIM_PARAM_PIPELINE)
+		filled |= NILFS_RECLAIM_STAT_PIPELINE;
+	return filled;
+}
+
+/**
+ * nilfs_reclaim_stat_return - pass statistics back to the caller
+ * @stat: statistics of the caller [optional]
+ * @st: statistics collected by the call
+ * @filled: flags of the extended fields filled by the call
+ *
+ * Only the base fields and the extended field groups requested in
+ * @st->exflags are stored, so a caller built against an older, shorter
+ * version of the nilfs_reclaim_stat struct is never written past its end.
+ * The flags of requested groups that are not in @filled are cleared in
+ * @stat->exflags.
+ */
+static void nilfs_reclaim_stat_return(struct nilfs_reclaim_stat *stat,
+				      const struct nilfs_reclaim_stat *st,
+				      unsigned long filled)
+{
+	if (!stat)
+		return;
+
+	stat->exflags = st->exflags & filled;
+
+	stat->cleaned_segs = st->cleaned_segs;
+	stat->protected_segs = st->protected_segs;
+	stat->deferred_segs = st->deferred_segs;
+	stat->live_blks = st->live_blks;
+	stat->live_vblks = st->live_vblks;
+	stat->live_pblks = st->live_pblks;
+	stat->defunct_blks = st->defunct_blks;
+	stat->defunct_vblks = st->defunct_vblks;
+	stat->defunct_pblks = st->defunct_pblks;
+	stat->freed_vblks = st->freed_vblks;
+
+	if (stat->exflags & NILFS_RECLAIM_STAT_VINFO_CACHE) {
+		stat->vinfo_hits = st->vinfo_hits;
+		stat->vinfo_misses = st->vinfo_misses;
+	}
+	if (stat->exflags & NILFS_RECLAIM_STAT_MEMORY) {
+		stat->peak_mem = st->peak_mem;
+		stat->nbatches = st->nbatches;
+	}
+	if (stat->exflags & NILFS_RECLAIM_STAT_PIPELINE)
+		stat->prepared_segs = st->prepared_segs;
+	if (stat->exflags & NILFS_RECLAIM_STAT_TIMING) {
+		memcpy(stat->phases, st->phases, sizeof(stat->phases));
+		stat->bytes_read = st->bytes_read;
+	}
+	if (stat->exflags & NILFS_RECLAIM_STAT_ERROR)
+		stat->error = st->error;
+}
+
+/**
+ * nilfs_xreclaim_segment - reclaim segments (enhanced API)
+ * @nilfs: nilfs object
+ * @segnums: array of segment numbers storing selected segments
+ * @nsegs: size of the @segnums array
+ * @dryrun: dry-run flag
+ * @params: reclaim parameters
+ * @stat: reclaim statistics
+ *
+ * On return, @segnums holds the cleaned segments first, then the
+ * deferred ones, and the protected (deselected) ones at the end.
+ *
+ * If a batch fails after earlier batches have been cleaned, the call
+ * succeeds with the segments not processed counted as protected ones,
+ * and the error is stored in @stat->error if NILFS_RECLAIM_STAT_ERROR
+ * is requested.  The segments left by a termination signal are counted
+ * the same way, so that cleaned, deferred and protected segments always
+ * add up to @nsegs.
+ */
+int nilfs_xreclaim_segment(struct nilfs *nilfs,
+			   uint64_t *segnums, size_t nsegs, int dryrun,
+			   const struct nilfs_reclaim_params *params,
+			   struct nilfs_reclaim_stat *stat)
+{
+	struct nilfs_reclaim_vectors vecs;
+	struct nilfs_reclaim_stat st;
+	struct nilfs_reclaim_prep *prep = NULL;
+	struct nilfs_prep_worker worker;
+	struct nilfs_vector *tmp;
+	sigset_t sigset, oldset;
+	size_t head, end, nacc, nra, maxblks;
+	unsigned long filled = 0;
+	int pipelined = 0, use_prep = 0;
+	ssize_t n;
+	int ret = -1;
+
+	if (unlikely(!(params->flags & NILFS_RECLAIM_PARAM_PROTSEQ) ||
+	    (params->flags & (~0UL << __NR_NILFS_RECLAIM_PARAMS)))) {
+		/*
+		 * The protseq parameter is mandatory.  Unknown
+		 * parameters are rejected.
+		 */
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&st, 0, sizeof(st));
+	if (stat)
+		st.exflags = stat->exflags & NILFS_RECLAIM_STAT_EXFLAGS;
+
+	if (params->flags & NILFS_RECLAIM_PARAM_PIPELINE) {
+		prep = params->prep;
+		if (params->next_prep)
+			*params->next_prep = NULL;
+	}
+
+	if (nsegs == 0) {
+		ret = 0;
+		goto out_stat;
+	}
+
+	vecs.no_set_suinfo = 0;
+	vecs.vdescv = nilfs_vector_create(sizeof(struct nilfs_vdesc));
+	vecs.bdescv = nilfs_vector_create(sizeof(struct nilfs_bdesc));
+	vecs.periodv = nilfs_vector_create(sizeof(struct nilfs_period));
+	vecs.vblocknrv = nilfs_vector_create(sizeof(uint64_t));
+	vecs.supv = nilfs_vector_create(sizeof(struct nilfs_suinfo_update));
+	if (unlikely(!vecs.vdescv || !vecs.bdescv || !vecs.periodv ||
+		     !vecs.vblocknrv || !vecs.supv))
+		goto out_vec;
+
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	ret = sigprocmask(SIG_BLOCK, &sigset, &oldset);
+	if (unlikely(ret < 0)) {
+		nilfs_gc_logger(LOG_ERR, "cannot block signals: %s",
+				strerror(errno));
+		goto out_vec;
+	}
+
+	ret = nilfs_lock_cleaner(nilfs);
+	if (unlikely(ret < 0))
+		goto out_sig;
+	filled = nilfs_reclaim_stat_filled(params);
+
+	nra = (params->flags & NILFS_RECLAIM_PARAM_READAHEAD) ?
+		params->readahead : 0;
+	maxblks = nilfs_reclaim_maxblks(params);
+
+	if (prep && nilfs_reclaim_prep_usable(nilfs, prep, segnums, nsegs,
+					      params->protseq)) {
+		memcpy(segnums, prep->order, sizeof(uint64_t) * nsegs);
+		tmp = vecs.vdescv;
+		vecs.vdescv = prep->vdescv;
+		prep->vdescv = tmp;
+		tmp = vecs.bdescv;
+		vecs.bdescv = prep->bdescv;
+		prep->bdescv = tmp;
+		st.prepared_segs = prep->nacc;
+		use_prep = 1;
+	}
+
+	/*
+	 * segnums[0 .. cleaned_segs) are cleaned, the following
+	 * deferred_segs ones deferred, segnums[head .. end) not processed
+	 * yet, and segnums[end .. nsegs) deselected.
+	 */
+	head = 0;
+	end = nsegs;
+	while (head < end) {
+		nilfs_vector_clear(vecs.periodv);
+		nilfs_vector_clear(vecs.vblocknrv);
+		nilfs_vector_clear(vecs.supv);
+
+		if (use_prep) {
+			use_prep = 0;
+			n = prep->n;
+			nacc = prep->nacc;
+		} else {
+			nilfs_vector_clear(vecs.vdescv);
+			nilfs_vector_clear(vecs.bdescv);
+
+			/* count blocks */
+			n = nilfs_acc_blocks(nilfs, segnums + head, end - head,
+					     params->protseq, nra, maxblks,
+					     vecs.vdescv, vecs.bdescv, &nacc,
+					     NULL, NULL, &st);
+			if (unlikely(n < 0)) {
+				ret = -1;
+				goto out_partial;
+			}
+		}
+		end = head + n;
+		if (nacc == 0)
+			break;
+
+		/*
+		 * No segment is read after the last batch has been
+		 * collected; let the worker read the next segments while
+		 * this batch is looked up and cleaned.
+		 */
+		if (head + nacc == end && !dryrun && !pipelined &&
+		    (params->flags & NILFS_RECLAIM_PARAM_PIPELINE) &&
+		    params->next_prep && params->next_nsegs > 0)
+			pipelined = nilfs_start_prep_worker(&worker, nilfs,
+							    params) == 0;
+
+		st.nbatches++;
+		ret = nilfs_reclaim_batch(nilfs, segnums + head, nacc, dryrun,
+					  params, &vecs, &st);
+		if (unlikely(ret < 0))
+			goto out_partial;
+		if (ret == NILFS_RECLAIM_BATCH_INTERRUPTED)
+			break;
+
+		if (ret == NILFS_RECLAIM_BATCH_DEFERRED) {
+			st.deferred_segs += nacc;
+		} else {
+			nilfs_rotate_segnums(segnums + st.cleaned_segs,
+					     st.deferred_segs, nacc);
+			st.cleaned_segs += nacc;
+		}
+		head += nacc;
+	}
+	/* an interrupted batch and the ones after it count as protected */
+	st.protected_segs = nsegs - head;
+	ret = 0;
+	goto out_lock;
+
+out_partial:
+	if (st.cleaned_segs > 0) {
+		/* keep the cleaned segments and report the error with them */
+		st.error = errno;
+		st.protected_segs = nsegs - head;
+		ret = 0;
 	}
 
 out_lock:
+	if (pipelined) {
+		*params->next_prep = nilfs_join_prep_worker(&worker);
+		st.bytes_read += worker.bytes_read;
+	}
+	if (vecs.no_set_suinfo)
+		nilfs_opt_clear_set_suinfo(nilfs);
+
 	if (unlikely(nilfs_unlock_cleaner(nilfs) < 0)) {
 		nilfs_gc_logger(LOG_CRIT, "failed to unlock cleaner: %s",
 				strerror(errno));
@@ -833,14 +2112,338 @@ out_sig:
 	sigprocmask(SIG_SETMASK, &oldset, NULL);
 
 out_vec:
-	nilfs_vector_destroy(vdescv);
-	nilfs_vector_destroy(bdescv);
-	nilfs_vector_destroy(periodv);
-	nilfs_vector_destroy(vblocknrv);
-	nilfs_vector_destroy(supv);
+	nilfs_vector_destroy(vecs.vdescv);
+	nilfs_vector_destroy(vecs.bdescv);
+	nilfs_vector_destroy(vecs.periodv);
+	nilfs_vector_destroy(vecs.vblocknrv);
+	nilfs_vector_destroy(vecs.supv);
+
+out_stat:
+	nilfs_reclaim_stat_return(stat, &st, filled);
+	return ret;
+}
+
+/*
+ * Number of blocks assessed in a batch by nilfs_assess_segments() if no
+ * memory budget is given; about 50 MiB of descriptors.
+ */
+#define NILFS_GC_ASSESS_MAXBLKS		(1UL << 18)
+
+/**
+ * nilfs_assess_lookup - find the result of a segment
+ * @refs: references to results keyed by segment number, sorted by key
+ * @n: number of references
+ * @segnum: segment number
+ *
+ * Return Value: index of the result of @segnum, or -1 if the segment is
+ * not being assessed.
+ */
+static ssize_t nilfs_assess_lookup(const struct nilfs_vdesc_ref *refs,
+				   size_t n, uint64_t segnum)
+{
+	size_t lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (refs[mid].key < segnum)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < n && refs[lo].key == segnum ? refs[lo].index : -1;
+}
+
+/**
+ * nilfs_assess_batch - count live blocks of a batch of segments
+ * @nilfs: nilfs object
+ * @params: reclaim parameters
+ * @vdescv: descriptors of virtual block numbers of the segments
+ * @bdescv: descriptors of disk block numbers of the segments
+ * @refs: references to @results keyed by segment number, sorted by key
+ * @nrefs: number of references
+ * @results: array of results to which the live blocks are added
+ * @stat: reclaim statistics to which the counts of blocks are added
+ *
+ * The lifetimes of the blocks of all segments in the batch are looked up
+ * together, and each live block is then attributed to the segment that
+ * contains its disk block number.
+ */
+static int nilfs_assess_batch(struct nilfs *nilfs,
+			      const struct nilfs_reclaim_params *params,
+			      struct nilfs_vector *vdescv,
+			      struct nilfs_vector *bdescv,
+			      const struct nilfs_vdesc_ref *refs, size_t nrefs,
+			      struct nilfs_assess_result *results,
+			      struct nilfs_reclaim_stat *stat)
+{
+	const struct nilfs_vdesc *vdescs;
+	const struct nilfs_bdesc *bdescs;
+	struct nilfs_vdesc_ref *vrefs;
+	struct nilfs_phase_clock clk;
+	const nilfs_cno_t *ss;
+	nilfs_cno_t *ssbuf = NULL;
+	unsigned char *live = NULL;
+	uint64_t bps = nilfs_get_blocks_per_segment(nilfs);
+	uint64_t segnum, cur;
+	size_t nvdescs, nbdescs, nhits, nlive, memsize, i;
+	ssize_t nss, k = -1;
+	int ret = -1;
+
+	if (unlikely(nilfs_get_vdesc(nilfs, vdescv,
+				     nilfs_reclaim_vicache(nilfs, params),
+				     &vrefs, &nhits, stat) < 0))
+		return -1;
+	free(vrefs);
+
+	vdescs = nilfs_vector_get_data(vdescv);
+	nvdescs = nilfs_vector_get_size(vdescv);
+	stat->vinfo_hits += nhits;
+	stat->vinfo_misses += nvdescs - nhits;
+
+	memsize = nilfs_vector_memsize(vdescv) + nilfs_vector_memsize(bdescv) +
+		nvdescs * (sizeof(*vrefs) + sizeof(struct nilfs_vinfo) +
+			   sizeof(size_t));
+	stat->peak_mem = max_t(size_t, stat->peak_mem, memsize);
+
+	nilfs_phase_begin(stat, &clk);
+	nss = nilfs_get_snapshot_set(nilfs, nilfs_reclaim_use_sscache(params),
+				     &ss, &ssbuf);
+	if (unlikely(nss < 0))
+		return -1;
+	nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_SNAPSHOT, &clk, 1);
+
+	nilfs_phase_begin(stat, &clk);
+	live = malloc(max_t(size_t, nvdescs, 1));
+	if (unlikely(!live))
+		goto out;
+
+	if (unlikely(nilfs_judge_vdescs(vdescs, nvdescs,
+					nilfs_reclaim_protcno(params), ss, nss,
+					live) < 0))
+		goto out;
+
+	/* the descriptors of a segment are adjacent in disk order */
+	for (i = 0, nlive = 0, cur = UINT64_MAX; i < nvdescs; i++) {
+		if (!live[i])
+			continue;
+		segnum = vdescs[i].vd_blocknr / bps;
+		if (segnum != cur) {
+			cur = segnum;
+			k = nilfs_assess_lookup(refs, nrefs, segnum);
+		}
+		if (k >= 0) {
+			results[k].live_vblks++;
+			nlive++;
+		}
+	}
+	nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_TOSS, &clk, 1);
+	stat->live_vblks += nlive;
+	stat->defunct_vblks += nvdescs - nlive;
+
+	if (unlikely(nilfs_get_bdesc(nilfs, bdescv, stat) < 0))
+		goto out;
+
+	nilfs_phase_begin(stat, &clk);
+	bdescs = nilfs_vector_get_data(bdescv);
+	nbdescs = nilfs_vector_get_size(bdescv);
+	for (i = 0, nlive = 0, cur = UINT64_MAX; i < nbdescs; i++) {
+		if (bdescs[i].bd_oblocknr != bdescs[i].bd_blocknr)
+			continue;
+		segnum = bdescs[i].bd_oblocknr / bps;
+		if (segnum != cur) {
+			cur = segnum;
+			k = nilfs_assess_lookup(refs, nrefs, segnum);
+		}
+		if (k >= 0) {
+			results[k].live_pblks++;
+			nlive++;
+		}
+	}
+	nilfs_phase_end(stat, NILFS_RECLAIM_PHASE_TOSS, &clk, 0);
+	stat->live_pblks += nlive;
+	stat->defunct_pblks += nbdescs - nlive;
+	ret = 0;
+out:
+	free(live);
+	free(ssbuf);
+	return ret;
+}
+
+/**
+ * nilfs_assess_segments - count live blocks of each of segments
+ * @nilfs: nilfs object
+ * @segnums: array of distinct segment numbers to be assessed
+ * @nsegs: size of the @segnums array
+ * @params: reclaim parameters
+ * @results: array of @nsegs entries to store the counts of the segment
+ * given by the same index of @segnums
+ * @stat: reclaim statistics [optional]
+ *
+ * Description: nilfs_assess_segments() counts the live blocks of each
+ * segment as a dry run of nilfs_xreclaim_segment() would, but without
+ * summing them up.  The segments are processed in batches that fit in
+ * the memory budget of @params, or in NILFS_GC_ASSESS_MAXBLKS blocks
+ * without one; the segments of a batch share the list of snapshots and
+ * the GET_VINFO and GET_BDESCS ioctls.  The cleaner lock is taken for
+ * each batch, and termination signals are held off only while it is
+ * held.  Pipeline parameters are ignored.
+ *
+ * If @stat is given, it receives the counts of all batches; segments
+ * that were assessed are counted as cleaned, and freed_vblks is not
+ * counted.
+ *
+ * Return Value: On success, the number of assessed segments is
+ * returned.  On error, -1 is returned.
+ */
+ssize_t nilfs_assess_segments(struct nilfs *nilfs, const uint64_t *segnums,
+			      size_t nsegs,
+			      const struct nilfs_reclaim_params *params,
+			      struct nilfs_assess_result *results,
+			      struct nilfs_reclaim_stat *stat)
+{
+	struct nilfs_reclaim_stat st;
+	struct nilfs_assess_result *res;
+	struct nilfs_vdesc_ref *refs = NULL;
+	struct nilfs_vector *vdescv = NULL, *bdescv = NULL;
+	struct nilfs_suinfo *sis = NULL;
+	uint64_t *order = NULL, *seqnums = NULL;
+	uint32_t bps = nilfs_get_blocks_per_segment(nilfs);
+	sigset_t sigset, oldset;
+	size_t head, end, nacc, nra, maxblks, i;
+	unsigned long filled = 0;
+	ssize_t n, ret = -1;
+
+	if (unlikely(!(params->flags & NILFS_RECLAIM_PARAM_PROTSEQ) ||
+	    (params->flags & (~0UL << __NR_NILFS_RECLAIM_PARAMS)))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&st, 0, sizeof(st));
+	if (stat)
+		st.exflags = stat->exflags & NILFS_RECLAIM_STAT_EXFLAGS;
+
+	memset(results, 0, sizeof(*results) * nsegs);
+	if (nsegs == 0) {
+		ret = 0;
+		goto out_stat;
+	}
+
+	refs = malloc(sizeof(*refs) * nsegs);
+	order = malloc(sizeof(*order) * nsegs);
+	seqnums = malloc(sizeof(*seqnums) * nsegs);
+	sis = malloc(sizeof(*sis) * nsegs);
+	vdescv = nilfs_vector_create(sizeof(struct nilfs_vdesc));
+	bdescv = nilfs_vector_create(sizeof(struct nilfs_bdesc));
+	if (unlikely(!refs || !order || !seqnums || !sis || !vdescv ||
+		     !bdescv))
+		goto out;
+
+	for (i = 0; i < nsegs; i++) {
+		refs[i].key = segnums[i];
+		refs[i].index = i;
+	}
+	if (unlikely(nilfs_sort_vdesc_refs(refs, nsegs) < 0))
+		goto out;
+	memcpy(order, segnums, sizeof(*order) * nsegs);
+
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+
+	nra = (params->flags & NILFS_RECLAIM_PARAM_READAHEAD) ?
+		params->readahead : 0;
+	maxblks = nilfs_reclaim_maxblks(params) ? : NILFS_GC_ASSESS_MAXBLKS;
+
 	/*
-	 * Flags of valid fields in stat->exflags must be unset.
+	 * order[0 .. head) are assessed, order[head .. end) not processed
+	 * yet, and order[end .. nsegs) deselected.
 	 */
+	head = 0;
+	end = nsegs;
+	while (head < end) {
+		nilfs_vector_clear(vdescv);
+		nilfs_vector_clear(bdescv);
+
+		if (unlikely(sigprocmask(SIG_BLOCK, &sigset, &oldset) < 0)) {
+			nilfs_gc_logger(LOG_ERR, "cannot block signals: %s",
+					strerror(errno));
+			goto out;
+		}
+		if (unlikely(nilfs_lock_cleaner(nilfs) < 0)) {
+			sigprocmask(SIG_SETMASK, &oldset, NULL);
+			goto out;
+		}
+		/* segments are never prepared in advance here */
+		filled = nilfs_reclaim_stat_filled(params) &
+			~NILFS_RECLAIM_STAT_PIPELINE;
+
+		n = nilfs_acc_blocks(nilfs, order + head, end - head,
+				     params->protseq, nra, maxblks, vdescv,
+				     bdescv, &nacc, sis + head,
+				     seqnums + head, &st);
+		if (n > 0 && nacc > 0) {
+			st.nbatches++;
+			if (unlikely(nilfs_assess_batch(nilfs, params, vdescv,
+							bdescv, refs, nsegs,
+							results, &st) < 0))
+				n = -1;
+		}
+
+		if (unlikely(nilfs_unlock_cleaner(nilfs) < 0)) {
+			nilfs_gc_logger(LOG_CRIT,
+					"failed to unlock cleaner: %s",
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		sigprocmask(SIG_SETMASK, &oldset, NULL);
+		if (unlikely(n < 0))
+			goto out;
+
+		end = head + n;
+		for (i = head; i < head + nacc; i++) {
+			res = &results[nilfs_assess_lookup(refs, nsegs,
+							   order[i])];
+			res->flags |= NILFS_ASSESS_RESULT_ASSESSED;
+			res->nblocks = sis[i].sui_nblocks;
+			res->seqnum = seqnums[i];
+			res->live_blks = res->live_vblks + res->live_pblks;
+			res->defunct_blks = bps - res->live_blks;
+			st.live_blks += res->live_blks;
+			st.defunct_blks += res->defunct_blks;
+		}
+		if (nacc == 0)
+			break;
+		head += nacc;
+	}
+	st.cleaned_segs = head;
+	st.protected_segs = nsegs - end;
+
+	if (end < nsegs) {
+		if (unlikely(nilfs_get_suinfo_batch(nilfs, order + end,
+						    nsegs - end,
+						    sis + end) < 0))
+			goto out;
+
+		for (i = end; i < nsegs; i++) {
+			if (!nilfs_suinfo_reclaimable(&sis[i]))
+				continue;
+			res = &results[nilfs_assess_lookup(refs, nsegs,
+							   order[i])];
+			res->flags |= NILFS_ASSESS_RESULT_PROTECTED;
+			res->nblocks = sis[i].sui_nblocks;
+		}
+	}
+	ret = head;
+out:
+	nilfs_vector_destroy(vdescv);
+	nilfs_vector_destroy(bdescv);
+	free(sis);
+	free(seqnums);
+	free(order);
+	free(refs);
+out_stat:
+	nilfs_reclaim_stat_return(stat, &st, filled);
 	return ret;
 }
 
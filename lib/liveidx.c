@@ -0,0 +1,572 @@
+/*
+ * liveidx.c - index of live block counts of segments
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * Counting the live blocks of a segment takes a dry run of the garbage
+ * collector, which reads the segment and looks up the virtual block
+ * numbers and the checkpoints of its blocks.  This keeps the result of
+ * such assessments in an array indexed by segment number, so that they
+ * can be reused until the segment is written again.  An entry is
+ * recognized as stale when the modification time or the number of
+ * blocks of the segment differs from the ones recorded with it; both
+ * change whenever the segment is reallocated with a new sequence number.
+ *
+ * The index is either kept in memory or mapped from a file so that it
+ * survives restarts and can be shared by the cleaner daemon and lssu.
+ * Each file system has its own file, named after its uuid (see
+ * nilfs_liveidx_path()), and a file that holds the index of another
+ * file system is never modified.  Writers of an index file hold a lock
+ * on it, while lookups read the mapping without locking; each entry has
+ * a sequence count, which is odd while the entry is being written, so
+ * that a lookup retries instead of returning a torn entry.
+ *
+ * A reused count is an estimate.  Besides the contents of the segment,
+ * the count depends on the set of snapshots and on the protection
+ * period: creating a snapshot can make dead blocks live again, and
+ * deleting one makes live blocks dead.  The index records a tag of the
+ * snapshots, and all its entries are discarded when the tag changes
+ * (see nilfs_liveidx_check_context()).  Each entry records the start of
+ * the protected checkpoints it was counted with, and it is only reused
+ * by callers that protect no more checkpoints, for whom the count is an
+ * upper bound.  The count still drifts down as checkpoints are deleted
+ * and as the protection window moves past the blocks of the segment.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <stdio.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_STRING_H
+#include <string.h>	/* memset(), memcmp(), memcpy() */
+#endif	/* HAVE_STRING_H */
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif	/* HAVE_UNISTD_H */
+
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif	/* HAVE_FCNTL_H */
+
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif	/* HAVE_SYS_STAT_H */
+
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif	/* HAVE_SYS_MMAN_H */
+
+#include <errno.h>
+#include "util.h"
+#include "liveidx.h"
+
+
+#define NILFS_LIVEIDX_MAGIC	0x584c564e	/* "NVLX" */
+#define NILFS_LIVEIDX_VERSION	3
+#define NILFS_LIVEIDX_NCPINFO	64	/* snapshots read per call */
+#define NILFS_LIVEIDX_NAME_MAX	(1 + 36 + 4 + 1)	/* "/<uuid>.idx" */
+
+/* Header of index file */
+struct nilfs_liveidx_header {
+	uint32_t magic;			/* Magic number */
+	uint16_t version;		/* Format version */
+	uint16_t entry_size;		/* Size of an entry */
+	uint64_t nsegs;			/* Number of entries */
+	unsigned char uuid[16];		/* uuid of the file system */
+	uint64_t context;		/* Tag of snapshots */
+	uint8_t pad[24];
+};
+
+/* Index of live block counts */
+struct nilfs_liveidx {
+	int fd;				/* Index file (-1 if in memory) */
+	void *map;			/* Header followed by entries */
+	size_t mapsize;			/* Size of @map */
+	uint64_t nsegs;			/* Number of entries in @map */
+	uint64_t context;		/* Tag found at the last check */
+};
+
+static inline struct nilfs_liveidx_header *
+nilfs_liveidx_header(const struct nilfs_liveidx *idx)
+{
+	return idx->map;
+}
+
+static inline struct nilfs_liveidx_entry *
+nilfs_liveidx_entries(const struct nilfs_liveidx *idx)
+{
+	return idx->map + sizeof(struct nilfs_liveidx_header);
+}
+
+static inline size_t nilfs_liveidx_size(uint64_t nsegs)
+{
+	return sizeof(struct nilfs_liveidx_header) +
+		sizeof(struct nilfs_liveidx_entry) * nsegs;
+}
+
+/**
+ * nilfs_liveidx_lock - lock or unlock index file
+ * @idx: index
+ * @type: F_WRLCK to lock, or F_UNLCK to unlock
+ */
+static int nilfs_liveidx_lock(const struct nilfs_liveidx *idx, short type)
+{
+	struct flock lock;
+
+	if (idx->fd < 0)
+		return 0;
+
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	while (fcntl(idx->fd, F_SETLKW, &lock) < 0) {
+		if (unlikely(errno != EINTR))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * nilfs_liveidx_check_file - verify header of index file
+ * @fd: file descriptor of the index file
+ * @uuid: uuid of the file system
+ * @nsegsp: place to store the number of entries in the file
+ *
+ * Return Value: 1 if the file holds an index of the file system given
+ * by @uuid, 0 if it is empty or holds an index of that file system in
+ * another format, or -1 on error.  If the file holds anything else,
+ * such as the index of another file system, errno is set to EEXIST.
+ */
+static int nilfs_liveidx_check_file(int fd, const unsigned char *uuid,
+				    uint64_t *nsegsp)
+{
+	struct nilfs_liveidx_header hdr;
+	struct stat stbuf;
+	ssize_t ret;
+
+	if (unlikely(fstat(fd, &stbuf) < 0))
+		return -1;
+
+	if (stbuf.st_size == 0)
+		return 0;
+
+	ret = pread(fd, &hdr, sizeof(hdr), 0);
+	if (unlikely(ret < 0))
+		return -1;
+
+	if (ret < sizeof(hdr) || hdr.magic != NILFS_LIVEIDX_MAGIC ||
+	    memcmp(hdr.uuid, uuid, sizeof(hdr.uuid)) != 0) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (hdr.version != NILFS_LIVEIDX_VERSION ||
+	    hdr.entry_size != sizeof(struct nilfs_liveidx_entry) ||
+	    stbuf.st_size < nilfs_liveidx_size(hdr.nsegs))
+		return 0;
+
+	*nsegsp = hdr.nsegs;
+	return 1;
+}
+
+/**
+ * nilfs_liveidx_map - (re)map index with a given number of entries
+ * @idx: index
+ * @nsegs: number of entries
+ */
+static int nilfs_liveidx_map(struct nilfs_liveidx *idx, uint64_t nsegs)
+{
+	size_t size = nilfs_liveidx_size(nsegs);
+	struct stat stbuf;
+	void *map;
+
+	if (idx->fd < 0) {
+		map = realloc(idx->map, size);
+		if (unlikely(!map))
+			return -1;
+		memset(map + idx->mapsize, 0, size - idx->mapsize);
+	} else {
+		if (unlikely(fstat(idx->fd, &stbuf) < 0))
+			return -1;
+		/* another process may have extended the file */
+		if (stbuf.st_size < size &&
+		    unlikely(ftruncate(idx->fd, size) < 0))
+			return -1;
+
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   idx->fd, 0);
+		if (unlikely(map == MAP_FAILED))
+			return -1;
+		if (idx->map)
+			munmap(idx->map, idx->mapsize);
+	}
+	idx->map = map;
+	idx->mapsize = size;
+	idx->nsegs = nsegs;
+	if (nilfs_liveidx_header(idx)->nsegs < nsegs)
+		nilfs_liveidx_header(idx)->nsegs = nsegs;
+	return 0;
+}
+
+/**
+ * nilfs_liveidx_path - get pathname of the index file of a file system
+ * @nilfs: nilfs object
+ * @dir: directory of index files
+ *
+ * The file is named after the uuid of the file system, so that the
+ * cleaner daemons of many volumes can share @dir.
+ *
+ * Return Value: On success, the pathname, which the caller frees, is
+ * returned.  On error, NULL is returned.
+ */
+char *nilfs_liveidx_path(const struct nilfs *nilfs, const char *dir)
+{
+	const unsigned char *uuid = nilfs_get_uuid(nilfs);
+	char *path, *cp;
+	int i;
+
+	path = malloc(strlen(dir) + NILFS_LIVEIDX_NAME_MAX);
+	if (unlikely(!path))
+		return NULL;
+
+	cp = path + sprintf(path, "%s/", dir);
+	for (i = 0; i < 16; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+			*cp++ = '-';
+		cp += sprintf(cp, "%02x", uuid[i]);
+	}
+	strcpy(cp, ".idx");
+	return path;
+}
+
+/**
+ * nilfs_liveidx_open - open index of live block counts
+ * @nilfs: nilfs object
+ * @path: pathname of index file, or NULL to keep the index in memory
+ *
+ * The index file is created if it does not exist.  An index of the file
+ * system in another version of the format is cleared in place; the
+ * file is never truncated, since other processes may have it mapped.
+ *
+ * Return Value: On success, the pointer to the index is returned.  On
+ * error, NULL is returned.  If the file holds the index of another file
+ * system or is not an index file, it is left untouched and errno is set
+ * to EEXIST.
+ */
+struct nilfs_liveidx *nilfs_liveidx_open(struct nilfs *nilfs,
+					 const char *path)
+{
+	struct nilfs_liveidx *idx;
+	struct nilfs_liveidx_header *hdr;
+	const unsigned char *uuid = nilfs_get_uuid(nilfs);
+	uint64_t nsegs = nilfs_get_nsegments(nilfs), nsegs2;
+	int valid = 0;
+	int errsv;
+
+	idx = malloc(sizeof(*idx));
+	if (unlikely(!idx))
+		return NULL;
+
+	memset(idx, 0, sizeof(*idx));
+	idx->fd = -1;
+
+	if (path) {
+		idx->fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (unlikely(idx->fd < 0))
+			goto failed;
+
+		if (unlikely(nilfs_liveidx_lock(idx, F_WRLCK) < 0))
+			goto failed_fd;
+
+		valid = nilfs_liveidx_check_file(idx->fd, uuid, &nsegs2);
+		if (unlikely(valid < 0))
+			goto failed_fd;
+		if (valid)
+			nsegs = max_t(uint64_t, nsegs, nsegs2);
+	}
+
+	if (unlikely(nilfs_liveidx_map(idx, nsegs) < 0))
+		goto failed_fd;
+
+	if (!valid) {
+		/* the file may be longer than the mapping; that is harmless */
+		memset(idx->map, 0, idx->mapsize);
+		hdr = nilfs_liveidx_header(idx);
+		hdr->magic = NILFS_LIVEIDX_MAGIC;
+		hdr->version = NILFS_LIVEIDX_VERSION;
+		hdr->entry_size = sizeof(struct nilfs_liveidx_entry);
+		hdr->nsegs = nsegs;
+		memcpy(hdr->uuid, uuid, sizeof(hdr->uuid));
+	}
+	nilfs_liveidx_lock(idx, F_UNLCK);
+	return idx;
+
+failed_fd:
+	if (idx->fd >= 0) {
+		errsv = errno;
+		close(idx->fd);	/* releases the lock */
+		errno = errsv;
+	}
+failed:
+	free(idx);
+	return NULL;
+}
+
+/**
+ * nilfs_liveidx_close - close index of live block counts
+ * @idx: index
+ */
+void nilfs_liveidx_close(struct nilfs_liveidx *idx)
+{
+	if (idx == NULL)
+		return;
+
+	if (idx->fd < 0) {
+		free(idx->map);
+	} else {
+		munmap(idx->map, idx->mapsize);
+		close(idx->fd);
+	}
+	free(idx);
+}
+
+/**
+ * nilfs_liveidx_read_entry - take a consistent copy of an entry
+ * @src: entry in the index
+ * @ent: place to store the copy
+ *
+ * Other processes may write @src at the same time.  The copy is taken
+ * again until the sequence count shows that no write overlapped it.
+ */
+static void nilfs_liveidx_read_entry(const struct nilfs_liveidx_entry *src,
+				     struct nilfs_liveidx_entry *ent)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+		memcpy(ent, src, sizeof(*ent));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&src->seq, __ATOMIC_RELAXED));
+}
+
+/**
+ * nilfs_liveidx_write_entry - overwrite an entry
+ * @dst: entry in the index
+ * @ent: new contents of the entry (@ent->seq is ignored)
+ *
+ * The caller holds the lock of the index, so there is only one writer.
+ */
+static void nilfs_liveidx_write_entry(struct nilfs_liveidx_entry *dst,
+				      const struct nilfs_liveidx_entry *ent)
+{
+	uint32_t seq = dst->seq;
+
+	__atomic_store_n(&dst->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	dst->seqnum = ent->seqnum;
+	dst->lastmod = ent->lastmod;
+	dst->protcno = ent->protcno;
+	dst->nblocks = ent->nblocks;
+	dst->flags = ent->flags;
+	dst->nlive = ent->nlive;
+	__atomic_store_n(&dst->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * nilfs_liveidx_lookup - look up live block count of a segment
+ * @idx: index
+ * @segnum: segment number
+ * @si: current usage of the segment
+ * @protcno: start of checkpoint numbers protected by the caller
+ * @ent: place to store the entry of the segment
+ *
+ * Return Value: 1 if a valid entry was found, 0 otherwise.
+ */
+int nilfs_liveidx_lookup(const struct nilfs_liveidx *idx, uint64_t segnum,
+			 const struct nilfs_suinfo *si, nilfs_cno_t protcno,
+			 struct nilfs_liveidx_entry *ent)
+{
+	if (segnum >= idx->nsegs)
+		return 0;
+
+	nilfs_liveidx_read_entry(&nilfs_liveidx_entries(idx)[segnum], ent);
+	return (ent->flags & NILFS_LIVEIDX_VALID) &&
+		ent->lastmod == si->sui_lastmod &&
+		ent->nblocks == si->sui_nblocks &&
+		ent->protcno <= protcno;
+}
+
+/**
+ * nilfs_liveidx_update - record live block count of a segment
+ * @idx: index
+ * @segnum: segment number
+ * @seqnum: sequence number of the segment
+ * @si: usage of the segment at the time of assessment
+ * @protcno: start of checkpoint numbers protected by the assessment
+ * @nlive: number of live blocks in the segment
+ *
+ * The count is dropped if another process has discarded the entries
+ * since the context was last checked.
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+int nilfs_liveidx_update(struct nilfs_liveidx *idx, uint64_t segnum,
+			 uint64_t seqnum, const struct nilfs_suinfo *si,
+			 nilfs_cno_t protcno, uint32_t nlive)
+{
+	struct nilfs_liveidx_entry ent;
+	int ret = -1;
+
+	if (unlikely(nilfs_liveidx_lock(idx, F_WRLCK) < 0))
+		return -1;
+
+	if (nilfs_liveidx_header(idx)->context != idx->context) {
+		ret = 0;
+		goto out;
+	}
+
+	if (segnum >= idx->nsegs &&
+	    unlikely(nilfs_liveidx_map(idx, segnum + 1) < 0))
+		goto out;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.seqnum = seqnum;
+	ent.lastmod = si->sui_lastmod;
+	ent.protcno = protcno;
+	ent.nblocks = si->sui_nblocks;
+	ent.flags = NILFS_LIVEIDX_VALID;
+	ent.nlive = nlive;
+	nilfs_liveidx_write_entry(&nilfs_liveidx_entries(idx)[segnum], &ent);
+	ret = 0;
+out:
+	nilfs_liveidx_lock(idx, F_UNLCK);
+	return ret;
+}
+
+/**
+ * nilfs_liveidx_clear - discard live block counts of segments
+ * @idx: index
+ * @segnums: array of segment numbers, or NULL for all segments
+ * @nsegs: number of segment numbers in @segnums
+ *
+ * The caller holds the lock of the index.
+ */
+static void nilfs_liveidx_clear(struct nilfs_liveidx *idx,
+				const uint64_t *segnums, size_t nsegs)
+{
+	struct nilfs_liveidx_entry ent;
+	uint64_t segnum;
+	size_t i;
+
+	memset(&ent, 0, sizeof(ent));
+	if (!segnums)
+		nsegs = idx->nsegs;
+	for (i = 0; i < nsegs; i++) {
+		segnum = segnums ? segnums[i] : i;
+		if (segnum < idx->nsegs)
+			nilfs_liveidx_write_entry(
+				&nilfs_liveidx_entries(idx)[segnum], &ent);
+	}
+}
+
+/**
+ * nilfs_liveidx_invalidate - discard live block counts of segments
+ * @idx: index
+ * @segnums: array of segment numbers
+ * @nsegs: number of segment numbers in @segnums
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+int nilfs_liveidx_invalidate(struct nilfs_liveidx *idx,
+			     const uint64_t *segnums, size_t nsegs)
+{
+	if (unlikely(nilfs_liveidx_lock(idx, F_WRLCK) < 0))
+		return -1;
+
+	nilfs_liveidx_clear(idx, segnums, nsegs);
+	nilfs_liveidx_lock(idx, F_UNLCK);
+	return 0;
+}
+
+/**
+ * nilfs_liveidx_context_tag - compute tag of context of live block counts
+ * @nilfs: nilfs object
+ * @tagp: place to store the tag
+ *
+ * The tag is a FNV-1a hash of the checkpoint numbers of the snapshots.
+ * It is never zero, which is the tag of a new index.
+ */
+static int nilfs_liveidx_context_tag(struct nilfs *nilfs, uint64_t *tagp)
+{
+	struct nilfs_cpinfo cpinfo[NILFS_LIVEIDX_NCPINFO];
+	uint64_t tag = 0xcbf29ce484222325ULL;	/* FNV offset basis */
+	nilfs_cno_t cno = 0;
+	ssize_t n, i;
+
+	do {
+		n = nilfs_get_cpinfo(nilfs, cno, NILFS_SNAPSHOT, cpinfo,
+				     NILFS_LIVEIDX_NCPINFO);
+		if (unlikely(n < 0))
+			return -1;
+		for (i = 0; i < n; i++)
+			tag = (tag ^ cpinfo[i].ci_cno) * 0x100000001b3ULL;
+		cno = n > 0 ? cpinfo[n - 1].ci_next : 0;
+	} while (cno != 0);
+
+	*tagp = tag ? : 1;
+	return 0;
+}
+
+/**
+ * nilfs_liveidx_check_context - discard counts taken in another context
+ * @idx: index
+ * @nilfs: nilfs object
+ *
+ * Live block counts are only reused while the snapshots stay the same
+ * as when they were recorded.  Callers check the context before they
+ * look up or update the index.
+ *
+ * Return Value: 1 if the entries were discarded, 0 if they were kept, or
+ * -1 on error.
+ */
+int nilfs_liveidx_check_context(struct nilfs_liveidx *idx,
+				struct nilfs *nilfs)
+{
+	struct nilfs_liveidx_header *hdr;
+	uint64_t tag;
+	int ret = 0;
+
+	if (unlikely(nilfs_liveidx_context_tag(nilfs, &tag) < 0))
+		return -1;
+
+	if (unlikely(nilfs_liveidx_lock(idx, F_WRLCK) < 0))
+		return -1;
+
+	hdr = nilfs_liveidx_header(idx);
+	if (hdr->context != tag) {
+		/* reach the entries another process has added */
+		if (hdr->nsegs > idx->nsegs &&
+		    unlikely(nilfs_liveidx_map(idx, hdr->nsegs) < 0)) {
+			ret = -1;
+			goto out;
+		}
+		hdr = nilfs_liveidx_header(idx);
+		nilfs_liveidx_clear(idx, NULL, 0);
+		hdr->context = tag;
+		ret = 1;
+	}
+	idx->context = tag;
+out:
+	nilfs_liveidx_lock(idx, F_UNLCK);
+	return ret;
+}
@@ -78,6 +78,7 @@
 #include "util.h"
 #include "pathnames.h"
 #include "realpath.h"
+#include "uring.h"
 
 /**
  * struct nilfs - nilfs object
@@ -90,6 +91,16 @@
  * @n_mincno: the minimum of valid checkpoint numbers
  * @n_sems: array of semaphores
  *     sems[0] protects garbage collection process
+ * @n_uring: io_uring instance for raw device reads (if enabled)
+ * @n_ioctls: number of ioctl calls per command (NILFS_IOCTL_STAT_*),
+ *     updated atomically
+ * @n_ss: cached checkpoint numbers of snapshots
+ * @n_nss: number of checkpoint numbers in @n_ss
+ * @n_ss_cno: latest checkpoint number when @n_ss was cached
+ * @n_ss_nsss: number of snapshots reported when @n_ss was cached
+ * @n_ss_nongc_ctime: creation time of the last non-GC segment when @n_ss
+ *     was cached
+ * @n_ss_valid: flag that indicates @n_ss is valid
  */
 struct nilfs {
 	struct nilfs_super_block *n_sb;
@@ -101,11 +112,22 @@ struct nilfs {
 	int n_opts;
 	nilfs_cno_t n_mincno;
 	sem_t *n_sems[1];
+	struct nilfs_uring *n_uring;
+	uint64_t *n_ioctls;
+	nilfs_cno_t *n_ss;
+	size_t n_nss;
+	nilfs_cno_t n_ss_cno;
+	uint64_t n_ss_nsss;
+	uint64_t n_ss_nongc_ctime;
+	int n_ss_valid;
 };
 
+#define NILFS_IO_CHUNK_SIZE	(128 * 1024)	/* split size of uring reads */
+
 enum {
 	NILFS_OPT_MMAP,
 	NILFS_OPT_SET_SUINFO,
+	NILFS_OPT_IO_URING,
 	__NR_NILFS_OPT,
 };
 
@@ -337,6 +359,16 @@ uint32_t nilfs_get_reserved_segments_ratio(const struct nilfs *nilfs)
 	return le32_to_cpu(nilfs->n_sb->s_r_segments_percentage);
 }
 
+/**
+ * nilfs_get_uuid - get 128-bit uuid of the file system
+ * @nilfs: nilfs object
+ */
+const unsigned char *nilfs_get_uuid(const struct nilfs *nilfs)
+{
+	assert(nilfs->n_sb != NULL);
+	return nilfs->n_sb->s_uuid;
+}
+
 static int __nilfs_opt_set_mmap(struct nilfs *nilfs)
 {
 	long pagesize;
@@ -359,6 +391,21 @@ static int __nilfs_opt_set_mmap(struct nilfs *nilfs)
 	return 0;
 }
 
+static int __nilfs_opt_set_io_uring(struct nilfs *nilfs)
+{
+	if (unlikely(nilfs->n_devfd < 0)) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (nilfs->n_uring == NULL) {
+		nilfs->n_uring = nilfs_uring_create(NILFS_URING_ENTRIES);
+		if (nilfs->n_uring == NULL)
+			return -1;
+	}
+	return 0;
+}
+
 /**
  * nilfs_opt_test - test whether the specified option is set or not
  * @nilfs: nilfs object
@@ -391,6 +438,10 @@ int nilfs_opt_set(struct nilfs *nilfs, unsigned int index)
 		ret = __nilfs_opt_set_mmap(nilfs);
 		if (ret < 0)
 			return ret;
+	} else if (index == NILFS_OPT_IO_URING) {
+		ret = __nilfs_opt_set_io_uring(nilfs);
+		if (ret < 0)
+			return ret;
 	}
 	nilfs->n_opts |= (1 << index);
 	return 0;
@@ -407,6 +458,11 @@ int nilfs_opt_clear(struct nilfs *nilfs, unsigned int index)
 		errno = EINVAL;
 		return -1;
 	}
+
+	if (index == NILFS_OPT_IO_URING) {
+		nilfs_uring_destroy(nilfs->n_uring);
+		nilfs->n_uring = NULL;
+	}
 	nilfs->n_opts &= ~(1 << index);
 	return 0;
 }
@@ -478,6 +534,19 @@ struct nilfs *nilfs_open(const char *dev, const char *dir, int flags)
 	nilfs->n_opts = 0;
 	nilfs->n_mincno = NILFS_CNO_MIN;
 	memset(nilfs->n_sems, 0, sizeof(nilfs->n_sems));
+	nilfs->n_uring = NULL;
+	nilfs->n_ss = NULL;
+	nilfs->n_nss = 0;
+	nilfs->n_ss_cno = 0;
+	nilfs->n_ss_nsss = 0;
+	nilfs->n_ss_nongc_ctime = 0;
+	nilfs->n_ss_valid = 0;
+
+	/* kept apart so that calls through a const object can be counted */
+	nilfs->n_ioctls = calloc(__NR_NILFS_IOCTL_STAT,
+				 sizeof(*nilfs->n_ioctls));
+	if (unlikely(nilfs->n_ioctls == NULL))
+		goto out_fd;
 
 	if (flags & NILFS_OPEN_RAW) {
 		if (dev == NULL) {
@@ -534,6 +603,7 @@ out_fd:
 	if (nilfs->n_iocfd >= 0)
 		close(nilfs->n_iocfd);
 
+	free(nilfs->n_ioctls);
 	free(nilfs->n_dev);
 	free(nilfs->n_ioc);
 	free(nilfs->n_sb);
@@ -547,6 +617,9 @@ out_fd:
  */
 void nilfs_close(struct nilfs *nilfs)
 {
+	nilfs_uring_destroy(nilfs->n_uring);
+	free(nilfs->n_ioctls);
+	free(nilfs->n_ss);
 	if (nilfs->n_sems[0] != NULL)
 		sem_close(nilfs->n_sems[0]);
 	if (nilfs->n_devfd >= 0)
@@ -560,6 +633,183 @@ void nilfs_close(struct nilfs *nilfs)
 	free(nilfs);
 }
 
+/**
+ * nilfs_close_ioc - release the mount point of a NILFS object
+ * @nilfs: NILFS object
+ *
+ * This lets the file system be unmounted while @nilfs is idle.  The
+ * functions that issue ioctls fail with EBADF until nilfs_open_ioc() is
+ * called.
+ */
+void nilfs_close_ioc(struct nilfs *nilfs)
+{
+	if (nilfs->n_iocfd >= 0) {
+		close(nilfs->n_iocfd);
+		nilfs->n_iocfd = -1;
+	}
+}
+
+/**
+ * nilfs_open_ioc - open the mount point of a NILFS object again
+ * @nilfs: NILFS object
+ *
+ * The mount point found by nilfs_open() is opened only if the file
+ * system mounted there is still the one on the device of @nilfs.  If
+ * @nilfs was opened with NILFS_OPEN_RAW, the file system must also not
+ * have been mounted again since then, which the mount count and the
+ * mount time of the super block tell.  This does nothing if the mount
+ * point is already open.
+ *
+ * Return Value: On success, 0 is returned.  On error, -1 is returned
+ * and errno is set.  errno is ENODEV if another file system is mounted
+ * at the mount point, or ESTALE if the file system was mounted again.
+ */
+int nilfs_open_ioc(struct nilfs *nilfs)
+{
+	struct nilfs_super_block *sbp;
+	struct stat devstat, iocstat;
+	int fd, errsv;
+
+	if (nilfs->n_iocfd >= 0)
+		return 0;
+	if (unlikely(nilfs->n_ioc == NULL)) {
+		errno = EBADF;
+		return -1;
+	}
+
+	fd = open(nilfs->n_ioc, O_RDONLY);
+	if (unlikely(fd < 0))
+		return -1;
+
+	if (unlikely(fstat(fd, &iocstat) < 0 ||
+		     stat(nilfs->n_dev, &devstat) < 0))
+		goto failed;
+
+	if (S_ISBLK(devstat.st_mode) && devstat.st_rdev != iocstat.st_dev) {
+		errno = ENODEV;
+		goto failed;
+	}
+
+	if (nilfs->n_sb != NULL) {
+		sbp = nilfs_sb_read(nilfs->n_devfd);
+		if (unlikely(sbp == NULL))
+			goto failed;
+		if (sbp->s_mnt_count != nilfs->n_sb->s_mnt_count ||
+		    sbp->s_mtime != nilfs->n_sb->s_mtime ||
+		    memcmp(sbp->s_uuid, nilfs->n_sb->s_uuid,
+			   sizeof(sbp->s_uuid)) != 0) {
+			free(sbp);
+			errno = ESTALE;
+			goto failed;
+		}
+		free(sbp);
+	}
+	nilfs->n_iocfd = fd;
+	return 0;
+
+failed:
+	errsv = errno;
+	close(fd);
+	errno = errsv;
+	return -1;
+}
+
+/**
+ * nilfs_lookup_snapshot_cache - get cached checkpoint numbers of snapshots
+ * @nilfs: nilfs object
+ * @cpstat: current status of checkpoints
+ * @ssp: place to store the array of cached checkpoint numbers
+ *
+ * The cache is regarded as valid while the latest checkpoint number and
+ * the number of snapshots in @cpstat are equal to the ones recorded by
+ * nilfs_update_snapshot_cache() or nilfs_rebase_snapshot_cache().
+ *
+ * This does not catch a checkpoint and a snapshot that swap modes
+ * through another nilfs object before the next log is written, e.g.
+ * "chcp cp A; chcp ss B".  The kernel refuses to delete the checkpoints
+ * of a snapshot, so such a stale list makes CLEAN_SEGMENTS fail with
+ * EBUSY but never frees blocks of the snapshot; the caller is expected
+ * to drop the cache on that failure.
+ *
+ * Return Value: On hit, the number of snapshots is returned and *@ssp
+ * points to the array owned by @nilfs, which stays valid until the next
+ * update.  On miss, -1 is returned and errno is set to ENOENT.
+ */
+ssize_t nilfs_lookup_snapshot_cache(const struct nilfs *nilfs,
+				    const struct nilfs_cpstat *cpstat,
+				    const nilfs_cno_t **ssp)
+{
+	if (!nilfs->n_ss_valid || nilfs->n_ss_cno != cpstat->cs_cno ||
+	    nilfs->n_ss_nsss != cpstat->cs_nsss) {
+		errno = ENOENT;
+		return -1;
+	}
+	*ssp = nilfs->n_ss;
+	return nilfs->n_nss;
+}
+
+/**
+ * nilfs_update_snapshot_cache - cache checkpoint numbers of snapshots
+ * @nilfs: nilfs object
+ * @cpstat: status of checkpoints read before @ss
+ * @sustat: status of segments read before @ss
+ * @ss: array of checkpoint numbers of snapshots allocated with malloc()
+ * @nss: number of checkpoint numbers in @ss
+ *
+ * @nilfs takes the ownership of @ss.
+ */
+void nilfs_update_snapshot_cache(struct nilfs *nilfs,
+				 const struct nilfs_cpstat *cpstat,
+				 const struct nilfs_sustat *sustat,
+				 nilfs_cno_t *ss, size_t nss)
+{
+	free(nilfs->n_ss);
+	nilfs->n_ss = ss;
+	nilfs->n_nss = nss;
+	nilfs->n_ss_cno = cpstat->cs_cno;
+	nilfs->n_ss_nsss = cpstat->cs_nsss;
+	nilfs->n_ss_nongc_ctime = sustat->ss_nongc_ctime;
+	nilfs->n_ss_valid = 1;
+}
+
+/**
+ * nilfs_rebase_snapshot_cache - keep snapshot list across own cleaning
+ * @nilfs: nilfs object
+ * @cpstat: status of checkpoints read right after CLEAN_SEGMENTS
+ * @sustat: status of segments read right after CLEAN_SEGMENTS
+ *
+ * Each CLEAN_SEGMENTS ioctl makes a checkpoint, which would make the
+ * next lookup miss.  The new checkpoint number is taken as the baseline
+ * of the cache if it advanced by at most one and neither the number of
+ * snapshots nor the creation time of the last non-GC segment changed;
+ * otherwise the cache is discarded.
+ */
+void nilfs_rebase_snapshot_cache(struct nilfs *nilfs,
+				 const struct nilfs_cpstat *cpstat,
+				 const struct nilfs_sustat *sustat)
+{
+	if (!nilfs->n_ss_valid)
+		return;
+
+	if (cpstat->cs_cno < nilfs->n_ss_cno ||
+	    cpstat->cs_cno > nilfs->n_ss_cno + 1 ||
+	    cpstat->cs_nsss != nilfs->n_ss_nsss ||
+	    sustat->ss_nongc_ctime != nilfs->n_ss_nongc_ctime) {
+		nilfs->n_ss_valid = 0;
+		return;
+	}
+	nilfs->n_ss_cno = cpstat->cs_cno;
+}
+
+/**
+ * nilfs_invalidate_snapshot_cache - discard cached snapshot list
+ * @nilfs: nilfs object
+ */
+void nilfs_invalidate_snapshot_cache(struct nilfs *nilfs)
+{
+	nilfs->n_ss_valid = 0;
+}
+
 /**
  * nilfs_get_dev - get the name of a device that nilfs object is opening
  * @nilfs: nilfs object
@@ -569,6 +819,25 @@ const char *nilfs_get_dev(const struct nilfs *nilfs)
 	return nilfs->n_dev;
 }
 
+/**
+ * nilfs_get_ioctl_count - get the number of ioctl calls of a command
+ * @nilfs: nilfs object
+ * @index: command (NILFS_IOCTL_STAT_*)
+ */
+uint64_t nilfs_get_ioctl_count(const struct nilfs *nilfs, unsigned int index)
+{
+	return index < __NR_NILFS_IOCTL_STAT ?
+		__atomic_load_n(&nilfs->n_ioctls[index], __ATOMIC_RELAXED) : 0;
+}
+
+static int nilfs_ioctl(const struct nilfs *nilfs, unsigned int index,
+		       unsigned long request, void *arg)
+{
+	/* threads sharing @nilfs may count at the same time */
+	__atomic_fetch_add(&nilfs->n_ioctls[index], 1, __ATOMIC_RELAXED);
+	return ioctl(nilfs->n_iocfd, request, arg);
+}
+
 /**
  * nilfs_lock - acquire a lock
  * @nilfs: nilfs object
@@ -633,7 +902,9 @@ int nilfs_change_cpmode(struct nilfs *nilfs, nilfs_cno_t cno, int mode)
 	cpmode.cm_cno = cno;
 	cpmode.cm_mode = mode;
 	cpmode.cm_pad = 0;
-	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_CHANGE_CPMODE, &cpmode);
+	nilfs_invalidate_snapshot_cache(nilfs);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_CHANGE_CPMODE,
+			   NILFS_IOCTL_CHANGE_CPMODE, &cpmode);
 }
 
 /**
@@ -667,7 +938,8 @@ ssize_t nilfs_get_cpinfo(struct nilfs *nilfs, nilfs_cno_t cno, int mode,
 	argv.v_size = sizeof(struct nilfs_cpinfo);
 	argv.v_index = cno;
 	argv.v_flags = mode;
-	ret = ioctl(nilfs->n_iocfd, NILFS_IOCTL_GET_CPINFO, &argv);
+	ret = nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_GET_CPINFO,
+			  NILFS_IOCTL_GET_CPINFO, &argv);
 	if (unlikely(ret < 0))
 		return -1;
 	if (mode == NILFS_CHECKPOINT && argv.v_nmembs > 0 &&
@@ -689,7 +961,8 @@ int nilfs_delete_checkpoint(struct nilfs *nilfs, nilfs_cno_t cno)
 		errno = EBADF;
 		return -1;
 	}
-	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_DELETE_CHECKPOINT, &cno);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_DELETE_CHECKPOINT,
+			   NILFS_IOCTL_DELETE_CHECKPOINT, &cno);
 }
 
 /**
@@ -703,7 +976,8 @@ int nilfs_get_cpstat(const struct nilfs *nilfs, struct nilfs_cpstat *cpstat)
 		errno = EBADF;
 		return -1;
 	}
-	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_GET_CPSTAT, cpstat);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_GET_CPSTAT,
+			   NILFS_IOCTL_GET_CPSTAT, cpstat);
 }
 
 /**
@@ -729,7 +1003,8 @@ ssize_t nilfs_get_suinfo(const struct nilfs *nilfs, uint64_t segnum,
 	argv.v_size = sizeof(struct nilfs_suinfo);
 	argv.v_flags = 0;
 	argv.v_index = segnum;
-	ret = ioctl(nilfs->n_iocfd, NILFS_IOCTL_GET_SUINFO, &argv);
+	ret = nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_GET_SUINFO,
+			  NILFS_IOCTL_GET_SUINFO, &argv);
 	if (unlikely(ret < 0))
 		return -1;
 	return argv.v_nmembs;
@@ -763,7 +1038,8 @@ int nilfs_set_suinfo(const struct nilfs *nilfs,
 	argv.v_index = 0;
 	argv.v_flags = 0;
 
-	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_SET_SUINFO, &argv);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_SET_SUINFO,
+			   NILFS_IOCTL_SET_SUINFO, &argv);
 }
 
 /**
@@ -778,7 +1054,8 @@ int nilfs_get_sustat(const struct nilfs *nilfs, struct nilfs_sustat *sustat)
 		return -1;
 	}
 
-	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_GET_SUSTAT, sustat);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_GET_SUSTAT,
+			   NILFS_IOCTL_GET_SUSTAT, sustat);
 }
 
 /**
@@ -803,7 +1080,8 @@ ssize_t nilfs_get_vinfo(const struct nilfs *nilfs,
 	argv.v_size = sizeof(struct nilfs_vinfo);
 	argv.v_flags = 0;
 	argv.v_index = 0;
-	ret = ioctl(nilfs->n_iocfd, NILFS_IOCTL_GET_VINFO, &argv);
+	ret = nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_GET_VINFO,
+			  NILFS_IOCTL_GET_VINFO, &argv);
 	if (unlikely(ret < 0))
 		return -1;
 	return argv.v_nmembs;
@@ -831,7 +1109,8 @@ ssize_t nilfs_get_bdescs(const struct nilfs *nilfs,
 	argv.v_size = sizeof(struct nilfs_bdesc);
 	argv.v_flags = 0;
 	argv.v_index = 0;
-	ret = ioctl(nilfs->n_iocfd, NILFS_IOCTL_GET_BDESCS, &argv);
+	ret = nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_GET_BDESCS,
+			  NILFS_IOCTL_GET_BDESCS, &argv);
 	if (unlikely(ret < 0))
 		return -1;
 	return argv.v_nmembs;
@@ -881,7 +1160,8 @@ int nilfs_clean_segments(struct nilfs *nilfs,
 	argv[4].v_base = (unsigned long)segnums;
 	argv[4].v_nmembs = nsegs;
 	argv[4].v_size = sizeof(uint64_t);
-	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_CLEAN_SEGMENTS, argv);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_CLEAN_SEGMENTS,
+			   NILFS_IOCTL_CLEAN_SEGMENTS, argv);
 }
 
 /**
@@ -896,7 +1176,8 @@ int nilfs_sync(const struct nilfs *nilfs, nilfs_cno_t *cnop)
 		return -1;
 	}
 
-	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_SYNC, cnop);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_SYNC,
+			   NILFS_IOCTL_SYNC, cnop);
 }
 
 /**
@@ -913,7 +1194,8 @@ int nilfs_resize(struct nilfs *nilfs, off_t size)
 		return -1;
 	}
 
-	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_RESIZE, &range);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_RESIZE,
+			   NILFS_IOCTL_RESIZE, &range);
 }
 
 /**
@@ -931,7 +1213,8 @@ int nilfs_set_alloc_range(struct nilfs *nilfs, off_t start, off_t end)
 		return -1;
 	}
 
-	return ioctl(nilfs->n_iocfd, NILFS_IOCTL_SET_ALLOC_RANGE, range);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_SET_ALLOC_RANGE,
+			   NILFS_IOCTL_SET_ALLOC_RANGE, range);
 }
 
 /**
@@ -947,7 +1230,7 @@ int nilfs_freeze(struct nilfs *nilfs)
 		return -1;
 	}
 
-	return ioctl(nilfs->n_iocfd, FIFREEZE, &arg);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_FREEZE, FIFREEZE, &arg);
 }
 
 /**
@@ -963,45 +1246,117 @@ int nilfs_thaw(struct nilfs *nilfs)
 		return -1;
 	}
 
-	return ioctl(nilfs->n_iocfd, FITHAW, &arg);
+	return nilfs_ioctl(nilfs, NILFS_IOCTL_STAT_THAW, FITHAW, &arg);
 }
 
 /**
- * nilfs_get_segment - read or mmap segment to a memory region
+ * nilfs_read_batch - read a batch of regions from the device
+ * @nilfs: nilfs object
+ * @reqs: array of read requests
+ * @nreqs: number of requests in @reqs
+ *
+ * The requests are submitted at once through io_uring if the io_uring
+ * option is set, or are issued one by one with pread(2) otherwise.
+ */
+static int nilfs_read_batch(const struct nilfs *nilfs,
+			    struct nilfs_io_req *reqs, size_t nreqs)
+{
+	size_t i;
+	ssize_t ret;
+
+	if (nilfs->n_uring != NULL)
+		return nilfs_uring_read(nilfs->n_uring, nilfs->n_devfd, reqs,
+					nreqs);
+
+	for (i = 0; i < nreqs; i++) {
+		ret = pread(nilfs->n_devfd, reqs[i].buf, reqs[i].len,
+			    reqs[i].offset);
+		if (unlikely(ret < 0))
+			return -1;
+		reqs[i].result = ret;
+	}
+	return 0;
+}
+
+/**
+ * nilfs_pread - read a region from the device
+ * @nilfs: nilfs object
+ * @buf: destination buffer
+ * @count: number of bytes to be read
+ * @offset: byte offset on the device
+ *
+ * With io_uring, a large region is split into NILFS_IO_CHUNK_SIZE
+ * pieces that are read in parallel so that the device sees a deep
+ * queue.
+ *
+ * Return Value: the number of bytes read, or -1 on error.
+ */
+static ssize_t nilfs_pread(const struct nilfs *nilfs, void *buf,
+			   size_t count, off_t offset)
+{
+	struct nilfs_io_req reqs[NILFS_URING_ENTRIES];
+	size_t chunk, n, i;
+	ssize_t done = 0;
+	int ret;
+
+	if (nilfs->n_uring == NULL || count <= NILFS_IO_CHUNK_SIZE)
+		goto single;
+
+	chunk = max_t(size_t, NILFS_IO_CHUNK_SIZE,
+		      DIV_ROUND_UP(count, NILFS_URING_ENTRIES));
+	n = DIV_ROUND_UP(count, chunk);
+	for (i = 0; i < n; i++) {
+		reqs[i].buf = buf + i * chunk;
+		reqs[i].len = min_t(size_t, chunk, count - i * chunk);
+		reqs[i].offset = offset + i * chunk;
+		reqs[i].result = 0;
+	}
+	ret = nilfs_read_batch(nilfs, reqs, n);
+	if (unlikely(ret < 0))
+		return -1;
+
+	/* report a short read at the first incomplete chunk */
+	for (i = 0; i < n; i++) {
+		done += reqs[i].result;
+		if (reqs[i].result < reqs[i].len)
+			break;
+	}
+	return done;
+
+single:
+	reqs[0].buf = buf;
+	reqs[0].len = count;
+	reqs[0].offset = offset;
+	reqs[0].result = 0;
+	ret = nilfs_read_batch(nilfs, reqs, 1);
+	return unlikely(ret < 0) ? -1 : reqs[0].result;
+}
+
+/**
+ * nilfs_get_segment_extent - get location of a segment on the device
  * @nilfs: nilfs object
  * @segnum: segment number
- * @segment: pointer to a segment object (nilfs_segment struct)
+ * @blocknrp: place to store start block number of the segment
+ * @nblocksp: place to store number of blocks in the segment
  */
-int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
-		      struct nilfs_segment *segment)
+static int nilfs_get_segment_extent(const struct nilfs *nilfs,
+				    uint64_t segnum, uint64_t *blocknrp,
+				    uint32_t *nblocksp)
 {
 	const struct nilfs_super_block *sb = nilfs->n_sb;
-	struct nilfs_segment_summary *segsum;
-	long pagesize;
-	uint32_t blocks_per_segment, blkbits, nblocks;
+	uint32_t blocks_per_segment;
 	uint64_t segblocknr;
-	size_t segsize;
-	off_t segstart;
-	void *addr;
-	ssize_t ret;
 
 	if (unlikely(nilfs->n_devfd < 0 || sb == NULL)) {
 		errno = EBADF;
 		return -1;
 	}
 
-	pagesize = sysconf(_SC_PAGESIZE);
-	if (unlikely(pagesize <= 0)) {
-		errno = EINVAL;
-		return -1;
-	}
-
 	if (unlikely(segnum >= nilfs_get_nsegments(nilfs))) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	blkbits = le32_to_cpu(sb->s_log_block_size) + 10;
 	blocks_per_segment = le32_to_cpu(sb->s_blocks_per_segment);
 	if (unlikely(blocks_per_segment < NILFS_SEG_MIN_BLOCKS)) {
 		errno = EINVAL;
@@ -1014,11 +1369,70 @@ int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 			errno = EINVAL;
 			return -1;
 		}
-		nblocks = blocks_per_segment - (uint32_t)segblocknr;
+		*nblocksp = blocks_per_segment - (uint32_t)segblocknr;
 	} else {
 		segblocknr = (uint64_t)blocks_per_segment * segnum;
-		nblocks = blocks_per_segment;
+		*nblocksp = blocks_per_segment;
 	}
+	*blocknrp = segblocknr;
+	return 0;
+}
+
+/**
+ * nilfs_init_segment - fill in a segment object
+ * @nilfs: nilfs object
+ * @segnum: segment number
+ * @segblocknr: start block number of the segment
+ * @nblocks: number of blocks in the segment
+ * @addr: start address of the memory region holding the segment
+ * @segment: segment object to be initialized
+ */
+static void nilfs_init_segment(const struct nilfs *nilfs, uint64_t segnum,
+			       uint64_t segblocknr, uint32_t nblocks,
+			       void *addr, struct nilfs_segment *segment)
+{
+	const struct nilfs_super_block *sb = nilfs->n_sb;
+	struct nilfs_segment_summary *segsum = addr;
+
+	segment->addr = addr;
+	segment->blkbits = le32_to_cpu(sb->s_log_block_size) + 10;
+	segment->segsize = (uint64_t)nblocks << segment->blkbits;
+	segment->segnum = segnum;
+	segment->seqnum = le64_to_cpu(segsum->ss_seq);
+	segment->blocknr = segblocknr;
+	segment->nblocks = nblocks;
+	segment->blocks_per_segment = le32_to_cpu(sb->s_blocks_per_segment);
+	segment->seed = le32_to_cpu(sb->s_crc_seed);
+}
+
+/**
+ * nilfs_get_segment - read or mmap segment to a memory region
+ * @nilfs: nilfs object
+ * @segnum: segment number
+ * @segment: pointer to a segment object (nilfs_segment struct)
+ */
+int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
+		      struct nilfs_segment *segment)
+{
+	long pagesize;
+	uint32_t blkbits, nblocks;
+	uint64_t segblocknr;
+	size_t segsize;
+	off_t segstart;
+	void *addr;
+	ssize_t ret;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (unlikely(pagesize <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ret = nilfs_get_segment_extent(nilfs, segnum, &segblocknr, &nblocks);
+	if (unlikely(ret < 0))
+		return -1;
+
+	blkbits = le32_to_cpu(nilfs->n_sb->s_log_block_size) + 10;
 	segsize = (uint64_t)nblocks << blkbits;
 	segstart = segblocknr << blkbits;
 
@@ -1053,7 +1467,7 @@ int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 	if (unlikely(addr == NULL))
 		return -1;
 
-	ret = pread(nilfs->n_devfd, addr, segsize, segstart);
+	ret = nilfs_pread(nilfs, addr, segsize, segstart);
 	if (unlikely(ret < 0)) {
 		free(addr);
 		return -1;
@@ -1062,19 +1476,173 @@ int nilfs_get_segment(struct nilfs *nilfs, uint64_t segnum,
 	segment->adjusted = 0;
 
 success:
-	segment->addr = addr;
-	segment->segsize = segsize;
-	segment->segnum = segnum;
-	segsum = addr;
-	segment->seqnum = le64_to_cpu(segsum->ss_seq);
-	segment->blocknr = segblocknr;
-	segment->nblocks = nblocks;
-	segment->blocks_per_segment = blocks_per_segment;
-	segment->blkbits = blkbits;
-	segment->seed = le32_to_cpu(sb->s_crc_seed);
+	nilfs_init_segment(nilfs, segnum, segblocknr, nblocks, addr, segment);
 	return 0;
 }
 
+/**
+ * nilfs_hint_willneed - start reading a range of the device in the background
+ * @nilfs: nilfs object
+ * @offset: byte offset of the range
+ * @len: length of the range in bytes
+ */
+static int nilfs_hint_willneed(const struct nilfs *nilfs, off_t offset,
+			       off_t len)
+{
+#if HAVE_POSIX_FADVISE
+	int ret;
+
+	ret = posix_fadvise(nilfs->n_devfd, offset, len, POSIX_FADV_WILLNEED);
+	if (unlikely(ret != 0)) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif	/* HAVE_POSIX_FADVISE */
+}
+
+#ifdef HAVE_MMAP
+/**
+ * nilfs_read_segment_summaries - read summary blocks of logs in a segment
+ * @nilfs: nilfs object
+ * @addr: memory region laid out as the segment
+ * @segstart: byte offset of the segment on the device
+ * @nblocks: number of blocks in the segment
+ * @blkcnt: number of blocks of valid logs in the segment
+ * @blkbits: bit shift for block size
+ *
+ * This walks the chain of logs by following ss_nblocks and reads only
+ * the summary blocks of each log into the place where they would be
+ * found if the whole segment were read.  The walk stops at the first
+ * block that does not look like a segment summary; the partial segment
+ * iterator validates the summaries in detail afterwards.  The first
+ * block of the next log is read ahead as soon as its position is known,
+ * so that its read overlaps the rest of the current summary.
+ */
+static int nilfs_read_segment_summaries(const struct nilfs *nilfs,
+					void *addr, off_t segstart,
+					uint32_t nblocks, uint32_t blkcnt,
+					unsigned int blkbits)
+{
+	const size_t blksize = 1UL << blkbits;
+	struct nilfs_segment_summary *segsum;
+	uint32_t blkoff = 0, pseg_nblocks, sumblks;
+	size_t count;
+	ssize_t ret;
+
+	blkcnt = min_t(uint32_t, blkcnt, nblocks);
+	while (blkcnt - blkoff >= NILFS_PSEG_MIN_BLOCKS) {
+		segsum = addr + ((size_t)blkoff << blkbits);
+		ret = nilfs_pread(nilfs, segsum, blksize,
+				  segstart + ((off_t)blkoff << blkbits));
+		if (unlikely(ret < 0))
+			return -1;
+		if (ret < blksize ||
+		    le32_to_cpu(segsum->ss_magic) != NILFS_SEGSUM_MAGIC)
+			break;
+
+		pseg_nblocks = le32_to_cpu(segsum->ss_nblocks);
+		sumblks = DIV_ROUND_UP(le32_to_cpu(segsum->ss_sumbytes),
+				       blksize);
+		if (pseg_nblocks == 0 || sumblks >= pseg_nblocks ||
+		    pseg_nblocks > nblocks - blkoff)
+			break;	/* leave it to the psegment iterator */
+
+		if (blkoff + pseg_nblocks + NILFS_PSEG_MIN_BLOCKS <= blkcnt)
+			nilfs_hint_willneed(nilfs, segstart +
+					    ((off_t)(blkoff + pseg_nblocks) <<
+					     blkbits), blksize);
+
+		if (sumblks > 1) {
+			count = (size_t)(sumblks - 1) << blkbits;
+			ret = nilfs_pread(nilfs, (void *)segsum + blksize,
+					  count, segstart +
+					  ((off_t)(blkoff + 1) << blkbits));
+			if (unlikely(ret < 0))
+				return -1;
+			if (ret < count)
+				break;
+		}
+		blkoff += pseg_nblocks;
+	}
+	return 0;
+}
+#endif	/* HAVE_MMAP */
+
+/**
+ * nilfs_get_segment_summary - read summary blocks of a segment
+ * @nilfs: nilfs object
+ * @segnum: segment number
+ * @blkcnt: number of blocks of valid logs in the segment
+ * @segment: pointer to a segment object (nilfs_segment struct)
+ *
+ * Description: nilfs_get_segment_summary() is a variant of
+ * nilfs_get_segment() for callers that only look at segment summaries,
+ * such as the garbage collector.  If mmap is available, the segment is
+ * mapped and only the pages that are accessed are read.  Otherwise,
+ * only the summary blocks of the logs found within the first @blkcnt
+ * blocks are read; the other blocks of the returned memory region are
+ * left unread and must not be accessed.  The segment object is released
+ * with nilfs_put_segment().
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+int nilfs_get_segment_summary(struct nilfs *nilfs, uint64_t segnum,
+			      uint32_t blkcnt, struct nilfs_segment *segment)
+{
+#ifdef HAVE_MMAP
+	long pagesize;
+	uint32_t blkbits, nblocks;
+	uint64_t segblocknr;
+	size_t segsize, alloc_size;
+	void *addr;
+	int ret;
+
+	/* mapped pages are read on demand */
+	if (nilfs_opt_test_mmap(nilfs))
+		return nilfs_get_segment(nilfs, segnum, segment);
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (unlikely(pagesize <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ret = nilfs_get_segment_extent(nilfs, segnum, &segblocknr, &nblocks);
+	if (unlikely(ret < 0))
+		return -1;
+
+	blkbits = le32_to_cpu(nilfs->n_sb->s_log_block_size) + 10;
+	segsize = (uint64_t)nblocks << blkbits;
+
+	/*
+	 * Anonymous pages are not allocated until they are written, so
+	 * memory is consumed only for the summary blocks.
+	 */
+	alloc_size = roundup(segsize, pagesize);
+	addr = mmap(0, alloc_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (unlikely(addr == MAP_FAILED))
+		return -1;
+
+	ret = nilfs_read_segment_summaries(nilfs, addr, segblocknr << blkbits,
+					   nblocks, blkcnt, blkbits);
+	if (unlikely(ret < 0)) {
+		munmap(addr, alloc_size);
+		return -1;
+	}
+	segment->mmapped = 1;
+	segment->adjusted = (alloc_size != segsize);
+	nilfs_init_segment(nilfs, segnum, segblocknr, nblocks, addr, segment);
+	return 0;
+#else
+	return nilfs_get_segment(nilfs, segnum, segment);
+#endif	/* HAVE_MMAP */
+}
+
 /**
  * nilfs_put_segment - free memory used for raw segment access
  * @segment: pointer to the segment object to be cleaned up
@@ -1111,19 +1679,49 @@ int nilfs_put_segment(struct nilfs_segment *segment)
 }
 
 /**
- * nilfs_get_segment_seqnum - get sequence number of segment
+ * nilfs_readahead_segment - start reading a segment summary in the background
  * @nilfs: nilfs object
  * @segnum: segment number
- * @seqnum: buffer to store sequence number of the segment given by @segnum
+ *
+ * Description: nilfs_readahead_segment() tells the kernel that the
+ * summary of the segment specified by @segnum will be accessed soon, so
+ * that a subsequent nilfs_get_segment_summary() call finds it in the
+ * page cache.  Only the first block of the segment, which holds the
+ * summary header of its first log, is read ahead; the positions of the
+ * other summary blocks are not known until it has been read, and the
+ * data blocks are never needed by the garbage collector.  This function
+ * does not wait for the read to complete.
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
  */
-int nilfs_get_segment_seqnum(const struct nilfs *nilfs, uint64_t segnum,
-			     uint64_t *seqnum)
+int nilfs_readahead_segment(const struct nilfs *nilfs, uint64_t segnum)
+{
+	uint32_t blkbits, nblocks;
+	uint64_t segblocknr;
+	int ret;
+
+	ret = nilfs_get_segment_extent(nilfs, segnum, &segblocknr, &nblocks);
+	if (unlikely(ret < 0))
+		return -1;
+
+	blkbits = le32_to_cpu(nilfs->n_sb->s_log_block_size) + 10;
+
+	return nilfs_hint_willneed(nilfs, (off_t)segblocknr << blkbits,
+				   (off_t)1 << blkbits);
+}
+
+/**
+ * nilfs_get_segment_seqnum_offset - get device offset of segment seqnum
+ * @nilfs: nilfs object
+ * @segnum: segment number
+ * @offsetp: place to store the byte offset of ss_seq of the segment
+ */
+static int nilfs_get_segment_seqnum_offset(const struct nilfs *nilfs,
+					   uint64_t segnum, off_t *offsetp)
 {
 	const struct nilfs_super_block *sb = nilfs->n_sb;
 	uint32_t blocks_per_segment, blkbits;
-	__le64 buf;
-	off_t segstart, offset;
-	ssize_t ret;
+	off_t segstart;
 
 	if (unlikely(nilfs->n_devfd < 0 || sb == NULL)) {
 		errno = EBADF;
@@ -1140,8 +1738,28 @@ int nilfs_get_segment_seqnum(const struct nilfs *nilfs, uint64_t segnum,
 	segstart = (segnum == 0 ? le64_to_cpu(sb->s_first_data_block) :
 		    blocks_per_segment * segnum) << blkbits;
 
-	offset = segstart + offsetof(struct nilfs_segment_summary, ss_seq);
-	ret = pread(nilfs->n_devfd, &buf, sizeof(buf), offset);
+	*offsetp = segstart + offsetof(struct nilfs_segment_summary, ss_seq);
+	return 0;
+}
+
+/**
+ * nilfs_get_segment_seqnum - get sequence number of segment
+ * @nilfs: nilfs object
+ * @segnum: segment number
+ * @seqnum: buffer to store sequence number of the segment given by @segnum
+ */
+int nilfs_get_segment_seqnum(const struct nilfs *nilfs, uint64_t segnum,
+			     uint64_t *seqnum)
+{
+	__le64 buf;
+	off_t offset;
+	ssize_t ret;
+
+	ret = nilfs_get_segment_seqnum_offset(nilfs, segnum, &offset);
+	if (unlikely(ret < 0))
+		return -1;
+
+	ret = nilfs_pread(nilfs, &buf, sizeof(buf), offset);
 	if (unlikely(ret < 0))
 		return -1;
 
@@ -1149,6 +1767,169 @@ int nilfs_get_segment_seqnum(const struct nilfs *nilfs, uint64_t segnum,
 	return 0;
 }
 
+/**
+ * struct nilfs_segnum_ref - segment number tagged with its array index
+ * @segnum: segment number
+ * @index: index of @segnum in the array given by the caller
+ */
+struct nilfs_segnum_ref {
+	uint64_t segnum;
+	size_t index;
+};
+
+static int nilfs_comp_segnum_ref(const void *elem1, const void *elem2)
+{
+	const struct nilfs_segnum_ref *ref1 = elem1, *ref2 = elem2;
+
+	if (ref1->segnum < ref2->segnum)
+		return -1;
+	return ref1->segnum > ref2->segnum ? 1 : 0;
+}
+
+static struct nilfs_segnum_ref *
+nilfs_sort_segnums(const uint64_t *segnums, size_t nsegs)
+{
+	struct nilfs_segnum_ref *refs;
+	size_t i;
+
+	refs = malloc(sizeof(*refs) * nsegs);
+	if (unlikely(refs == NULL))
+		return NULL;
+
+	for (i = 0; i < nsegs; i++) {
+		refs[i].segnum = segnums[i];
+		refs[i].index = i;
+	}
+	qsort(refs, nsegs, sizeof(*refs), nilfs_comp_segnum_ref);
+	return refs;
+}
+
+/**
+ * nilfs_get_segment_seqnums - get sequence numbers of segments
+ * @nilfs: nilfs object
+ * @segnums: array of segment numbers
+ * @nsegs: number of segment numbers stored in @segnums
+ * @seqnums: array to store the sequence number of each segment in @segnums
+ *
+ * Description: nilfs_get_segment_seqnums() is a vectorized version of
+ * nilfs_get_segment_seqnum().  The segment numbers are sorted and
+ * duplicates are merged so that the device is read once per segment in
+ * ascending order.  The reads are submitted in a single batch if the
+ * io_uring option is set.
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+int nilfs_get_segment_seqnums(const struct nilfs *nilfs,
+			      const uint64_t *segnums, size_t nsegs,
+			      uint64_t *seqnums)
+{
+	struct nilfs_segnum_ref *refs;
+	struct nilfs_io_req *reqs;
+	__le64 *bufs;
+	off_t offset;
+	size_t i, n;
+	int ret = -1;
+
+	if (nsegs == 0)
+		return 0;
+
+	refs = nilfs_sort_segnums(segnums, nsegs);
+	if (unlikely(refs == NULL))
+		return -1;
+
+	reqs = malloc(sizeof(*reqs) * nsegs);
+	bufs = malloc(sizeof(*bufs) * nsegs);
+	if (unlikely(reqs == NULL || bufs == NULL))
+		goto out;
+
+	for (i = 0, n = 0; i < nsegs; i++) {
+		if (i > 0 && refs[i].segnum == refs[i - 1].segnum)
+			continue;
+		if (unlikely(nilfs_get_segment_seqnum_offset(
+				     nilfs, refs[i].segnum, &offset) < 0))
+			goto out;
+		reqs[n].buf = &bufs[n];
+		reqs[n].len = sizeof(bufs[n]);
+		reqs[n].offset = offset;
+		reqs[n].result = 0;
+		n++;
+	}
+
+	if (unlikely(nilfs_read_batch(nilfs, reqs, n) < 0))
+		goto out;
+
+	for (i = 0, n = 0; i < nsegs; i++) {
+		if (i > 0 && refs[i].segnum != refs[i - 1].segnum)
+			n++;
+		if (unlikely(reqs[n].result < sizeof(bufs[n]))) {
+			errno = EIO;
+			goto out;
+		}
+		seqnums[refs[i].index] = le64_to_cpu(bufs[n]);
+	}
+	ret = 0;
+out:
+	free(bufs);
+	free(reqs);
+	free(refs);
+	return ret;
+}
+
+#define NILFS_SUINFO_BATCH	128
+
+/**
+ * nilfs_get_suinfo_batch - get segment usage of scattered segments
+ * @nilfs: nilfs object
+ * @segnums: array of segment numbers
+ * @nsegs: number of segment numbers stored in @segnums
+ * @si: array to store segment usage of each segment in @segnums
+ *
+ * Description: nilfs_get_suinfo_batch() sorts the segment numbers and
+ * fetches segments lying within NILFS_SUINFO_BATCH entries of each
+ * other with a single ioctl instead of issuing one ioctl per segment.
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+int nilfs_get_suinfo_batch(const struct nilfs *nilfs, const uint64_t *segnums,
+			   size_t nsegs, struct nilfs_suinfo *si)
+{
+	struct nilfs_suinfo buf[NILFS_SUINFO_BATCH];
+	struct nilfs_segnum_ref *refs;
+	uint64_t start;
+	size_t i, j;
+	ssize_t n;
+	int ret = -1;
+
+	if (nsegs == 0)
+		return 0;
+
+	refs = nilfs_sort_segnums(segnums, nsegs);
+	if (unlikely(refs == NULL))
+		return -1;
+
+	for (i = 0; i < nsegs; i = j) {
+		start = refs[i].segnum;
+		for (j = i + 1; j < nsegs; j++) {
+			if (refs[j].segnum - start >= NILFS_SUINFO_BATCH)
+				break;
+		}
+		n = nilfs_get_suinfo(nilfs, start, buf,
+				     refs[j - 1].segnum - start + 1);
+		if (unlikely(n < 0))
+			goto out;
+		if (unlikely(refs[j - 1].segnum - start >= n)) {
+			errno = EINVAL;	/* beyond the last segment */
+			goto out;
+		}
+		for (; i < j; i++)
+			si[refs[i].index] = buf[refs[i].segnum - start];
+	}
+	ret = 0;
+out:
+	free(refs);
+	return ret;
+}
+
 nilfs_cno_t nilfs_get_oldest_cno(struct nilfs *nilfs)
 {
 	struct nilfs_cpinfo cpinfo[1];
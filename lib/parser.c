@@ -149,3 +149,62 @@ int nilfs_parse_protection_period(const char *arg, unsigned long *period)
 out:
 	return ret;
 }
+
+/**
+ * nilfs_parse_size - parse a size in bytes
+ * @arg: string of a number optionally followed by a unit suffix
+ * @size: place to store the number of bytes
+ *
+ * The suffix is "kB", "MB", "GB", "TB", "PB", or "EB" for powers of
+ * 1000, and "K", "M", "G", ... or "KiB", "MiB", "GiB", ... for powers
+ * of 1024, as in the configuration file of the cleaner daemon.
+ *
+ * Return Value: On success, 0 is returned.  On error, -1 is returned and
+ * errno is set to EINVAL or ERANGE.
+ */
+int nilfs_parse_size(const char *arg, unsigned long long *size)
+{
+	static const char prefixes[] = "KMGTPE";
+	unsigned long long val, unit = 1;
+	const char *p;
+	char *endptr;
+	int i;
+
+	if (!isdigit((unsigned char)arg[0]))
+		goto failed_inval;
+
+	errno = 0;
+	val = strtoull(arg, &endptr, 10);
+	if (val == ULLONG_MAX && errno == ERANGE)
+		return -1;
+
+	if (*endptr != '\0') {
+		if (endptr[0] == 'k' && endptr[1] == 'B') {
+			p = strchr(prefixes, 'K');
+		} else {
+			p = strchr(prefixes, endptr[0]);
+			if (!p)
+				goto failed_inval;
+		}
+		if (endptr[1] == '\0' ||
+		    (endptr[1] == 'i' && endptr[2] == 'B' && endptr[3] == '\0')) {
+			for (i = 0; i <= p - prefixes; i++)
+				unit <<= 10;
+		} else if (endptr[1] == 'B' && endptr[2] == '\0') {
+			for (i = 0; i <= p - prefixes; i++)
+				unit *= 1000;
+		} else {
+			goto failed_inval;
+		}
+		if (val > ULLONG_MAX / unit) {
+			errno = ERANGE;
+			return -1;
+		}
+	}
+	*size = val * unit;
+	return 0;
+
+failed_inval:
+	errno = EINVAL;
+	return -1;
+}
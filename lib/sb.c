@@ -38,6 +38,10 @@
 #include <sys/types.h>
 #endif	/* HAVE_SYS_TYPES_H */
 
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif	/* HAVE_SYS_STAT_H */
+
 #if HAVE_FCNTL_H
 #include <fcntl.h>
 #endif	/* HAVE_FCNTL_H */
@@ -103,6 +107,23 @@ static int nilfs_sb2_offset_is_too_small(struct nilfs_super_block *sbp,
 			     (le32_to_cpu(sbp->s_log_block_size) + 10));
 }
 
+static int nilfs_get_device_size(int devfd, uint64_t *devsize)
+{
+	struct stat stbuf;
+	int ret;
+
+	ret = fstat(devfd, &stbuf);
+	if (unlikely(ret < 0))
+		return -1;
+
+	/* allow file system images to be accessed without a loop device */
+	if (S_ISREG(stbuf.st_mode)) {
+		*devsize = stbuf.st_size;
+		return 0;
+	}
+	return ioctl(devfd, BLKGETSIZE64, devsize);
+}
+
 static int __nilfs_sb_read(int devfd, struct nilfs_super_block **sbp,
 			   uint64_t *offsets)
 {
@@ -115,7 +136,7 @@ static int __nilfs_sb_read(int devfd, struct nilfs_super_block **sbp,
 	if (unlikely(sbp[0] == NULL || sbp[1] == NULL))
 		goto failed;
 
-	ret = ioctl(devfd, BLKGETSIZE64, &devsize);
+	ret = nilfs_get_device_size(devfd, &devsize);
 	if (unlikely(ret != 0))
 		goto failed;
 
@@ -0,0 +1,347 @@
+/*
+ * sucache.c - incrementally refreshed cache of segment usage
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * The cleaner daemon looks at the usage of every segment in each
+ * cleaning cycle.  Instead of reading the whole sufile every time, this
+ * keeps a copy of it and only fetches the entries that are likely to
+ * have changed: the segments around the log head, where the file
+ * system allocates new segments, and the segments that the caller has
+ * invalidated after cleaning them.  The number of clean segments in the
+ * cache is compared with the one reported by the kernel to detect
+ * changes that were missed, in which case the whole sufile is read
+ * again.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <stdio.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_STRING_H
+#include <string.h>	/* memset(), memcmp() */
+#endif	/* HAVE_STRING_H */
+
+#include <errno.h>
+#include "util.h"
+#include "sucache.h"
+
+
+#define NILFS_SUCACHE_NSUINFO	512	/* Entries fetched per ioctl */
+#define NILFS_SUCACHE_NSTALE	64	/* Max. segments to be refetched */
+#define NILFS_SUCACHE_SLACK	2	/*
+					 * Number of segments scanned behind
+					 * the log head, which covers segments
+					 * that were active at the last refresh
+					 */
+#define NILFS_SUCACHE_RESCAN_INTERVAL	256	/*
+						 * Number of partial refreshes
+						 * between full scans
+						 */
+
+/* Cache of segment usage */
+struct nilfs_sucache {
+	struct nilfs *nilfs;
+	struct nilfs_suinfo *si;	/* Usage of segments, by segnum */
+	uint64_t nsegs;			/* Number of cached segments */
+	uint64_t ncleansegs;		/* Number of clean segments in @si */
+	uint64_t head;			/* Most recently written segment */
+	struct nilfs_sustat sustat;	/* Status at the last refresh */
+	unsigned int nrefresh;		/* Partial refreshes since full scan */
+	int valid;			/* @si holds the whole sufile */
+	size_t nstale;			/* Number of segments in @stale */
+	uint64_t stale[NILFS_SUCACHE_NSTALE];	/* Segments to be refetched */
+	struct nilfs_sucache_stat stat;	/* Statistics */
+};
+
+static inline int nilfs_sucache_is_clean(const struct nilfs_suinfo *si)
+{
+	/* the active flag is not recorded on disk */
+	return !(si->sui_flags & ~(1UL << NILFS_SUINFO_ACTIVE));
+}
+
+struct nilfs_sucache *nilfs_sucache_create(struct nilfs *nilfs)
+{
+	struct nilfs_sucache *sucache;
+
+	sucache = malloc(sizeof(*sucache));
+	if (unlikely(!sucache))
+		return NULL;
+
+	memset(sucache, 0, sizeof(*sucache));
+	sucache->nilfs = nilfs;
+	return sucache;
+}
+
+void nilfs_sucache_destroy(struct nilfs_sucache *sucache)
+{
+	if (sucache) {
+		free(sucache->si);
+		free(sucache);
+	}
+}
+
+/**
+ * nilfs_sucache_update - store usage of a segment to the cache
+ * @sucache: segment usage cache
+ * @segnum: segment number
+ * @si: usage of the segment given by @segnum
+ *
+ * Return Value: 1 if the cached entry changed, 0 otherwise.
+ */
+static int nilfs_sucache_update(struct nilfs_sucache *sucache,
+				uint64_t segnum, const struct nilfs_suinfo *si)
+{
+	struct nilfs_suinfo *cached = &sucache->si[segnum];
+
+	int was_clean, is_clean;
+
+	if (memcmp(cached, si, sizeof(*si)) == 0)
+		return 0;
+
+	was_clean = nilfs_sucache_is_clean(cached);
+	is_clean = nilfs_sucache_is_clean(si);
+	if (was_clean && !is_clean)
+		sucache->ncleansegs--;
+	else if (!was_clean && is_clean)
+		sucache->ncleansegs++;
+
+	*cached = *si;
+	if (si->sui_lastmod >= sucache->si[sucache->head].sui_lastmod)
+		sucache->head = segnum;
+	return 1;
+}
+
+static int nilfs_sucache_scan_all(struct nilfs_sucache *sucache,
+				  const struct nilfs_sustat *sustat)
+{
+	struct nilfs_suinfo *si;
+	uint64_t segnum, nsegs = sustat->ss_nsegs;
+	size_t count;
+	ssize_t n;
+
+	if (sucache->si == NULL || sucache->nsegs != nsegs) {
+		si = realloc(sucache->si,
+			     sizeof(*si) * max_t(uint64_t, nsegs, 1));
+		if (unlikely(!si))
+			return -1;
+		sucache->si = si;
+	}
+	sucache->valid = 0;
+	sucache->nsegs = nsegs;
+	sucache->nstale = 0;
+
+	for (segnum = 0; segnum < nsegs; segnum += n) {
+		count = min_t(uint64_t, nsegs - segnum, NILFS_SUCACHE_NSUINFO);
+		n = nilfs_get_suinfo(sucache->nilfs, segnum,
+				     &sucache->si[segnum], count);
+		if (unlikely(n < 0))
+			return -1;
+		if (unlikely(n == 0)) {
+			/*
+			 * Inconsistent number of segments; keep what was
+			 * read and scan again at the next refresh.
+			 */
+			nsegs = segnum;
+			break;
+		}
+	}
+
+	sucache->nsegs = nsegs;
+	sucache->ncleansegs = 0;
+	sucache->head = 0;
+	for (segnum = 0; segnum < nsegs; segnum++) {
+		si = &sucache->si[segnum];
+		if (nilfs_sucache_is_clean(si))
+			sucache->ncleansegs++;
+		if (si->sui_lastmod >= sucache->si[sucache->head].sui_lastmod)
+			sucache->head = segnum;
+	}
+
+	sucache->sustat = *sustat;
+	sucache->nrefresh = 0;
+	sucache->valid = 1;
+	sucache->stat.full_scans++;
+	sucache->stat.scanned_segs += nsegs;
+	return 0;
+}
+
+static int nilfs_sucache_scan_stale(struct nilfs_sucache *sucache)
+{
+	struct nilfs_suinfo si[NILFS_SUCACHE_NSTALE];
+	size_t i;
+	int ret;
+
+	ret = nilfs_get_suinfo_batch(sucache->nilfs, sucache->stale,
+				     sucache->nstale, si);
+	if (unlikely(ret < 0))
+		return -1;
+
+	for (i = 0; i < sucache->nstale; i++)
+		nilfs_sucache_update(sucache, sucache->stale[i], &si[i]);
+
+	sucache->stat.scanned_segs += sucache->nstale;
+	sucache->nstale = 0;
+	return 0;
+}
+
+/**
+ * nilfs_sucache_scan_head - refetch segments around the log head
+ * @sucache: segment usage cache
+ *
+ * New segments are allocated by searching forward from the last
+ * allocated one for a clean segment.  This scans forward from the log
+ * head until a batch of segments in which nothing changed and which
+ * still contains a clean segment is found; the allocator could not have
+ * gone beyond it.
+ */
+static int nilfs_sucache_scan_head(struct nilfs_sucache *sucache)
+{
+	struct nilfs_suinfo si[NILFS_SUCACHE_NSUINFO];
+	uint64_t segnum, nsegs = sucache->nsegs, scanned = 0;
+	size_t count, nchanged;
+	int has_clean;
+	ssize_t n, i;
+
+	if (nsegs == 0)
+		return 0;
+
+	segnum = (sucache->head + nsegs -
+		  min_t(uint64_t, NILFS_SUCACHE_SLACK, nsegs - 1)) % nsegs;
+
+	while (scanned < nsegs) {
+		count = min_t(uint64_t, nsegs - segnum, nsegs - scanned);
+		count = min_t(size_t, count, NILFS_SUCACHE_NSUINFO);
+		n = nilfs_get_suinfo(sucache->nilfs, segnum, si, count);
+		if (unlikely(n < 0))
+			return -1;
+		if (unlikely(n == 0)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		nchanged = 0;
+		has_clean = 0;
+		for (i = 0; i < n; i++) {
+			if (nilfs_sucache_update(sucache, segnum + i, &si[i]))
+				nchanged++;
+			else if (nilfs_sucache_is_clean(&si[i]))
+				has_clean = 1;
+		}
+		scanned += n;
+		segnum = (segnum + n) % nsegs;
+
+		if (!nchanged && has_clean)
+			break;
+	}
+	sucache->stat.scanned_segs += scanned;
+	return 0;
+}
+
+/**
+ * nilfs_sucache_refresh - bring segment usage cache up to date
+ * @sucache: segment usage cache
+ * @sustat: current status information on segments
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned and
+ * the cache is marked invalid so that the next call reads the whole
+ * sufile.
+ */
+int nilfs_sucache_refresh(struct nilfs_sucache *sucache,
+			  const struct nilfs_sustat *sustat)
+{
+	int changed;
+
+	if (!sucache->valid || sucache->nsegs != sustat->ss_nsegs ||
+	    sucache->nrefresh >= NILFS_SUCACHE_RESCAN_INTERVAL)
+		goto full_scan;
+
+	if (sucache->nstale > 0 && nilfs_sucache_scan_stale(sucache) < 0)
+		goto full_scan;
+
+	changed = memcmp(&sucache->sustat, sustat, sizeof(*sustat)) != 0;
+	if (changed && nilfs_sucache_scan_head(sucache) < 0)
+		goto full_scan;
+
+	/*
+	 * Writes racing with the scan may make the cached count smaller
+	 * than @sustat, but never larger unless a write was missed.
+	 */
+	if (sucache->ncleansegs > sustat->ss_ncleansegs ||
+	    (!changed && sucache->ncleansegs != sustat->ss_ncleansegs))
+		goto full_scan;
+
+	sucache->sustat = *sustat;
+	sucache->nrefresh++;
+	sucache->stat.partial_scans++;
+	return 0;
+
+full_scan:
+	if (unlikely(nilfs_sucache_scan_all(sucache, sustat) < 0)) {
+		sucache->valid = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * nilfs_sucache_invalidate - mark segments whose usage may have changed
+ * @sucache: segment usage cache
+ * @segnums: array of segment numbers
+ * @nsegs: number of segment numbers stored in @segnums
+ *
+ * The caller invalidates segments it has cleaned or whose usage it has
+ * updated, so that they are refetched at the next refresh.
+ */
+void nilfs_sucache_invalidate(struct nilfs_sucache *sucache,
+			      const uint64_t *segnums, size_t nsegs)
+{
+	if (!sucache->valid)
+		return;
+
+	if (sucache->nstale + nsegs > NILFS_SUCACHE_NSTALE) {
+		sucache->valid = 0;
+		return;
+	}
+	memcpy(&sucache->stale[sucache->nstale], segnums,
+	       sizeof(*segnums) * nsegs);
+	sucache->nstale += nsegs;
+}
+
+/**
+ * nilfs_sucache_invalidate_all - discard segment usage cache
+ * @sucache: segment usage cache
+ */
+void nilfs_sucache_invalidate_all(struct nilfs_sucache *sucache)
+{
+	sucache->valid = 0;
+}
+
+/**
+ * nilfs_sucache_get_suinfo - get cached usage of all segments
+ * @sucache: segment usage cache
+ * @nsegsp: place to store the number of segments
+ *
+ * Return Value: array of segment usage indexed by segment number, which
+ * stays valid until the next refresh.
+ */
+const struct nilfs_suinfo *
+nilfs_sucache_get_suinfo(const struct nilfs_sucache *sucache,
+			 uint64_t *nsegsp)
+{
+	*nsegsp = sucache->valid ? sucache->nsegs : 0;
+	return sucache->si;
+}
+
+void nilfs_sucache_get_stat(const struct nilfs_sucache *sucache,
+			    struct nilfs_sucache_stat *stat)
+{
+	*stat = sucache->stat;
+}
@@ -0,0 +1,359 @@
+/*
+ * uring.c - io_uring based raw device i/o
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * This is a minimal io_uring client built directly on the system call
+ * interface so that libnilfs does not depend on liburing.  It is only
+ * used to submit batches of reads against the raw device, and callers
+ * fall back to pread(2) when it is unavailable.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif	/* HAVE_STRING_H */
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif	/* HAVE_UNISTD_H */
+
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif	/* HAVE_SYS_MMAN_H */
+
+#if HAVE_TIME_H
+#include <time.h>
+#endif	/* HAVE_TIME_H */
+
+#if HAVE_IO_URING
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif	/* HAVE_IO_URING */
+
+#include <errno.h>
+#include "util.h"
+#include "uring.h"
+
+#if HAVE_IO_URING
+
+/**
+ * struct nilfs_uring - io_uring instance
+ * @fd: file descriptor of the ring
+ * @entries: number of submission queue entries
+ * @sq_ring: mapped submission queue ring
+ * @sq_ring_size: size of @sq_ring
+ * @sq_head: head index of submission queue (updated by kernel)
+ * @sq_tail: tail index of submission queue
+ * @sq_mask: index mask of submission queue
+ * @sq_array: index array of submission queue
+ * @sqes: mapped array of submission queue entries
+ * @cq_ring: mapped completion queue ring (may be @sq_ring)
+ * @cq_ring_size: size of @cq_ring
+ * @cq_head: head index of completion queue
+ * @cq_tail: tail index of completion queue (updated by kernel)
+ * @cq_mask: index mask of completion queue
+ * @cqes: array of completion queue entries
+ */
+struct nilfs_uring {
+	int fd;
+	unsigned int entries;
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int nilfs_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int nilfs_uring_enter(int fd, unsigned int to_submit,
+			     unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/**
+ * nilfs_uring_create - create an io_uring instance
+ * @entries: queue depth
+ *
+ * Return Value: On success, the pointer to the new ring is returned.
+ * On error, NULL is returned.  errno is set to ENOSYS if the running
+ * kernel does not support io_uring.
+ */
+struct nilfs_uring *nilfs_uring_create(unsigned int entries)
+{
+	struct nilfs_uring *ring;
+	struct io_uring_params p;
+	int errsv;
+
+	ring = malloc(sizeof(*ring));
+	if (unlikely(!ring))
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = nilfs_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		goto failed_ring;
+
+	ring->entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array +
+		p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_size = ring->cq_ring_size =
+			max_t(size_t, ring->sq_ring_size, ring->cq_ring_size);
+
+	ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto failed_fd;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(0, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto failed_sq_ring;
+	}
+
+	ring->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto failed_cq_ring;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return ring;
+
+failed_cq_ring:
+	errsv = errno;
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	errno = errsv;
+failed_sq_ring:
+	errsv = errno;
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	errno = errsv;
+failed_fd:
+	errsv = errno;
+	close(ring->fd);
+	errno = errsv;
+failed_ring:
+	free(ring);
+	return NULL;
+}
+
+/**
+ * nilfs_uring_destroy - destroy an io_uring instance
+ * @ring: ring returned by nilfs_uring_create()
+ */
+void nilfs_uring_destroy(struct nilfs_uring *ring)
+{
+	if (ring == NULL)
+		return;
+
+	munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+/**
+ * nilfs_uring_reap - consume completion queue entries
+ * @ring: io_uring instance
+ * @reqs: array of read requests
+ * @err: place to store the error of the first failed request
+ *
+ * Return Value: the number of completion queue entries consumed.
+ */
+static unsigned int nilfs_uring_reap(struct nilfs_uring *ring,
+				     struct nilfs_io_req *reqs, int *err)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, n = 0;
+
+	head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		if (unlikely(cqe->res < 0)) {
+			if (!*err)
+				*err = -cqe->res;
+		} else {
+			reqs[cqe->user_data].result = cqe->res;
+		}
+		head++;
+		n++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+/**
+ * nilfs_uring_drain - wait for the requests in flight after an error
+ * @ring: io_uring instance
+ * @reqs: array of read requests
+ * @inflight: number of requests queued and not yet completed
+ *
+ * The requests must not outlive the call to nilfs_uring_read() since
+ * they refer to its iovec array and to the buffers of the caller.  The
+ * entries that the kernel has not consumed yet are taken back from the
+ * submission queue; the others are waited for.  Without SQPOLL, the
+ * kernel consumes entries only inside io_uring_enter(), so taking them
+ * back is safe.  If io_uring_enter() keeps failing, the completion
+ * queue is polled instead, since completions are posted anyway.
+ */
+static void nilfs_uring_drain(struct nilfs_uring *ring,
+			      struct nilfs_io_req *reqs, unsigned int inflight)
+{
+	const struct timespec delay = { 0, 1000000 };	/* 1 ms */
+	unsigned int unsubmitted;
+	int err = 0;
+	int ret;
+
+	unsubmitted = *ring->sq_tail -
+		__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail - unsubmitted,
+			 __ATOMIC_RELEASE);
+	inflight -= unsubmitted;
+
+	while (inflight > 0) {
+		inflight -= nilfs_uring_reap(ring, reqs, &err);
+		if (inflight == 0)
+			break;
+		ret = nilfs_uring_enter(ring->fd, 0, 1,
+					IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR)
+			nanosleep(&delay, NULL);
+	}
+}
+
+/**
+ * nilfs_uring_read - submit a batch of reads and wait for completion
+ * @ring: io_uring instance
+ * @fd: file descriptor to read from
+ * @reqs: array of read requests
+ * @nreqs: number of requests in @reqs
+ *
+ * Up to @ring->entries requests are in flight at once.  The number of
+ * bytes read by each request is stored in its @result field, which may
+ * be short at the end of the device just like pread(2).
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned and
+ * errno is set to the error of the first failed request.
+ */
+int nilfs_uring_read(struct nilfs_uring *ring, int fd,
+		     struct nilfs_io_req *reqs, size_t nreqs)
+{
+	struct iovec iov[NILFS_URING_ENTRIES];
+	struct io_uring_sqe *sqe;
+	unsigned int tail, index, batch, inflight, i;
+	size_t done = 0;
+	int err = 0;
+	int ret, errsv;
+
+	while (done < nreqs) {
+		batch = min_t(size_t, nreqs - done,
+			      min_t(unsigned int, ring->entries,
+				    NILFS_URING_ENTRIES));
+
+		tail = *ring->sq_tail;
+		for (i = 0; i < batch; i++) {
+			index = (tail + i) & *ring->sq_mask;
+			sqe = &ring->sqes[index];
+			memset(sqe, 0, sizeof(*sqe));
+			iov[i].iov_base = reqs[done + i].buf;
+			iov[i].iov_len = reqs[done + i].len;
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = fd;
+			sqe->off = reqs[done + i].offset;
+			sqe->addr = (unsigned long)&iov[i];
+			sqe->len = 1;
+			sqe->user_data = done + i;
+			ring->sq_array[index] = index;
+		}
+		__atomic_store_n(ring->sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+		inflight = batch;
+		while (inflight > 0) {
+			ret = nilfs_uring_enter(ring->fd,
+						*ring->sq_tail -
+						__atomic_load_n(ring->sq_head,
+								__ATOMIC_ACQUIRE),
+						1, IORING_ENTER_GETEVENTS);
+			if (unlikely(ret < 0)) {
+				if (errno == EINTR)
+					continue;
+				errsv = errno;
+				nilfs_uring_drain(ring, reqs, inflight);
+				errno = errsv;
+				return -1;
+			}
+
+			inflight -= nilfs_uring_reap(ring, reqs, &err);
+		}
+		done += batch;
+	}
+
+	if (unlikely(err)) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+#else /* !HAVE_IO_URING */
+
+struct nilfs_uring *nilfs_uring_create(unsigned int entries)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void nilfs_uring_destroy(struct nilfs_uring *ring)
+{
+}
+
+int nilfs_uring_read(struct nilfs_uring *ring, int fd,
+		     struct nilfs_io_req *reqs, size_t nreqs)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif	/* HAVE_IO_URING */
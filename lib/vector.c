@@ -216,3 +216,56 @@ void *nilfs_vector_insert_elements(struct nilfs_vector *vector,
 	vector->v_nelems += nelems;
 	return vector->v_data + index * vector->v_elemsize;
 }
+
+/**
+ * nilfs_vector_filter - delete elements rejected by a filter function
+ * @vector: vector
+ * @filter: filter function
+ * @arg: argument passed to @filter
+ *
+ * Description: nilfs_vector_filter() calls @filter for each element of
+ * @vector in order, and deletes the elements for which @filter returns
+ * zero.  Elements for which @filter returns a positive value are kept
+ * and packed toward the head of the array preserving their order.  The
+ * array is compacted in a single pass, so the cost is linear in the
+ * number of elements regardless of how deleted elements are scattered.
+ *
+ * If @filter returns a negative value, the iteration is aborted; the
+ * element passed to @filter and all subsequent elements are kept.
+ *
+ * Return Value: On success, the number of deleted elements is returned.
+ * On error, -1 is returned.
+ */
+ssize_t nilfs_vector_filter(struct nilfs_vector *vector,
+			    int (*filter)(void *elem, void *arg), void *arg)
+{
+	const size_t elemsize = vector->v_elemsize;
+	size_t i, j = 0;
+	void *elem;
+	int ret = 0;
+
+	for (i = 0; i < vector->v_nelems; i++) {
+		elem = vector->v_data + elemsize * i;
+		ret = filter(elem, arg);
+		if (unlikely(ret < 0))
+			break;
+		if (ret == 0)
+			continue;
+		if (j < i)
+			memcpy(vector->v_data + elemsize * j, elem, elemsize);
+		j++;
+	}
+
+	if (unlikely(ret < 0)) {
+		/* keep the unprocessed elements */
+		if (j < i)
+			memmove(vector->v_data + elemsize * j,
+				vector->v_data + elemsize * i,
+				(vector->v_nelems - i) * elemsize);
+		vector->v_nelems -= i - j;
+		return -1;
+	}
+
+	vector->v_nelems = j;
+	return i - j;
+}
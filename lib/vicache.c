@@ -0,0 +1,220 @@
+/*
+ * vicache.c - cache of lifetime information of virtual blocks
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * The garbage collector looks up the lifetime (period of checkpoints)
+ * of every virtual block in the segments to be reclaimed with the
+ * GET_VINFO ioctl.  Segments whose cleaning was deferred, failed, or
+ * assessed in a dry run are looked up again in later cycles.  This keeps
+ * the results in a direct-mapped table of bounded size.
+ *
+ * The period of a virtual block changes when the block is overwritten
+ * or deleted, which ends the period, and when its virtual block number
+ * is freed by the garbage collector and then reused by a new block.  A
+ * stale period that still looks alive only keeps a block longer than
+ * needed, but a stale dead period of a reused number would make the
+ * garbage collector discard a live block.  Therefore:
+ *
+ *  - the virtual block numbers freed by cleaning are evicted right after
+ *    the CLEAN_SEGMENTS ioctl (nilfs_vicache_evict()), and
+ *  - the whole cache is discarded when the latest checkpoint number or
+ *    the time of the last non-GC write (ss_nongc_ctime) changes, since a
+ *    number can be reused only by a write that makes a new checkpoint.
+ *    The checkpoint number catches writes within the one-second
+ *    resolution of ss_nongc_ctime and numbers freed by other processes.
+ *    The checkpoint made by our own CLEAN_SEGMENTS ioctl is taken as the
+ *    new baseline instead (nilfs_vicache_rebase()), so that the cache
+ *    survives from one cleaning step to the next.
+ *
+ * Discarding is done in constant time by bumping a generation number
+ * stored with each entry.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <stdio.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_STRING_H
+#include <string.h>	/* memset() */
+#endif	/* HAVE_STRING_H */
+
+#include <errno.h>
+#include "util.h"
+#include "vicache.h"
+
+
+/* Cached lifetime of a virtual block */
+struct nilfs_vicache_entry {
+	uint64_t vblocknr;		/* Virtual block number */
+	uint64_t gen;			/* Generation when cached */
+	struct nilfs_period period;	/* Lifetime of the block */
+};
+
+/* Cache of lifetime information of virtual blocks */
+struct nilfs_vicache {
+	struct nilfs_vicache_entry *entries;
+	size_t mask;			/* Number of entries - 1 */
+	uint64_t gen;			/* Current generation (never 0) */
+	uint64_t nongc_ctime;		/* Last non-GC write time */
+	nilfs_cno_t cno;		/* Latest checkpoint number */
+	int valid;			/* @nongc_ctime and @cno are valid */
+};
+
+/**
+ * nilfs_vicache_create - create a cache of lifetime of virtual blocks
+ * @nentries: maximum number of entries (rounded up to a power of 2)
+ */
+struct nilfs_vicache *nilfs_vicache_create(size_t nentries)
+{
+	struct nilfs_vicache *vicache;
+	size_t size = 1;
+
+	if (unlikely(nentries == 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (size < nentries)
+		size <<= 1;
+
+	vicache = malloc(sizeof(*vicache));
+	if (unlikely(!vicache))
+		return NULL;
+
+	memset(vicache, 0, sizeof(*vicache));
+	vicache->entries = calloc(size, sizeof(*vicache->entries));
+	if (unlikely(!vicache->entries)) {
+		free(vicache);
+		return NULL;
+	}
+	vicache->mask = size - 1;
+	vicache->gen = 1;
+	return vicache;
+}
+
+void nilfs_vicache_destroy(struct nilfs_vicache *vicache)
+{
+	if (vicache) {
+		free(vicache->entries);
+		free(vicache);
+	}
+}
+
+static inline struct nilfs_vicache_entry *
+nilfs_vicache_slot(const struct nilfs_vicache *vicache, uint64_t vblocknr)
+{
+	/* Fibonacci hashing spreads consecutive block numbers */
+	return &vicache->entries[(vblocknr * 0x9e3779b97f4a7c15ULL >> 32) &
+				 vicache->mask];
+}
+
+/**
+ * nilfs_vicache_validate - discard cache if virtual blocks changed
+ * @vicache: vinfo cache
+ * @sustat: current status information on segments
+ * @cno: latest checkpoint number
+ */
+void nilfs_vicache_validate(struct nilfs_vicache *vicache,
+			    const struct nilfs_sustat *sustat, nilfs_cno_t cno)
+{
+	if (!vicache->valid || vicache->nongc_ctime != sustat->ss_nongc_ctime ||
+	    vicache->cno != cno)
+		nilfs_vicache_invalidate_all(vicache);
+
+	vicache->nongc_ctime = sustat->ss_nongc_ctime;
+	vicache->cno = cno;
+	vicache->valid = 1;
+}
+
+/**
+ * nilfs_vicache_lookup - look up lifetime of a virtual block
+ * @vicache: vinfo cache
+ * @vblocknr: virtual block number
+ * @period: place to store the lifetime of the block
+ *
+ * Return Value: 1 if the block was found in the cache, 0 otherwise.
+ */
+int nilfs_vicache_lookup(const struct nilfs_vicache *vicache,
+			 uint64_t vblocknr, struct nilfs_period *period)
+{
+	const struct nilfs_vicache_entry *ent =
+		nilfs_vicache_slot(vicache, vblocknr);
+
+	if (ent->gen != vicache->gen || ent->vblocknr != vblocknr)
+		return 0;
+	*period = ent->period;
+	return 1;
+}
+
+/**
+ * nilfs_vicache_insert - cache lifetime of a virtual block
+ * @vicache: vinfo cache
+ * @vblocknr: virtual block number
+ * @period: lifetime of the block
+ */
+void nilfs_vicache_insert(struct nilfs_vicache *vicache, uint64_t vblocknr,
+			  const struct nilfs_period *period)
+{
+	struct nilfs_vicache_entry *ent = nilfs_vicache_slot(vicache, vblocknr);
+
+	ent->vblocknr = vblocknr;
+	ent->gen = vicache->gen;
+	ent->period = *period;
+}
+
+/**
+ * nilfs_vicache_evict - discard lifetime of freed virtual blocks
+ * @vicache: vinfo cache
+ * @vblocknrs: array of virtual block numbers freed by the kernel
+ * @n: number of virtual block numbers in @vblocknrs
+ */
+void nilfs_vicache_evict(struct nilfs_vicache *vicache,
+			 const uint64_t *vblocknrs, size_t n)
+{
+	struct nilfs_vicache_entry *ent;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		ent = nilfs_vicache_slot(vicache, vblocknrs[i]);
+		if (ent->vblocknr == vblocknrs[i])
+			ent->gen = 0;
+	}
+}
+
+/**
+ * nilfs_vicache_rebase - move past the checkpoint made by cleaning
+ * @vicache: vinfo cache
+ * @sustat: status information on segments after cleaning
+ * @cno: latest checkpoint number after cleaning
+ *
+ * The CLEAN_SEGMENTS ioctl makes one checkpoint, and the numbers it freed
+ * have been evicted.  If no other write was made since the cache was
+ * validated, @cno becomes the checkpoint number that the cache is valid
+ * for.  Otherwise, the cache is discarded.
+ */
+void nilfs_vicache_rebase(struct nilfs_vicache *vicache,
+			  const struct nilfs_sustat *sustat, nilfs_cno_t cno)
+{
+	if (vicache->valid && vicache->nongc_ctime == sustat->ss_nongc_ctime &&
+	    (cno == vicache->cno || cno == vicache->cno + 1))
+		vicache->cno = cno;
+	else
+		nilfs_vicache_invalidate_all(vicache);
+}
+
+/**
+ * nilfs_vicache_invalidate_all - discard all entries of vinfo cache
+ * @vicache: vinfo cache
+ */
+void nilfs_vicache_invalidate_all(struct nilfs_vicache *vicache)
+{
+	vicache->gen++;
+	vicache->valid = 0;
+}
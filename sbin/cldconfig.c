@@ -54,6 +54,7 @@
 #include <errno.h>
 #include <assert.h>
 #include "nilfs.h"
+#include "parser.h"
 #include "util.h"
 #include "cldconfig.h"
 
@@ -130,6 +131,41 @@ static int nilfs_cldconfig_get_ulong_argument(char **tokens, size_t ntoks,
 	return 0;
 }
 
+static int nilfs_cldconfig_get_ulong_range_argument(char **tokens,
+						    size_t ntoks,
+						    unsigned long max,
+						    unsigned long *nump)
+{
+	unsigned long num;
+
+	if (nilfs_cldconfig_get_ulong_argument(tokens, ntoks, &num) < 0)
+		return -1;
+
+	if (num > max) {
+		syslog(LOG_WARNING, "%s: %s: too large, use the maximum value",
+		       tokens[0], tokens[1]);
+		num = max;
+	}
+	*nump = num;
+	return 0;
+}
+
+static int nilfs_cldconfig_handle_path(char **tokens, size_t ntoks,
+				       char *path, size_t size)
+{
+	if (strcmp(tokens[1], "none") == 0) {
+		path[0] = '\0';
+		return 0;
+	}
+	if (tokens[1][0] != '/' || strlen(tokens[1]) >= size) {
+		syslog(LOG_WARNING, "%s: %s: invalid pathname", tokens[0],
+		       tokens[1]);
+		return 0;
+	}
+	strcpy(path, tokens[1]);
+	return 0;
+}
+
 static int nilfs_cldconfig_get_time_argument(char **tokens, size_t ntoks,
 					     struct timespec *ts)
 {
@@ -362,6 +398,19 @@ nilfs_cldconfig_handle_max_clean_segments(struct nilfs_cldconfig *config,
 	return 0;
 }
 
+static int
+nilfs_cldconfig_handle_target_clean_segments(struct nilfs_cldconfig *config,
+					     char **tokens, size_t ntoks,
+					     struct nilfs *nilfs)
+{
+	struct nilfs_param param;
+
+	if (nilfs_cldconfig_get_size_argument(tokens, ntoks, &param) == 0)
+		config->cf_target_clean_segments =
+			nilfs_convert_size_to_nsegments(nilfs, &param);
+	return 0;
+}
+
 static int
 nilfs_cldconfig_handle_clean_check_interval(struct nilfs_cldconfig *config,
 					    char **tokens, size_t ntoks,
@@ -379,9 +428,27 @@ nilfs_cldconfig_handle_selection_policy_timestamp(struct nilfs_cldconfig *cf,
 	return 0;
 }
 
+static int
+nilfs_cldconfig_handle_selection_policy_greedy(struct nilfs_cldconfig *cf,
+					       char **tokens, size_t ntoks)
+{
+	cf->cf_selection_policy = NILFS_SELECTION_POLICY_GREEDY;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_selection_policy_cost_benefit(
+	struct nilfs_cldconfig *cf, char **tokens, size_t ntoks)
+{
+	cf->cf_selection_policy = NILFS_SELECTION_POLICY_COST_BENEFIT;
+	return 0;
+}
+
 static const struct nilfs_cldconfig_polhandle
 nilfs_cldconfig_polhandle_table[] = {
 	{"timestamp",	nilfs_cldconfig_handle_selection_policy_timestamp},
+	{"greedy",	nilfs_cldconfig_handle_selection_policy_greedy},
+	{"cost-benefit", nilfs_cldconfig_handle_selection_policy_cost_benefit},
 };
 
 #define NILFS_CLDCONFIG_NPOLHANDLES			\
@@ -413,16 +480,10 @@ nilfs_cldconfig_handle_nsegments_per_clean(struct nilfs_cldconfig *config,
 {
 	unsigned long n;
 
-	if (nilfs_cldconfig_get_ulong_argument(tokens, ntoks, &n) < 0)
-		return 0;
-
-	if (n > NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX) {
-		syslog(LOG_WARNING, "%s: %s: too large, use the maximum value",
-		       tokens[0], tokens[1]);
-		n = NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX;
-	}
-
-	config->cf_nsegments_per_clean = n;
+	if (nilfs_cldconfig_get_ulong_range_argument(
+		    tokens, ntoks, NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX,
+		    &n) == 0)
+		config->cf_nsegments_per_clean = n;
 	return 0;
 }
 
@@ -433,16 +494,10 @@ nilfs_cldconfig_handle_mc_nsegments_per_clean(struct nilfs_cldconfig *config,
 {
 	unsigned long n;
 
-	if (nilfs_cldconfig_get_ulong_argument(tokens, ntoks, &n) < 0)
-		return 0;
-
-	if (n > NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX) {
-		syslog(LOG_WARNING, "%s: %s: too large, use the maximum value",
-		       tokens[0], tokens[1]);
-		n = NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX;
-	}
-
-	config->cf_mc_nsegments_per_clean = n;
+	if (nilfs_cldconfig_get_ulong_range_argument(
+		    tokens, ntoks, NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX,
+		    &n) == 0)
+		config->cf_mc_nsegments_per_clean = n;
 	return 0;
 }
 
@@ -536,6 +591,170 @@ static int nilfs_cldconfig_handle_use_set_suinfo(struct nilfs_cldconfig *config,
 	return 0;
 }
 
+static int nilfs_cldconfig_handle_use_io_uring(struct nilfs_cldconfig *config,
+					       char **tokens, size_t ntoks,
+					       struct nilfs *nilfs)
+{
+	config->cf_use_io_uring = 1;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_segment_readahead(struct nilfs_cldconfig *config,
+					 char **tokens, size_t ntoks,
+					 struct nilfs *nilfs)
+{
+	unsigned long n;
+
+	if (nilfs_cldconfig_get_ulong_range_argument(
+		    tokens, ntoks, NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX,
+		    &n) == 0)
+		config->cf_segment_readahead = n;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_live_block_sampling(struct nilfs_cldconfig *config,
+					   char **tokens, size_t ntoks,
+					   struct nilfs *nilfs)
+{
+	unsigned long n;
+
+	if (nilfs_cldconfig_get_ulong_range_argument(
+		    tokens, ntoks, NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX,
+		    &n) == 0)
+		config->cf_live_block_sampling = n;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_liveness_index_directory(
+	struct nilfs_cldconfig *config, char **tokens, size_t ntoks,
+	struct nilfs *nilfs)
+{
+	return nilfs_cldconfig_handle_path(
+		tokens, ntoks, config->cf_liveness_index_directory,
+		sizeof(config->cf_liveness_index_directory));
+}
+
+static int
+nilfs_cldconfig_handle_vinfo_cache_size(struct nilfs_cldconfig *config,
+					char **tokens, size_t ntoks,
+					struct nilfs *nilfs)
+{
+	unsigned long n;
+
+	if (nilfs_cldconfig_get_ulong_range_argument(
+		    tokens, ntoks, NILFS_CLDCONFIG_VINFO_CACHE_SIZE_MAX,
+		    &n) == 0)
+		config->cf_vinfo_cache_size = n;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_pipelined_cleaning(struct nilfs_cldconfig *config,
+					  char **tokens, size_t ntoks,
+					  struct nilfs *nilfs)
+{
+	config->cf_pipelined_cleaning = 1;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_io_throttle_utilization(struct nilfs_cldconfig *config,
+					       char **tokens, size_t ntoks,
+					       struct nilfs *nilfs)
+{
+	unsigned long n;
+
+	if (nilfs_cldconfig_get_ulong_range_argument(tokens, ntoks, 100,
+						     &n) == 0)
+		config->cf_io_throttle_utilization = n;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_io_throttle_stat_file(struct nilfs_cldconfig *config,
+					     char **tokens, size_t ntoks,
+					     struct nilfs *nilfs)
+{
+	return nilfs_cldconfig_handle_path(
+		tokens, ntoks, config->cf_io_throttle_stat_file,
+		sizeof(config->cf_io_throttle_stat_file));
+}
+
+static int
+nilfs_cldconfig_handle_adaptive_cleaning(struct nilfs_cldconfig *config,
+					 char **tokens, size_t ntoks,
+					 struct nilfs *nilfs)
+{
+	config->cf_adaptive_cleaning = 1;
+	return 0;
+}
+
+static int nilfs_cldconfig_get_bytes_argument(char **tokens, size_t ntoks,
+					      unsigned long long *bytes)
+{
+	if (nilfs_parse_size(tokens[1], bytes) < 0) {
+		syslog(LOG_WARNING, "%s: %s: %s", tokens[0], tokens[1],
+		       errno == ERANGE ? "number too large" :
+		       "bad expression");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_reclaim_memory_budget(struct nilfs_cldconfig *config,
+					     char **tokens, size_t ntoks,
+					     struct nilfs *nilfs)
+{
+	unsigned long long bytes;
+
+	if (nilfs_cldconfig_get_bytes_argument(tokens, ntoks, &bytes) == 0)
+		config->cf_reclaim_memory_budget = bytes;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_gc_bandwidth(char **tokens, size_t ntoks,
+				    unsigned long long *bandwidth)
+{
+	unsigned long long bytes;
+
+	if (nilfs_cldconfig_get_bytes_argument(tokens, ntoks, &bytes) == 0)
+		*bandwidth = bytes;
+	return 0;
+}
+
+static int
+nilfs_cldconfig_handle_gc_read_bandwidth(struct nilfs_cldconfig *config,
+					 char **tokens, size_t ntoks,
+					 struct nilfs *nilfs)
+{
+	return nilfs_cldconfig_handle_gc_bandwidth(
+		tokens, ntoks, &config->cf_gc_read_bandwidth);
+}
+
+static int
+nilfs_cldconfig_handle_gc_write_bandwidth(struct nilfs_cldconfig *config,
+					  char **tokens, size_t ntoks,
+					  struct nilfs *nilfs)
+{
+	return nilfs_cldconfig_handle_gc_bandwidth(
+		tokens, ntoks, &config->cf_gc_write_bandwidth);
+}
+
+static int
+nilfs_cldconfig_handle_metrics_directory(struct nilfs_cldconfig *config,
+					 char **tokens, size_t ntoks,
+					 struct nilfs *nilfs)
+{
+	return nilfs_cldconfig_handle_path(
+		tokens, ntoks, config->cf_metrics_directory,
+		sizeof(config->cf_metrics_directory));
+}
+
 static const struct nilfs_cldconfig_log_priority
 nilfs_cldconfig_log_priority_table[] = {
 	{"emerg",	LOG_EMERG},
@@ -631,6 +850,62 @@ nilfs_cldconfig_keyword_table[] = {
 		"use_set_suinfo", 1, 1,
 		nilfs_cldconfig_handle_use_set_suinfo
 	},
+	{
+		"segment_readahead", 2, 2,
+		nilfs_cldconfig_handle_segment_readahead
+	},
+	{
+		"use_io_uring", 1, 1,
+		nilfs_cldconfig_handle_use_io_uring
+	},
+	{
+		"live_block_sampling", 2, 2,
+		nilfs_cldconfig_handle_live_block_sampling
+	},
+	{
+		"liveness_index_directory", 2, 2,
+		nilfs_cldconfig_handle_liveness_index_directory
+	},
+	{
+		"vinfo_cache_size", 2, 2,
+		nilfs_cldconfig_handle_vinfo_cache_size
+	},
+	{
+		"reclaim_memory_budget", 2, 2,
+		nilfs_cldconfig_handle_reclaim_memory_budget
+	},
+	{
+		"pipelined_cleaning", 1, 1,
+		nilfs_cldconfig_handle_pipelined_cleaning
+	},
+	{
+		"adaptive_cleaning", 1, 1,
+		nilfs_cldconfig_handle_adaptive_cleaning
+	},
+	{
+		"target_clean_segments", 2, 2,
+		nilfs_cldconfig_handle_target_clean_segments
+	},
+	{
+		"io_throttle_utilization", 2, 2,
+		nilfs_cldconfig_handle_io_throttle_utilization
+	},
+	{
+		"io_throttle_stat_file", 2, 2,
+		nilfs_cldconfig_handle_io_throttle_stat_file
+	},
+	{
+		"gc_read_bandwidth", 2, 2,
+		nilfs_cldconfig_handle_gc_read_bandwidth
+	},
+	{
+		"gc_write_bandwidth", 2, 2,
+		nilfs_cldconfig_handle_gc_write_bandwidth
+	},
+	{
+		"metrics_directory", 2, 2,
+		nilfs_cldconfig_handle_metrics_directory
+	},
 };
 
 static int nilfs_cldconfig_handle_keyword(struct nilfs_cldconfig *config,
@@ -703,6 +978,28 @@ static void nilfs_cldconfig_set_default(struct nilfs_cldconfig *config,
 	param.unit = NILFS_CLDCONFIG_MC_MIN_RECLAIMABLE_BLOCKS_UNIT;
 	config->cf_mc_min_reclaimable_blocks =
 		nilfs_convert_size_to_blocks_per_segment(nilfs, &param);
+
+	config->cf_segment_readahead = NILFS_CLDCONFIG_SEGMENT_READAHEAD;
+	config->cf_use_io_uring = NILFS_CLDCONFIG_USE_IO_URING;
+	config->cf_live_block_sampling = NILFS_CLDCONFIG_LIVE_BLOCK_SAMPLING;
+	config->cf_liveness_index_directory[0] = '\0';
+	config->cf_vinfo_cache_size = NILFS_CLDCONFIG_VINFO_CACHE_SIZE;
+	config->cf_reclaim_memory_budget =
+		NILFS_CLDCONFIG_RECLAIM_MEMORY_BUDGET;
+	config->cf_pipelined_cleaning = NILFS_CLDCONFIG_PIPELINED_CLEANING;
+	config->cf_adaptive_cleaning = NILFS_CLDCONFIG_ADAPTIVE_CLEANING;
+
+	param.num = NILFS_CLDCONFIG_TARGET_CLEAN_SEGMENTS;
+	param.unit = NILFS_CLDCONFIG_TARGET_CLEAN_SEGMENTS_UNIT;
+	config->cf_target_clean_segments =
+		nilfs_convert_size_to_nsegments(nilfs, &param);
+
+	config->cf_io_throttle_utilization =
+		NILFS_CLDCONFIG_IO_THROTTLE_UTILIZATION;
+	config->cf_io_throttle_stat_file[0] = '\0';
+	config->cf_gc_read_bandwidth = NILFS_CLDCONFIG_GC_READ_BANDWIDTH;
+	config->cf_gc_write_bandwidth = NILFS_CLDCONFIG_GC_WRITE_BANDWIDTH;
+	config->cf_metrics_directory[0] = '\0';
 }
 
 static inline int iseol(int c)
@@ -19,6 +19,7 @@
 #endif	/* HAVE_TIME_H */
 
 #include <stdint.h>	/* uint64_t */
+#include <limits.h>	/* PATH_MAX */
 #include <syslog.h>
 
 /**
@@ -71,6 +72,31 @@ enum nilfs_size_unit {
  * @cf_min_reclaimable_blocks: minimum reclaimable blocks for cleaning
  * @cf_mc_min_reclaimable_blocks: minimum reclaimable blocks for cleaning
  * if clean segments < min_clean_segments
+ * @cf_segment_readahead: number of segments read ahead during cleaning
+ * @cf_use_io_uring: flag that indicates the use of io_uring for raw reads
+ * @cf_live_block_sampling: number of candidate segments whose live blocks
+ * are counted before selection
+ * @cf_liveness_index_directory: pathname of the directory of liveness
+ * index files (empty if in memory)
+ * @cf_vinfo_cache_size: number of entries of vinfo cache
+ * @cf_reclaim_memory_budget: upper limit in bytes of memory used for
+ * block descriptors per cleaning step (0 if unlimited)
+ * @cf_pipelined_cleaning: flag that indicates that segments of the next
+ * cleaning step are read while the current step is cleaned
+ * @cf_adaptive_cleaning: flag that indicates that the number of segments
+ * per clean cycle and the cleaning interval are set by a controller
+ * @cf_target_clean_segments: number of free segments that the controller
+ * aims to keep
+ * @cf_io_throttle_utilization: utilization of the device by other I/O in
+ * percent above which cleaning is held back (0 if disabled)
+ * @cf_io_throttle_stat_file: pathname of the I/O statistics file of the
+ * device (empty if derived from the device)
+ * @cf_gc_read_bandwidth: upper limit in bytes per second of reads by
+ * garbage collection (0 if unlimited)
+ * @cf_gc_write_bandwidth: upper limit in bytes per second of writes by
+ * garbage collection (0 if unlimited)
+ * @cf_metrics_directory: pathname of the directory where metrics are
+ * written (empty if disabled)
  */
 struct nilfs_cldconfig {
 	int cf_selection_policy;
@@ -88,10 +114,26 @@ struct nilfs_cldconfig {
 	int cf_log_priority;
 	unsigned long cf_min_reclaimable_blocks;
 	unsigned long cf_mc_min_reclaimable_blocks;
+	unsigned long cf_segment_readahead;
+	int cf_use_io_uring;
+	unsigned long cf_live_block_sampling;
+	char cf_liveness_index_directory[PATH_MAX];
+	unsigned long cf_vinfo_cache_size;
+	unsigned long long cf_reclaim_memory_budget;
+	int cf_pipelined_cleaning;
+	int cf_adaptive_cleaning;
+	uint64_t cf_target_clean_segments;
+	unsigned long cf_io_throttle_utilization;
+	char cf_io_throttle_stat_file[PATH_MAX];
+	unsigned long long cf_gc_read_bandwidth;
+	unsigned long long cf_gc_write_bandwidth;
+	char cf_metrics_directory[PATH_MAX];
 };
 
 enum nilfs_selection_policy {
 	NILFS_SELECTION_POLICY_TIMESTAMP = 0,
+	NILFS_SELECTION_POLICY_GREEDY,
+	NILFS_SELECTION_POLICY_COST_BENEFIT,
 	__NR_NILFS_SELECTION_POLICY
 };
 
@@ -113,8 +155,24 @@ enum nilfs_selection_policy {
 #define NILFS_CLDCONFIG_MIN_RECLAIMABLE_BLOCKS_UNIT	NILFS_SIZE_UNIT_PERCENT
 #define NILFS_CLDCONFIG_MC_MIN_RECLAIMABLE_BLOCKS	1
 #define NILFS_CLDCONFIG_MC_MIN_RECLAIMABLE_BLOCKS_UNIT	NILFS_SIZE_UNIT_PERCENT
+#define NILFS_CLDCONFIG_SEGMENT_READAHEAD		0
+#define NILFS_CLDCONFIG_USE_IO_URING			0
+#define NILFS_CLDCONFIG_LIVE_BLOCK_SAMPLING		0
+#define NILFS_CLDCONFIG_VINFO_CACHE_SIZE		65536
+#define NILFS_CLDCONFIG_VINFO_CACHE_SIZE_MAX		(1UL << 24)
+#define NILFS_CLDCONFIG_RECLAIM_MEMORY_BUDGET		0
+#define NILFS_CLDCONFIG_PIPELINED_CLEANING		0
+#define NILFS_CLDCONFIG_ADAPTIVE_CLEANING		0
+#define NILFS_CLDCONFIG_TARGET_CLEAN_SEGMENTS		15
+#define NILFS_CLDCONFIG_TARGET_CLEAN_SEGMENTS_UNIT	NILFS_SIZE_UNIT_PERCENT
+#define NILFS_CLDCONFIG_IO_THROTTLE_UTILIZATION		0
+#define NILFS_CLDCONFIG_GC_READ_BANDWIDTH		0
+#define NILFS_CLDCONFIG_GC_WRITE_BANDWIDTH		0
 
 #define NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX	32
+/* segments selected per step with pipelined cleaning, next ones included */
+#define NILFS_CLDCONFIG_NSEGMENTS_SELECT_MAX	\
+	(2 * NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX)
 
 struct nilfs;
 
@@ -25,6 +25,10 @@
 #include <unistd.h>
 #endif	/* HAVE_UNISTD_H */
 
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif	/* HAVE_FCNTL_H */
+
 #if HAVE_ERR_H
 #include <err.h>
 #endif	/* HAVE_ERR_H */
@@ -45,6 +49,10 @@
 #include <sys/stat.h>
 #endif	/* HAVE_SYS_STAT_H */
 
+#if HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>	/* major(), minor() */
+#endif	/* HAVE_SYS_SYSMACROS_H */
+
 #if HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif	/* HAVE_SYS_TIME */
@@ -66,22 +74,28 @@
 #endif	/* HAVE_POLL_H */
 
 #include <errno.h>
+#include <stdarg.h>	/* va_start, va_end, vsyslog */
 #include <signal.h>
 #include <setjmp.h>
 #include <assert.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include "nilfs.h"
 #include "compat.h"
 #include "nilfs2_ondisk.h"	/* NILFS_MIN_NRSVSEGS */
 #include "util.h"
-#include "vector.h"
 #include "nilfs_gc.h"
 #include "nilfs_cleaner.h"
 #include "cleaner_msg.h"
 #include "cldconfig.h"
+#include "segheap.h"
 #include "cnormap.h"
+#include "sucache.h"
+#include "liveidx.h"
+#include "vicache.h"
 #include "realpath.h"
 
+extern int check_mount(const char *device);
 
 #ifndef SYSCONFDIR
 #define SYSCONFDIR		"/etc"
@@ -93,7 +107,9 @@
 #include <getopt.h>
 static const struct option long_option[] = {
 	{"conffile", required_argument, NULL, 'c'},
+	{"max-active", required_argument, NULL, 'a'},
 	{"help", no_argument, NULL, 'h'},
+	{"multi", no_argument, NULL, 'm'},
 	/* nofork option is obsolete. It does nothing even if passed */
 	{"nofork", no_argument, NULL, 'n'},
 	{"protection-period", required_argument, NULL, 'p'},
@@ -101,22 +117,181 @@ static const struct option long_option[] = {
 	{NULL, 0, NULL, 0}
 };
 #define NILFS_CLEANERD_OPTIONS	\
+	"  -a, --max-active=COUNT\tmax. number of devices cleaned at a time\n" \
 	"  -c, --conffile\tspecify configuration file\n"	\
 	"  -h, --help    \tdisplay this help and exit\n"	\
+	"  -m, --multi   \tclean all the devices given\n"	\
 	"  -p, --protection-period\tspecify protection period\n" \
 	"  -V, --version \tprint version and exit\n"
 #else	/* !_GNU_SOURCE */
 #define NILFS_CLEANERD_OPTIONS	\
+	"  -a COUNT      \tmax. number of devices cleaned at a time\n" \
 	"  -c            \tspecify configuration file\n"	\
 	"  -h            \tdisplay this help and exit\n"	\
+	"  -m            \tclean all the devices given\n"	\
 	"  -p            \tspecify protection period\n"		\
 	"  -V            \tprint version and exit\n"
 #endif	/* _GNU_SOURCE */
 
+/**
+ * struct nilfs_cleanerd_rate - state of the cleaning rate controller
+ * @last: time of the last update (monotonic)
+ * @ncleansegs: number of clean segments at the last update
+ * @nongc_ctime: creation time of the last log written by users at the
+ * last update
+ * @gain: net number of segments freed by cleaning since the last update
+ * @write_rate: smoothed number of segments consumed by users per second
+ * @efficiency: smoothed fraction of the blocks of cleaned segments that
+ * were reclaimed
+ * @clean_rate: number of segments to be cleaned per second
+ */
+struct nilfs_cleanerd_rate {
+	struct timespec last;
+	uint64_t ncleansegs;
+	uint64_t nongc_ctime;
+	double gain;
+	double write_rate;
+	double efficiency;
+	double clean_rate;
+};
+
+/**
+ * struct nilfs_cleanerd_throttle - state of the foreground I/O throttle
+ * @path: I/O statistics file of the device, or NULL if disabled
+ * @valid: flag that indicates that @last and @io_ticks hold a sample
+ * @last: time of the last sample (monotonic)
+ * @io_ticks: milliseconds the device has spent doing I/O, at @last
+ * @in_flight: number of requests in flight at @last
+ * @utilization: utilization of the device in percent while the cleaner
+ * was idle
+ * @ndelays: number of steps delayed in a row
+ * @nsegs_limit: upper limit of segments cleaned at this step (0 if none)
+ * @delayed_steps: number of delayed steps
+ * @shrunk_steps: number of shrunk steps
+ */
+struct nilfs_cleanerd_throttle {
+	char *path;
+	int valid;
+	struct timespec last;
+	unsigned long long io_ticks;
+	unsigned long in_flight;
+	unsigned long utilization;
+	int ndelays;
+	long nsegs_limit;
+	uint64_t delayed_steps;
+	uint64_t shrunk_steps;
+};
+
+/**
+ * struct nilfs_cleanerd_bucket - token bucket of garbage collection I/O
+ * @rate: bytes added to the bucket per second (0 if unlimited)
+ * @tokens: bytes available; negative while an overdraft is paid back
+ * @last: time tokens were last added (monotonic)
+ * @cost: smoothed number of bytes per cleaned segment
+ */
+struct nilfs_cleanerd_bucket {
+	unsigned long long rate;
+	double tokens;
+	struct timespec last;
+	double cost;
+};
+
+/* upper bounds in seconds of the buckets of latency histograms */
+static const double nilfs_cleanerd_latency_bounds[] = {
+	0.01, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0
+};
+
+#define NILFS_CLEANERD_NR_LATENCY_BUCKETS \
+	(ARRAY_SIZE(nilfs_cleanerd_latency_bounds) + 1)
+
+/**
+ * struct nilfs_cleanerd_histogram - histogram of durations
+ * @counts: number of durations per bucket; the last bucket counts the
+ * ones above all bounds
+ * @sum: sum of durations in seconds
+ */
+struct nilfs_cleanerd_histogram {
+	uint64_t counts[NILFS_CLEANERD_NR_LATENCY_BUCKETS];
+	double sum;
+};
+
+/**
+ * struct nilfs_cleanerd_metrics - counters exported to the metrics file
+ * @path: pathname of the metrics file, or NULL if disabled
+ * @failed: flag that indicates that the last write failed
+ * @last: time of the last write (monotonic)
+ * @selected_segs: number of segments selected to be cleaned
+ * @cleaned_segs: number of cleaned segments
+ * @deferred_segs: number of deferred segments
+ * @protected_segs: number of selected segments found protected
+ * @live_blks: number of live blocks moved by cleaning
+ * @defunct_blks: number of blocks reclaimed by cleaning
+ * @last_clean: time of the last step that cleaned segments (0 if none)
+ * @select_latency: durations of segment selection
+ * @clean_latency: durations of cleaning steps
+ */
+struct nilfs_cleanerd_metrics {
+	char *path;
+	int failed;
+	struct timespec last;
+	uint64_t selected_segs;
+	uint64_t cleaned_segs;
+	uint64_t deferred_segs;
+	uint64_t protected_segs;
+	uint64_t live_blks;
+	uint64_t defunct_blks;
+	time_t last_clean;
+	struct nilfs_cleanerd_histogram select_latency;
+	struct nilfs_cleanerd_histogram clean_latency;
+};
+
+/**
+ * struct nilfs_cleanerd_pool - volumes served by a multi-volume daemon
+ * @vols: cleanerd objects of the volumes
+ * @nvols: number of volumes in @vols
+ * @nslots: number of volumes that may be cleaned at a time
+ * @nactive: number of volumes holding a slot
+ * @lock: lock of the pool and of the scheduling state of the volumes
+ * @cond: condition signalled when a step is queued or the workers stop
+ * @queue: volumes whose steps are due, in order of urgency
+ * @nqueued: number of volumes in @queue
+ * @threads: worker threads running the steps
+ * @nthreads: number of threads in @threads
+ * @stop: flag that tells the workers to exit
+ * @wakefd: pipe through which the workers wake up the main loop
+ */
+struct nilfs_cleanerd_pool {
+	struct nilfs_cleanerd **vols;
+	size_t nvols;
+	int nslots;
+	int nactive;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct nilfs_cleanerd **queue;
+	size_t nqueued;
+	pthread_t *threads;
+	int nthreads;
+	int stop;
+	int wakefd[2];
+};
+
 /**
  * struct nilfs_cleanerd - nilfs cleaner daemon
  * @nilfs: nilfs object
  * @cnormap: checkpoint number reverse mapper
+ * @sucache: cache of segment usage information
+ * @liveidx: index of live block counts of segments
+ * @liveidx_path: pathname of the file of @liveidx (NULL if in memory)
+ * @vicache: cache of virtual block lifetimes (NULL if disabled)
+ * @vicache_size: number of entries of @vicache
+ * @vinfo_hits: number of virtual blocks found in @vicache
+ * @vinfo_misses: number of virtual blocks looked up with GET_VINFO
+ * @reclaim_peak_mem: peak size in bytes of memory used for block
+ * descriptors in a cleaning step
+ * @prep: blocks of the next segments collected in advance (NULL if none)
+ * @prepared_segs: number of segments whose blocks were taken from @prep
+ * @phases: time spent in each phase of cleaning (NILFS_RECLAIM_PHASE_*)
+ * @bytes_read: number of bytes of segment summaries read
  * @config: config structure
  * @conffile: configuration file name
  * @running: running state
@@ -129,6 +304,28 @@ static const struct option long_option[] = {
  * @timeout: timeout value for sleeping
  * @min_reclaimable_blocks: min. number of reclaimable blocks
  * @prev_nongc_ctime: previous nongc ctime
+ * @rate: state of the cleaning rate controller
+ * @throttle: state of the foreground I/O throttle
+ * @read_bucket: budget of bytes read by garbage collection
+ * @write_bucket: budget of bytes written by garbage collection
+ * @budget_nsegs_limit: upper limit of segments cleaned at this step
+ * within the I/O budget (0 if none)
+ * @budget_delayed_steps: number of steps delayed to stay within the I/O
+ * budget
+ * @metrics: counters exported to the metrics file
+ * @pool: pool of volumes served by the same daemon (NULL if none)
+ * @active: flag that indicates that the volume holds a slot of @pool
+ * @nsteps: number of steps run since the slot of @pool was acquired
+ * @waiting: flag that indicates that the volume waits for a slot of @pool
+ * @kicked: flag that requests the next step without waiting for @wakeup
+ * @wakeup: time of the next step in a multi-volume daemon (monotonic)
+ * @busy: flag that indicates that a step of the volume is queued or
+ * running on a worker thread of @pool
+ * @reload_req: configuration reload requested by a signal
+ * @dump_req: dump requested by a signal
+ * @free_ratio: ratio of clean segments found at the last step
+ * @short_of_space: flag that indicates that the volume had fewer clean
+ * segments than min_clean_segments at the last step
  * @recvq: receive queue
  * @recvq_name: receive queue name
  * @sendq: send queue
@@ -146,6 +343,18 @@ static const struct option long_option[] = {
 struct nilfs_cleanerd {
 	struct nilfs *nilfs;
 	struct nilfs_cnormap *cnormap;
+	struct nilfs_sucache *sucache;
+	struct nilfs_liveidx *liveidx;
+	char *liveidx_path;
+	struct nilfs_vicache *vicache;
+	unsigned long vicache_size;
+	uint64_t vinfo_hits;
+	uint64_t vinfo_misses;
+	size_t reclaim_peak_mem;
+	struct nilfs_reclaim_prep *prep;
+	uint64_t prepared_segs;
+	struct nilfs_reclaim_phase phases[NILFS_RECLAIM_NR_PHASES];
+	uint64_t bytes_read;
 	struct nilfs_cldconfig config;
 	char *conffile;
 	int running;
@@ -159,6 +368,24 @@ struct nilfs_cleanerd {
 	struct timespec timeout;
 	unsigned long min_reclaimable_blocks;
 	uint64_t prev_nongc_ctime;
+	struct nilfs_cleanerd_rate rate;
+	struct nilfs_cleanerd_throttle throttle;
+	struct nilfs_cleanerd_bucket read_bucket;
+	struct nilfs_cleanerd_bucket write_bucket;
+	long budget_nsegs_limit;
+	uint64_t budget_delayed_steps;
+	struct nilfs_cleanerd_metrics metrics;
+	struct nilfs_cleanerd_pool *pool;
+	int active;
+	int nsteps;
+	int waiting;
+	int kicked;
+	struct timespec wakeup;
+	int busy;
+	int reload_req;
+	int dump_req;
+	double free_ratio;
+	int short_of_space;
 	mqd_t recvq;
 	char *recvq_name;
 	mqd_t sendq;
@@ -173,26 +400,26 @@ struct nilfs_cleanerd {
 	unsigned long mm_min_reclaimable_blocks;
 };
 
-/**
- * struct nilfs_segimp - segment importance
- * @si_segnum: segment number
- * @si_importance: importance of segment
- */
-struct nilfs_segimp {
-	uint64_t si_segnum;
-	long long si_importance;
-};
-
 /* command line option value */
 static unsigned long protection_period;
 
 /* global variables */
-static struct nilfs_cleanerd *nilfs_cleanerd;
+static __thread struct nilfs_cleanerd *nilfs_cleanerd;
+static struct nilfs_cleanerd_pool nilfs_cleanerd_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.wakefd = { -1, -1 },
+};
 static sigjmp_buf nilfs_cleanerd_env; /* for siglongjmp */
 static volatile sig_atomic_t nilfs_cleanerd_reload_config; /* reload flag */
 static volatile sig_atomic_t nilfs_cleanerd_dump_req; /* dump request */
+static volatile sig_atomic_t nilfs_cleanerd_exit_req; /* exit request */
 static char nilfs_cleanerd_msgbuf[NILFS_CLEANER_MSG_MAX_REQSZ];
 
+static const char *nilfs_selection_policy_name[] = {
+	"timestamp", "greedy", "cost-benefit"
+};
+
 static const char *nilfs_cleaner_cmd_name[] = {
 	"get-status", "run", "suspend", "resume", "tune", "reload", "wait",
 	"stop", "shutdown"
@@ -206,10 +433,11 @@ static void nilfs_cleanerd_version(const char *progname)
 static void nilfs_cleanerd_usage(const char *progname)
 {
 	fprintf(stderr,
-		"Usage: %s [option]... dev\n"
+		"Usage: %s [option]... dev [dir]\n"
+		"       %s [option]... -m dev...\n"
 		"%s options:\n"
 		NILFS_CLEANERD_OPTIONS,
-		progname, progname);
+		progname, progname, progname);
 }
 
 static void nilfs_cleanerd_set_log_priority(struct nilfs_cleanerd *cleanerd)
@@ -217,10 +445,78 @@ static void nilfs_cleanerd_set_log_priority(struct nilfs_cleanerd *cleanerd)
 	setlogmask(LOG_UPTO(cleanerd->config.cf_log_priority));
 }
 
+/**
+ * nilfs_cleanerd_vlog - log a message about a volume
+ * @cleanerd: cleanerd object
+ * @priority: priority of the message
+ * @fmt: format of the message
+ * @args: arguments of @fmt
+ *
+ * A daemon serving many volumes prefixes the message with the device of
+ * the volume.
+ */
+static void nilfs_cleanerd_vlog(const struct nilfs_cleanerd *cleanerd,
+				int priority, const char *fmt, va_list args)
+{
+	char buf[PATH_MAX + 256];
+	const char *dev;
+	size_t len = 0;
+	int errsv = errno;	/* for %m */
+
+	if (!cleanerd || !cleanerd->pool)
+		goto out;
+
+	for (dev = nilfs_get_dev(cleanerd->nilfs); *dev; dev++) {
+		if (len + 2 >= sizeof(buf))
+			goto out;
+		if (*dev == '%')
+			buf[len++] = '%';
+		buf[len++] = *dev;
+	}
+	if (snprintf(buf + len, sizeof(buf) - len, ": %s", fmt) <
+	    sizeof(buf) - len)
+		fmt = buf;
+out:
+	errno = errsv;
+	vsyslog(priority, fmt, args);
+}
+
+static void nilfs_cleanerd_log(const struct nilfs_cleanerd *cleanerd,
+			       int priority, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	nilfs_cleanerd_vlog(cleanerd, priority, fmt, args);
+	va_end(args);
+}
+
+/* logger of the GC library, which reports on the volume being cleaned */
+static void nilfs_cleanerd_gc_logger(int priority, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	nilfs_cleanerd_vlog(nilfs_cleanerd, priority, fmt, args);
+	va_end(args);
+}
+
+static const char * const nilfs_reclaim_phase_names[] = {
+	[NILFS_RECLAIM_PHASE_READ]	= "read",
+	[NILFS_RECLAIM_PHASE_PARSE]	= "parse",
+	[NILFS_RECLAIM_PHASE_VINFO]	= "vinfo",
+	[NILFS_RECLAIM_PHASE_SNAPSHOT]	= "snapshot",
+	[NILFS_RECLAIM_PHASE_TOSS]	= "toss",
+	[NILFS_RECLAIM_PHASE_BDESC]	= "bdesc",
+	[NILFS_RECLAIM_PHASE_CLEAN]	= "clean",
+};
+
 static void nilfs_cleanerd_dump(struct nilfs_cleanerd *cleanerd)
 {
+	struct nilfs_sucache_stat scstat;
+	const struct nilfs_reclaim_phase *ph;
 	struct timespec ts;
-	int ret;
+	int ret, i;
 
 	syslog(LOG_DEBUG, "============== nilfs_cleanerd dump ==============");
 	ret = clock_gettime(CLOCK_REALTIME, &ts);
@@ -236,11 +532,26 @@ skip_current_time:
 
 skip_monotonic_clock:
 	syslog(LOG_DEBUG, "---------------- cleanerd state -----------------");
+	syslog(LOG_DEBUG, "device: %s", nilfs_get_dev(cleanerd->nilfs));
+	syslog(LOG_DEBUG, "selection_policy: %s",
+	       nilfs_selection_policy_name[
+		       cleanerd->config.cf_selection_policy]);
+	syslog(LOG_DEBUG, "live_block_sampling: %lu",
+	       cleanerd->config.cf_live_block_sampling);
+	syslog(LOG_DEBUG, "liveness_index: %s",
+	       cleanerd->liveidx_path ? : "(memory)");
 	syslog(LOG_DEBUG, "running: %d", cleanerd->running);
 	syslog(LOG_DEBUG, "fallback: %d", cleanerd->fallback);
 	syslog(LOG_DEBUG, "retry_cleaning: %d", cleanerd->retry_cleaning);
 	syslog(LOG_DEBUG, "no_timeout: %d", cleanerd->no_timeout);
 	syslog(LOG_DEBUG, "shutdown: %d", cleanerd->shutdown);
+	if (cleanerd->pool) {
+		syslog(LOG_DEBUG, "pool_active: %d", cleanerd->active);
+		syslog(LOG_DEBUG, "pool_waiting: %d", cleanerd->waiting);
+		syslog(LOG_DEBUG, "pool_slots: %d/%d",
+		       cleanerd->pool->nactive, cleanerd->pool->nslots);
+		syslog(LOG_DEBUG, "free_ratio: %.3f", cleanerd->free_ratio);
+	}
 	syslog(LOG_DEBUG, "ncleansegs: %ld", cleanerd->ncleansegs);
 	syslog(LOG_DEBUG, "cleaning_interval: %ld.%09ld",
 	       cleanerd->cleaning_interval.tv_sec,
@@ -253,6 +564,41 @@ skip_monotonic_clock:
 	       cleanerd->min_reclaimable_blocks);
 	syslog(LOG_DEBUG, "prev_nongc_ctime: %llu",
 	       (unsigned long long)cleanerd->prev_nongc_ctime);
+	syslog(LOG_DEBUG, "adaptive_cleaning: %d",
+	       cleanerd->config.cf_adaptive_cleaning);
+	syslog(LOG_DEBUG, "target_clean_segments: %llu",
+	       (unsigned long long)cleanerd->config.cf_target_clean_segments);
+	syslog(LOG_DEBUG, "rate_write_rate: %.3f segs/s",
+	       cleanerd->rate.write_rate);
+	syslog(LOG_DEBUG, "rate_efficiency: %.3f", cleanerd->rate.efficiency);
+	syslog(LOG_DEBUG, "rate_clean_rate: %.3f segs/s",
+	       cleanerd->rate.clean_rate);
+	syslog(LOG_DEBUG, "rate_last_ncleansegs: %llu",
+	       (unsigned long long)cleanerd->rate.ncleansegs);
+	syslog(LOG_DEBUG, "io_throttle_utilization: %lu",
+	       cleanerd->config.cf_io_throttle_utilization);
+	syslog(LOG_DEBUG, "io_throttle_stat_file: %s",
+	       cleanerd->throttle.path ? : "(none)");
+	syslog(LOG_DEBUG, "io_utilization: %lu", cleanerd->throttle.utilization);
+	syslog(LOG_DEBUG, "io_in_flight: %lu", cleanerd->throttle.in_flight);
+	syslog(LOG_DEBUG, "io_delayed_steps: %llu",
+	       (unsigned long long)cleanerd->throttle.delayed_steps);
+	syslog(LOG_DEBUG, "io_shrunk_steps: %llu",
+	       (unsigned long long)cleanerd->throttle.shrunk_steps);
+	syslog(LOG_DEBUG, "gc_read_bandwidth: %llu B/s",
+	       cleanerd->read_bucket.rate);
+	syslog(LOG_DEBUG, "gc_read_tokens: %.0f", cleanerd->read_bucket.tokens);
+	syslog(LOG_DEBUG, "gc_read_cost: %.0f B/seg", cleanerd->read_bucket.cost);
+	syslog(LOG_DEBUG, "gc_write_bandwidth: %llu B/s",
+	       cleanerd->write_bucket.rate);
+	syslog(LOG_DEBUG, "gc_write_tokens: %.0f",
+	       cleanerd->write_bucket.tokens);
+	syslog(LOG_DEBUG, "gc_write_cost: %.0f B/seg",
+	       cleanerd->write_bucket.cost);
+	syslog(LOG_DEBUG, "gc_budget_delayed_steps: %llu",
+	       (unsigned long long)cleanerd->budget_delayed_steps);
+	syslog(LOG_DEBUG, "metrics_file: %s",
+	       cleanerd->metrics.path ? : "(none)");
 	syslog(LOG_DEBUG, "mm_prev_state: %d", cleanerd->mm_prev_state);
 	syslog(LOG_DEBUG, "mm_nrestpasses: %d", cleanerd->mm_nrestpasses);
 	syslog(LOG_DEBUG, "mm_nrestsegs: %ld", cleanerd->mm_nrestsegs);
@@ -265,9 +611,283 @@ skip_monotonic_clock:
 	       cleanerd->mm_cleaning_interval.tv_nsec);
 	syslog(LOG_DEBUG, "mm_min_reclaimable_blocks: %lu",
 	       cleanerd->mm_min_reclaimable_blocks);
+	nilfs_sucache_get_stat(cleanerd->sucache, &scstat);
+	syslog(LOG_DEBUG, "sucache_full_scans: %llu",
+	       (unsigned long long)scstat.full_scans);
+	syslog(LOG_DEBUG, "sucache_partial_scans: %llu",
+	       (unsigned long long)scstat.partial_scans);
+	syslog(LOG_DEBUG, "sucache_scanned_segs: %llu",
+	       (unsigned long long)scstat.scanned_segs);
+	syslog(LOG_DEBUG, "vinfo_cache_size: %lu", cleanerd->vicache_size);
+	syslog(LOG_DEBUG, "vinfo_cache_hits: %llu",
+	       (unsigned long long)cleanerd->vinfo_hits);
+	syslog(LOG_DEBUG, "vinfo_cache_misses: %llu",
+	       (unsigned long long)cleanerd->vinfo_misses);
+	syslog(LOG_DEBUG, "reclaim_peak_mem: %zu", cleanerd->reclaim_peak_mem);
+	syslog(LOG_DEBUG, "prepared_segs: %llu",
+	       (unsigned long long)cleanerd->prepared_segs);
+	for (i = 0; i < NILFS_RECLAIM_NR_PHASES; i++) {
+		ph = &cleanerd->phases[i];
+		syslog(LOG_DEBUG, "gc_%s: wall %llu.%06llu cpu %llu.%06llu calls %zu",
+		       nilfs_reclaim_phase_names[i],
+		       (unsigned long long)(ph->wall_ns / 1000000000),
+		       (unsigned long long)(ph->wall_ns % 1000000000 / 1000),
+		       (unsigned long long)(ph->cpu_ns / 1000000000),
+		       (unsigned long long)(ph->cpu_ns % 1000000000 / 1000),
+		       ph->ncalls);
+	}
+	syslog(LOG_DEBUG, "gc_bytes_read: %llu",
+	       (unsigned long long)cleanerd->bytes_read);
 	syslog(LOG_DEBUG, "=================================================");
 }
 
+/**
+ * nilfs_cleanerd_open_liveidx - (re)open index of live block counts
+ * @cleanerd: cleanerd object
+ *
+ * The index is kept in memory unless a directory is given by the
+ * liveness_index_directory directive, or if the file of the volume in
+ * that directory cannot be opened.
+ */
+static void nilfs_cleanerd_open_liveidx(struct nilfs_cleanerd *cleanerd)
+{
+	const char *dir = cleanerd->config.cf_liveness_index_directory;
+	struct nilfs_liveidx *liveidx;
+	char *path = NULL;
+
+	if (dir[0] != '\0') {
+		path = nilfs_liveidx_path(cleanerd->nilfs, dir);
+		if (unlikely(!path))
+			goto failed;
+	}
+
+	if (cleanerd->liveidx &&
+	    (path ? cleanerd->liveidx_path &&
+	     strcmp(path, cleanerd->liveidx_path) == 0 :
+	     cleanerd->liveidx_path == NULL)) {
+		free(path);
+		return;	/* not changed */
+	}
+
+	if (path) {
+		liveidx = nilfs_liveidx_open(cleanerd->nilfs, path);
+		if (likely(liveidx))
+			goto done;
+
+		if (errno == EEXIST)
+			nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+					   "%s is not a liveness index of this file system, keeping it in memory",
+					   path);
+		else
+			nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+					   "cannot open liveness index %s, keeping it in memory: %m",
+					   path);
+		free(path);
+		path = NULL;
+	}
+	liveidx = nilfs_liveidx_open(cleanerd->nilfs, NULL);
+	if (unlikely(!liveidx))
+		goto failed;
+done:
+	nilfs_liveidx_close(cleanerd->liveidx);
+	free(cleanerd->liveidx_path);
+	cleanerd->liveidx = liveidx;
+	cleanerd->liveidx_path = path;
+	return;
+
+failed:
+	nilfs_cleanerd_log(cleanerd, LOG_ERR,
+			   "failed to create liveness index: %m");
+	free(path);
+}
+
+/**
+ * nilfs_cleanerd_resize_vicache - (re)create vinfo cache
+ * @cleanerd: cleanerd object
+ */
+static void nilfs_cleanerd_resize_vicache(struct nilfs_cleanerd *cleanerd)
+{
+	unsigned long size = cleanerd->config.cf_vinfo_cache_size;
+	struct nilfs_vicache *vicache = NULL;
+
+	if (size == cleanerd->vicache_size)
+		return;
+
+	if (size > 0) {
+		vicache = nilfs_vicache_create(size);
+		if (unlikely(!vicache)) {
+			nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+					   "failed to create vinfo cache: %m");
+			size = 0;
+		}
+	}
+	nilfs_vicache_destroy(cleanerd->vicache);
+	cleanerd->vicache = vicache;
+	cleanerd->vicache_size = size;
+}
+
+/**
+ * nilfs_cleanerd_setup_metrics - choose the metrics file of the device
+ * @cleanerd: cleanerd object
+ *
+ * The file is named after the device in metrics_directory, e.g.
+ * mapper_vg-lv.prom for /dev/mapper/vg-lv, so that the daemons of many
+ * volumes can share a directory read by a textfile collector.  Slashes
+ * become underscores, and underscores and percent signs are written as
+ * %5f and %25, so that distinct devices never share a file.
+ */
+static void nilfs_cleanerd_setup_metrics(struct nilfs_cleanerd *cleanerd)
+{
+	struct nilfs_cleanerd_metrics *mt = &cleanerd->metrics;
+	const char *dir = cleanerd->config.cf_metrics_directory;
+	const char *name = nilfs_get_dev(cleanerd->nilfs);
+	char *path = NULL, *cp;
+	size_t len;
+
+	if (dir[0] != '\0') {
+		if (strncmp(name, "/dev/", 5) == 0)
+			name += 5;
+		while (*name == '/')
+			name++;
+
+		len = strlen(dir) + 3 * strlen(name) + sizeof("/.prom");
+		path = malloc(len);
+		if (unlikely(!path)) {
+			nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+					   "metrics disabled: %m");
+		} else {
+			cp = path + sprintf(path, "%s/", dir);
+			for (; *name; name++) {
+				if (*name == '/')
+					*cp++ = '_';
+				else if (*name == '_' || *name == '%')
+					cp += sprintf(cp, "%%%02x", *name);
+				else
+					*cp++ = *name;
+			}
+			strcpy(cp, ".prom");
+		}
+	}
+
+	if (mt->path && (!path || strcmp(path, mt->path) != 0))
+		unlink(mt->path);
+	free(mt->path);
+	mt->path = path;
+	mt->failed = 0;
+	mt->last.tv_sec = 0;
+	mt->last.tv_nsec = 0;
+}
+
+/**
+ * nilfs_cleanerd_setup_throttle - find I/O statistics of the device
+ * @cleanerd: cleanerd object
+ *
+ * The statistics file is given by the io_throttle_stat_file directive,
+ * or is the stat file of the block device in sysfs.  Partitions have
+ * their own file there, so this looks it up by device number.
+ */
+static void nilfs_cleanerd_setup_throttle(struct nilfs_cleanerd *cleanerd)
+{
+	struct nilfs_cleanerd_throttle *th = &cleanerd->throttle;
+	const char *path = cleanerd->config.cf_io_throttle_stat_file;
+	const char *dev = nilfs_get_dev(cleanerd->nilfs);
+	char buf[64];
+	struct stat stbuf;
+
+	free(th->path);
+	th->path = NULL;
+	th->valid = 0;
+	th->ndelays = 0;
+	th->nsegs_limit = 0;
+
+	if (cleanerd->config.cf_io_throttle_utilization == 0)
+		return;
+
+	if (path[0] == '\0') {
+		if (stat(dev, &stbuf) < 0 || !S_ISBLK(stbuf.st_mode)) {
+			nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+					   "cannot find I/O statistics of %s, I/O throttle disabled",
+					   dev);
+			return;
+		}
+		snprintf(buf, sizeof(buf), "/sys/dev/block/%u:%u/stat",
+			 major(stbuf.st_rdev), minor(stbuf.st_rdev));
+		path = buf;
+	}
+
+	th->path = strdup(path);
+	if (unlikely(!th->path))
+		nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+				   "I/O throttle disabled: %m");
+}
+
+/**
+ * nilfs_cleanerd_account_reclaim - accumulate statistics of reclamation
+ * @cleanerd: cleanerd object
+ * @stat: reclaim statistics
+ */
+static void nilfs_cleanerd_account_reclaim(struct nilfs_cleanerd *cleanerd,
+					   const struct nilfs_reclaim_stat *stat)
+{
+	const struct nilfs_reclaim_phase *ph;
+	int i;
+
+	if (stat->exflags & NILFS_RECLAIM_STAT_VINFO_CACHE) {
+		cleanerd->vinfo_hits += stat->vinfo_hits;
+		cleanerd->vinfo_misses += stat->vinfo_misses;
+	}
+	if (stat->exflags & NILFS_RECLAIM_STAT_MEMORY) {
+		cleanerd->reclaim_peak_mem = max_t(size_t,
+						   cleanerd->reclaim_peak_mem,
+						   stat->peak_mem);
+		if (stat->nbatches > 1)
+			nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+					   "reclaimed in %zu batches within memory budget",
+					   stat->nbatches);
+	}
+	if (stat->exflags & NILFS_RECLAIM_STAT_PIPELINE)
+		cleanerd->prepared_segs += stat->prepared_segs;
+	if (stat->exflags & NILFS_RECLAIM_STAT_TIMING) {
+		for (i = 0; i < NILFS_RECLAIM_NR_PHASES; i++) {
+			ph = &stat->phases[i];
+			cleanerd->phases[i].wall_ns += ph->wall_ns;
+			cleanerd->phases[i].cpu_ns += ph->cpu_ns;
+			cleanerd->phases[i].ncalls += ph->ncalls;
+		}
+		cleanerd->bytes_read += stat->bytes_read;
+	}
+}
+
+/**
+ * nilfs_cleanerd_log_timing - log time spent in each phase of a step
+ * @cleanerd: cleanerd object
+ * @stat: reclaim statistics
+ */
+static void nilfs_cleanerd_log_timing(struct nilfs_cleanerd *cleanerd,
+				      const struct nilfs_reclaim_stat *stat)
+{
+	const struct nilfs_reclaim_phase *ph;
+	char buf[256];
+	size_t len = 0;
+	int i;
+
+	if (!(stat->exflags & NILFS_RECLAIM_STAT_TIMING))
+		return;
+
+	for (i = 0; i < NILFS_RECLAIM_NR_PHASES && len < sizeof(buf); i++) {
+		ph = &stat->phases[i];
+		len += snprintf(buf + len, sizeof(buf) - len,
+				" %s %llu/%llu us (%zu)",
+				nilfs_reclaim_phase_names[i],
+				(unsigned long long)(ph->wall_ns / 1000),
+				(unsigned long long)(ph->cpu_ns / 1000),
+				ph->ncalls);
+	}
+	nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+			   "gc time (wall/cpu):%s, %llu bytes read", buf,
+			   (unsigned long long)stat->bytes_read);
+}
+
 /**
  * nilfs_cleanerd_config - load configuration file
  * @cleanerd: cleanerd object
@@ -295,11 +915,27 @@ static int nilfs_cleanerd_config(struct nilfs_cleanerd *cleanerd,
 	else
 		nilfs_opt_clear_set_suinfo(cleanerd->nilfs);
 
+	if (!config->cf_use_io_uring)
+		nilfs_opt_clear_io_uring(cleanerd->nilfs);
+	else if (nilfs_opt_set_io_uring(cleanerd->nilfs) < 0)
+		nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+				   "io_uring not available, falling back to pread: %m");
+
 	nilfs_cleanerd_set_log_priority(cleanerd);
+	nilfs_cleanerd_open_liveidx(cleanerd);
+	nilfs_cleanerd_resize_vicache(cleanerd);
+	nilfs_cleanerd_setup_throttle(cleanerd);
+	nilfs_cleanerd_setup_metrics(cleanerd);
+
+	if (!config->cf_pipelined_cleaning) {
+		nilfs_reclaim_prep_free(cleanerd->prep);
+		cleanerd->prep = NULL;
+	}
 
 	if (protection_period != ULONG_MAX) {
-		syslog(LOG_INFO, "override protection period to %lu",
-		       protection_period);
+		nilfs_cleanerd_log(cleanerd, LOG_INFO,
+				   "override protection period to %lu",
+				   protection_period);
 		config->cf_protection_period.tv_sec = protection_period;
 		config->cf_protection_period.tv_nsec = 0;
 	}
@@ -318,13 +954,16 @@ static int nilfs_cleanerd_reconfig(struct nilfs_cleanerd *cleanerd,
 
 	ret = nilfs_cleanerd_config(cleanerd, conffile);
 	if (unlikely(ret < 0)) {
-		syslog(LOG_ERR, "cannot configure: %m");
+		nilfs_cleanerd_log(cleanerd, LOG_ERR, "cannot configure: %m");
 	} else {
 		cleanerd->ncleansegs = config->cf_nsegments_per_clean;
 		cleanerd->cleaning_interval = config->cf_cleaning_interval;
 		cleanerd->min_reclaimable_blocks =
 				config->cf_min_reclaimable_blocks;
-		syslog(LOG_INFO, "configuration file reloaded");
+		cleanerd->read_bucket.rate = config->cf_gc_read_bandwidth;
+		cleanerd->write_bucket.rate = config->cf_gc_write_bandwidth;
+		nilfs_cleanerd_log(cleanerd, LOG_INFO,
+				   "configuration file reloaded");
 	}
 	return ret;
 }
@@ -417,10 +1056,13 @@ static __attribute__((noinline)) char *get_canonical_path(const char *path)
 /**
  * nilfs_cleanerd_create - create cleanerd object
  * @dev: name of the device on which the cleanerd operates
+ * @dir: mount point of the device (NULL to look it up)
  * @conffile: pathname of configuration file
+ * @pool: pool of volumes served by the same daemon (NULL if none)
  */
 static struct nilfs_cleanerd *
-nilfs_cleanerd_create(const char *dev, const char *dir, const char *conffile)
+nilfs_cleanerd_create(const char *dev, const char *dir, const char *conffile,
+		      struct nilfs_cleanerd_pool *pool)
 {
 	struct nilfs_cleanerd *cleanerd;
 	int ret;
@@ -430,6 +1072,7 @@ nilfs_cleanerd_create(const char *dev, const char *dir, const char *conffile)
 		return NULL;
 
 	memset(cleanerd, 0, sizeof(*cleanerd));
+	cleanerd->rate.efficiency = 1.0;
 
 	cleanerd->nilfs = nilfs_open(dev, dir,
 				       NILFS_OPEN_RAW | NILFS_OPEN_RDWR |
@@ -438,17 +1081,25 @@ nilfs_cleanerd_create(const char *dev, const char *dir, const char *conffile)
 		syslog(LOG_ERR, "cannot open nilfs on %s: %m", dev);
 		goto out_cleanerd;
 	}
+	cleanerd->pool = pool;
 
 	cleanerd->cnormap = nilfs_cnormap_create(cleanerd->nilfs);
 	if (unlikely(cleanerd->cnormap == NULL)) {
-		syslog(LOG_ERR,
-		       "failed to create checkpoint number reverse mapper: %m");
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "failed to create checkpoint number reverse mapper: %m");
 		goto out_nilfs;
 	}
 
+	cleanerd->sucache = nilfs_sucache_create(cleanerd->nilfs);
+	if (unlikely(cleanerd->sucache == NULL)) {
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "failed to create segment usage cache: %m");
+		goto out_cnormap;
+	}
+
 	cleanerd->conffile = strdup(conffile ? : NILFS_CLEANERD_CONFFILE);
 	if (unlikely(cleanerd->conffile == NULL))
-		goto out_cnormap;
+		goto out_sucache;
 
 	ret = nilfs_cleanerd_config(cleanerd, NULL);
 	if (unlikely(ret < 0))
@@ -464,7 +1115,16 @@ nilfs_cleanerd_create(const char *dev, const char *dir, const char *conffile)
 
 	/* error */
 out_conffile:
+	if (cleanerd->metrics.path)
+		unlink(cleanerd->metrics.path);
+	free(cleanerd->metrics.path);
+	free(cleanerd->throttle.path);
+	nilfs_vicache_destroy(cleanerd->vicache);
+	nilfs_liveidx_close(cleanerd->liveidx);
+	free(cleanerd->liveidx_path);
 	free(cleanerd->conffile);
+out_sucache:
+	nilfs_sucache_destroy(cleanerd->sucache);
 out_cnormap:
 	nilfs_cnormap_destroy(cleanerd->cnormap);
 out_nilfs:
@@ -479,23 +1139,21 @@ static void nilfs_cleanerd_destroy(struct nilfs_cleanerd *cleanerd)
 {
 	nilfs_cleanerd_close_queue(cleanerd);
 	free(cleanerd->conffile);
+	nilfs_reclaim_prep_free(cleanerd->prep);
+	nilfs_vicache_destroy(cleanerd->vicache);
+	nilfs_liveidx_close(cleanerd->liveidx);
+	free(cleanerd->liveidx_path);
+	free(cleanerd->throttle.path);
+	/* do not leave the counters of a stopped cleaner behind */
+	if (cleanerd->metrics.path)
+		unlink(cleanerd->metrics.path);
+	free(cleanerd->metrics.path);
+	nilfs_sucache_destroy(cleanerd->sucache);
 	nilfs_cnormap_destroy(cleanerd->cnormap);
 	nilfs_close(cleanerd->nilfs);
 	free(cleanerd);
 }
 
-static int nilfs_comp_segimp(const void *elem1, const void *elem2)
-{
-	const struct nilfs_segimp *segimp1 = elem1, *segimp2 = elem2;
-
-	if (segimp1->si_importance < segimp2->si_importance)
-		return -1;
-	else if (segimp1->si_importance > segimp2->si_importance)
-		return 1;
-
-	return (segimp1->si_segnum < segimp2->si_segnum) ? -1 : 1;
-}
-
 static int nilfs_cleanerd_automatic_suspend(struct nilfs_cleanerd *cleanerd)
 {
 	return cleanerd->config.cf_min_clean_segments > 0;
@@ -503,8 +1161,14 @@ static int nilfs_cleanerd_automatic_suspend(struct nilfs_cleanerd *cleanerd)
 
 static long nilfs_cleanerd_ncleansegs(struct nilfs_cleanerd *cleanerd)
 {
-	return cleanerd->running == 2 ?
+	long n = cleanerd->running == 2 ?
 		cleanerd->mm_ncleansegs : cleanerd->ncleansegs;
+
+	if (cleanerd->throttle.nsegs_limit > 0)
+		n = min_t(long, n, cleanerd->throttle.nsegs_limit);
+	if (cleanerd->budget_nsegs_limit > 0)
+		n = min_t(long, n, cleanerd->budget_nsegs_limit);
+	return n;
 }
 
 static struct timespec *
@@ -531,6 +1195,246 @@ nilfs_cleanerd_min_reclaimable_blocks(struct nilfs_cleanerd *cleanerd)
 		cleanerd->min_reclaimable_blocks;
 }
 
+static double nilfs_timespec_to_sec(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1000000000.0;
+}
+
+static void nilfs_sec_to_timespec(double sec, struct timespec *ts)
+{
+	ts->tv_sec = sec;
+	ts->tv_nsec = (sec - ts->tv_sec) * 1000000000.0;
+}
+
+/* weight of a new sample in the smoothed I/O cost per segment */
+#define NILFS_CLEANERD_BUCKET_WEIGHT	0.25
+
+/**
+ * nilfs_cleanerd_bucket_refill - add tokens for the time elapsed
+ * @bucket: token bucket
+ * @now: current time (monotonic)
+ * @burst: capacity of @bucket in seconds of its rate
+ */
+static void nilfs_cleanerd_bucket_refill(struct nilfs_cleanerd_bucket *bucket,
+					 const struct timespec *now,
+					 double burst)
+{
+	double capacity = bucket->rate * burst;
+	struct timespec dt;
+
+	if (!timespecisset(&bucket->last)) {
+		bucket->tokens = capacity;
+	} else {
+		timespecsub(now, &bucket->last, &dt);
+		bucket->tokens += bucket->rate * nilfs_timespec_to_sec(&dt);
+		if (bucket->tokens > capacity)
+			bucket->tokens = capacity;
+	}
+	bucket->last = *now;
+}
+
+/**
+ * nilfs_cleanerd_bucket_burst - capacity of the I/O budget in seconds
+ * @cleanerd: cleanerd object
+ *
+ * The buckets hold the tokens of at least one cleaning interval, so that
+ * a step every interval can use the full bandwidth.
+ */
+static double nilfs_cleanerd_bucket_burst(struct nilfs_cleanerd *cleanerd)
+{
+	double interval = nilfs_timespec_to_sec(
+		nilfs_cleanerd_cleaning_interval(cleanerd));
+
+	return interval > 1.0 ? interval : 1.0;
+}
+
+static void nilfs_cleanerd_bucket_charge(struct nilfs_cleanerd_bucket *bucket,
+					 const struct timespec *now,
+					 double burst, uint64_t bytes,
+					 size_t nsegs)
+{
+	double cost;
+
+	if (!bucket->rate)
+		return;
+
+	nilfs_cleanerd_bucket_refill(bucket, now, burst);
+	bucket->tokens -= bytes;
+	if (nsegs > 0) {
+		cost = (double)bytes / nsegs;
+		bucket->cost += bucket->cost > 0 ?
+			NILFS_CLEANERD_BUCKET_WEIGHT * (cost - bucket->cost) :
+			cost;
+	}
+}
+
+/**
+ * nilfs_cleanerd_charge_budget - charge I/O of garbage collection
+ * @cleanerd: cleanerd object
+ * @rbytes: number of bytes read
+ * @wbytes: number of bytes written
+ * @nsegs: number of segments cleaned or deferred by the I/O (0 for a dry
+ * run)
+ */
+static void nilfs_cleanerd_charge_budget(struct nilfs_cleanerd *cleanerd,
+					 uint64_t rbytes, uint64_t wbytes,
+					 size_t nsegs)
+{
+	struct timespec now;
+	double burst;
+
+	if (!cleanerd->read_bucket.rate && !cleanerd->write_bucket.rate)
+		return;
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+		return;
+
+	burst = nilfs_cleanerd_bucket_burst(cleanerd);
+	nilfs_cleanerd_bucket_charge(&cleanerd->read_bucket, &now, burst,
+				     rbytes, nsegs);
+	nilfs_cleanerd_bucket_charge(&cleanerd->write_bucket, &now, burst,
+				     wbytes, nsegs);
+}
+
+/**
+ * nilfs_cleanerd_check_budget - fit a cleaning step in the I/O budget
+ * @cleanerd: cleanerd object
+ *
+ * Description: The bytes read and written by garbage collection are
+ * charged to token buckets filled at gc_read_bandwidth and
+ * gc_write_bandwidth bytes per second.  A step is delayed until the
+ * overdraft of the previous steps is paid back, and is otherwise limited
+ * to the number of segments whose smoothed cost fits in the tokens
+ * available.  At least one segment is cleaned per step, so a step may
+ * overdraw the budget and delay the following ones.  Unlike the I/O
+ * throttle, the budget also applies to manual runs and while clean
+ * segments are short.
+ *
+ * Return Value: 1 if the step is to be delayed, or 0 otherwise.
+ */
+static int nilfs_cleanerd_check_budget(struct nilfs_cleanerd *cleanerd)
+{
+	struct nilfs_cleanerd_bucket *buckets[] = {
+		&cleanerd->read_bucket, &cleanerd->write_bucket
+	};
+	struct nilfs_cleanerd_bucket *bucket;
+	struct timespec now;
+	double burst, segsize, wait = 0;
+	long n, limit;
+	int i;
+
+	cleanerd->budget_nsegs_limit = 0;
+	if (!cleanerd->read_bucket.rate && !cleanerd->write_bucket.rate)
+		return 0;
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+		return 0;
+
+	burst = nilfs_cleanerd_bucket_burst(cleanerd);
+	segsize = (double)nilfs_get_blocks_per_segment(cleanerd->nilfs) *
+		nilfs_get_block_size(cleanerd->nilfs);
+	n = limit = nilfs_cleanerd_ncleansegs(cleanerd);
+
+	for (i = 0; i < ARRAY_SIZE(buckets); i++) {
+		bucket = buckets[i];
+		if (!bucket->rate)
+			continue;
+
+		nilfs_cleanerd_bucket_refill(bucket, &now, burst);
+		if (bucket->cost <= 0)
+			bucket->cost = segsize;	/* until a step is measured */
+
+		if (bucket->tokens < 0) {
+			wait = max_t(double, wait,
+				     -bucket->tokens / bucket->rate);
+		} else if (bucket->tokens < bucket->cost * limit) {
+			limit = bucket->tokens / bucket->cost;
+		}
+	}
+
+	if (wait > 0) {
+		nilfs_sec_to_timespec(wait, &cleanerd->timeout);
+		cleanerd->budget_delayed_steps++;
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+				   "I/O budget exhausted, delay %.3f seconds",
+				   wait);
+		return 1;
+	}
+
+	if (limit < n) {
+		cleanerd->budget_nsegs_limit = max_t(long, limit, 1);
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+				   "clean up to %ld segments within I/O budget",
+				   cleanerd->budget_nsegs_limit);
+	}
+	return 0;
+}
+
+/**
+ * nilfs_cleanerd_get_protcno - get start of protected checkpoint numbers
+ * @cleanerd: cleanerd object
+ * @protcnop: place to store the checkpoint number
+ */
+static int nilfs_cleanerd_get_protcno(struct nilfs_cleanerd *cleanerd,
+				      nilfs_cno_t *protcnop)
+{
+	struct timespec *pt;
+	int ret;
+
+	pt = nilfs_cleanerd_protection_period(cleanerd);
+
+	ret = nilfs_cnormap_track_back(cleanerd->cnormap, pt->tv_sec,
+				       protcnop);
+	if (unlikely(ret < 0)) {
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "cannot get checkpoint number from protection period (%llu): %m",
+				   (unsigned long long)pt->tv_sec);
+		return -1;
+	}
+	nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+			   "got cno %llu from protection period %lu",
+			   (unsigned long long)*protcnop,
+			   (unsigned long)pt->tv_sec);
+	return 0;
+}
+
+/**
+ * nilfs_cleanerd_init_reclaim_params - set up parameters for reclamation
+ * @cleanerd: cleanerd object
+ * @protseq: lower limit of sequence numbers of protected segments
+ * @params: reclaim parameters to be initialized
+ */
+static int
+nilfs_cleanerd_init_reclaim_params(struct nilfs_cleanerd *cleanerd,
+				   uint64_t protseq,
+				   struct nilfs_reclaim_params *params)
+{
+
+	params->flags = NILFS_RECLAIM_PARAM_PROTSEQ |
+			NILFS_RECLAIM_PARAM_PROTCNO |
+			NILFS_RECLAIM_PARAM_MIN_RECLAIMABLE_BLKS |
+			NILFS_RECLAIM_PARAM_SNAPSHOT_CACHE;
+	params->min_reclaimable_blks =
+			nilfs_cleanerd_min_reclaimable_blocks(cleanerd);
+	params->protseq = protseq;
+	if (cleanerd->config.cf_segment_readahead > 0) {
+		params->flags |= NILFS_RECLAIM_PARAM_READAHEAD;
+		params->readahead = cleanerd->config.cf_segment_readahead;
+	}
+	if (cleanerd->vicache) {
+		params->flags |= NILFS_RECLAIM_PARAM_VINFO_CACHE;
+		params->vicache = cleanerd->vicache;
+	}
+	if (cleanerd->config.cf_reclaim_memory_budget > 0) {
+		params->flags |= NILFS_RECLAIM_PARAM_MEM_BUDGET;
+		params->mem_budget = min_t(unsigned long long,
+					   cleanerd->config.cf_reclaim_memory_budget,
+					   SIZE_MAX);
+	}
+
+	return nilfs_cleanerd_get_protcno(cleanerd, &params->protcno);
+}
+
 static void
 nilfs_cleanerd_reduce_ncleansegs_for_retry(struct nilfs_cleanerd *cleanerd)
 {
@@ -555,16 +1459,22 @@ static int nilfs_segments_still_reclaimable(struct nilfs *nilfs,
 					    unsigned long nsegs,
 					    uint64_t protseq)
 {
-	struct nilfs_suinfo si;
-	int i, ret;
+	struct nilfs_suinfo si[NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX];
+	uint64_t seqnums[NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX];
+	int have_si;
+	int i;
+
+	assert(nsegs <= NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX);
+
+	have_si = nilfs_get_suinfo_batch(nilfs, segnumv, nsegs, si) == 0;
+	if (nilfs_get_segment_seqnums(nilfs, segnumv, nsegs, seqnums) < 0)
+		return 0;
 
 	for (i = 0; i < nsegs; i++) {
-		if (nilfs_get_suinfo(nilfs, segnumv[i], &si, 1) == 1 &&
-		    !nilfs_suinfo_reclaimable(&si))
+		if (have_si && !nilfs_suinfo_reclaimable(&si[i]))
 			continue;
 
-		ret = nilfs_segment_is_protected(nilfs, segnumv[i], protseq);
-		if (ret > 0)
+		if (cnt64_ge(seqnums[i], protseq))
 			return 1;
 	}
 	return 0;
@@ -590,51 +1500,226 @@ static int nilfs_shrink_protected_region(struct nilfs *nilfs)
 	return ret;
 }
 
+#define NILFS_CLEANERD_CB_SCALE	1024	/* resolution of cost-benefit ratio */
+
 /**
- * nilfs_cleanerd_select_segments - select segments to be reclaimed
+ * nilfs_cleanerd_segment_importance - calculate importance of a segment
  * @cleanerd: cleanerd object
- * @sustat: status information on segments
- * @segnums: array of segment numbers to store selected segments
- * @prottimep: place to store lower limit of protected period
- * @oldestp: place to store the oldest mod-time
+ * @si: usage of the segment
+ * @nlive: (estimated) number of live blocks in the segment
+ * @now: current time
+ * @timestamp: importance of the segment in the timestamp policy
+ *
+ * Segments are selected in ascending order of importance.  The greedy
+ * policy prefers segments with fewest live blocks.  The cost-benefit
+ * policy prefers segments with a larger (1 - u) * age / (1 + u) ratio,
+ * where u is the fraction of live blocks in the segment.
  */
-#define NILFS_CLEANERD_NSUINFO	512
-#define NILFS_CLEANERD_NULLTIME INT64_MAX
-
-static ssize_t
-nilfs_cleanerd_select_segments(struct nilfs_cleanerd *cleanerd,
-			       struct nilfs_sustat *sustat, uint64_t *segnums,
-			       int64_t *prottimep, int64_t *oldestp)
+static long long
+nilfs_cleanerd_segment_importance(struct nilfs_cleanerd *cleanerd,
+				  const struct nilfs_suinfo *si,
+				  unsigned long nlive, int64_t now,
+				  long long timestamp)
 {
-	struct nilfs *nilfs;
-	struct nilfs_vector *smv;
-	struct nilfs_segimp *sm;
-	struct nilfs_suinfo si[NILFS_CLEANERD_NSUINFO];
+	unsigned long blocks_per_segment;
+	int64_t age;
+	double u;
+
+	switch (cleanerd->config.cf_selection_policy) {
+	case NILFS_SELECTION_POLICY_GREEDY:
+		return nlive;
+	case NILFS_SELECTION_POLICY_COST_BENEFIT:
+		blocks_per_segment =
+			nilfs_get_blocks_per_segment(cleanerd->nilfs);
+		age = max_t(int64_t, now - (int64_t)si->sui_lastmod, 0);
+		u = (double)min_t(unsigned long, nlive, blocks_per_segment) /
+			blocks_per_segment;
+		return -(long long)((1 - u) * age / (1 + u) *
+				    NILFS_CLEANERD_CB_SCALE);
+	default:
+		return timestamp;
+	}
+}
+
+/**
+ * nilfs_cleanerd_live_blocks - estimate number of live blocks in a segment
+ * @cleanerd: cleanerd object
+ * @segnum: segment number
+ * @si: usage of the segment
+ * @protcno: start of checkpoint numbers protected in this selection
+ */
+static unsigned long
+nilfs_cleanerd_live_blocks(struct nilfs_cleanerd *cleanerd, uint64_t segnum,
+			   const struct nilfs_suinfo *si, nilfs_cno_t protcno)
+{
+	struct nilfs_liveidx_entry ent;
+
+	if (cleanerd->config.cf_selection_policy !=
+	    NILFS_SELECTION_POLICY_TIMESTAMP && cleanerd->liveidx &&
+	    nilfs_liveidx_lookup(cleanerd->liveidx, segnum, si, protcno,
+				 &ent))
+		return ent.nlive;
+	return si->sui_nblocks;
+}
+
+/**
+ * nilfs_cleanerd_sample_live_blocks - refine importance of candidates
+ * @cleanerd: cleanerd object
+ * @cands: candidate segments sorted in ascending order of importance
+ * @ncands: number of candidates
+ * @si: usage of segments indexed by segment number
+ * @protseq: lower limit of sequence numbers of protected segments
+ * @now: current time
+ *
+ * The number of blocks recorded in the segment usage counts blocks that
+ * were written to the segment, which is an upper bound of live blocks.
+ * This counts the live blocks of the best candidates with a dry run of
+ * the garbage collector, records them in the liveness index, and sorts
+ * the candidates again.  Candidates already found in the index are not
+ * assessed again.
+ */
+static void
+nilfs_cleanerd_sample_live_blocks(struct nilfs_cleanerd *cleanerd,
+				  struct nilfs_segimp *cands, size_t ncands,
+				  const struct nilfs_suinfo *si,
+				  uint64_t protseq, int64_t now)
+{
+	struct nilfs_reclaim_params params;
+	struct nilfs_reclaim_stat stat;
+	struct nilfs_liveidx_entry ent;
+	struct nilfs_assess_result res[NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX];
+	uint64_t segnums[NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX];
+	size_t idx[NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX];
+	size_t i, nsample, nmiss = 0;
+	uint64_t segnum;
+
+	if (nilfs_cleanerd_init_reclaim_params(cleanerd, protseq, &params) < 0)
+		return;
+
+	nsample = min_t(size_t, cleanerd->config.cf_live_block_sampling,
+			ncands);
+	for (i = 0; i < nsample; i++) {
+		segnum = cands[i].si_segnum;
+		if (cleanerd->liveidx &&
+		    nilfs_liveidx_lookup(cleanerd->liveidx, segnum, &si[segnum],
+					 params.protcno, &ent))
+			continue;
+		segnums[nmiss] = segnum;
+		idx[nmiss++] = i;
+	}
+	if (nmiss == 0)
+		return;
+
+	memset(&stat, 0, sizeof(stat));
+	stat.exflags = NILFS_RECLAIM_STAT_VINFO_CACHE |
+		NILFS_RECLAIM_STAT_TIMING;
+	if (nilfs_assess_segments(cleanerd->nilfs, segnums, nmiss, &params,
+				  res, &stat) < 0) {
+		nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+				   "cannot assess segments: %m");
+		return;		/* keep the estimates */
+	}
+	nilfs_cleanerd_account_reclaim(cleanerd, &stat);
+	nilfs_cleanerd_charge_budget(cleanerd, stat.bytes_read, 0, 0);
+
+	for (i = 0; i < nmiss; i++) {
+		if (!(res[i].flags & NILFS_ASSESS_RESULT_ASSESSED))
+			continue;	/* keep the estimate */
+
+		if (cleanerd->liveidx)
+			nilfs_liveidx_update(cleanerd->liveidx, segnums[i],
+					     res[i].seqnum, &si[segnums[i]],
+					     params.protcno, res[i].live_blks);
+
+		cands[idx[i]].si_importance =
+			nilfs_cleanerd_segment_importance(
+				cleanerd, &si[segnums[i]], res[i].live_blks,
+				now, cands[idx[i]].si_importance);
+	}
+	qsort(cands, ncands, sizeof(*cands), nilfs_comp_segimp);
+}
+
+/**
+ * nilfs_cleanerd_select_segments - select segments to be reclaimed
+ * @cleanerd: cleanerd object
+ * @sustat: status information on segments
+ * @segnums: array of segment numbers to store selected segments
+ * @nnextp: place to store the number of segments selected for the next
+ * step
+ * @prottimep: place to store lower limit of protected period
+ * @oldestp: place to store the oldest mod-time
+ *
+ * With pipelined cleaning, the segments that come next in the order of
+ * selection are stored in @segnums after the selected ones, so that they
+ * can be read while the selected ones are cleaned.  @segnums must have
+ * room for NILFS_CLDCONFIG_NSEGMENTS_SELECT_MAX segments.
+ */
+#define NILFS_CLEANERD_NULLTIME INT64_MAX
+
+static ssize_t
+nilfs_cleanerd_select_segments(struct nilfs_cleanerd *cleanerd,
+			       struct nilfs_sustat *sustat, uint64_t *segnums,
+			       size_t *nnextp, int64_t *prottimep,
+			       int64_t *oldestp)
+{
+	struct nilfs_segimp heap[NILFS_CLDCONFIG_NSEGMENTS_SELECT_MAX];
+	const struct nilfs_suinfo *si;
 	struct timespec ts, ts2;
 	int64_t prottime, oldest, lastmod, now;
-	uint64_t segnum;
-	size_t count, nsegs;
-	ssize_t nssegs, n;
+	uint64_t segnum, ncached;
+	nilfs_cno_t protcno = 0;
+	size_t nsegs, nsel, ncands, nssegs = 0;
 	long long imp, thr;
+	int sampling;
 	int ret;
 	int i;
 
-	nsegs = nilfs_cleanerd_ncleansegs(cleanerd);
-	nilfs = cleanerd->nilfs;
+	nsegs = min_t(size_t, nilfs_cleanerd_ncleansegs(cleanerd),
+		      NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX);
+	nsel = cleanerd->config.cf_pipelined_cleaning ? 2 * nsegs : nsegs;
+
+	/* take extra candidates for the live block sampler */
+	sampling = cleanerd->config.cf_selection_policy !=
+		NILFS_SELECTION_POLICY_TIMESTAMP &&
+		cleanerd->config.cf_live_block_sampling > 0;
+	ncands = sampling ?
+		max_t(size_t, nsel, cleanerd->config.cf_live_block_sampling) :
+		nsel;
 
-	smv = nilfs_vector_create(sizeof(struct nilfs_segimp));
-	if (unlikely(!smv))
+	ret = nilfs_sucache_refresh(cleanerd->sucache, sustat);
+	if (unlikely(ret < 0))
 		return -1;
 
+	if (cleanerd->liveidx) {
+		ret = nilfs_liveidx_check_context(cleanerd->liveidx,
+						  cleanerd->nilfs);
+		if (unlikely(ret < 0))
+			return -1;
+		if (ret > 0)
+			nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+					   "liveness index reset");
+		if (cleanerd->config.cf_selection_policy !=
+		    NILFS_SELECTION_POLICY_TIMESTAMP &&
+		    unlikely(nilfs_cleanerd_get_protcno(cleanerd,
+							&protcno) < 0))
+			return -1;
+	}
+
+	si = nilfs_sucache_get_suinfo(cleanerd->sucache, &ncached);
+	if (unlikely(ncached != sustat->ss_nsegs))
+		nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+				   "inconsistent number of segments: %llu (nsegs=%llu)",
+				   (unsigned long long)ncached,
+				   (unsigned long long)sustat->ss_nsegs);
+
 	/*
 	 * The segments that were more recently written to disk than
 	 * prottime are not selected.
 	 */
 	ret = clock_gettime(CLOCK_REALTIME, &ts);
-	if (unlikely(ret < 0)) {
-		nssegs = -1;
-		goto out;
-	}
+	if (unlikely(ret < 0))
+		return -1;
+
 	timespecsub(&ts, nilfs_cleanerd_protection_period(cleanerd), &ts2);
 	now = ts.tv_sec;
 	prottime = ts2.tv_sec;
@@ -646,67 +1731,51 @@ nilfs_cleanerd_select_segments(struct nilfs_cleanerd *cleanerd,
 	 */
 	thr = sustat->ss_nongc_ctime;
 
-	for (segnum = 0; segnum < sustat->ss_nsegs; segnum += n) {
-		count = min_t(uint64_t, sustat->ss_nsegs - segnum,
-			      NILFS_CLEANERD_NSUINFO);
-		n = nilfs_get_suinfo(nilfs, segnum, si, count);
-		if (unlikely(n < 0)) {
-			nssegs = n;
-			goto out;
-		}
-		for (i = 0; i < n; i++) {
-			if (!nilfs_suinfo_reclaimable(&si[i]))
-				continue;
-
-			/*
-			 * Use local variable 'lastmod' to treat the
-			 * segment timestamp as a signed type value.
-			 */
-			lastmod = si[i].sui_lastmod;
+	for (segnum = 0; segnum < ncached; segnum++) {
+		if (!nilfs_suinfo_reclaimable(&si[segnum]))
+			continue;
 
-			/*
-			 * Timestamp policy.  The importance value is
-			 * adjusted to include segments with a future
-			 * timestamp.
-			 */
-			imp = lastmod <= now ? lastmod : thr - 1;
-
-			if (imp < thr) {
-				if (lastmod < oldest)
-					oldest = lastmod;
-				if (lastmod < prottime || lastmod > now) {
-					sm = nilfs_vector_get_new_element(smv);
-					if (unlikely(sm == NULL)) {
-						nssegs = -1;
-						goto out;
-					}
-					sm->si_segnum = segnum + i;
-					sm->si_importance = imp;
-				}
+		/*
+		 * Use local variable 'lastmod' to treat the segment
+		 * timestamp as a signed type value.
+		 */
+		lastmod = si[segnum].sui_lastmod;
+
+		/*
+		 * Timestamp policy.  The importance value is adjusted
+		 * to include segments with a future timestamp.
+		 */
+		imp = lastmod <= now ? lastmod : thr - 1;
+
+		if (imp < thr) {
+			if (lastmod < oldest)
+				oldest = lastmod;
+			if (lastmod < prottime || lastmod > now) {
+				imp = nilfs_cleanerd_segment_importance(
+					cleanerd, &si[segnum],
+					nilfs_cleanerd_live_blocks(
+						cleanerd, segnum, &si[segnum],
+						protcno),
+					now, imp);
+				nilfs_segheap_add(heap, &nssegs, ncands,
+						  segnum, imp);
 			}
 		}
-		if (unlikely(n == 0)) {
-			syslog(LOG_WARNING,
-			       "inconsistent number of segments: %llu (nsegs=%llu)",
-			       (unsigned long long)nilfs_vector_get_size(smv),
-			       (unsigned long long)sustat->ss_nsegs);
-			break;
-		}
 	}
-	nilfs_vector_sort(smv, nilfs_comp_segimp);
+	nilfs_segheap_sort(heap, nssegs);
 
-	nssegs = min_t(size_t, nilfs_vector_get_size(smv), nsegs);
-	for (i = 0; i < nssegs; i++) {
-		sm = nilfs_vector_get_element(smv, i);
-		assert(sm != NULL);
-		segnums[i] = sm->si_segnum;
-	}
+	if (sampling && nssegs > 0)
+		nilfs_cleanerd_sample_live_blocks(cleanerd, heap, nssegs, si,
+						  sustat->ss_prot_seq, now);
+	nssegs = min_t(size_t, nssegs, nsel);
+
+	for (i = 0; i < nssegs; i++)
+		segnums[i] = heap[i].si_segnum;
+	*nnextp = nssegs > nsegs ? nssegs - nsegs : 0;
 	*prottimep = prottime;
 	*oldestp = oldest;
 
- out:
-	nilfs_vector_destroy(smv);
-	return nssegs;
+	return nssegs - *nnextp;
 }
 
 static int oom_adjust(void)
@@ -796,6 +1865,12 @@ static RETSIGTYPE handle_sigterm(int signum)
 	siglongjmp(nilfs_cleanerd_env, 1);
 }
 
+/* a daemon serving many volumes must not jump out with the pool locked */
+static RETSIGTYPE handle_sigterm_pool(int signum)
+{
+	nilfs_cleanerd_exit_req = 1;
+}
+
 static RETSIGTYPE handle_sighup(int signum)
 {
 	nilfs_cleanerd_reload_config = 1;
@@ -866,31 +1941,55 @@ static int nilfs_cleanerd_init_signal_handlers(struct nilfs_cleanerd *cleanerd,
 	return 0;
 }
 
-static void nilfs_cleanerd_handle_signals(struct nilfs_cleanerd *cleanerd)
+/**
+ * nilfs_cleanerd_handle_signals - serve requests made by signals
+ * @vols: array of cleanerd objects
+ * @nvols: number of cleanerd objects in @vols
+ *
+ * The requests apply to all the volumes served by the daemon.  They are
+ * kept for a volume whose step is running on a worker thread, and are
+ * served at the first call after the step.
+ */
+static void nilfs_cleanerd_handle_signals(struct nilfs_cleanerd **vols,
+					  size_t nvols)
 {
-	if (nilfs_cleanerd_reload_config) {
-		nilfs_cleanerd_reconfig(cleanerd, NULL);
-		nilfs_cleanerd_reload_config = 0;
-	}
-
-	if (nilfs_cleanerd_dump_req) {
-		if (cleanerd->config.cf_log_priority == LOG_DEBUG)
-			nilfs_cleanerd_dump(cleanerd);
-		nilfs_cleanerd_dump_req = 0;
+	struct nilfs_cleanerd *cleanerd;
+	size_t i;
+
+	for (i = 0; i < nvols; i++) {
+		cleanerd = vols[i];
+		if (nilfs_cleanerd_reload_config)
+			cleanerd->reload_req = 1;
+		if (nilfs_cleanerd_dump_req)
+			cleanerd->dump_req = 1;
+		if (cleanerd->busy)
+			continue;	/* served after its step */
+
+		if (cleanerd->reload_req) {
+			nilfs_cleanerd_reconfig(cleanerd, NULL);
+			cleanerd->reload_req = 0;
+		}
+		if (cleanerd->dump_req) {
+			if (cleanerd->config.cf_log_priority == LOG_DEBUG)
+				nilfs_cleanerd_dump(cleanerd);
+			cleanerd->dump_req = 0;
+		}
 	}
+	nilfs_cleanerd_reload_config = 0;
+	nilfs_cleanerd_dump_req = 0;
 }
 
 static void nilfs_cleanerd_clean_check_pause(struct nilfs_cleanerd *cleanerd)
 {
 	cleanerd->running = 0;
 	cleanerd->timeout = cleanerd->config.cf_clean_check_interval;
-	syslog(LOG_INFO, "pause (clean check)");
+	nilfs_cleanerd_log(cleanerd, LOG_INFO, "pause (clean check)");
 }
 
 static void nilfs_cleanerd_clean_check_resume(struct nilfs_cleanerd *cleanerd)
 {
 	cleanerd->running = 1;
-	syslog(LOG_INFO, "resume (clean check)");
+	nilfs_cleanerd_log(cleanerd, LOG_INFO, "resume (clean check)");
 }
 
 static void nilfs_cleanerd_manual_suspend(struct nilfs_cleanerd *cleanerd)
@@ -898,7 +1997,7 @@ static void nilfs_cleanerd_manual_suspend(struct nilfs_cleanerd *cleanerd)
 	cleanerd->mm_prev_state = cleanerd->running;
 	cleanerd->running = -1;
 	cleanerd->timeout = cleanerd->config.cf_clean_check_interval;
-	syslog(LOG_INFO, "suspend (manual)");
+	nilfs_cleanerd_log(cleanerd, LOG_INFO, "suspend (manual)");
 }
 
 static void nilfs_cleanerd_manual_resume(struct nilfs_cleanerd *cleanerd)
@@ -906,27 +2005,27 @@ static void nilfs_cleanerd_manual_resume(struct nilfs_cleanerd *cleanerd)
 	/* cleanerd->running == -1 */
 	cleanerd->mm_prev_state = 0;
 	cleanerd->running = cleanerd->mm_prev_state;
-	syslog(LOG_INFO, "resume (manual)");
+	nilfs_cleanerd_log(cleanerd, LOG_INFO, "resume (manual)");
 }
 
 static void nilfs_cleanerd_manual_run(struct nilfs_cleanerd *cleanerd)
 {
 	cleanerd->running = 2;
-	syslog(LOG_INFO, "run (manual)");
+	nilfs_cleanerd_log(cleanerd, LOG_INFO, "run (manual)");
 }
 
 static void nilfs_cleanerd_manual_end(struct nilfs_cleanerd *cleanerd)
 {
 	cleanerd->running = 0;
 	cleanerd->timeout = cleanerd->config.cf_clean_check_interval;
-	syslog(LOG_INFO, "manual run completed");
+	nilfs_cleanerd_log(cleanerd, LOG_INFO, "manual run completed");
 }
 
 static void nilfs_cleanerd_manual_stop(struct nilfs_cleanerd *cleanerd)
 {
 	cleanerd->running = 0;
 	cleanerd->timeout = cleanerd->config.cf_clean_check_interval;
-	syslog(LOG_INFO, "manual run aborted");
+	nilfs_cleanerd_log(cleanerd, LOG_INFO, "manual run aborted");
 }
 
 static int nilfs_cleanerd_init_interval(struct nilfs_cleanerd *cleanerd)
@@ -935,7 +2034,8 @@ static int nilfs_cleanerd_init_interval(struct nilfs_cleanerd *cleanerd)
 
 	ret = clock_gettime(CLOCK_MONOTONIC, &cleanerd->target);
 	if (unlikely(ret < 0)) {
-		syslog(LOG_ERR, "cannot get monotonic time: %m");
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "cannot get monotonic time: %m");
 		return -1;
 	}
 	timespecadd(&cleanerd->target, &cleanerd->config.cf_cleaning_interval,
@@ -970,7 +2070,8 @@ static int nilfs_cleanerd_recalc_interval(struct nilfs_cleanerd *cleanerd,
 
 			ret = clock_gettime(CLOCK_REALTIME, &curr);
 			if (unlikely(ret < 0)) {
-				syslog(LOG_ERR, "cannot get current time: %m");
+				nilfs_cleanerd_log(cleanerd, LOG_ERR,
+						   "cannot get current time: %m");
 				return -1;
 			}
 			tgt = min_t(int64_t, oldest, curr.tv_sec);
@@ -988,7 +2089,8 @@ static int nilfs_cleanerd_recalc_interval(struct nilfs_cleanerd *cleanerd,
 
 	ret = clock_gettime(CLOCK_MONOTONIC, &curr);
 	if (unlikely(ret < 0)) {
-		syslog(LOG_ERR, "cannot get monotonic time: %m");
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "cannot get monotonic time: %m");
 		return -1;
 	}
 
@@ -996,7 +2098,7 @@ static int nilfs_cleanerd_recalc_interval(struct nilfs_cleanerd *cleanerd,
 		timespecadd(&curr, &cleanerd->config.cf_retry_interval,
 			    &cleanerd->target);
 		timespecsub(&cleanerd->target, &curr, &cleanerd->timeout);
-		syslog(LOG_DEBUG, "retry interval");
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG, "retry interval");
 		return 0;
 	}
 
@@ -1006,7 +2108,7 @@ static int nilfs_cleanerd_recalc_interval(struct nilfs_cleanerd *cleanerd,
 	if (!timespeccmp(&curr, &cleanerd->target, <) || cleanerd->no_timeout) {
 		timespecclear(&cleanerd->timeout);
 		timespecadd(&curr, interval, &cleanerd->target);
-		syslog(LOG_DEBUG, "adjust interval");
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG, "adjust interval");
 		return 0;
 	}
 	timespecsub(&cleanerd->target, &curr, &cleanerd->timeout);
@@ -1036,7 +2138,8 @@ static int nilfs_cleanerd_respond(struct nilfs_cleanerd *cleanerd,
 		ret = -1;
 		cleanerd->sendq = mq_open(nambuf, O_WRONLY | O_NONBLOCK);
 		if (unlikely(cleanerd->sendq < 0)) {
-			syslog(LOG_ERR, "cannot open queue to client: %m");
+			nilfs_cleanerd_log(cleanerd, LOG_ERR,
+					   "cannot open queue to client: %m");
 			goto out;
 		}
 		uuid_copy(cleanerd->client_uuid, req->client_uuid);
@@ -1044,13 +2147,14 @@ static int nilfs_cleanerd_respond(struct nilfs_cleanerd *cleanerd,
 	ret = mq_send(cleanerd->sendq, (char *)res, sizeof(*res),
 		      NILFS_CLEANER_PRIO_HIGH);
 	if (unlikely(ret < 0)) {
-		syslog(LOG_ERR, "cannot respond to client: %m");
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "cannot respond to client: %m");
 	} else {
 		if (req->cmd >= 0 &&
 		    req->cmd < ARRAY_SIZE(nilfs_cleaner_cmd_name))
-			syslog(LOG_DEBUG, "command %s %s",
-			       nilfs_cleaner_cmd_name[req->cmd],
-			       res->result ? "nacked" : "acked");
+			nilfs_cleanerd_log(cleanerd, LOG_DEBUG, "command %s %s",
+					   nilfs_cleaner_cmd_name[req->cmd],
+					   res->result ? "nacked" : "acked");
 	}
 out:
 	return ret;
@@ -1090,7 +2194,8 @@ static int nilfs_cleanerd_cmd_run(struct nilfs_cleanerd *cleanerd,
 	struct nilfs_cleaner_request_with_args *req2;
 	struct nilfs_cleaner_response res = {0};
 
-	if (argsize < sizeof(req2->args))
+	/* clients older than the bandwidth arguments send shorter ones */
+	if (argsize < offsetof(struct nilfs_cleaner_args, read_bandwidth))
 		goto error_inval;
 
 	req2 = (struct nilfs_cleaner_request_with_args *)req;
@@ -1204,8 +2309,33 @@ static int nilfs_cleanerd_cmd_tune(struct nilfs_cleanerd *cleanerd,
 				   struct nilfs_cleaner_request *req,
 				   size_t argsize)
 {
-	/* Not yet implemented */
-	return nilfs_cleanerd_nak(cleanerd, req, EOPNOTSUPP);
+	struct nilfs_cleaner_request_with_args *req2;
+	struct nilfs_cleaner_response res = {0};
+
+	if (argsize < sizeof(req2->args))
+		return nilfs_cleanerd_nak(cleanerd, req, EINVAL);
+
+	req2 = (struct nilfs_cleaner_request_with_args *)req;
+
+	/* only the I/O budget can be tuned for now */
+	if (req2->args.valid & ~(NILFS_CLEANER_ARG_READ_BANDWIDTH |
+				 NILFS_CLEANER_ARG_WRITE_BANDWIDTH))
+		return nilfs_cleanerd_nak(cleanerd, req, EOPNOTSUPP);
+
+	if (req2->args.valid & NILFS_CLEANER_ARG_READ_BANDWIDTH) {
+		cleanerd->read_bucket.rate = req2->args.read_bandwidth;
+		nilfs_cleanerd_log(cleanerd, LOG_INFO,
+				   "gc read bandwidth set to %llu bytes/s",
+				   cleanerd->read_bucket.rate);
+	}
+	if (req2->args.valid & NILFS_CLEANER_ARG_WRITE_BANDWIDTH) {
+		cleanerd->write_bucket.rate = req2->args.write_bandwidth;
+		nilfs_cleanerd_log(cleanerd, LOG_INFO,
+				   "gc write bandwidth set to %llu bytes/s",
+				   cleanerd->write_bucket.rate);
+	}
+	res.result = NILFS_CLEANER_RSP_ACK;
+	return nilfs_cleanerd_respond(cleanerd, req, &res);
 }
 
 static int nilfs_cleanerd_cmd_reload(struct nilfs_cleanerd *cleanerd,
@@ -1275,14 +2405,14 @@ static int nilfs_cleanerd_handle_message(struct nilfs_cleanerd *cleanerd,
 	int ret = -1;
 
 	if (bytes < sizeof(*req) || bytes < sizeof(*req) + req->argsize) {
-		syslog(LOG_NOTICE, "too short message");
+		nilfs_cleanerd_log(cleanerd, LOG_NOTICE, "too short message");
 		goto out;
 	}
 	argsize = bytes - sizeof(*req);
 
 	if (req->cmd >= 0 && req->cmd < ARRAY_SIZE(nilfs_cleaner_cmd_name))
-		syslog(LOG_DEBUG, "received %s command",
-		       nilfs_cleaner_cmd_name[req->cmd]);
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG, "received %s command",
+				   nilfs_cleaner_cmd_name[req->cmd]);
 
 	switch (req->cmd) {
 	case NILFS_CLEANER_CMD_GET_STATUS:
@@ -1313,21 +2443,51 @@ static int nilfs_cleanerd_handle_message(struct nilfs_cleanerd *cleanerd,
 		ret = nilfs_cleanerd_cmd_shutdown(cleanerd, req, argsize);
 		break;
 	default:
-		syslog(LOG_DEBUG, "received unknown command: %d", req->cmd);
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+				   "received unknown command: %d", req->cmd);
 		return nilfs_cleanerd_nak(cleanerd, req, EINVAL);
 	}
 out:
 	return ret;
 }
 
+/**
+ * nilfs_cleanerd_receive - receive and handle a message from a client
+ * @cleanerd: cleanerd object
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+static int nilfs_cleanerd_receive(struct nilfs_cleanerd *cleanerd)
+{
+	ssize_t bytes;
+
+	bytes = mq_receive(cleanerd->recvq, nilfs_cleanerd_msgbuf,
+			   sizeof(nilfs_cleanerd_msgbuf), NULL);
+	if (unlikely(bytes < 0)) {
+		if (errno == EINTR || errno == EAGAIN) {
+			nilfs_cleanerd_log(cleanerd, LOG_INFO,
+					   "mq_receive aborted: %s",
+					   errno == EINTR ?
+					   "interrupted" : "no message found");
+		} else {
+			nilfs_cleanerd_log(cleanerd, LOG_ERR,
+					   "mq_receive failed: %m");
+			return -1;
+		}
+	} else {
+		nilfs_cleanerd_handle_message(cleanerd, nilfs_cleanerd_msgbuf,
+					      bytes);
+	}
+	return 0;
+}
+
 static int nilfs_cleanerd_wait(struct nilfs_cleanerd *cleanerd)
 {
 	struct pollfd pfd;
-	ssize_t bytes;
 	int ret;
 
-	syslog(LOG_DEBUG, "wait %ld.%09ld",
-	       cleanerd->timeout.tv_sec, cleanerd->timeout.tv_nsec);
+	nilfs_cleanerd_log(cleanerd, LOG_DEBUG, "wait %ld.%09ld",
+			   cleanerd->timeout.tv_sec, cleanerd->timeout.tv_nsec);
 
 	memset(&pfd, 0, sizeof(pfd));
 	pfd.fd = cleanerd->recvq;
@@ -1336,34 +2496,21 @@ static int nilfs_cleanerd_wait(struct nilfs_cleanerd *cleanerd)
 	ret = ppoll(&pfd, 1, &cleanerd->timeout, NULL);
 	if (unlikely(ret < 0)) {
 		if (errno == EINTR) {
-			syslog(LOG_INFO, "wake up (interrupted)");
+			nilfs_cleanerd_log(cleanerd, LOG_INFO,
+					   "wake up (interrupted)");
 			goto out;
 		}
-		syslog(LOG_ERR, "ppoll failed: %m");
+		nilfs_cleanerd_log(cleanerd, LOG_ERR, "ppoll failed: %m");
 		return -1;
 	}
 
 	if (!(pfd.revents & POLLIN)) {
-		syslog(LOG_DEBUG, "wake up (timed out)");
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG, "wake up (timed out)");
 		goto out;
 	}
-	syslog(LOG_DEBUG, "wake up to handle message");
+	nilfs_cleanerd_log(cleanerd, LOG_DEBUG, "wake up to handle message");
 
-	bytes = mq_receive(cleanerd->recvq, nilfs_cleanerd_msgbuf,
-			   sizeof(nilfs_cleanerd_msgbuf), NULL);
-	if (unlikely(bytes < 0)) {
-		if (errno == EINTR || errno == EAGAIN) {
-			syslog(LOG_INFO, "mq_receive aborted: %s",
-			       errno == EINTR ?
-			       "interrupted" : "no message found");
-		} else {
-			syslog(LOG_ERR, "mq_receive failed: %m");
-			return -1;
-		}
-	} else {
-		nilfs_cleanerd_handle_message(cleanerd, nilfs_cleanerd_msgbuf,
-					      bytes);
-	}
+	return nilfs_cleanerd_receive(cleanerd);
 out:
 	return 0;
 }
@@ -1417,135 +2564,728 @@ static int nilfs_cleanerd_handle_clean_check(struct nilfs_cleanerd *cleanerd,
 	return 0; /* do gc */
 }
 
-static ssize_t
-nilfs_cleanerd_count_inuse_segments(struct nilfs_cleanerd *cleanerd,
-				    struct nilfs_sustat *sustat)
+/* weight of a new sample in the smoothed estimates of the controller */
+#define NILFS_CLEANERD_RATE_WEIGHT	0.25
+/* time in seconds over which the controller makes up for a deficit */
+#define NILFS_CLEANERD_RATE_HORIZON	60.0
+/* lower bound of the estimated efficiency of cleaning */
+#define NILFS_CLEANERD_RATE_MIN_EFFICIENCY	0.05
+
+/**
+ * nilfs_cleanerd_rate_feedback - account segments freed by cleaning
+ * @cleanerd: cleanerd object
+ * @stat: reclaim statistics of a cleaning step
+ *
+ * The live blocks of the cleaned segments are written again, so the net
+ * gain is the number of cleaned segments less the segments the live
+ * blocks take up.  The live blocks of deferred segments are counted as
+ * well, which makes the estimate conservative.
+ */
+static void nilfs_cleanerd_rate_feedback(struct nilfs_cleanerd *cleanerd,
+					 const struct nilfs_reclaim_stat *stat)
 {
-	struct nilfs_suinfo si[NILFS_CLEANERD_NSUINFO];
-	uint64_t segnum;
-	unsigned long rest, count;
-	ssize_t nsi, i;
-	ssize_t nfound = 0;
+	struct nilfs_cleanerd_rate *rc = &cleanerd->rate;
+	double nblocks, freed;
 
-	segnum = 0;
-	rest = sustat->ss_nsegs;
-	while (rest > 0 && segnum < sustat->ss_nsegs) {
-		count = min_t(unsigned long, rest, NILFS_CLEANERD_NSUINFO);
-		nsi = nilfs_get_suinfo(cleanerd->nilfs, segnum, si, count);
-		if (unlikely(nsi < 0)) {
-			syslog(LOG_ERR, "cannot get segment usage info: %m");
-			return -1;
-		}
-		for (i = 0; i < nsi; i++, segnum++) {
-			if (nilfs_suinfo_reclaimable(&si[i])) {
-				nfound++;
-				rest--;
-			}
-		}
-	}
-	return nfound; /* return the number of found segments */
+	if (stat->cleaned_segs == 0)
+		return;
+
+	nblocks = (double)stat->cleaned_segs *
+		nilfs_get_blocks_per_segment(cleanerd->nilfs);
+	freed = nblocks - min_t(double, stat->live_blks, nblocks);
+
+	rc->efficiency += (freed / nblocks - rc->efficiency) *
+		NILFS_CLEANERD_RATE_WEIGHT;
+	rc->gain += freed / nilfs_get_blocks_per_segment(cleanerd->nilfs);
 }
 
-static int nilfs_cleanerd_handle_manual_mode(struct nilfs_cleanerd *cleanerd,
-					     struct nilfs_sustat *sustat)
+/**
+ * nilfs_cleanerd_control_rate - set cleaning pace from the write rate
+ * @cleanerd: cleanerd object
+ * @sustat: status information on segments
+ *
+ * Description: The number of segments consumed by users since the last
+ * update is derived from the change of the number of clean segments and
+ * the net gain of cleaning, and is counted only if users wrote a log in
+ * the meantime.  The controller cleans as fast as the smoothed write
+ * rate plus the gap to target_clean_segments spread over
+ * NILFS_CLEANERD_RATE_HORIZON seconds, divided by the efficiency of
+ * cleaning.  The rate is then turned into the number of segments per
+ * cycle and the cleaning interval, ranging from one segment per
+ * clean_check_interval to mc_nsegments_per_clean segments per
+ * mc_cleaning_interval.
+ */
+static void nilfs_cleanerd_control_rate(struct nilfs_cleanerd *cleanerd,
+					const struct nilfs_sustat *sustat)
 {
-	ssize_t ret;
+	struct nilfs_cldconfig *config = &cleanerd->config;
+	struct nilfs_cleanerd_rate *rc = &cleanerd->rate;
+	struct timespec now, dt;
+	double elapsed, consumed, sample, target, rate, interval, n;
+	double min_rate, max_rate, mc_interval, max_interval;
+	long max_nsegs;
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &now) < 0)) {
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "cannot get monotonic time: %m");
+		return;
+	}
 
-	if (cleanerd->mm_nrestsegs == 0) {
-		if (cleanerd->mm_nrestpasses > 0) {
-			ret = nilfs_cleanerd_count_inuse_segments(cleanerd,
-								  sustat);
-			if (ret < 0) {
-				cleanerd->mm_nrestpasses = 0;
-			} else {
-				cleanerd->mm_nrestpasses--;
-				cleanerd->mm_nrestsegs = ret;
-			}
+	if (timespecisset(&rc->last)) {
+		timespecsub(&now, &rc->last, &dt);
+		elapsed = nilfs_timespec_to_sec(&dt);
+		if (elapsed <= 0)
+			return;
+
+		sample = 0;
+		if (sustat->ss_nongc_ctime != rc->nongc_ctime) {
+			consumed = (double)rc->ncleansegs -
+				(double)sustat->ss_ncleansegs + rc->gain;
+			if (consumed > 0)
+				sample = consumed / elapsed;
 		}
+		rc->write_rate += (sample - rc->write_rate) *
+			NILFS_CLEANERD_RATE_WEIGHT;
 	}
-	if (cleanerd->mm_nrestpasses == 0 && cleanerd->mm_nrestsegs == 0)
-		nilfs_cleanerd_manual_end(cleanerd);
+	rc->last = now;
+	rc->ncleansegs = sustat->ss_ncleansegs;
+	rc->nongc_ctime = sustat->ss_nongc_ctime;
+	rc->gain = 0;
+
+	target = config->cf_target_clean_segments +
+		nilfs_get_reserved_segments(cleanerd->nilfs, sustat->ss_nsegs);
+	rate = rc->write_rate +
+		(target - (double)sustat->ss_ncleansegs) /
+		NILFS_CLEANERD_RATE_HORIZON;
+	rate /= max_t(double, rc->efficiency,
+		      NILFS_CLEANERD_RATE_MIN_EFFICIENCY);
+
+	max_nsegs = max_t(long, config->cf_mc_nsegments_per_clean, 1);
+	mc_interval = nilfs_timespec_to_sec(&config->cf_mc_cleaning_interval);
+	max_interval = max_t(double,
+			     nilfs_timespec_to_sec(
+				     &config->cf_clean_check_interval),
+			     mc_interval);
+	min_rate = max_interval > 0 ? 1 / max_interval : 0;
+	if (rate < min_rate)
+		rate = min_rate;
+	if (mc_interval > 0) {
+		max_rate = max_nsegs / mc_interval;
+		if (rate > max_rate)
+			rate = max_rate;
+	}
+	rc->clean_rate = rate;
+
+	interval = nilfs_timespec_to_sec(&config->cf_cleaning_interval);
+	n = rate * interval;
+	if (n > max_nsegs) {
+		n = max_nsegs;
+		interval = n / rate;
+	} else if (n < 1) {
+		n = 1;
+		interval = rate > 0 ? 1 / rate : max_interval;
+	} else if (n > (long)n) {
+		n = (long)n + 1;
+	}
+	if (interval < mc_interval)
+		interval = mc_interval;
+	if (interval > max_interval)
+		interval = max_interval;
 
-	return 0;
+	cleanerd->ncleansegs = n;
+	nilfs_sec_to_timespec(interval, &cleanerd->cleaning_interval);
 }
 
-static int nilfs_cleanerd_check_state(struct nilfs_cleanerd *cleanerd,
-				      struct nilfs_sustat *sustat)
+/* number of steps delayed in a row before a step is forced */
+#define NILFS_CLEANERD_THROTTLE_MAX_DELAYS	6
+
+/**
+ * nilfs_cleanerd_read_iostat - read I/O statistics of a block device
+ * @path: pathname of a file in the format of /sys/block/<dev>/stat
+ * @in_flight: place to store the number of requests in flight
+ * @io_ticks: place to store milliseconds spent doing I/O
+ */
+static int nilfs_cleanerd_read_iostat(const char *path,
+				      unsigned long *in_flight,
+				      unsigned long long *io_ticks)
 {
+	FILE *fp;
 	int ret;
 
-	if (cleanerd->running < 0)
-		return 1; /* suspending -> sleep */
-
-	if (cleanerd->running == 2)
-		nilfs_cleanerd_handle_manual_mode(cleanerd, sustat);
-
-	if (cleanerd->running < 2 &&
-	    nilfs_cleanerd_automatic_suspend(cleanerd)) {
-		ret = nilfs_cleanerd_handle_clean_check(cleanerd, sustat);
-		if (ret)
-			return 1; /* pausing (clean check) -> sleep */
-	}
+	fp = fopen(path, "r");
+	if (unlikely(!fp))
+		return -1;
 
-	if (cleanerd->running == 0) {
-		/* idle */
-		if (sustat->ss_nongc_ctime != cleanerd->prev_nongc_ctime) {
-			cleanerd->running = 1;
-			cleanerd->prev_nongc_ctime = sustat->ss_nongc_ctime;
-		} else {
-			return 1; /* fs not updated -> sleep */
-		}
+	/* skip read and write counters; in_flight and io_ticks follow */
+	ret = fscanf(fp, "%*s %*s %*s %*s %*s %*s %*s %*s %lu %llu",
+		     in_flight, io_ticks);
+	fclose(fp);
+	if (unlikely(ret != 2)) {
+		errno = EINVAL;
+		return -1;
 	}
-	return 0; /* do gc */
+	return 0;
 }
 
-static void nilfs_cleanerd_progress(struct nilfs_cleanerd *cleanerd, int nsegs)
+/**
+ * nilfs_cleanerd_throttle_mark - take a sample of I/O statistics
+ * @cleanerd: cleanerd object
+ *
+ * Return Value: On success, 0 is returned.  On error, -1 is returned and
+ * the throttle is disabled until the configuration is reloaded.
+ */
+static int nilfs_cleanerd_throttle_mark(struct nilfs_cleanerd *cleanerd)
 {
-	if (cleanerd->running == 2) {
-		/* decrease remaining number of segments */
-		cleanerd->mm_nrestsegs =
-			max_t(long, cleanerd->mm_nrestsegs - nsegs, 0);
+	struct nilfs_cleanerd_throttle *th = &cleanerd->throttle;
+
+	if (!th->path)
+		return -1;
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &th->last) < 0 ||
+		     nilfs_cleanerd_read_iostat(th->path, &th->in_flight,
+						&th->io_ticks) < 0)) {
+		nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+				   "cannot read %s, I/O throttle disabled: %m",
+				   th->path);
+		free(th->path);
+		th->path = NULL;
+		th->valid = 0;
+		return -1;
 	}
+	th->valid = 1;
+	return 0;
 }
 
-static int nilfs_cleanerd_clean_segments(struct nilfs_cleanerd *cleanerd,
-					 uint64_t *segnums, size_t nsegs,
-					 uint64_t protseq, size_t *ndone)
+/**
+ * nilfs_cleanerd_throttle - hold back cleaning while the device is busy
+ * @cleanerd: cleanerd object
+ * @sustat: status information on segments
+ *
+ * Description: The utilization of the device is measured between the
+ * end of the previous cleaning step and now, when only other processes
+ * use it.  If it exceeds io_throttle_utilization, the step is delayed
+ * while requests are in flight, or shrunk in proportion to the excess
+ * otherwise.  After NILFS_CLEANERD_THROTTLE_MAX_DELAYS delays in a row,
+ * a step of one segment is let through.  The throttle does not apply if
+ * the number of clean segments is below min_clean_segments, nor to
+ * manual runs.
+ *
+ * Return Value: 1 if the step is to be delayed, or 0 otherwise.
+ */
+static int nilfs_cleanerd_throttle(struct nilfs_cleanerd *cleanerd,
+				   const struct nilfs_sustat *sustat)
 {
-	struct nilfs_reclaim_params params;
-	struct nilfs_reclaim_stat stat;
-	struct timespec *pt;
-	int ret, i, sumsegs;
+	struct nilfs_cleanerd_throttle *th = &cleanerd->throttle;
+	struct nilfs_cldconfig *config = &cleanerd->config;
+	unsigned long ceiling = config->cf_io_throttle_utilization;
+	unsigned long long prev_ticks = th->io_ticks, elapsed;
+	struct timespec prev = th->last, dt;
+	int valid = th->valid;
+	long n;
+
+	th->nsegs_limit = 0;
+	if (!th->path || cleanerd->running != 1)
+		return 0;
 
-	params.flags = NILFS_RECLAIM_PARAM_PROTSEQ |
-		       NILFS_RECLAIM_PARAM_PROTCNO |
-		       NILFS_RECLAIM_PARAM_MIN_RECLAIMABLE_BLKS;
-	params.min_reclaimable_blks =
-			nilfs_cleanerd_min_reclaimable_blocks(cleanerd);
-	params.protseq = protseq;
+	if (nilfs_cleanerd_throttle_mark(cleanerd) < 0 || !valid)
+		return 0;
 
-	pt = nilfs_cleanerd_protection_period(cleanerd);
+	timespecsub(&th->last, &prev, &dt);
+	elapsed = dt.tv_sec * 1000ULL + dt.tv_nsec / 1000000;
+	if (elapsed == 0)
+		return 0;
+	th->utilization = min_t(unsigned long long,
+				(th->io_ticks - prev_ticks) * 100 / elapsed,
+				100);
+	if (th->utilization <= ceiling) {
+		th->ndelays = 0;
+		return 0;
+	}
 
-	ret = nilfs_cnormap_track_back(cleanerd->cnormap, pt->tv_sec,
-				       &params.protcno);
-	if (unlikely(ret < 0)) {
-		syslog(LOG_ERR,
-		       "cannot get checkpoint number from protection period (%llu): %m",
-		       (unsigned long long)pt->tv_sec);
-		goto out;
+	if (sustat->ss_ncleansegs < config->cf_min_clean_segments +
+	    nilfs_get_reserved_segments(cleanerd->nilfs, sustat->ss_nsegs)) {
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+				   "device busy (%lu%%), not throttled",
+				   th->utilization);
+		return 0;
 	}
-	syslog(LOG_DEBUG, "got cno %llu from protection period %lu",
-	       (unsigned long long)params.protcno, (unsigned long)pt->tv_sec);
 
-	memset(&stat, 0, sizeof(stat));
-	ret = nilfs_xreclaim_segment(cleanerd->nilfs, segnums, nsegs, 0,
-				     &params, &stat);
+	if (th->in_flight > 0 &&
+	    th->ndelays < NILFS_CLEANERD_THROTTLE_MAX_DELAYS) {
+		th->ndelays++;
+		th->delayed_steps++;
+		cleanerd->timeout = *nilfs_cleanerd_cleaning_interval(cleanerd);
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+				   "device busy (%lu%%, %lu in flight), delay",
+				   th->utilization, th->in_flight);
+		return 1;
+	}
+
+	n = th->ndelays ? 1 : cleanerd->ncleansegs *
+		(100 - th->utilization) / (100 - ceiling);
+	th->nsegs_limit = max_t(long, n, 1);
+	th->ndelays = 0;
+	th->shrunk_steps++;
+	nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+			   "device busy (%lu%%), clean up to %ld segments",
+			   th->utilization, th->nsegs_limit);
+	return 0;
+}
+
+/* minimum interval in seconds between writes of the metrics file */
+#define NILFS_CLEANERD_METRICS_INTERVAL	1
+
+static const char * const nilfs_ioctl_stat_names[] = {
+	[NILFS_IOCTL_STAT_CHANGE_CPMODE]	= "change_cpmode",
+	[NILFS_IOCTL_STAT_DELETE_CHECKPOINT]	= "delete_checkpoint",
+	[NILFS_IOCTL_STAT_GET_CPINFO]		= "get_cpinfo",
+	[NILFS_IOCTL_STAT_GET_CPSTAT]		= "get_cpstat",
+	[NILFS_IOCTL_STAT_GET_SUINFO]		= "get_suinfo",
+	[NILFS_IOCTL_STAT_SET_SUINFO]		= "set_suinfo",
+	[NILFS_IOCTL_STAT_GET_SUSTAT]		= "get_sustat",
+	[NILFS_IOCTL_STAT_GET_VINFO]		= "get_vinfo",
+	[NILFS_IOCTL_STAT_GET_BDESCS]		= "get_bdescs",
+	[NILFS_IOCTL_STAT_CLEAN_SEGMENTS]	= "clean_segments",
+	[NILFS_IOCTL_STAT_SYNC]			= "sync",
+	[NILFS_IOCTL_STAT_RESIZE]		= "resize",
+	[NILFS_IOCTL_STAT_SET_ALLOC_RANGE]	= "set_alloc_range",
+	[NILFS_IOCTL_STAT_FREEZE]		= "freeze",
+	[NILFS_IOCTL_STAT_THAW]			= "thaw",
+};
+
+/**
+ * nilfs_cleanerd_observe - add the time elapsed since @start to a histogram
+ * @hist: histogram
+ * @start: start time (monotonic)
+ */
+static void nilfs_cleanerd_observe(struct nilfs_cleanerd_histogram *hist,
+				   const struct timespec *start)
+{
+	struct timespec now, dt;
+	double sec;
+	int i;
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+		return;
+
+	timespecsub(&now, start, &dt);
+	sec = nilfs_timespec_to_sec(&dt);
+	for (i = 0; i < ARRAY_SIZE(nilfs_cleanerd_latency_bounds); i++) {
+		if (sec <= nilfs_cleanerd_latency_bounds[i])
+			break;
+	}
+	hist->counts[i]++;
+	hist->sum += sec;
+}
+
+static void nilfs_metrics_header(FILE *fp, const char *name,
+				 const char *type, const char *help)
+{
+	fprintf(fp, "# HELP nilfs_cleanerd_%s %s\n", name, help);
+	fprintf(fp, "# TYPE nilfs_cleanerd_%s %s\n", name, type);
+}
+
+static void nilfs_metrics_put(FILE *fp, const char *label, const char *name,
+			      const char *type, const char *help,
+			      unsigned long long val)
+{
+	nilfs_metrics_header(fp, name, type, help);
+	fprintf(fp, "nilfs_cleanerd_%s{%s} %llu\n", name, label, val);
+}
+
+static void
+nilfs_metrics_put_histogram(FILE *fp, const char *label, const char *name,
+			    const char *help,
+			    const struct nilfs_cleanerd_histogram *hist)
+{
+	unsigned long long count = 0;
+	int i;
+
+	nilfs_metrics_header(fp, name, "histogram", help);
+	for (i = 0; i < ARRAY_SIZE(nilfs_cleanerd_latency_bounds); i++) {
+		count += hist->counts[i];
+		fprintf(fp, "nilfs_cleanerd_%s_bucket{%s,le=\"%g\"} %llu\n",
+			name, label, nilfs_cleanerd_latency_bounds[i], count);
+	}
+	count += hist->counts[i];
+	fprintf(fp, "nilfs_cleanerd_%s_bucket{%s,le=\"+Inf\"} %llu\n",
+		name, label, count);
+	fprintf(fp, "nilfs_cleanerd_%s_sum{%s} %.6f\n", name, label, hist->sum);
+	fprintf(fp, "nilfs_cleanerd_%s_count{%s} %llu\n", name, label, count);
+}
+
+/**
+ * nilfs_cleanerd_print_metrics - print metrics in Prometheus text format
+ * @cleanerd: cleanerd object
+ * @sustat: status information on segments
+ * @fp: output stream
+ */
+static void nilfs_cleanerd_print_metrics(struct nilfs_cleanerd *cleanerd,
+					 const struct nilfs_sustat *sustat,
+					 FILE *fp)
+{
+	const struct nilfs_cleanerd_metrics *mt = &cleanerd->metrics;
+	const char *dev = nilfs_get_dev(cleanerd->nilfs);
+	char label[PATH_MAX * 2 + 16], *cp;
+	int i;
+
+	/* escape the device name as a label value */
+	cp = label + sprintf(label, "device=\"");
+	for (; *dev; dev++) {
+		if (*dev == '"' || *dev == '\\' || *dev == '\n')
+			*cp++ = '\\';
+		*cp++ = *dev == '\n' ? 'n' : *dev;
+	}
+	strcpy(cp, "\"");
+
+	nilfs_metrics_put(fp, label, "segments", "gauge",
+			  "Number of segments of the file system.",
+			  sustat->ss_nsegs);
+	nilfs_metrics_put(fp, label, "clean_segments", "gauge",
+			  "Number of clean segments.", sustat->ss_ncleansegs);
+	nilfs_metrics_put(fp, label, "reserved_segments", "gauge",
+			  "Number of segments reserved for the file system.",
+			  nilfs_get_reserved_segments(cleanerd->nilfs,
+						      sustat->ss_nsegs));
+	nilfs_metrics_put(fp, label, "min_clean_segments", "gauge",
+			  "Number of clean segments below which cleaning starts.",
+			  cleanerd->config.cf_min_clean_segments);
+	nilfs_metrics_put(fp, label, "max_clean_segments", "gauge",
+			  "Number of clean segments above which cleaning stops.",
+			  cleanerd->config.cf_max_clean_segments);
+	fprintf(fp, "# HELP nilfs_cleanerd_running %s\n",
+		"Running state (1: running, 2: manual run, 0: idle, "
+		"-1: suspended).");
+	fprintf(fp, "# TYPE nilfs_cleanerd_running gauge\n");
+	fprintf(fp, "nilfs_cleanerd_running{%s} %d\n", label,
+		cleanerd->running);
+	nilfs_metrics_put(fp, label, "last_clean_timestamp_seconds", "gauge",
+			  "Time of the last step that cleaned segments.",
+			  mt->last_clean);
+	nilfs_metrics_put(fp, label, "update_timestamp_seconds", "gauge",
+			  "Time this file was written.", time(NULL));
+
+	nilfs_metrics_put(fp, label, "segments_selected_total", "counter",
+			  "Segments selected to be cleaned.",
+			  mt->selected_segs);
+	nilfs_metrics_put(fp, label, "segments_cleaned_total", "counter",
+			  "Segments cleaned.", mt->cleaned_segs);
+	nilfs_metrics_put(fp, label, "segments_deferred_total", "counter",
+			  "Segments whose cleaning was deferred.",
+			  mt->deferred_segs);
+	nilfs_metrics_put(fp, label, "segments_protected_total", "counter",
+			  "Selected segments skipped as protected.",
+			  mt->protected_segs);
+	nilfs_metrics_put(fp, label, "live_blocks_total", "counter",
+			  "Live blocks moved by cleaning.", mt->live_blks);
+	nilfs_metrics_put(fp, label, "defunct_blocks_total", "counter",
+			  "Blocks reclaimed by cleaning.", mt->defunct_blks);
+	nilfs_metrics_put(fp, label, "summary_read_bytes_total", "counter",
+			  "Bytes of segment summaries read.",
+			  cleanerd->bytes_read);
+	nilfs_metrics_put(fp, label, "vinfo_cache_hits_total", "counter",
+			  "Lookups of virtual blocks served by the cache.",
+			  cleanerd->vinfo_hits);
+	nilfs_metrics_put(fp, label, "vinfo_cache_misses_total", "counter",
+			  "Lookups of virtual blocks sent to the kernel.",
+			  cleanerd->vinfo_misses);
+	nilfs_metrics_put(fp, label, "io_throttle_delayed_steps_total",
+			  "counter", "Steps delayed by the I/O throttle.",
+			  cleanerd->throttle.delayed_steps);
+	nilfs_metrics_put(fp, label, "io_throttle_shrunk_steps_total",
+			  "counter", "Steps shrunk by the I/O throttle.",
+			  cleanerd->throttle.shrunk_steps);
+	nilfs_metrics_put(fp, label, "io_budget_delayed_steps_total",
+			  "counter", "Steps delayed by the I/O budget.",
+			  cleanerd->budget_delayed_steps);
+
+	nilfs_metrics_header(fp, "ioctls_total", "counter",
+			     "Ioctl calls to the file system.");
+	for (i = 0; i < __NR_NILFS_IOCTL_STAT; i++)
+		fprintf(fp, "nilfs_cleanerd_ioctls_total{%s,ioctl=\"%s\"} %llu\n",
+			label, nilfs_ioctl_stat_names[i],
+			(unsigned long long)nilfs_get_ioctl_count(
+				cleanerd->nilfs, i));
+
+	nilfs_metrics_header(fp, "phase_seconds_total", "counter",
+			     "Wall-clock time spent in each phase of cleaning.");
+	for (i = 0; i < NILFS_RECLAIM_NR_PHASES; i++)
+		fprintf(fp, "nilfs_cleanerd_phase_seconds_total{%s,phase=\"%s\"} %.6f\n",
+			label, nilfs_reclaim_phase_names[i],
+			cleanerd->phases[i].wall_ns / 1000000000.0);
+	nilfs_metrics_header(fp, "phase_cpu_seconds_total", "counter",
+			     "CPU time spent in each phase of cleaning.");
+	for (i = 0; i < NILFS_RECLAIM_NR_PHASES; i++)
+		fprintf(fp, "nilfs_cleanerd_phase_cpu_seconds_total{%s,phase=\"%s\"} %.6f\n",
+			label, nilfs_reclaim_phase_names[i],
+			cleanerd->phases[i].cpu_ns / 1000000000.0);
+
+	nilfs_metrics_put_histogram(fp, label, "select_duration_seconds",
+				    "Time taken to select segments.",
+				    &mt->select_latency);
+	nilfs_metrics_put_histogram(fp, label, "clean_duration_seconds",
+				    "Time taken by cleaning steps.",
+				    &mt->clean_latency);
+}
+
+/**
+ * nilfs_cleanerd_write_metrics - replace the metrics file
+ * @cleanerd: cleanerd object
+ * @sustat: status information on segments
+ *
+ * The metrics are written to a temporary file that is renamed over the
+ * metrics file, so that readers never see a partial file.
+ */
+static int nilfs_cleanerd_write_metrics(struct nilfs_cleanerd *cleanerd,
+					const struct nilfs_sustat *sustat)
+{
+	const char *path = cleanerd->metrics.path;
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int errsv;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fp = fopen(tmp, "w");
+	if (unlikely(!fp))
+		return -1;
+
+	nilfs_cleanerd_print_metrics(cleanerd, sustat, fp);
+
+	if (unlikely(ferror(fp))) {
+		fclose(fp);
+		errno = EIO;
+		goto failed;
+	}
+	if (unlikely(fclose(fp) == EOF || rename(tmp, path) < 0))
+		goto failed;
+	return 0;
+
+failed:
+	errsv = errno;
+	unlink(tmp);
+	errno = errsv;
+	return -1;
+}
+
+/**
+ * nilfs_cleanerd_update_metrics - write metrics before going to sleep
+ * @cleanerd: cleanerd object
+ * @sustat: status information on segments
+ *
+ * The file is rewritten at most every NILFS_CLEANERD_METRICS_INTERVAL
+ * seconds, unless the daemon is about to sleep for longer than that.
+ */
+static void nilfs_cleanerd_update_metrics(struct nilfs_cleanerd *cleanerd,
+					  const struct nilfs_sustat *sustat)
+{
+	struct nilfs_cleanerd_metrics *mt = &cleanerd->metrics;
+	struct timespec now, dt;
+
+	if (!mt->path)
+		return;
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC, &now) < 0))
+		return;
+
+	timespecsub(&now, &mt->last, &dt);
+	if (timespecisset(&mt->last) &&
+	    dt.tv_sec < NILFS_CLEANERD_METRICS_INTERVAL &&
+	    cleanerd->timeout.tv_sec < NILFS_CLEANERD_METRICS_INTERVAL)
+		return;
+
+	mt->last = now;
+	if (unlikely(nilfs_cleanerd_write_metrics(cleanerd, sustat) < 0)) {
+		if (!mt->failed)
+			nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+					   "cannot write metrics to %s: %m",
+					   mt->path);
+		mt->failed = 1;
+	} else {
+		mt->failed = 0;
+	}
+}
+
+static ssize_t
+nilfs_cleanerd_count_inuse_segments(struct nilfs_cleanerd *cleanerd,
+				    struct nilfs_sustat *sustat)
+{
+	const struct nilfs_suinfo *si;
+	uint64_t segnum, ncached;
+	ssize_t nfound = 0;
+	int ret;
+
+	ret = nilfs_sucache_refresh(cleanerd->sucache, sustat);
+	if (unlikely(ret < 0)) {
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "cannot get segment usage info: %m");
+		return -1;
+	}
+	si = nilfs_sucache_get_suinfo(cleanerd->sucache, &ncached);
+
+	for (segnum = 0; segnum < ncached; segnum++) {
+		if (nilfs_suinfo_reclaimable(&si[segnum]))
+			nfound++;
+	}
+	return nfound; /* return the number of found segments */
+}
+
+static int nilfs_cleanerd_handle_manual_mode(struct nilfs_cleanerd *cleanerd,
+					     struct nilfs_sustat *sustat)
+{
+	ssize_t ret;
+
+	if (cleanerd->mm_nrestsegs == 0) {
+		if (cleanerd->mm_nrestpasses > 0) {
+			ret = nilfs_cleanerd_count_inuse_segments(cleanerd,
+								  sustat);
+			if (ret < 0) {
+				cleanerd->mm_nrestpasses = 0;
+			} else {
+				cleanerd->mm_nrestpasses--;
+				cleanerd->mm_nrestsegs = ret;
+			}
+		}
+	}
+	if (cleanerd->mm_nrestpasses == 0 && cleanerd->mm_nrestsegs == 0)
+		nilfs_cleanerd_manual_end(cleanerd);
+
+	return 0;
+}
+
+static int nilfs_cleanerd_check_state(struct nilfs_cleanerd *cleanerd,
+				      struct nilfs_sustat *sustat)
+{
+	int ret;
+
+	if (cleanerd->running < 0)
+		return 1; /* suspending -> sleep */
+
+	if (cleanerd->running == 2)
+		nilfs_cleanerd_handle_manual_mode(cleanerd, sustat);
+
+	if (cleanerd->running < 2 &&
+	    nilfs_cleanerd_automatic_suspend(cleanerd)) {
+		ret = nilfs_cleanerd_handle_clean_check(cleanerd, sustat);
+		if (ret)
+			return 1; /* pausing (clean check) -> sleep */
+	}
+
+	if (cleanerd->running == 0) {
+		/* idle */
+		if (sustat->ss_nongc_ctime != cleanerd->prev_nongc_ctime) {
+			cleanerd->running = 1;
+			cleanerd->prev_nongc_ctime = sustat->ss_nongc_ctime;
+		} else {
+			return 1; /* fs not updated -> sleep */
+		}
+	}
+
+	if (cleanerd->running == 1 && cleanerd->config.cf_adaptive_cleaning)
+		nilfs_cleanerd_control_rate(cleanerd, sustat);
+	return 0; /* do gc */
+}
+
+static void nilfs_cleanerd_progress(struct nilfs_cleanerd *cleanerd, int nsegs)
+{
+	if (cleanerd->running == 2) {
+		/* decrease remaining number of segments */
+		cleanerd->mm_nrestsegs =
+			max_t(long, cleanerd->mm_nrestsegs - nsegs, 0);
+	}
+}
+
+/**
+ * nilfs_cleanerd_clean_segments - reclaim selected segments
+ * @cleanerd: cleanerd object
+ * @segnums: array of segments to be reclaimed
+ * @nsegs: size of the @segnums array
+ * @nextnums: array of segments expected to be reclaimed next
+ * @nnext: size of the @nextnums array
+ * @protseq: lower limit of sequence numbers of protected segments
+ * @ndone: place to store the number of cleaned or deferred segments
+ *
+ * If @nnext is not zero, the segments of @nextnums are read during the
+ * reclamation, and their blocks are used at the next step if the same
+ * segments are selected again.
+ */
+static int nilfs_cleanerd_clean_segments(struct nilfs_cleanerd *cleanerd,
+					 uint64_t *segnums, size_t nsegs,
+					 const uint64_t *nextnums, size_t nnext,
+					 uint64_t protseq, size_t *ndone)
+{
+	struct nilfs_reclaim_params params;
+	struct nilfs_reclaim_stat stat;
+	struct nilfs_reclaim_prep *next = NULL;
+	uint64_t live_bytes;
+	int ret, i, sumsegs;
+
+	ret = nilfs_cleanerd_init_reclaim_params(cleanerd, protseq, &params);
+	if (unlikely(ret < 0))
+		goto out;
+
+	if (cleanerd->config.cf_pipelined_cleaning) {
+		params.flags |= NILFS_RECLAIM_PARAM_PIPELINE;
+		params.prep = cleanerd->prep;
+		params.next_segnums = nextnums;
+		params.next_nsegs = nnext;
+		params.next_prep = &next;
+	}
+
+	memset(&stat, 0, sizeof(stat));
+	stat.exflags = NILFS_RECLAIM_STAT_VINFO_CACHE |
+		NILFS_RECLAIM_STAT_MEMORY | NILFS_RECLAIM_STAT_PIPELINE |
+		NILFS_RECLAIM_STAT_TIMING | NILFS_RECLAIM_STAT_ERROR;
+	ret = nilfs_xreclaim_segment(cleanerd->nilfs, segnums, nsegs, 0,
+				     &params, &stat);
+	if (ret == 0 && (stat.exflags & NILFS_RECLAIM_STAT_ERROR) &&
+	    stat.error) {
+		errno = stat.error;
+		nilfs_cleanerd_log(cleanerd, LOG_WARNING,
+				   "cleaning stopped after %zu segments: %m",
+				   stat.cleaned_segs);
+	}
+	nilfs_cleanerd_account_reclaim(cleanerd, &stat);
+	nilfs_cleanerd_log_timing(cleanerd, &stat);
+	nilfs_cleanerd_rate_feedback(cleanerd, &stat);
+	/* live blocks are read and written again by the kernel */
+	live_bytes = (uint64_t)stat.live_blks *
+		nilfs_get_block_size(cleanerd->nilfs);
+	nilfs_cleanerd_charge_budget(cleanerd, stat.bytes_read + live_bytes,
+				     live_bytes,
+				     stat.cleaned_segs + stat.deferred_segs);
+	cleanerd->metrics.cleaned_segs += stat.cleaned_segs;
+	cleanerd->metrics.deferred_segs += stat.deferred_segs;
+	cleanerd->metrics.protected_segs += stat.protected_segs;
+	cleanerd->metrics.live_blks += stat.live_blks;
+	cleanerd->metrics.defunct_blks += stat.defunct_blks;
+	if (stat.cleaned_segs > 0)
+		cleanerd->metrics.last_clean = time(NULL);
+	nilfs_reclaim_prep_free(cleanerd->prep);
+	cleanerd->prep = next;
+	/* cleaned or updated segments are refetched at the next refresh */
+	nilfs_sucache_invalidate(cleanerd->sucache, segnums, nsegs);
+	if (cleanerd->liveidx)
+		nilfs_liveidx_invalidate(cleanerd->liveidx, segnums, nsegs);
 	if (unlikely(ret < 0)) {
 		if (errno == ENOMEM) {
 			nilfs_cleanerd_reduce_ncleansegs_for_retry(cleanerd);
 			cleanerd->fallback = 1;
 			*ndone = 0;
 			ret = 0;
+		} else if (errno == EBUSY) {
+			/*
+			 * A checkpoint became a snapshot after the list of
+			 * snapshots was read; the list is read again at
+			 * the next step.
+			 */
+			nilfs_cleanerd_log(cleanerd, LOG_INFO,
+					   "snapshots changed during cleaning, retrying");
+			*ndone = 0;
+			ret = 0;
 		}
 		goto out;
 	}
@@ -1554,8 +3294,9 @@ static int nilfs_cleanerd_clean_segments(struct nilfs_cleanerd *cleanerd,
 
 	if (stat.cleaned_segs > 0) {
 		for (i = 0; i < stat.cleaned_segs; i++)
-			syslog(LOG_DEBUG, "segment %llu cleaned",
-			       (unsigned long long)segnums[i]);
+			nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+					   "segment %llu cleaned",
+					   (unsigned long long)segnums[i]);
 
 		nilfs_cleanerd_progress(cleanerd, stat.cleaned_segs);
 		cleanerd->fallback = 0;
@@ -1567,8 +3308,9 @@ static int nilfs_cleanerd_clean_segments(struct nilfs_cleanerd *cleanerd,
 	if (stat.deferred_segs > 0) {
 		sumsegs = stat.cleaned_segs + stat.deferred_segs;
 		for (i = stat.cleaned_segs; i < sumsegs; i++)
-			syslog(LOG_DEBUG, "segment %llu deferred",
-			       (unsigned long long)segnums[i]);
+			nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+					   "segment %llu deferred",
+					   (unsigned long long)segnums[i]);
 
 		nilfs_cleanerd_progress(cleanerd, stat.deferred_segs);
 		cleanerd->fallback = 0;
@@ -1581,14 +3323,15 @@ static int nilfs_cleanerd_clean_segments(struct nilfs_cleanerd *cleanerd,
 	}
 
 	if (*ndone == 0) {
-		syslog(LOG_DEBUG, "no segments cleaned");
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG, "no segments cleaned");
 
 		if (!cleanerd->retry_cleaning &&
 		    nilfs_segments_still_reclaimable(
 			    cleanerd->nilfs, segnums, nsegs, protseq) &&
 		    nilfs_shrink_protected_region(cleanerd->nilfs) == 0) {
 
-			syslog(LOG_DEBUG, "retrying protected region");
+			nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+					   "retrying protected region");
 			cleanerd->retry_cleaning = 1;
 		} else {
 			cleanerd->retry_cleaning = 0;
@@ -1599,37 +3342,192 @@ out:
 	return ret;
 }
 
+/* number of steps after which a volume hands its slot over */
+#define NILFS_CLEANERD_SLOT_STEPS	4
+
+static int nilfs_cleanerd_cmp_urgency(const void *elem1, const void *elem2)
+{
+	const struct nilfs_cleanerd *cl1, *cl2;
+
+	cl1 = *(struct nilfs_cleanerd * const *)elem1;
+	cl2 = *(struct nilfs_cleanerd * const *)elem2;
+
+	if (cl1->free_ratio < cl2->free_ratio)
+		return -1;
+	return cl1->free_ratio > cl2->free_ratio ? 1 : 0;
+}
+
 /**
- * nilfs_cleanerd_clean_loop - main loop of the cleaner daemon
+ * nilfs_cleanerd_kick_waiters - let the volumes waiting for a slot retry
+ * @pool: pool of volumes
+ */
+static void nilfs_cleanerd_kick_waiters(struct nilfs_cleanerd_pool *pool)
+{
+	size_t i;
+
+	for (i = 0; i < pool->nvols; i++) {
+		if (pool->vols[i]->waiting) {
+			pool->vols[i]->waiting = 0;
+			pool->vols[i]->kicked = 1;
+		}
+	}
+}
+
+/**
+ * nilfs_cleanerd_defer_slot - test if a more urgent volume wants the slot
  * @cleanerd: cleanerd object
+ *
+ * Description: The volumes woken up by a released slot run their next
+ * step in order of urgency, but a volume whose step is due anyway may
+ * come first.  It leaves the last free slot to a woken volume with a
+ * smaller ratio of clean segments.
  */
-static int nilfs_cleanerd_clean_loop(struct nilfs_cleanerd *cleanerd)
+static int nilfs_cleanerd_defer_slot(struct nilfs_cleanerd *cleanerd)
 {
-	struct nilfs_sustat sustat;
-	int64_t prottime = 0, oldest = 0;
-	uint64_t segnums[NILFS_CLDCONFIG_NSEGMENTS_PER_CLEAN_MAX];
-	sigset_t sigset;
-	size_t ndone;
-	int ns, ret;
+	struct nilfs_cleanerd_pool *pool = cleanerd->pool;
+	struct nilfs_cleanerd *rival;
+	size_t i;
 
-	sigemptyset(&sigset);
-	ret = sigprocmask(SIG_SETMASK, &sigset, NULL);
-	if (unlikely(ret < 0)) {
-		syslog(LOG_ERR, "cannot set signal mask: %m");
-		return -1;
+	if (pool->nactive + 1 < pool->nslots)
+		return 0;
+
+	for (i = 0; i < pool->nvols; i++) {
+		rival = pool->vols[i];
+		if (rival != cleanerd && rival->kicked && !rival->active &&
+		    nilfs_cleanerd_cmp_urgency(&rival, &cleanerd) < 0)
+			return 1;
 	}
+	return 0;
+}
 
-	ret = nilfs_cleanerd_init_signal_handlers(cleanerd, &sigset);
-	if (unlikely(ret < 0))
-		return -1;
+/**
+ * nilfs_cleanerd_preempt_slot - take the slot of a less urgent volume
+ * @cleanerd: cleanerd object
+ *
+ * Description: A volume short of clean segments takes over the slot of
+ * the volume with the largest ratio of clean segments among those that
+ * are neither short of clean segments nor in a manual run.  The
+ * preempted volume waits for a slot from its next step on.
+ *
+ * Return Value: 1 if a slot was freed, or 0 otherwise.
+ */
+static int nilfs_cleanerd_preempt_slot(struct nilfs_cleanerd *cleanerd)
+{
+	struct nilfs_cleanerd_pool *pool = cleanerd->pool;
+	struct nilfs_cleanerd *victim = NULL, *vol;
+	size_t i;
 
-	nilfs_cleanerd_reload_config = 0;
-	nilfs_cleanerd_dump_req = 0;
+	if (!cleanerd->short_of_space)
+		return 0;
+
+	for (i = 0; i < pool->nvols; i++) {
+		vol = pool->vols[i];
+		if (!vol->active || vol->short_of_space || vol->running == 2)
+			continue;
+		if (!victim || nilfs_cleanerd_cmp_urgency(&vol, &victim) > 0)
+			victim = vol;
+	}
+	if (!victim)
+		return 0;
+
+	nilfs_cleanerd_log(cleanerd, LOG_INFO,
+			   "take the slot of %s (short of clean segments)",
+			   nilfs_get_dev(victim->nilfs));
+	victim->active = 0;
+	victim->waiting = 1;
+	pool->nactive--;
+	return 1;
+}
+
+/**
+ * nilfs_cleanerd_acquire_slot - get permission to clean a volume
+ * @cleanerd: cleanerd object
+ *
+ * Description: A daemon serving many volumes cleans at most
+ * pool->nslots of them at a time, so that they do not contend for the
+ * disks they share.  A volume that finds all the slots taken waits for
+ * a cleaning interval or until a slot is released, unless it is short
+ * of clean segments and can preempt a less urgent volume.  Manual runs
+ * requested by clients are never held back.
+ *
+ * Return Value: 1 if the volume must wait for a slot, or 0 otherwise.
+ */
+static int nilfs_cleanerd_acquire_slot(struct nilfs_cleanerd *cleanerd)
+{
+	struct nilfs_cleanerd_pool *pool = cleanerd->pool;
+
+	if (!pool || cleanerd->active)
+		return 0;
+
+	if (cleanerd->running != 2 &&
+	    (nilfs_cleanerd_defer_slot(cleanerd) ||
+	     (pool->nactive >= pool->nslots &&
+	      !nilfs_cleanerd_preempt_slot(cleanerd)))) {
+		cleanerd->waiting = 1;
+		cleanerd->timeout = *nilfs_cleanerd_cleaning_interval(cleanerd);
+		nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+				   "wait for a slot (%d busy)", pool->nactive);
+		return 1;
+	}
+	cleanerd->waiting = 0;
+	cleanerd->active = 1;
+	cleanerd->nsteps = 0;
+	pool->nactive++;
+	return 0;
+}
+
+/**
+ * nilfs_cleanerd_release_slot - give up permission to clean a volume
+ * @cleanerd: cleanerd object
+ *
+ * Description: The volumes waiting for a slot are woken up to compete
+ * for the released one.
+ */
+static void nilfs_cleanerd_release_slot(struct nilfs_cleanerd *cleanerd)
+{
+	struct nilfs_cleanerd_pool *pool = cleanerd->pool;
+
+	if (!pool || !cleanerd->active)
+		return;
+
+	cleanerd->active = 0;
+	pool->nactive--;
+	nilfs_cleanerd_kick_waiters(pool);
+}
+
+/**
+ * nilfs_cleanerd_unlock_pool - let the other volumes go on during I/O
+ * @cleanerd: cleanerd object
+ *
+ * Description: A worker thread of a multi-volume daemon runs a step
+ * with the lock of the pool held, and drops it only while the step
+ * reads or writes without looking at the scheduling state.
+ */
+static void nilfs_cleanerd_unlock_pool(struct nilfs_cleanerd *cleanerd)
+{
+	if (cleanerd->pool)
+		pthread_mutex_unlock(&cleanerd->pool->lock);
+}
+
+static void nilfs_cleanerd_lock_pool(struct nilfs_cleanerd *cleanerd)
+{
+	if (cleanerd->pool)
+		pthread_mutex_lock(&cleanerd->pool->lock);
+}
+
+/**
+ * nilfs_cleanerd_start - prepare a volume for the main loop
+ * @cleanerd: cleanerd object
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+static int nilfs_cleanerd_start(struct nilfs_cleanerd *cleanerd)
+{
+	int ret;
 
 	cleanerd->running = 1;
 	cleanerd->fallback = 0;
 	cleanerd->retry_cleaning = 0;
-	nilfs_gc_logger = syslog;
 
 	ret = nilfs_cleanerd_init_interval(cleanerd);
 	if (unlikely(ret < 0))
@@ -1639,64 +3537,176 @@ static int nilfs_cleanerd_clean_loop(struct nilfs_cleanerd *cleanerd)
 	cleanerd->cleaning_interval = cleanerd->config.cf_cleaning_interval;
 	cleanerd->min_reclaimable_blocks =
 			cleanerd->config.cf_min_reclaimable_blocks;
-
+	cleanerd->read_bucket.rate = cleanerd->config.cf_gc_read_bandwidth;
+	cleanerd->write_bucket.rate = cleanerd->config.cf_gc_write_bandwidth;
 
 	if (nilfs_cleanerd_automatic_suspend(cleanerd))
 		nilfs_cleanerd_clean_check_pause(cleanerd);
+	return 0;
+}
 
-	while (!cleanerd->shutdown) {
-		cleanerd->no_timeout = 0;
+/**
+ * nilfs_cleanerd_step - run one step of garbage collection
+ * @cleanerd: cleanerd object
+ *
+ * Description: This checks the state of the file system and cleans the
+ * segments selected, if any.  cleanerd->timeout is set to the time to
+ * wait before the next step.  In a multi-volume daemon, this is called
+ * on a worker thread with the lock of the pool held.
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+static int nilfs_cleanerd_step(struct nilfs_cleanerd *cleanerd)
+{
+	struct nilfs_sustat sustat;
+	int64_t prottime = 0, oldest = 0;
+	uint64_t segnums[NILFS_CLDCONFIG_NSEGMENTS_SELECT_MAX];
+	struct timespec start;
+	size_t ndone, nnext;
+	int ns, ret;
 
-		ret = sigprocmask(SIG_BLOCK, &sigset, NULL);
-		if (unlikely(ret < 0)) {
-			syslog(LOG_ERR, "cannot set signal mask: %m");
-			return -1;
-		}
+	cleanerd->no_timeout = 0;
+
+	ret = nilfs_get_sustat(cleanerd->nilfs, &sustat);
+	if (unlikely(ret < 0)) {
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "cannot get segment usage stat: %m");
+		return -1;
+	}
+	if (sustat.ss_nsegs > 0)
+		cleanerd->free_ratio =
+			(double)sustat.ss_ncleansegs / sustat.ss_nsegs;
+	cleanerd->short_of_space =
+		nilfs_cleanerd_automatic_suspend(cleanerd) &&
+		sustat.ss_ncleansegs < cleanerd->config.cf_min_clean_segments +
+		nilfs_get_reserved_segments(cleanerd->nilfs, sustat.ss_nsegs);
+
+	if (nilfs_cleanerd_check_state(cleanerd, &sustat)) {
+		nilfs_cleanerd_release_slot(cleanerd);
+		goto sleep;
+	}
+
+	if (nilfs_cleanerd_acquire_slot(cleanerd))
+		goto sleep;
+
+	if (nilfs_cleanerd_throttle(cleanerd, &sustat))
+		goto sleep;
 
-		nilfs_cleanerd_handle_signals(cleanerd);
+	if (nilfs_cleanerd_check_budget(cleanerd))
+		goto sleep;
 
-		ret = nilfs_get_sustat(cleanerd->nilfs, &sustat);
+	/* starts garbage collection */
+	nilfs_cleanerd_log(cleanerd, LOG_DEBUG, "ncleansegs = %llu",
+			   (unsigned long long)sustat.ss_ncleansegs);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	nilfs_cleanerd_unlock_pool(cleanerd);
+	ns = nilfs_cleanerd_select_segments(
+		cleanerd, &sustat, segnums, &nnext, &prottime, &oldest);
+	if (unlikely(ns < 0)) {
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "cannot select segments: %m");
+		nilfs_cleanerd_lock_pool(cleanerd);
+		return -1;
+	}
+	nilfs_cleanerd_observe(&cleanerd->metrics.select_latency, &start);
+	cleanerd->metrics.selected_segs += ns;
+	nilfs_cleanerd_log(cleanerd, LOG_DEBUG,
+			   "%d segment%s selected to be cleaned", ns,
+			   (ns <= 1) ? "" : "s");
+	ndone = 0;
+	if (ns > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = nilfs_cleanerd_clean_segments(
+			cleanerd, segnums, ns, segnums + ns, nnext,
+			sustat.ss_prot_seq, &ndone);
 		if (unlikely(ret < 0)) {
-			syslog(LOG_ERR, "cannot get segment usage stat: %m");
+			nilfs_cleanerd_lock_pool(cleanerd);
 			return -1;
 		}
+		nilfs_cleanerd_observe(&cleanerd->metrics.clean_latency,
+				       &start);
+		/* leave the I/O of this step out of the next sample */
+		nilfs_cleanerd_throttle_mark(cleanerd);
+	} else {
+		cleanerd->retry_cleaning = 0;
+	}
+	nilfs_cleanerd_lock_pool(cleanerd);
+	/* done */
+
+	ret = nilfs_cleanerd_recalc_interval(
+		cleanerd, ns, ndone, prottime, oldest);
+	if (unlikely(ret < 0))
+		return -1;
+
+	/*
+	 * Hand the slot over while there is nothing to clean here, and
+	 * every few steps so that the most urgent volume gets it next.
+	 */
+	if ((ndone == 0 && !cleanerd->fallback &&
+	     !cleanerd->retry_cleaning) ||
+	    (cleanerd->active &&
+	     ++cleanerd->nsteps >= NILFS_CLEANERD_SLOT_STEPS))
+		nilfs_cleanerd_release_slot(cleanerd);
 
-		if (nilfs_cleanerd_check_state(cleanerd, &sustat))
-			goto sleep;
+sleep:
+	/* a woken volume may have left a free slot untaken */
+	if (cleanerd->pool && !cleanerd->active &&
+	    cleanerd->pool->nactive < cleanerd->pool->nslots)
+		nilfs_cleanerd_kick_waiters(cleanerd->pool);
+	nilfs_cleanerd_unlock_pool(cleanerd);
+	nilfs_cleanerd_update_metrics(cleanerd, &sustat);
+	nilfs_cleanerd_lock_pool(cleanerd);
+	return 0;
+}
 
-		/* starts garbage collection */
-		syslog(LOG_DEBUG, "ncleansegs = %llu",
-		       (unsigned long long)sustat.ss_ncleansegs);
+/**
+ * nilfs_cleanerd_clean_loop - main loop of the cleaner daemon
+ * @cleanerd: cleanerd object
+ */
+static int nilfs_cleanerd_clean_loop(struct nilfs_cleanerd *cleanerd)
+{
+	sigset_t sigset;
+	int ret;
 
-		ns = nilfs_cleanerd_select_segments(
-			cleanerd, &sustat, segnums, &prottime, &oldest);
-		if (unlikely(ns < 0)) {
-			syslog(LOG_ERR, "cannot select segments: %m");
+	sigemptyset(&sigset);
+	ret = sigprocmask(SIG_SETMASK, &sigset, NULL);
+	if (unlikely(ret < 0)) {
+		nilfs_cleanerd_log(cleanerd, LOG_ERR,
+				   "cannot set signal mask: %m");
+		return -1;
+	}
+
+	ret = nilfs_cleanerd_init_signal_handlers(cleanerd, &sigset);
+	if (unlikely(ret < 0))
+		return -1;
+
+	nilfs_cleanerd_reload_config = 0;
+	nilfs_cleanerd_dump_req = 0;
+	nilfs_gc_logger = syslog;
+
+	ret = nilfs_cleanerd_start(cleanerd);
+	if (unlikely(ret < 0))
+		return -1;
+
+	while (!cleanerd->shutdown) {
+		ret = sigprocmask(SIG_BLOCK, &sigset, NULL);
+		if (unlikely(ret < 0)) {
+			nilfs_cleanerd_log(cleanerd, LOG_ERR,
+					   "cannot set signal mask: %m");
 			return -1;
 		}
-		syslog(LOG_DEBUG, "%d segment%s selected to be cleaned",
-		       ns, (ns <= 1) ? "" : "s");
-		ndone = 0;
-		if (ns > 0) {
-			ret = nilfs_cleanerd_clean_segments(
-				cleanerd, segnums, ns, sustat.ss_prot_seq,
-				&ndone);
-			if (unlikely(ret < 0))
-				return -1;
-		} else {
-			cleanerd->retry_cleaning = 0;
-		}
-		/* done */
 
-		ret = nilfs_cleanerd_recalc_interval(
-			cleanerd, ns, ndone, prottime, oldest);
+		nilfs_cleanerd_handle_signals(&cleanerd, 1);
+
+		ret = nilfs_cleanerd_step(cleanerd);
 		if (unlikely(ret < 0))
 			return -1;
 
-sleep:
 		ret = sigprocmask(SIG_UNBLOCK, &sigset, NULL);
 		if (unlikely(ret < 0)) {
-			syslog(LOG_ERR, "cannot set signal mask: %m");
+			nilfs_cleanerd_log(cleanerd, LOG_ERR,
+					   "cannot set signal mask: %m");
 			return -1;
 		}
 
@@ -1707,11 +3717,402 @@ sleep:
 	return 0;
 }
 
+/**
+ * nilfs_cleanerd_pool_detach - stop serving a volume
+ * @pool: pool of volumes
+ * @index: index of the volume in @pool
+ */
+static void nilfs_cleanerd_pool_detach(struct nilfs_cleanerd_pool *pool,
+				       size_t index)
+{
+	struct nilfs_cleanerd *cleanerd = pool->vols[index];
+
+	syslog(LOG_INFO, "detach %s", nilfs_get_dev(cleanerd->nilfs));
+	nilfs_cleanerd_release_slot(cleanerd);
+	pool->nvols--;
+	memmove(&pool->vols[index], &pool->vols[index + 1],
+		sizeof(pool->vols[0]) * (pool->nvols - index));
+	if (nilfs_cleanerd == cleanerd)
+		nilfs_cleanerd = NULL;
+	nilfs_cleanerd_destroy(cleanerd);
+}
+
+/**
+ * nilfs_cleanerd_pool_worker - run the steps queued by the main loop
+ * @arg: pool of volumes
+ *
+ * Description: A worker takes the most urgent volume of the queue and
+ * runs its step.  It clears the busy flag of the volume afterwards and
+ * writes to the wakeup pipe, so that the main loop waits on the message
+ * queue of the volume again and schedules its next step.
+ */
+static void *nilfs_cleanerd_pool_worker(void *arg)
+{
+	struct nilfs_cleanerd_pool *pool = arg;
+	struct nilfs_cleanerd *cleanerd;
+	struct timespec now;
+	char c = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->nqueued == 0)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->stop)
+			break;
+
+		cleanerd = pool->queue[0];
+		pool->nqueued--;
+		memmove(&pool->queue[0], &pool->queue[1],
+			sizeof(pool->queue[0]) * pool->nqueued);
+
+		nilfs_cleanerd = cleanerd;
+		if (unlikely(nilfs_cleanerd_step(cleanerd) < 0)) {
+			syslog(LOG_ERR, "cleaning %s failed",
+			       nilfs_get_dev(cleanerd->nilfs));
+			cleanerd->shutdown = 1;
+			/* let the others take over its slot */
+			nilfs_cleanerd_release_slot(cleanerd);
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timespecadd(&now, &cleanerd->timeout,
+				    &cleanerd->wakeup);
+		}
+		nilfs_cleanerd = NULL;
+		/* do not keep the volume busy until the next step */
+		nilfs_close_ioc(cleanerd->nilfs);
+		cleanerd->busy = 0;
+
+		if (unlikely(write(pool->wakefd[1], &c, 1) < 0 &&
+			     errno != EAGAIN))
+			syslog(LOG_ERR, "cannot wake up the main loop: %m");
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * nilfs_cleanerd_pool_start - start the worker threads of a pool
+ * @pool: pool of volumes
+ *
+ * Description: A pool has as many workers as slots, but no more than
+ * volumes, so that every volume holding a slot can be cleaned at the
+ * same time as the others.  The workers block all the signals, which
+ * are left to the main loop.
+ *
+ * Return Value: On success, 0 is returned. On error, -1 is returned.
+ */
+static int nilfs_cleanerd_pool_start(struct nilfs_cleanerd_pool *pool)
+{
+	sigset_t sigset, oldset;
+	int nthreads = pool->nslots;
+	int ret;
+
+	if ((size_t)nthreads > pool->nvols)
+		nthreads = pool->nvols;
+
+	pool->queue = malloc(sizeof(*pool->queue) * pool->nvols);
+	pool->threads = malloc(sizeof(*pool->threads) * nthreads);
+	if (unlikely(!pool->queue || !pool->threads)) {
+		syslog(LOG_ERR, "cannot allocate memory: %m");
+		return -1;
+	}
+
+	if (unlikely(pipe2(pool->wakefd, O_NONBLOCK | O_CLOEXEC) < 0)) {
+		syslog(LOG_ERR, "cannot create pipe: %m");
+		return -1;
+	}
+
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+	while (pool->nthreads < nthreads) {
+		ret = pthread_create(&pool->threads[pool->nthreads], NULL,
+				     nilfs_cleanerd_pool_worker, pool);
+		if (unlikely(ret != 0)) {
+			syslog(LOG_ERR, "cannot start worker thread: %s",
+			       strerror(ret));
+			break;
+		}
+		pool->nthreads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	return pool->nthreads < nthreads ? -1 : 0;
+}
+
+/**
+ * nilfs_cleanerd_pool_stop - stop the worker threads of a pool
+ * @pool: pool of volumes
+ *
+ * Description: The workers finish the steps they are running, and the
+ * steps still queued are dropped.  This must be called without the
+ * lock of the pool held.
+ */
+static void nilfs_cleanerd_pool_stop(struct nilfs_cleanerd_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pool->nthreads = 0;
+
+	if (pool->wakefd[0] >= 0) {
+		close(pool->wakefd[0]);
+		close(pool->wakefd[1]);
+	}
+	free(pool->threads);
+	free(pool->queue);
+}
+
+/**
+ * nilfs_cleanerd_pool_dispatch - queue the steps that are due
+ * @pool: pool of volumes
+ * @due: array to collect the volumes in
+ *
+ * Description: The steps due at the same time are queued in order of
+ * urgency, that is, the volume with the smallest ratio of clean
+ * segments first, so that it is the first to get a worker and a free
+ * slot.  The mount point of a volume is open only during its steps, so
+ * that the volume can be unmounted between them.  A volume found
+ * unmounted, or mounted again, at the time of its step is shut down.
+ */
+static void nilfs_cleanerd_pool_dispatch(struct nilfs_cleanerd_pool *pool,
+					 struct nilfs_cleanerd **due)
+{
+	struct nilfs_cleanerd *cleanerd;
+	struct timespec now;
+	size_t i, ndue = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < pool->nvols; i++) {
+		cleanerd = pool->vols[i];
+		if (cleanerd->busy || cleanerd->shutdown)
+			continue;
+		if (cleanerd->kicked ||
+		    !timespeccmp(&now, &cleanerd->wakeup, <))
+			due[ndue++] = cleanerd;
+	}
+
+	for (i = 0; i < ndue; i++) {
+		cleanerd = due[i];
+		cleanerd->kicked = 0;
+		if (check_mount(nilfs_get_dev(cleanerd->nilfs)) == 0) {
+			/* unmounted lazily, or the mount is gone */
+			nilfs_cleanerd_log(cleanerd, LOG_INFO,
+					   "no longer mounted");
+			cleanerd->shutdown = 1;
+			nilfs_cleanerd_release_slot(cleanerd);
+			continue;
+		}
+		if (unlikely(nilfs_open_ioc(cleanerd->nilfs) < 0)) {
+			/* moved, covered, or mounted again */
+			nilfs_cleanerd_log(cleanerd, LOG_INFO,
+					   "cannot open the mount point: %m");
+			cleanerd->shutdown = 1;
+			nilfs_cleanerd_release_slot(cleanerd);
+			continue;
+		}
+		cleanerd->busy = 1;
+		pool->queue[pool->nqueued++] = cleanerd;
+	}
+
+	if (pool->nqueued > 0) {
+		qsort(pool->queue, pool->nqueued, sizeof(*pool->queue),
+		      nilfs_cleanerd_cmp_urgency);
+		pthread_cond_broadcast(&pool->cond);
+	}
+}
+
+/**
+ * nilfs_cleanerd_pool_loop - main loop of a daemon serving many volumes
+ * @pool: pool of volumes
+ *
+ * Description: The main loop waits on the message queues of the
+ * volumes and hands the steps that are due over to the worker threads
+ * of @pool, which clean up to pool->nslots volumes at the same time.
+ * The message queue of a volume is left alone while its step runs, and
+ * the workers wake up the loop through a pipe when a step ends.  A
+ * volume is detached when a client shuts it down, when it fails, or
+ * when it is found unmounted at the time of its step, and the loop ends
+ * when no volume is left.  SIGTERM and SIGINT are taken only while the
+ * loop waits, and end it as well.  The caller stops the workers with
+ * nilfs_cleanerd_pool_stop().
+ */
+static int nilfs_cleanerd_pool_loop(struct nilfs_cleanerd_pool *pool)
+{
+	struct nilfs_cleanerd *cleanerd, **due;
+	struct pollfd *pfds;
+	struct timespec now, timeout, ts;
+	sigset_t sigset;
+	size_t i;
+	char buf[64];
+	int nready, ret = -1;
+
+	due = malloc(sizeof(*due) * pool->nvols);
+	pfds = malloc(sizeof(*pfds) * (pool->nvols + 1));
+	if (unlikely(!due || !pfds)) {
+		syslog(LOG_ERR, "cannot allocate memory: %m");
+		goto out;
+	}
+
+	sigemptyset(&sigset);
+	if (unlikely(sigprocmask(SIG_SETMASK, &sigset, NULL) < 0)) {
+		syslog(LOG_ERR, "cannot set signal mask: %m");
+		goto out;
+	}
+
+	if (unlikely(nilfs_cleanerd_init_signal_handlers(pool->vols[0],
+							 &sigset) < 0))
+		goto out;
+
+	if (unlikely(set_signal_handler(SIGTERM, handle_sigterm_pool) < 0 ||
+		     set_signal_handler(SIGINT, handle_sigterm_pool) < 0)) {
+		syslog(LOG_ERR, "cannot set SIGTERM signal handler: %m");
+		goto out;
+	}
+	sigaddset(&sigset, SIGTERM);
+	sigaddset(&sigset, SIGINT);
+
+	nilfs_cleanerd_reload_config = 0;
+	nilfs_cleanerd_dump_req = 0;
+	nilfs_cleanerd_exit_req = 0;
+	nilfs_gc_logger = nilfs_cleanerd_gc_logger;
+
+	for (i = 0; i < pool->nvols; ) {
+		cleanerd = pool->vols[i];
+		nilfs_cleanerd = cleanerd;
+		if (unlikely(nilfs_cleanerd_start(cleanerd) < 0)) {
+			nilfs_cleanerd_pool_detach(pool, i);
+			continue;
+		}
+		cleanerd->kicked = 1;
+		i++;
+	}
+	nilfs_cleanerd = NULL;
+
+	if (pool->nvols == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	if (unlikely(sigprocmask(SIG_BLOCK, &sigset, NULL) < 0)) {
+		syslog(LOG_ERR, "cannot set signal mask: %m");
+		goto out;
+	}
+
+	if (unlikely(nilfs_cleanerd_pool_start(pool) < 0))
+		goto out;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		if (nilfs_cleanerd_exit_req)
+			break;
+
+		nilfs_cleanerd_handle_signals(pool->vols, pool->nvols);
+
+		for (i = 0; i < pool->nvols; ) {
+			if (pool->vols[i]->shutdown && !pool->vols[i]->busy)
+				nilfs_cleanerd_pool_detach(pool, i);
+			else
+				i++;
+		}
+		if (pool->nvols == 0)
+			break;
+
+		nilfs_cleanerd_pool_dispatch(pool, due);
+
+		/* sleep until the earliest step is due or a step ends */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout.tv_sec = LONG_MAX;
+		timeout.tv_nsec = 0;
+		for (i = 0; i < pool->nvols; i++) {
+			cleanerd = pool->vols[i];
+			pfds[i].fd = cleanerd->busy ? -1 : cleanerd->recvq;
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+
+			if (cleanerd->busy)
+				continue;
+			if (cleanerd->kicked || cleanerd->shutdown ||
+			    !timespeccmp(&now, &cleanerd->wakeup, <)) {
+				timeout.tv_sec = 0;
+				continue;
+			}
+			timespecsub(&cleanerd->wakeup, &now, &ts);
+			if (timespeccmp(&ts, &timeout, <))
+				timeout = ts;
+		}
+		pfds[i].fd = pool->wakefd[0];
+		pfds[i].events = POLLIN;
+		pfds[i].revents = 0;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		if (unlikely(sigprocmask(SIG_UNBLOCK, &sigset, NULL) < 0)) {
+			syslog(LOG_ERR, "cannot set signal mask: %m");
+			goto out;
+		}
+
+		syslog(LOG_DEBUG, "wait %ld.%09ld",
+		       timeout.tv_sec, timeout.tv_nsec);
+
+		nready = ppoll(pfds, pool->nvols + 1, &timeout, NULL);
+		if (unlikely(nready < 0)) {
+			if (errno != EINTR) {
+				syslog(LOG_ERR, "ppoll failed: %m");
+				goto out;
+			}
+			syslog(LOG_INFO, "wake up (interrupted)");
+		}
+
+		if (unlikely(sigprocmask(SIG_BLOCK, &sigset, NULL) < 0)) {
+			syslog(LOG_ERR, "cannot set signal mask: %m");
+			goto out;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		if (nready <= 0)
+			continue;
+
+		if (pfds[pool->nvols].revents & POLLIN) {
+			while (read(pool->wakefd[0], buf, sizeof(buf)) > 0)
+				;
+		}
+
+		for (i = 0; i < pool->nvols; i++) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			cleanerd = pool->vols[i];
+			if (unlikely(nilfs_cleanerd_receive(cleanerd) < 0))
+				cleanerd->shutdown = 1;
+			/* the message may have changed the schedule */
+			cleanerd->kicked = 1;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	ret = 0;
+out:
+	free(pfds);
+	free(due);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	char *progname, *conffile;
 	char *dev, *dir;
 	char *endptr;
+	struct nilfs_cleanerd_pool *pool = &nilfs_cleanerd_pool;
+	struct nilfs_cleanerd *cleanerd;
+	char **volatile devs = NULL;	/* used after siglongjmp */
+	volatile size_t ndevs = 0;
+	size_t i;
+	unsigned long max_active = 1;
+	int multi = 0;
 	int status, c, ret;
 #ifdef _GNU_SOURCE
 	int option_index;
@@ -1726,19 +4127,30 @@ int main(int argc, char *argv[])
 	dir = NULL;
 
 #ifdef _GNU_SOURCE
-	while ((c = getopt_long(argc, argv, "c:hnp:V",
+	while ((c = getopt_long(argc, argv, "a:c:hmnp:V",
 				long_option, &option_index)) >= 0) {
 #else	/* !_GNU_SOURCE */
-	while ((c = getopt(argc, argv, "c:hnp:V")) >= 0) {
+	while ((c = getopt(argc, argv, "a:c:hmnp:V")) >= 0) {
 #endif	/* _GNU_SOURCE */
 
 		switch (c) {
+		case 'a':
+			max_active = strtoul(optarg, &endptr, 10);
+			if (endptr == optarg || *endptr != '\0' ||
+			    max_active == 0 || max_active > INT_MAX)
+				errx(EXIT_FAILURE,
+				     "invalid number of active devices: %s",
+				     optarg);
+			break;
 		case 'c':
 			conffile = optarg;
 			break;
 		case 'h':
 			nilfs_cleanerd_usage(progname);
 			exit(EXIT_SUCCESS);
+		case 'm':
+			multi = 1;
+			break;
 		case 'n':
 			/* ignore nofork option, do nothing */
 			break;
@@ -1762,6 +4174,27 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (multi) {
+		if (optind >= argc)
+			errx(EXIT_FAILURE, "no device specified");
+
+		devs = calloc(argc - optind, sizeof(*devs));
+		if (unlikely(!devs))
+			err(EXIT_FAILURE, NULL);
+
+		for ( ; optind < argc; optind++) {
+			devs[ndevs] = get_canonical_path(argv[optind]);
+			if (unlikely(!devs[ndevs])) {
+				warn("failed to canonicalize device path %s",
+				     argv[optind]);
+				status = EXIT_FAILURE;
+				goto out_free;
+			}
+			ndevs++;
+		}
+		goto daemonize;
+	}
+
 	if (optind < argc) {
 		const char *path = argv[optind++];
 
@@ -1782,6 +4215,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
+daemonize:
 	ret = daemonize(0, 0);
 	if (unlikely(ret < 0)) {
 		warn(NULL);
@@ -1797,7 +4231,10 @@ int main(int argc, char *argv[])
 		syslog(LOG_WARNING,
 		       "adjusting the OOM killer failed: %m");
 
-	nilfs_cleanerd = nilfs_cleanerd_create(dev, dir, conffile);
+	if (multi)
+		goto start_pool;
+
+	nilfs_cleanerd = nilfs_cleanerd_create(dev, dir, conffile, NULL);
 	if (unlikely(nilfs_cleanerd == NULL)) {
 		syslog(LOG_ERR, "cannot create cleanerd on %s: %m", dev);
 		status = EXIT_FAILURE;
@@ -1811,6 +4248,40 @@ int main(int argc, char *argv[])
 	}
 
 	nilfs_cleanerd_destroy(nilfs_cleanerd);
+	goto out_close_log;
+
+start_pool:
+	pool->vols = calloc(ndevs, sizeof(*pool->vols));
+	if (unlikely(!pool->vols)) {
+		syslog(LOG_ERR, "cannot allocate memory: %m");
+		status = EXIT_FAILURE;
+		goto out_close_log;
+	}
+	pool->nslots = max_active;
+
+	for (i = 0; i < ndevs; i++) {
+		cleanerd = nilfs_cleanerd_create(devs[i], NULL, conffile,
+						 pool);
+		if (unlikely(cleanerd == NULL)) {
+			syslog(LOG_ERR, "cannot create cleanerd on %s: %m",
+			       devs[i]);
+			status = EXIT_FAILURE;
+			continue;
+		}
+		pool->vols[pool->nvols++] = cleanerd;
+		syslog(LOG_INFO, "attach %s", devs[i]);
+	}
+
+	if (pool->nvols > 0) {
+		ret = nilfs_cleanerd_pool_loop(pool);
+		if (unlikely(ret < 0))
+			status = EXIT_FAILURE;
+	}
+	nilfs_cleanerd_pool_stop(pool);
+
+	for (i = 0; i < pool->nvols; i++)
+		nilfs_cleanerd_destroy(pool->vols[i]);
+	free(pool->vols);
 
 out_close_log:
 	syslog(LOG_INFO, "shutdown");
@@ -1819,6 +4290,9 @@ out_close_log:
 out_free:
 	free(dir);	/* free(NULL) is just ignored */
 	free(dev);
+	for (i = 0; i < ndevs; i++)
+		free(devs[i]);
+	free(devs);
 
 	exit(status);
 }
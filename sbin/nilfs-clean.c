@@ -77,6 +77,7 @@ static const struct option long_option[] = {
 	{"status", no_argument, NULL, 'l'},
 	{"protection-period", required_argument, NULL, 'p'},
 	{"quit", no_argument, NULL, 'q'},
+	{"read-bandwidth", required_argument, NULL, 'R'},
 	{"resume", no_argument, NULL, 'r'},
 	{"stop", no_argument, NULL, 'b'},
 	{"suspend", no_argument, NULL, 's'},
@@ -84,6 +85,7 @@ static const struct option long_option[] = {
 	{"min-reclaimable-blocks", required_argument, NULL, 'm'},
 	{"verbose", no_argument, NULL, 'v'},
 	{"version", no_argument, NULL, 'V'},
+	{"write-bandwidth", required_argument, NULL, 'W'},
 	{NULL, 0, NULL, 0}
 };
 #define NILFS_CLEAN_USAGE						\
@@ -100,16 +102,21 @@ static const struct option long_option[] = {
 	"               \t\tbefore a segment can be cleaned\n"		\
 	"  -q, --quit\t\tshutdown cleaner\n"				\
 	"  -r, --resume\t\tresume cleaner\n"				\
+	"  -R, --read-bandwidth=BYTES\n"				\
+	"               \t\tlimit bytes read by GC per second\n"	\
 	"  -s, --suspend\t\tsuspend cleaner\n"				\
 	"  -S, --speed=COUNT[/SECONDS]\n"				\
 	"               \t\tset GC speed\n"				\
 	"  -v, --verbose\t\tverbose mode\n"				\
-	"  -V, --version\t\tdisplay version and exit\n"
+	"  -V, --version\t\tdisplay version and exit\n"			\
+	"  -W, --write-bandwidth=BYTES\n"				\
+	"               \t\tlimit bytes written by GC per second\n"
 #else
 #define NILFS_CLEAN_USAGE						  \
 	"Usage: %s [-b] [-c [conffile]] [-h] [-l] [-m blocks]\n"	  \
-	"          [-p protection-period] [-q] [-r] [-s] [-S gc-speed]\n" \
-	"          [-v] [-V] [device]\n"
+	"          [-p protection-period] [-q] [-r] [-R read-bandwidth]\n" \
+	"          [-s] [-S gc-speed] [-v] [-V] [-W write-bandwidth]\n"	  \
+	"          [device]\n"
 #endif	/* _GNU_SOURCE */
 
 
@@ -121,6 +128,7 @@ enum {
 	NILFS_CLEAN_CMD_RELOAD,
 	NILFS_CLEAN_CMD_STOP,
 	NILFS_CLEAN_CMD_SHUTDOWN,
+	NILFS_CLEAN_CMD_TUNE,
 };
 
 /* options */
@@ -135,6 +143,8 @@ static int nsegments_per_clean = 2;
 static struct timespec cleaning_interval = { 0, 100000000 };   /* 100 msec */
 static unsigned long min_reclaimable_blocks = ULONG_MAX;
 static unsigned char min_reclaimable_blocks_unit = NILFS_CLEANER_ARG_UNIT_NONE;
+static unsigned long long read_bandwidth = ULLONG_MAX;
+static unsigned long long write_bandwidth = ULLONG_MAX;
 
 static sigjmp_buf nilfs_clean_env;
 static struct nilfs_cleaner *nilfs_cleaner;
@@ -287,6 +297,30 @@ static int nilfs_clean_do_shutdown(struct nilfs_cleaner *cleaner)
 	return 0;
 }
 
+static int nilfs_clean_do_tune(struct nilfs_cleaner *cleaner)
+{
+	struct nilfs_cleaner_args args;
+	int ret;
+
+	memset(&args, 0, sizeof(args));
+	if (read_bandwidth != ULLONG_MAX) {
+		args.read_bandwidth = read_bandwidth;
+		args.valid |= NILFS_CLEANER_ARG_READ_BANDWIDTH;
+	}
+	if (write_bandwidth != ULLONG_MAX) {
+		args.write_bandwidth = write_bandwidth;
+		args.valid |= NILFS_CLEANER_ARG_WRITE_BANDWIDTH;
+	}
+
+	ret = nilfs_cleaner_tune(cleaner, &args);
+	if (unlikely(ret < 0)) {
+		myprintf(_("Error: cannot tune cleaner: %s\n"),
+			 strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 static int nilfs_clean_request(struct nilfs_cleaner *cleaner)
 {
 	int status = EXIT_FAILURE;
@@ -314,6 +348,9 @@ static int nilfs_clean_request(struct nilfs_cleaner *cleaner)
 	case NILFS_CLEAN_CMD_SHUTDOWN:
 		ret = nilfs_clean_do_shutdown(cleaner);
 		break;
+	case NILFS_CLEAN_CMD_TUNE:
+		ret = nilfs_clean_do_tune(cleaner);
+		break;
 	default:
 		goto out;
 	}
@@ -443,18 +480,33 @@ static int nilfs_clean_parse_min_reclaimable(const char *arg)
 	return 0;
 }
 
+static int nilfs_clean_parse_bandwidth(const char *arg,
+				       unsigned long long *bandwidth)
+{
+	if (nilfs_parse_size(arg, bandwidth) < 0 ||
+	    *bandwidth == ULLONG_MAX) {
+		if (errno == ERANGE)
+			myprintf(_("Error: value too large: %s\n"), arg);
+		else
+			myprintf(_("Error: invalid bandwidth: %s\n"), arg);
+		return -1;
+	}
+	return 0;
+}
+
 static void nilfs_clean_parse_options(int argc, char *argv[])
 {
 #ifdef _GNU_SOURCE
 	int option_index;
 #endif	/* _GNU_SOURCE */
+	int run_opts = 0;
 	int c, ret;
 
 #ifdef _GNU_SOURCE
-	while ((c = getopt_long(argc, argv, "bc::hlm:p:qrsS:vV",
+	while ((c = getopt_long(argc, argv, "bc::hlm:p:qrR:sS:vVW:",
 				long_option, &option_index)) >= 0) {
 #else
-	while ((c = getopt(argc, argv, "bc::hlm:p:qrsS:vV")) >= 0) {
+	while ((c = getopt(argc, argv, "bc::hlm:p:qrR:sS:vVW:")) >= 0) {
 #endif	/* _GNU_SOURCE */
 		switch (c) {
 		case 'b':
@@ -475,12 +527,15 @@ static void nilfs_clean_parse_options(int argc, char *argv[])
 		case 'm':
 			if (nilfs_clean_parse_min_reclaimable(optarg) < 0)
 				exit(EXIT_FAILURE);
+			run_opts = 1;
 			break;
 		case 'p':
 			ret = nilfs_parse_protection_period(
 				optarg, &protection_period);
-			if (!ret)
+			if (!ret) {
+				run_opts = 1;
 				break;
+			}
 
 			if (errno == ERANGE) {
 				myprintf(_("Error: too large period: %s\n"),
@@ -496,12 +551,18 @@ static void nilfs_clean_parse_options(int argc, char *argv[])
 		case 'r':
 			clean_cmd = NILFS_CLEAN_CMD_RESUME;
 			break;
+		case 'R':
+			if (nilfs_clean_parse_bandwidth(optarg,
+							&read_bandwidth) < 0)
+				exit(EXIT_FAILURE);
+			break;
 		case 's':
 			clean_cmd = NILFS_CLEAN_CMD_SUSPEND;
 			break;
 		case 'S':
 			if (nilfs_clean_parse_gcspeed(optarg) < 0)
 				exit(EXIT_FAILURE);
+			run_opts = 1;
 			break;
 		case 'v':
 			verbose = 1;
@@ -509,11 +570,25 @@ static void nilfs_clean_parse_options(int argc, char *argv[])
 		case 'V':
 			show_version_only = 1;
 			break;
+		case 'W':
+			if (nilfs_clean_parse_bandwidth(optarg,
+							&write_bandwidth) < 0)
+				exit(EXIT_FAILURE);
+			break;
 		default:
 			myprintf(_("Error: invalid option -- %c\n"), optopt);
 			exit(EXIT_FAILURE);
 		}
 	}
+
+	if (read_bandwidth != ULLONG_MAX || write_bandwidth != ULLONG_MAX) {
+		/* the limits outlast a run, so they are not run options */
+		if (clean_cmd != NILFS_CLEAN_CMD_RUN || run_opts) {
+			myprintf(_("Error: -R and -W cannot be used with other commands or with -m, -p, or -S\n"));
+			exit(EXIT_FAILURE);
+		}
+		clean_cmd = NILFS_CLEAN_CMD_TUNE;
+	}
 }
 
 int main(int argc, char *argv[])
@@ -525,19 +525,26 @@ nilfs_resize_count_inuse_segments(struct nilfs *nilfs, uint64_t start,
 static int nilfs_resize_verify_failure(struct nilfs *nilfs,
 				       uint64_t *segnumv, unsigned long nsegs)
 {
-	struct nilfs_suinfo si;
+	struct nilfs_suinfo si[NILFS_RESIZE_NSUINFO];
+	uint64_t seqnums[NILFS_RESIZE_NSUINFO];
+	uint64_t protseq = sustat.ss_prot_seq;
+	unsigned long nc;
+	int have_si, ret;
 	int reason = 0;
-	int i, ret;
+	int i;
+
+	for (; nsegs > 0; segnumv += nc, nsegs -= nc) {
+		nc = min_t(unsigned long, nsegs, NILFS_RESIZE_NSUINFO);
 
-	for (i = 0; i < nsegs; i++) {
-		if (nilfs_get_suinfo(nilfs, segnumv[i], &si, 1) == 1) {
-			if (!nilfs_suinfo_reclaimable(&si))
+		have_si = nilfs_get_suinfo_batch(nilfs, segnumv, nc, si) == 0;
+		ret = nilfs_get_segment_seqnums(nilfs, segnumv, nc, seqnums);
+
+		for (i = 0; i < nc; i++) {
+			if (have_si && !nilfs_suinfo_reclaimable(&si[i]))
 				reason |= NILFS_RESIZE_SEGMENT_UNRECLAIMABLE;
+			if (ret == 0 && cnt64_ge(seqnums[i], protseq))
+				reason |= NILFS_RESIZE_SEGMENT_PROTECTED;
 		}
-		ret = nilfs_segment_is_protected(nilfs, segnumv[i],
-						 sustat.ss_prot_seq);
-		if (ret > 0)
-			reason |= NILFS_RESIZE_SEGMENT_PROTECTED;
 	}
 	return reason;
 }
@@ -548,10 +555,18 @@ static ssize_t nilfs_resize_move_segments(struct nilfs *nilfs,
 {
 	unsigned long rest = nsegs, nc;
 	uint64_t *snp = segnumv;
+	struct nilfs_reclaim_params params;
+	struct nilfs_reclaim_stat stat;
 	ssize_t nmoved = 0, i, nhits;
 	int rv = 0;
 	int ret;
 
+	params.flags = NILFS_RECLAIM_PARAM_PROTSEQ |
+		NILFS_RECLAIM_PARAM_PROTCNO |
+		NILFS_RECLAIM_PARAM_SNAPSHOT_CACHE;
+	params.min_reclaimable_blks = 0;
+	params.protcno = 0;
+
 	for (snp = segnumv; rest > 0; snp += nc, rest -= nc) {
 		nc = min_t(unsigned long, rest, nsegments_per_clean);
 
@@ -559,10 +574,14 @@ static ssize_t nilfs_resize_move_segments(struct nilfs *nilfs,
 		if (unlikely(ret < 0))
 			return -1;
 
-		ret = nilfs_reclaim_segment(nilfs, snp, nc,
-					    sustat.ss_prot_seq, 0);
+		params.protseq = sustat.ss_prot_seq;
+		memset(&stat, 0, sizeof(stat));
+		stat.exflags = NILFS_RECLAIM_STAT_ERROR;
+		ret = nilfs_xreclaim_segment(nilfs, snp, nc, 0, &params,
+					     &stat);
 		if (unlikely(ret < 0))
 			return -1;
+		ret = stat.cleaned_segs;
 
 		nmoved += ret;
 
@@ -574,6 +593,13 @@ static ssize_t nilfs_resize_move_segments(struct nilfs *nilfs,
 		if (nhits)
 			nilfs_resize_progress_inc(nhits);
 
+		/* the segments cleaned before an error are kept */
+		if (unlikely((stat.exflags & NILFS_RECLAIM_STAT_ERROR) &&
+			     stat.error)) {
+			errno = stat.error;
+			return -1;
+		}
+
 		/* check reason of gc failure */
 		if (ret < nc && reason)
 			rv |= nilfs_resize_verify_failure(nilfs, snp + ret,
@@ -987,6 +1013,9 @@ static int nilfs_resize_online(const char *device, unsigned long long newsize)
 		goto out;
 	}
 
+	/* reads of the device fall back to pread() if unavailable */
+	nilfs_opt_set_io_uring(nilfs);
+
 	ret = nilfs_resize_load_layout(nilfs);
 	if (unlikely(ret < 0))
 		goto out_unlock;
@@ -0,0 +1,105 @@
+/*
+ * segheap.c - selection of the least important segments
+ *
+ * Licensed under GPLv2: the complete text of the GNU General Public
+ * License can be found in COPYING file of the nilfs-utils package.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include "segheap.h"
+
+/**
+ * nilfs_comp_segimp - compare segments by importance
+ * @elem1: segment importance
+ * @elem2: segment importance
+ *
+ * Ties are broken by segment number, so that the order is total.
+ */
+int nilfs_comp_segimp(const void *elem1, const void *elem2)
+{
+	const struct nilfs_segimp *segimp1 = elem1, *segimp2 = elem2;
+
+	if (segimp1->si_importance < segimp2->si_importance)
+		return -1;
+	else if (segimp1->si_importance > segimp2->si_importance)
+		return 1;
+
+	return (segimp1->si_segnum < segimp2->si_segnum) ? -1 : 1;
+}
+
+static inline void nilfs_swap_segimp(struct nilfs_segimp *segimp1,
+				     struct nilfs_segimp *segimp2)
+{
+	struct nilfs_segimp tmp = *segimp1;
+
+	*segimp1 = *segimp2;
+	*segimp2 = tmp;
+}
+
+static void nilfs_segheap_sift_down(struct nilfs_segimp *heap, size_t n,
+				    size_t i)
+{
+	size_t child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n &&
+		    nilfs_comp_segimp(&heap[child + 1], &heap[child]) > 0)
+			child++;
+		if (nilfs_comp_segimp(&heap[child], &heap[i]) < 0)
+			break;
+		nilfs_swap_segimp(&heap[child], &heap[i]);
+		i = child;
+	}
+}
+
+/**
+ * nilfs_segheap_add - add a segment to a bounded max-heap
+ * @heap: array of segment importance organized as a max-heap
+ * @np: number of segments in @heap (updated)
+ * @max: capacity of @heap
+ * @segnum: segment number
+ * @importance: importance of the segment
+ *
+ * The heap keeps the @max least important segments seen so far, with
+ * the most important one of them at the root, so that selecting k out
+ * of N segments takes O(N log k) time and O(k) memory.
+ */
+void nilfs_segheap_add(struct nilfs_segimp *heap, size_t *np, size_t max,
+		       uint64_t segnum, long long importance)
+{
+	struct nilfs_segimp segimp = {
+		.si_segnum = segnum, .si_importance = importance
+	};
+	size_t i, parent;
+
+	if (*np < max) {
+		i = (*np)++;
+		heap[i] = segimp;
+		while (i > 0) {
+			parent = (i - 1) / 2;
+			if (nilfs_comp_segimp(&heap[i], &heap[parent]) < 0)
+				break;
+			nilfs_swap_segimp(&heap[i], &heap[parent]);
+			i = parent;
+		}
+	} else if (max > 0 && nilfs_comp_segimp(&segimp, &heap[0]) < 0) {
+		heap[0] = segimp;
+		nilfs_segheap_sift_down(heap, *np, 0);
+	}
+}
+
+/**
+ * nilfs_segheap_sort - sort a max-heap in ascending order of importance
+ * @heap: array of segment importance organized as a max-heap
+ * @n: number of segments in @heap
+ */
+void nilfs_segheap_sort(struct nilfs_segimp *heap, size_t n)
+{
+	while (n > 1) {
+		nilfs_swap_segimp(&heap[0], &heap[--n]);
+		nilfs_segheap_sift_down(heap, n, 0);
+	}
+}
@@ -0,0 +1,29 @@
+/*
+ * segheap.h - selection of the least important segments
+ *
+ * Licensed under GPLv2: the complete text of the GNU General Public
+ * License can be found in COPYING file of the nilfs-utils package.
+ */
+
+#ifndef SEGHEAP_H
+#define SEGHEAP_H
+
+#include <stddef.h>	/* size_t */
+#include <stdint.h>	/* uint64_t */
+
+/**
+ * struct nilfs_segimp - segment importance
+ * @si_segnum: segment number
+ * @si_importance: importance of segment
+ */
+struct nilfs_segimp {
+	uint64_t si_segnum;
+	long long si_importance;
+};
+
+int nilfs_comp_segimp(const void *elem1, const void *elem2);
+void nilfs_segheap_add(struct nilfs_segimp *heap, size_t *np, size_t max,
+		       uint64_t segnum, long long importance);
+void nilfs_segheap_sort(struct nilfs_segimp *heap, size_t n);
+
+#endif /* SEGHEAP_H */
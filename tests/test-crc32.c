@@ -0,0 +1,167 @@
+/*
+ * test-crc32.c - check crc32 engines against the bytewise reference
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * Every crc32 engine built into the library, whether or not it is
+ * selected at run time, is compared with crc32_le_bytewise() over
+ * random buffers, seeds, lengths and alignments.  With -b, the
+ * throughput of each engine is measured as well.
+ *
+ * Usage: test-crc32 [-b] [iterations]
+ */
+#include "crc32.c"	/* reach the static engines */
+
+#include <stdio.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_STRING_H
+#include <string.h>
+#endif	/* HAVE_STRING_H */
+
+#include "test-util.h"
+
+#define TEST_BUFSIZE	(1UL << 20)
+#define TEST_ALIGN_MAX	16
+#define TEST_BENCH_SIZE	4096	/* a block of the file system */
+#define TEST_BENCH_LOOPS	(1UL << 16)
+
+struct crc32_engine {
+	const char *name;
+	uint32_t (*fn)(uint32_t, const unsigned char *, size_t);
+	int usable;
+};
+
+static struct crc32_engine engines[] = {
+	{ "bytewise", crc32_le_bytewise, 1 },
+	{ "slice-by-8", crc32_le_generic, 1 },
+#if HAVE_CRC32_PCLMUL
+	{ "pclmul", crc32_le_pclmul, 0 },
+#endif	/* HAVE_CRC32_PCLMUL */
+	{ "crc32_le", crc32_le, 1 },
+};
+
+#define NR_ENGINES	(sizeof(engines) / sizeof(engines[0]))
+
+static void test_check_engines(void)
+{
+	size_t i;
+
+	for (i = 0; i < NR_ENGINES; i++) {
+#if HAVE_CRC32_PCLMUL
+		if (engines[i].fn == crc32_le_pclmul) {
+			__builtin_cpu_init();
+			engines[i].usable =
+				__builtin_cpu_supports("pclmul") &&
+				__builtin_cpu_supports("sse4.1");
+		}
+#endif	/* HAVE_CRC32_PCLMUL */
+		if (!engines[i].usable)
+			printf("%s: not supported by this CPU, skipped\n",
+			       engines[i].name);
+	}
+}
+
+static int test_compare(const unsigned char *buf, size_t len, uint32_t seed)
+{
+	uint32_t expected = crc32_le_bytewise(seed, buf, len), crc;
+	size_t i;
+
+	for (i = 1; i < NR_ENGINES; i++) {
+		if (!engines[i].usable)
+			continue;
+		crc = engines[i].fn(seed, buf, len);
+		if (crc != expected) {
+			fprintf(stderr,
+				"%s: crc 0x%08x != 0x%08x (seed 0x%08x, align %zu, len %zu)\n",
+				engines[i].name, crc, expected, seed,
+				(size_t)((uintptr_t)buf % TEST_ALIGN_MAX), len);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void test_throughput(const unsigned char *buf)
+{
+	struct timespec start;
+	unsigned long loops;
+	uint32_t crc = 0;
+	double sec;
+	size_t i, j;
+
+	for (i = 0; i < NR_ENGINES; i++) {
+		if (!engines[i].usable)
+			continue;
+		/* the bytewise engine is an order of magnitude slower */
+		loops = i == 0 ? TEST_BENCH_LOOPS / 8 : TEST_BENCH_LOOPS;
+		test_clock_start(&start);
+		for (j = 0; j < loops; j++)
+			crc = engines[i].fn(crc, buf +
+					    (j * TEST_BENCH_SIZE) %
+					    (TEST_BUFSIZE - TEST_BENCH_SIZE),
+					    TEST_BENCH_SIZE);
+		sec = test_elapsed(&start);
+		printf("%-12s %8.1f MiB/s (crc 0x%08x)\n", engines[i].name,
+		       loops * TEST_BENCH_SIZE / sec / (1 << 20), crc);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = 20000, n;
+	unsigned char *buf;
+	size_t len, align, i;
+	uint32_t seed;
+	int argi;
+
+	argi = test_init(argc, argv, "[iterations]");
+	if (argc > argi)
+		iterations = strtoul(argv[argi], NULL, 0);
+
+	buf = malloc(TEST_BUFSIZE + TEST_ALIGN_MAX);
+	if (!buf) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < TEST_BUFSIZE + TEST_ALIGN_MAX; i++)
+		buf[i] = test_rand();
+
+	test_check_engines();
+
+	/* every short length at every alignment */
+	for (align = 0; align < TEST_ALIGN_MAX; align++) {
+		for (len = 0; len <= 256; len++) {
+			seed = test_rand();
+			if (test_compare(buf + align, len, seed) < 0)
+				return EXIT_FAILURE;
+		}
+	}
+
+	/* random lengths, mostly around the block sizes */
+	for (n = 0; n < iterations; n++) {
+		align = test_rand() % TEST_ALIGN_MAX;
+		len = test_rand() % 64;
+		if (len == 0)
+			len = test_rand() % TEST_BUFSIZE;
+		else if (len < 16)
+			len = test_rand() % 65536;
+		else
+			len = (1024 << (test_rand() % 3)) +
+				(test_rand() % 129) - 64;
+		seed = test_rand();
+		if (test_compare(buf + align, len, seed) < 0)
+			return EXIT_FAILURE;
+	}
+	test_report_rounds(iterations, "every engine", "bytewise");
+
+	if (test_bench)
+		test_throughput(buf);
+	free(buf);
+	return EXIT_SUCCESS;
+}
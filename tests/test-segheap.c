@@ -0,0 +1,123 @@
+/*
+ * test-segheap.c - check the segment heap of the cleaner daemon
+ *
+ * Licensed under GPLv2: the complete text of the GNU General Public
+ * License can be found in COPYING file of the nilfs-utils package.
+ *
+ * The k least important segments chosen by nilfs_segheap_add() and
+ * nilfs_segheap_sort() are compared with the first k entries of the
+ * whole candidate array sorted by qsort(), and both ways of selecting
+ * them are timed with -b.
+ *
+ * Usage: test-segheap [-b] [nsegs [ncands [rounds]]]
+ */
+#include "segheap.c"	/* not part of any library */
+
+#include <stdio.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#include "util.h"
+#include "test-util.h"
+
+/*
+ * Importance values are drawn from @range so that small ranges give
+ * many ties, which must be broken by segment number.
+ */
+static void test_fill(struct nilfs_segimp *all, size_t n, uint64_t range)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		all[i].si_segnum = i;
+		all[i].si_importance = test_rand() % range;
+	}
+}
+
+static int test_select(struct nilfs_segimp *all, size_t n,
+		       struct nilfs_segimp *heap, size_t k,
+		       double *heap_sec, double *qsort_sec)
+{
+	struct timespec start;
+	size_t nheap = 0, i;
+
+	test_clock_start(&start);
+	for (i = 0; i < n; i++)
+		nilfs_segheap_add(heap, &nheap, k, all[i].si_segnum,
+				  all[i].si_importance);
+	nilfs_segheap_sort(heap, nheap);
+	if (heap_sec)
+		*heap_sec = test_elapsed(&start);
+
+	test_clock_start(&start);
+	qsort(all, n, sizeof(*all), nilfs_comp_segimp);
+	if (qsort_sec)
+		*qsort_sec = test_elapsed(&start);
+
+	if (nheap != min_t(size_t, n, k)) {
+		fprintf(stderr, "%zu of %zu segments selected, expected %zu\n",
+			nheap, n, min_t(size_t, n, k));
+		return -1;
+	}
+	for (i = 0; i < nheap; i++) {
+		if (heap[i].si_segnum != all[i].si_segnum ||
+		    heap[i].si_importance != all[i].si_importance) {
+			fprintf(stderr,
+				"entry %zu: segment %llu (%lld) != %llu (%lld), n %zu, k %zu\n",
+				i, (unsigned long long)heap[i].si_segnum,
+				heap[i].si_importance,
+				(unsigned long long)all[i].si_segnum,
+				all[i].si_importance, n, k);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t nsegs, ncands = 64, rounds = 2000, n, k, i;
+	struct nilfs_segimp *all, *heap;
+	double heap_sec, qsort_sec;
+	char what[64];
+	int argi;
+
+	argi = test_init(argc, argv, "[nsegs [ncands [rounds]]]");
+	nsegs = test_bench ? 10000000 : 100000;
+	if (argc > argi)
+		nsegs = strtoul(argv[argi], NULL, 0);
+	if (argc > argi + 1)
+		ncands = strtoul(argv[argi + 1], NULL, 0);
+	if (argc > argi + 2)
+		rounds = strtoul(argv[argi + 2], NULL, 0);
+
+	all = malloc(sizeof(*all) * max_t(size_t, nsegs, 4096));
+	heap = malloc(sizeof(*heap) * max_t(size_t, ncands, 64));
+	if (!all || !heap) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	/* small random cases, including empty heaps and heavy ties */
+	for (i = 0; i < rounds; i++) {
+		n = test_rand() % 4096;
+		k = test_rand() % 65;
+		test_fill(all, n, i % 2 ? 50 : 1ULL << 40);
+		if (test_select(all, n, heap, k, NULL, NULL) < 0)
+			return EXIT_FAILURE;
+	}
+	test_report_rounds(rounds, "heap", "qsort");
+
+	test_fill(all, nsegs, 1ULL << 40);
+	if (test_select(all, nsegs, heap, ncands, &heap_sec, &qsort_sec) < 0)
+		return EXIT_FAILURE;
+	snprintf(what, sizeof(what), "%zu segments, %zu candidates", nsegs,
+		 ncands);
+	test_report_times(what, "heap", heap_sec, "qsort", qsort_sec);
+
+	free(heap);
+	free(all);
+	return EXIT_SUCCESS;
+}
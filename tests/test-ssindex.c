@@ -0,0 +1,139 @@
+/*
+ * test-ssindex.c - check the snapshot index of the garbage collector
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * nilfs_ssindex_any_in() is compared with a binary search over the
+ * sorted snapshot numbers, and both are timed with -b.
+ *
+ * Usage: test-ssindex [-b] [nsnapshots [nperiods [rounds]]]
+ */
+#include "gc.c"		/* reach the static helpers */
+
+#include <stdio.h>
+
+#include "test-util.h"
+
+/* reference: is a snapshot in [p_start, p_end)? */
+static int test_any_in(const nilfs_cno_t *ss, size_t n,
+		       const struct nilfs_period *period)
+{
+	size_t low = 0, high = n, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (ss[mid] < period->p_start)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low < n && ss[low] < period->p_end;
+}
+
+/*
+ * Snapshots are spread with gaps of up to @gap checkpoints, and the
+ * periods are up to about twice as long, so that both hits and misses
+ * are common.
+ */
+static int test_run(size_t nss, size_t nperiods, nilfs_cno_t gap,
+		    double *index_sec, double *bsearch_sec)
+{
+	const struct nilfs_period **periodp = NULL;
+	struct nilfs_period *periods = NULL;
+	unsigned char *result = NULL, *expected = NULL;
+	struct nilfs_ssindex idx = { NULL, 0, 0 };
+	struct timespec start;
+	nilfs_cno_t *ss, cno = 0;
+	size_t i, nhits = 0;
+	int ret = -1;
+
+	ss = malloc(sizeof(*ss) * (nss + 1));
+	periods = malloc(sizeof(*periods) * (nperiods + 1));
+	periodp = malloc(sizeof(*periodp) * (nperiods + 1));
+	result = malloc(nperiods + 1);
+	expected = malloc(nperiods + 1);
+	if (!ss || !periods || !periodp || !result || !expected) {
+		perror("malloc");
+		goto out;
+	}
+	for (i = 0; i < nss; i++)
+		ss[i] = (cno += 1 + test_rand() % gap);
+	for (i = 0; i < nperiods; i++) {
+		periods[i].p_start = test_rand() % (cno + 2 * gap);
+		periods[i].p_end = periods[i].p_start + 1 +
+			test_rand() % (2 * gap);
+		periodp[i] = &periods[i];
+	}
+
+	if (nilfs_ssindex_build(&idx, ss, nss) < 0) {
+		perror("nilfs_ssindex_build");
+		goto out;
+	}
+	test_clock_start(&start);
+	nilfs_ssindex_any_in(&idx, periodp, nperiods, result);
+	if (index_sec)
+		*index_sec = test_elapsed(&start);
+
+	test_clock_start(&start);
+	for (i = 0; i < nperiods; i++)
+		expected[i] = test_any_in(ss, nss, &periods[i]);
+	if (bsearch_sec)
+		*bsearch_sec = test_elapsed(&start);
+
+	for (i = 0; i < nperiods; i++) {
+		nhits += expected[i];
+		if (result[i] != expected[i]) {
+			fprintf(stderr,
+				"period [%llu, %llu): %d != %d, %zu snapshots\n",
+				(unsigned long long)periods[i].p_start,
+				(unsigned long long)periods[i].p_end,
+				result[i], expected[i], nss);
+			goto out;
+		}
+	}
+	ret = nhits;
+out:
+	free(idx.ss);
+	free(expected);
+	free(result);
+	free(periodp);
+	free(periods);
+	free(ss);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t nss = 10000, nperiods, rounds = 1000, i;
+	double index_sec, bsearch_sec;
+	char what[80];
+	int nhits, argi;
+
+	argi = test_init(argc, argv, "[nsnapshots [nperiods [rounds]]]");
+	nperiods = test_bench ? 10000000 : 100000;
+	if (argc > argi)
+		nss = strtoul(argv[argi], NULL, 0);
+	if (argc > argi + 1)
+		nperiods = strtoul(argv[argi + 1], NULL, 0);
+	if (argc > argi + 2)
+		rounds = strtoul(argv[argi + 2], NULL, 0);
+
+	/* small random cases, covering every shape of a small tree */
+	for (i = 0; i < rounds; i++) {
+		if (test_run(i % 300, 1 + test_rand() % 100,
+			     1 + test_rand() % 8, NULL, NULL) < 0)
+			return EXIT_FAILURE;
+	}
+	test_report_rounds(rounds, "index", "binary search");
+
+	nhits = test_run(nss, nperiods, 100, &index_sec, &bsearch_sec);
+	if (nhits < 0)
+		return EXIT_FAILURE;
+	snprintf(what, sizeof(what), "%zu snapshots, %zu periods (%d hits)",
+		 nss, nperiods, nhits);
+	test_report_times(what, "index", index_sec, "binary search",
+			  bsearch_sec);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+/*
+ * test-util.c - helpers shared by the check programs
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * Every check program takes a -b option.  Without it, as run by 'make
+ * check', only the results are checked; with it, as run by 'make
+ * bench', larger cases are used and the compared methods are timed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif	/* HAVE_CONFIG_H */
+
+#include <stdio.h>
+
+#if HAVE_STDLIB_H
+#include <stdlib.h>
+#endif	/* HAVE_STDLIB_H */
+
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif	/* HAVE_UNISTD_H */
+
+#include "test-util.h"
+
+int test_bench;		/* time the compared methods */
+
+static uint64_t test_rand_state = 0x9e3779b97f4a7c15ULL;
+
+/**
+ * test_init - parse the common options of a check program
+ * @argc: number of arguments
+ * @argv: array of arguments
+ * @usage: usage of the program arguments following the options
+ *
+ * Return Value: index of the first program argument in @argv.  The
+ * program exits if an unknown option is given.
+ */
+int test_init(int argc, char *argv[], const char *usage)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "b")) >= 0) {
+		switch (c) {
+		case 'b':
+			test_bench = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b] %s\n", argv[0], usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+	return optind;
+}
+
+/* xorshift64*, so that a failure can be reproduced */
+uint64_t test_rand(void)
+{
+	test_rand_state ^= test_rand_state >> 12;
+	test_rand_state ^= test_rand_state << 25;
+	test_rand_state ^= test_rand_state >> 27;
+	return test_rand_state * 0x2545f4914f6cdd1dULL;
+}
+
+void test_clock_start(struct timespec *start)
+{
+	if (test_bench)
+		clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/* seconds since test_clock_start(), or 0 if not benchmarking */
+double test_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	if (!test_bench)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void test_report_rounds(size_t rounds, const char *subject,
+			const char *reference)
+{
+	printf("%zu random rounds: %s matches %s\n", rounds, subject,
+	       reference);
+}
+
+/* print the times of two methods, only when benchmarking */
+void test_report_times(const char *what, const char *name1, double sec1,
+		       const char *name2, double sec2)
+{
+	if (test_bench)
+		printf("%s: %s %.3f s, %s %.3f s\n", what, name1, sec1, name2,
+		       sec2);
+}
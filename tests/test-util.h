@@ -0,0 +1,30 @@
+/*
+ * test-util.h - helpers shared by the check programs
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ */
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if HAVE_TIME_H
+#include <time.h>	/* timespec */
+#endif	/* HAVE_TIME_H */
+
+extern int test_bench;
+
+int test_init(int argc, char *argv[], const char *usage);
+uint64_t test_rand(void);
+void test_clock_start(struct timespec *start);
+double test_elapsed(const struct timespec *start);
+void test_report_rounds(size_t rounds, const char *subject,
+			const char *reference);
+void test_report_times(const char *what, const char *name1, double sec1,
+		       const char *name2, double sec2);
+
+#endif /* TEST_UTIL_H */
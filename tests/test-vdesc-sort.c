@@ -0,0 +1,203 @@
+/*
+ * test-vdesc-sort.c - check the sorts of virtual block descriptors
+ *
+ * Licensed under LGPLv2: the complete text of the GNU Lesser General
+ * Public License can be found in COPYING file of the nilfs-utils
+ * package.
+ *
+ * nilfs_sort_vdesc_refs() is compared with qsort() ordering by key
+ * and then by index, which is what a stable sort by key gives, and
+ * both are timed with -b.  nilfs_sort_vdesc_blocknr() is checked on
+ * shuffled segments, with and without overlapping runs.
+ *
+ * Usage: test-vdesc-sort [-b] [nvdescs [rounds]]
+ */
+#include "gc.c"		/* reach the static helpers */
+
+#include <stdio.h>
+
+#include "test-util.h"
+
+#define TEST_BLOCKS_PER_SEGMENT	2048
+
+static int test_comp_ref(const void *elem1, const void *elem2)
+{
+	const struct nilfs_vdesc_ref *ref1 = elem1, *ref2 = elem2;
+
+	if (ref1->key != ref2->key)
+		return ref1->key < ref2->key ? -1 : 1;
+	return ref1->index < ref2->index ? -1 : ref1->index > ref2->index;
+}
+
+/*
+ * Keys are drawn from @range above @base: a full 64-bit range, a
+ * range of virtual block numbers, or a small one with many ties.
+ */
+static void test_fill_refs(struct nilfs_vdesc_ref *refs, size_t n,
+			   uint64_t base, uint64_t range)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		refs[i].key = base + (range ? test_rand() % range : test_rand());
+		refs[i].index = i;
+	}
+}
+
+static int test_sort_refs(struct nilfs_vdesc_ref *refs,
+			  struct nilfs_vdesc_ref *expected, size_t n,
+			  double *radix_sec, double *qsort_sec)
+{
+	struct timespec start;
+	size_t i;
+
+	memcpy(expected, refs, sizeof(*refs) * n);
+
+	test_clock_start(&start);
+	if (nilfs_sort_vdesc_refs(refs, n) < 0) {
+		perror("nilfs_sort_vdesc_refs");
+		return -1;
+	}
+	if (radix_sec)
+		*radix_sec = test_elapsed(&start);
+
+	test_clock_start(&start);
+	qsort(expected, n, sizeof(*expected), test_comp_ref);
+	if (qsort_sec)
+		*qsort_sec = test_elapsed(&start);
+
+	for (i = 0; i < n; i++) {
+		if (refs[i].key != expected[i].key ||
+		    refs[i].index != expected[i].index) {
+			fprintf(stderr,
+				"ref %zu: (%llu, %zu) != (%llu, %zu), n %zu\n",
+				i, (unsigned long long)refs[i].key,
+				refs[i].index,
+				(unsigned long long)expected[i].key,
+				expected[i].index, n);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Descriptors are collected in disk order within each segment, so
+ * the vector is built from ascending runs of shuffled segments.  If
+ * @overlap is set, the runs share blocks and the fallback is taken.
+ */
+static int test_sort_blocknr(size_t nsegs, int overlap)
+{
+	struct nilfs_vector *vdescv;
+	struct nilfs_vdesc *vdesc;
+	uint64_t *segnums, tmp;
+	size_t i, j, n;
+	int ret = -1;
+
+	vdescv = nilfs_vector_create(sizeof(struct nilfs_vdesc));
+	segnums = malloc(sizeof(*segnums) * nsegs);
+	if (!vdescv || !segnums) {
+		perror("malloc");
+		goto out;
+	}
+	for (i = 0; i < nsegs; i++)
+		segnums[i] = i;
+	for (i = nsegs; i > 1; i--) {
+		j = test_rand() % i;
+		tmp = segnums[i - 1];
+		segnums[i - 1] = segnums[j];
+		segnums[j] = tmp;
+	}
+	for (i = 0; i < nsegs; i++) {
+		for (j = 0; j < TEST_BLOCKS_PER_SEGMENT; j++) {
+			if (test_rand() % 3 == 0)
+				continue;
+			vdesc = nilfs_vector_get_new_element(vdescv);
+			if (!vdesc) {
+				perror("nilfs_vector_get_new_element");
+				goto out;
+			}
+			memset(vdesc, 0, sizeof(*vdesc));
+			vdesc->vd_blocknr = overlap ?
+				segnums[i] + j * nsegs :
+				segnums[i] * TEST_BLOCKS_PER_SEGMENT + j;
+		}
+	}
+	if (nilfs_sort_vdesc_blocknr(vdescv) < 0) {
+		perror("nilfs_sort_vdesc_blocknr");
+		goto out;
+	}
+	vdesc = nilfs_vector_get_data(vdescv);
+	n = nilfs_vector_get_size(vdescv);
+	for (i = 1; i < n; i++) {
+		if (vdesc[i].vd_blocknr < vdesc[i - 1].vd_blocknr) {
+			fprintf(stderr,
+				"descriptor %zu: block %llu after %llu, %zu segments%s\n",
+				i, (unsigned long long)vdesc[i].vd_blocknr,
+				(unsigned long long)vdesc[i - 1].vd_blocknr,
+				nsegs, overlap ? ", overlapped" : "");
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	free(segnums);
+	if (vdescv)
+		nilfs_vector_destroy(vdescv);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t nvdescs, rounds = 2000, n, i;
+	struct nilfs_vdesc_ref *refs, *expected;
+	double radix_sec, qsort_sec;
+	static const uint64_t ranges[] = { 0, 1ULL << 24, 100 };
+	char what[64];
+	int argi;
+
+	argi = test_init(argc, argv, "[nvdescs [rounds]]");
+	nvdescs = test_bench ? 8000000 : 100000;
+	if (argc > argi)
+		nvdescs = strtoul(argv[argi], NULL, 0);
+	if (argc > argi + 1)
+		rounds = strtoul(argv[argi + 1], NULL, 0);
+
+	n = nvdescs > 4096 ? nvdescs : 4096;
+	refs = malloc(sizeof(*refs) * n);
+	expected = malloc(sizeof(*expected) * n);
+	if (!refs || !expected) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	/* small random cases over each range of keys */
+	for (i = 0; i < rounds; i++) {
+		n = test_rand() % 4096;
+		test_fill_refs(refs, n, 1ULL << 32, ranges[i % 3]);
+		if (test_sort_refs(refs, expected, n, NULL, NULL) < 0)
+			return EXIT_FAILURE;
+	}
+	test_report_rounds(rounds, "radix sort", "qsort");
+
+	for (i = 0; i < 3; i++) {
+		test_fill_refs(refs, nvdescs, 1ULL << 32, ranges[i]);
+		if (test_sort_refs(refs, expected, nvdescs, &radix_sec,
+				   &qsort_sec) < 0)
+			return EXIT_FAILURE;
+		snprintf(what, sizeof(what), "%zu refs, key range %llu",
+			 nvdescs, (unsigned long long)ranges[i]);
+		test_report_times(what, "radix", radix_sec, "qsort",
+				  qsort_sec);
+	}
+
+	for (i = 1; i <= 64; i *= 2) {
+		if (test_sort_blocknr(i, 0) < 0 || test_sort_blocknr(i, 1) < 0)
+			return EXIT_FAILURE;
+	}
+	printf("disk order sort of up to 64 segments: ok\n");
+
+	free(expected);
+	free(refs);
+	return EXIT_SUCCESS;
+}